@@ -9,10 +9,17 @@ ifeq ($(TARGET_ARCH),arm)
 LOCAL_SRC_FILES := \
 	recovery.c \
 	bootloader.c \
+	chunkstore.c \
 	commands.c \
 	extracommands.c \
 	firmware.c \
+	hashdir.c \
 	install.c \
+	logger.c \
+	md5.c \
+	nrestore.c \
+	ntar.c \
+	nverify.c \
 	roots.c \
 	verifier.c \
 	getprop.c \
@@ -121,7 +128,11 @@ LOCAL_MODULE_TAGS := eng
 
 LOCAL_SRC_FILES += default_recovery_ui.c
 
-LOCAL_STATIC_LIBRARIES := libminzip libunz libamend libmtdutils libmmcutils libmincrypt
+# nverify.c and nrestore.c use zlib's crc32() and inflate(), which
+# libunz carries.
+LOCAL_C_INCLUDES += external/zlib
+
+LOCAL_STATIC_LIBRARIES := libminzip libunz libamend libmtdutils libmmcutils libmincrypt libtracing
 LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libcutils
 LOCAL_STATIC_LIBRARIES += libstdc++ libc  #libdump_image liberase_image libflash_image
 
@@ -144,14 +155,37 @@ include $(BUILD_EXECUTABLE)
 # Depend on the generated keys.inc containing the OTA public keys.
 #$(intermediates)/install.o: $(RECOVERY_INSTALL_OTA_KEYS_INC)
 
+# Host check of whole-file signature verification:
+#   verifier_test bootable/recovery/testdata
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := \
+	verifier_test.c \
+	verifier.c \
+	minzip/Hash.c \
+	minzip/SysUtil.c \
+	minzip/DirUtil.c \
+	minzip/Inlines.c \
+	minzip/Zip.c
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH) \
+	external/zlib \
+	external/safe-iop/include
+LOCAL_STATIC_LIBRARIES := libmincrypt libz libcutils
+LOCAL_LDLIBS += -lpthread -lresolv
+LOCAL_MODULE := verifier_test
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_HOST_EXECUTABLE)
+
 include $(commands_recovery_local_path)/minui/Android.mk
 include $(commands_recovery_local_path)/amend/Android.mk
 include $(commands_recovery_local_path)/minzip/Android.mk
 include $(commands_recovery_local_path)/mtdutils/Android.mk
 include $(commands_recovery_local_path)/mmcutils/Android.mk
+include $(commands_recovery_local_path)/tracing/Android.mk
 include $(commands_recovery_local_path)/tools/Android.mk
 include $(commands_recovery_local_path)/edify/Android.mk
 include $(commands_recovery_local_path)/updater/Android.mk
+include $(commands_recovery_local_path)/bench/Android.mk
 commands_recovery_local_path :=
 
 endif   # TARGET_ARCH == arm
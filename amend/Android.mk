@@ -31,7 +31,17 @@ LOCAL_SRC_FILES := \
 		register.c \
 		main.c
 
+# register.c runs hash_dir and copy_dir on plain host paths, for tests.
+LOCAL_SRC_FILES += \
+		../hashdir.c \
+		../minzip/Hash.c \
+		../minzip/DirUtil.c \
+		../minzip/Inlines.c
+
 LOCAL_CFLAGS := $(amend_cflags) -g -O0
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES := libmincrypt libcutils
+LOCAL_LDLIBS += -lpthread
 LOCAL_MODULE := amend
 LOCAL_YACCFLAGS := -v
 
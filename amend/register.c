@@ -14,12 +14,15 @@
  * limitations under the License.
  */
 
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #undef NDEBUG
 #include <assert.h>
 #include "commands.h"
+#include "hashdir.h"
+#include "minzip/DirUtil.h"
 
 #include "register.h"
 
@@ -48,6 +51,23 @@
         if (result == NULL) return -1;     \
     } while (false)
 
+/* There are no roots like "SYS:" on the host; paths without a colon
+ * are plain host paths, which hash_dir and copy_dir act on for real.
+ */
+#define IS_HOST_PATH(p) (strchr((p), ':') == NULL)
+
+/* hash_dir() reports errors through the recovery UI; here they go to
+ * stderr.
+ */
+void
+ui_print(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
 
 /*
  * Command definitions
@@ -92,6 +112,9 @@ cmd_copy_dir(const char *name, void *cookie, int argc, const char *argv[])
     UNUSED(name);
     UNUSED(cookie);
     CHECK_WORDS();
+    if (argc == 2 && IS_HOST_PATH(argv[0]) && IS_HOST_PATH(argv[1])) {
+        return dirCopyHierarchy(argv[0], argv[1], 0, NULL, NULL) == 0 ? 0 : 1;
+    }
 //xxx
     return -1;
 }
@@ -232,8 +255,16 @@ fn_hash_dir(const char *name, void *cookie, int argc, const char *argv[],
         dir = argv[0];
     }
 
+    if (IS_HOST_PATH(dir)) {
+        char digest[HASH_DIR_HEX_SIZE];
+        if (hash_dir(dir, digest) != 0) {
+            return 1;
+        }
+        *result = strdup(digest);
+    } else {
 //xxx build and return the string
-    *result = strdup("hashvalue");
+        *result = strdup("hashvalue");
+    }
     if (resultLen != NULL) {
       *resultLen = strlen(*result);
     }
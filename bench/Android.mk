@@ -0,0 +1,75 @@
+# Host-side benchmarks for minzip, the verifier, edify, amend and mtdutils.
+#
+#   recovery_bench [-r runs] [-n files] [-k keys -s signed.zip] [-m mtd]
+#   amend_bench [-r runs]
+#
+# Results are printed as "BENCH <name> <value> <unit>" lines.
+
+LOCAL_PATH := $(call my-dir)
+
+bench_cflags := -O2 -DNDEBUG -Wall
+
+#
+# minzip, verifier, edify and mtdutils
+#
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	recovery_bench.c \
+	bench_util.c \
+	../verifier.c \
+	../minzip/Hash.c \
+	../minzip/SysUtil.c \
+	../minzip/DirUtil.c \
+	../minzip/Inlines.c \
+	../minzip/Zip.c \
+	../edify/lexer.l \
+	../edify/parser.y \
+	../edify/expr.c \
+	../mtdutils/mtdutils.c \
+	../mtdutils/mtd_emulator.c
+
+# "-x c" forces the lex/yacc files to be compiled as c;
+# the build system otherwise forces them to be c++.
+LOCAL_CFLAGS := $(bench_cflags) -x c -DMTDUTILS_EMULATOR
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/.. \
+	$(LOCAL_PATH)/../edify \
+	external/zlib \
+	external/safe-iop/include
+LOCAL_STATIC_LIBRARIES := libmincrypt libz libcutils
+LOCAL_LDLIBS += -lpthread -lresolv
+LOCAL_MODULE := recovery_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+#
+# amend (its parser symbols clash with edify's, so it gets its own binary)
+#
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	amend_bench.c \
+	bench_util.c \
+	../amend/amend.c \
+	../amend/lexer.l \
+	../amend/parser_y.y \
+	../amend/ast.c \
+	../amend/symtab.c \
+	../amend/commands.c \
+	../amend/execute.c \
+	../amend/register.c \
+	../hashdir.c \
+	../minzip/Hash.c \
+	../minzip/DirUtil.c \
+	../minzip/Inlines.c
+
+LOCAL_CFLAGS := $(bench_cflags) -x c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/.. $(LOCAL_PATH)/../amend
+LOCAL_STATIC_LIBRARIES := libmincrypt libcutils
+LOCAL_LDLIBS += -lpthread
+LOCAL_MODULE := amend_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host benchmark for the amend parser.  amend and edify both use the
+ * default yacc/lex symbol names, so this lives in its own executable.
+ *
+ * usage: amend_bench [-r runs] [-v]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "amend/amend.h"
+#include "amend/commands.h"
+#include "amend/register.h"
+#include "bench.h"
+
+#define AMEND_LINES 5000
+
+int main(int argc, char **argv) {
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:v")) != -1) {
+        switch (opt) {
+        case 'r': gBenchRuns = atoi(optarg); break;
+        case 'v': verbose = true; break;
+        default:
+            fprintf(stderr, "usage: amend_bench [-r runs] [-v]\n");
+            return 2;
+        }
+    }
+    if (gBenchRuns < 1 || gBenchRuns > BENCH_MAX_RUNS) {
+        fprintf(stderr, "runs must be between 1 and %d\n", BENCH_MAX_RUNS);
+        return 2;
+    }
+
+    if (!verbose) bench_quiet();
+
+    if (commandInit() < 0 || registerUpdateCommands() < 0 ||
+            registerUpdateFunctions() < 0) {
+        fprintf(stderr, "can't register amend commands\n");
+        return 1;
+    }
+
+    // Lines in the style of a real update-script, using only the commands
+    // the host build registers.
+    static const char *lines[] = {
+        "assert hash_dir(\"SYS:\") == \"112345oldhashvalue1234123\"\n",
+        "mark SYS: dirty\n",
+        "copy_dir \"PKG:android-files\" SYS:\n",
+        "assert matches(hash_dir(\"SYS:\"), \"667890\", \"999999\") != \"\"\n",
+        "format CACHE:\n",
+    };
+    size_t len = 0;
+    int i;
+    for (i = 0; i < AMEND_LINES; ++i) {
+        len += strlen(lines[i % (sizeof(lines) / sizeof(lines[0]))]);
+    }
+    char *script = malloc(len + 1);
+    if (script == NULL) return 1;
+    char *p = script;
+    for (i = 0; i < AMEND_LINES; ++i) {
+        const char *line = lines[i % (sizeof(lines) / sizeof(lines[0]))];
+        strcpy(p, line);
+        p += strlen(line);
+    }
+
+    double samples[BENCH_MAX_RUNS];
+    int run;
+    for (run = 0; run < gBenchRuns; ++run) {
+        double start = bench_now();
+        if (parseAmendScript(script, len) == NULL) {
+            fprintf(stderr, "amend parse failed\n");
+            return 1;
+        }
+        samples[run] = bench_now() - start;
+    }
+
+    bench_report("config.runs", gBenchRuns, "runs");
+    bench_report("amend.parse", AMEND_LINES /
+                 bench_median(samples, gBenchRuns), "lines/s");
+    bench_report("amend.parse.throughput", len / 1048576.0 /
+                 bench_median(samples, gBenchRuns), "MB/s");
+
+    free(script);
+    return 0;
+}
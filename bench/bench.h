@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_BENCH_H
+#define _RECOVERY_BENCH_H
+
+/* Shared helpers for the host benchmarks.
+ *
+ * Every result is printed as one tab-separated line:
+ *
+ *     BENCH <name> <value> <unit>
+ *
+ * where value is the median over the configured number of runs, so the
+ * output can be diffed or collected by scripts across builds.
+ */
+
+#define BENCH_MAX_RUNS 64
+
+/* Number of times each measurement is repeated. */
+extern int gBenchRuns;
+
+double bench_now(void);
+
+/* Median of samples[0..count), reordering the array. */
+double bench_median(double *samples, int count);
+
+void bench_report(const char *name, double value, const char *unit);
+
+/* Send the libraries' own logging (on stdout and stderr) to /dev/null,
+ * keeping only the BENCH lines on the original stdout.
+ */
+void bench_quiet(void);
+
+#endif
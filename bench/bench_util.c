@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+int gBenchRuns = 5;
+
+static FILE *gBenchOut = NULL;
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double da = *(const double *) a, db = *(const double *) b;
+    return da < db ? -1 : da > db;
+}
+
+double bench_median(double *samples, int count) {
+    if (count <= 0) return 0;
+    qsort(samples, count, sizeof(double), compare_doubles);
+    if (count % 2) return samples[count / 2];
+    return (samples[count / 2 - 1] + samples[count / 2]) / 2;
+}
+
+void bench_report(const char *name, double value, const char *unit) {
+    FILE *out = gBenchOut ? gBenchOut : stdout;
+    fprintf(out, "BENCH\t%s\t%.3f\t%s\n", name, value, unit);
+    fflush(out);
+}
+
+
+void bench_quiet(void) {
+    fflush(stdout);
+    gBenchOut = fdopen(dup(STDOUT_FILENO), "w");
+    if (gBenchOut == NULL) return;
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+}
@@ -0,0 +1,382 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host benchmarks for the libraries recovery and the updater are built
+ * from: minzip, the package verifier, edify and mtdutils.
+ *
+ * usage: recovery_bench [-r runs] [-n files] [-k keys -s signed.zip]
+ *                       [-m mtd-partition] [-v]
+ *
+ * Synthetic archives are written with minzip's own ZipWriter into a
+ * scratch directory under /tmp.  Signature verification needs a real
+ * signed package and its DumpPublicKey key file, so it only runs when
+ * -k and -s are given; likewise the MTD read benchmark only runs when
+ * the named partition exists.
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "edify/expr.h"
+#include "minzip/DirUtil.h"
+#include "minzip/Zip.h"
+#include "mtdutils/mtdutils.h"
+#include "verifier.h"
+
+extern int yyparse(Expr** root, int* error_count);
+extern void yy_scan_string(const char* str);
+
+#define LARGE_ENTRY_SIZE (16 * 1024 * 1024)
+#define EDIFY_STATEMENTS 2000
+
+/* The verifier reports through recovery's UI; there's no screen here. */
+void ui_print(const char *fmt, ...) {}
+void ui_set_progress(float fraction) {}
+
+static char gScratch[PATH_MAX];
+static int gNumFiles = 10000;
+
+/* Fill buf with text that compresses roughly like a typical system file. */
+static void fill_data(unsigned char *buf, size_t len, unsigned seed) {
+    static const char words[] =
+        "android recovery update package system framework lib bin etc "
+        "xbin app media fonts usr keychars keylayout permissions ";
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = (seed >> 24) % 8 == 0 ? (unsigned char) (seed >> 16)
+                                       : words[(i + (seed >> 28)) % (sizeof(words) - 1)];
+    }
+}
+
+static int build_small_archive(const char *path) {
+    ZipWriter *zw = mzCreateZipArchive(path);
+    if (zw == NULL) return -1;
+
+    unsigned char buf[8192];
+    char name[PATH_MAX];
+    int i;
+    for (i = 0; i < gNumFiles; ++i) {
+        size_t len = 1024 + (i * 7919) % (sizeof(buf) - 1024);
+        fill_data(buf, len, i);
+        snprintf(name, sizeof(name), "system/app/dir%03d/file%05d.txt",
+                 i % 100, i);
+        if (!mzWriteZipEntryFromBuffer(zw, name, buf, len,
+                                       MZ_COMPRESSION_DEFLATED)) {
+            mzFinishZipArchive(zw);
+            return -1;
+        }
+    }
+    return mzFinishZipArchive(zw);
+}
+
+static int build_large_archive(const char *path) {
+    ZipWriter *zw = mzCreateZipArchive(path);
+    if (zw == NULL) return -1;
+
+    unsigned char *buf = malloc(LARGE_ENTRY_SIZE);
+    if (buf == NULL) {
+        mzFinishZipArchive(zw);
+        return -1;
+    }
+    fill_data(buf, LARGE_ENTRY_SIZE, 42);
+    bool ok = mzWriteZipEntryFromBuffer(zw, "deflated.img", buf,
+                    LARGE_ENTRY_SIZE, MZ_COMPRESSION_DEFLATED) &&
+              mzWriteZipEntryFromBuffer(zw, "stored.img", buf,
+                    LARGE_ENTRY_SIZE, MZ_COMPRESSION_STORED);
+    free(buf);
+    int ret = mzFinishZipArchive(zw);
+    return ok ? ret : -1;
+}
+
+static void bench_zip_open(const char *path) {
+    double samples[BENCH_MAX_RUNS];
+    unsigned entries = 0;
+    int run;
+    for (run = 0; run < gBenchRuns; ++run) {
+        ZipArchive za;
+        double start = bench_now();
+        if (mzOpenZipArchive(path, &za) != 0) {
+            fprintf(stderr, "can't open %s\n", path);
+            return;
+        }
+        samples[run] = bench_now() - start;
+        entries = mzZipEntryCount(&za);
+        mzCloseZipArchive(&za);
+    }
+    double t = bench_median(samples, gBenchRuns);
+    bench_report("zip.open.time", t * 1000, "ms");
+    bench_report("zip.open.entries", entries / t, "entries/s");
+}
+
+static void bench_zip_extract_entry(const char *path, const char *entry,
+        const char *name) {
+    ZipArchive za;
+    if (mzOpenZipArchive(path, &za) != 0) return;
+    const ZipEntry *ze = mzFindZipEntry(&za, entry);
+    unsigned char *buf = ze ? malloc(mzGetZipEntryUncompLen(ze)) : NULL;
+    if (buf == NULL) {
+        mzCloseZipArchive(&za);
+        return;
+    }
+
+    double samples[BENCH_MAX_RUNS];
+    int run;
+    for (run = 0; run < gBenchRuns; ++run) {
+        double start = bench_now();
+        if (!mzExtractZipEntryToBuffer(&za, ze, buf)) {
+            fprintf(stderr, "can't extract %s\n", entry);
+            break;
+        }
+        samples[run] = bench_now() - start;
+    }
+    if (run == gBenchRuns) {
+        bench_report(name, mzGetZipEntryUncompLen(ze) / 1048576.0 /
+                     bench_median(samples, gBenchRuns), "MB/s");
+    }
+    free(buf);
+    mzCloseZipArchive(&za);
+}
+
+static void bench_zip_extract_recursive(const char *path) {
+    ZipArchive za;
+    if (mzOpenZipArchive(path, &za) != 0) return;
+
+    unsigned i;
+    double bytes = 0;
+    for (i = 0; i < mzZipEntryCount(&za); ++i) {
+        bytes += mzGetZipEntryUncompLen(mzGetZipEntryAt(&za, i));
+    }
+
+    char target[PATH_MAX];
+    snprintf(target, sizeof(target), "%s/extract", gScratch);
+
+    double samples[BENCH_MAX_RUNS];
+    int run;
+    for (run = 0; run < gBenchRuns; ++run) {
+        dirUnlinkHierarchy(target);
+        mkdir(target, 0755);
+        sync();
+        double start = bench_now();
+        if (!mzExtractRecursive(&za, "system", target, 0, NULL, NULL, NULL)) {
+            fprintf(stderr, "can't extract %s\n", path);
+            break;
+        }
+        samples[run] = bench_now() - start;
+    }
+    if (run == gBenchRuns) {
+        double t = bench_median(samples, gBenchRuns);
+        bench_report("zip.extract_recursive.files",
+                     mzZipEntryCount(&za) / t, "files/s");
+        bench_report("zip.extract_recursive.throughput",
+                     bytes / 1048576.0 / t, "MB/s");
+    }
+    dirUnlinkHierarchy(target);
+    mzCloseZipArchive(&za);
+}
+
+static void bench_verify(const char *keysPath, const char *packagePath) {
+    int numKeys;
+    RSAPublicKey *keys = load_keys(keysPath, &numKeys);
+    if (keys == NULL) {
+        fprintf(stderr, "can't load keys from %s\n", keysPath);
+        return;
+    }
+    ZipArchive za;
+    if (mzOpenZipArchive(packagePath, &za) != 0) {
+        fprintf(stderr, "can't open %s\n", packagePath);
+        free(keys);
+        return;
+    }
+
+    struct stat st;
+    stat(packagePath, &st);
+    double samples[BENCH_MAX_RUNS];
+    int run;
+    bool wholeFile = verify_file_signature(&za, keys, numKeys, true) !=
+            VERIFY_FILE_UNSIGNED;
+    for (run = 0; run < gBenchRuns; ++run) {
+        double start = bench_now();
+        bool ok = wholeFile ?
+                verify_file_signature(&za, keys, numKeys, true) ==
+                        VERIFY_FILE_OK :
+                verify_jar_signature(&za, keys, numKeys, true);
+        if (!ok) {
+            fprintf(stderr, "%s failed to verify\n", packagePath);
+            break;
+        }
+        samples[run] = bench_now() - start;
+    }
+    if (run == gBenchRuns) {
+        bench_report(wholeFile ? "verify.file_signature.throughput"
+                               : "verify.jar_signature.throughput",
+                     st.st_size / 1048576.0 / bench_median(samples, gBenchRuns),
+                     "MB/s");
+    }
+    mzCloseZipArchive(&za);
+    free(keys);
+}
+
+static void bench_edify(void) {
+    static const char statement[] =
+        "ifelse(is_substring(\"system\", concat(\"/\", \"system\", \"/bin\")),"
+        " less_than_int(\"12\", \"345\"), assert(\"x\" == \"x\"));\n";
+    size_t len = sizeof(statement) - 1;
+    char *script = malloc(len * EDIFY_STATEMENTS + 1);
+    if (script == NULL) return;
+    int i;
+    for (i = 0; i < EDIFY_STATEMENTS; ++i) {
+        memcpy(script + i * len, statement, len);
+    }
+    script[len * EDIFY_STATEMENTS] = '\0';
+
+    RegisterBuiltins();
+    FinishRegistration();
+
+    double parseSamples[BENCH_MAX_RUNS], evalSamples[BENCH_MAX_RUNS];
+    int run;
+    for (run = 0; run < gBenchRuns; ++run) {
+        Expr *root;
+        int errors = 0;
+        double start = bench_now();
+        yy_scan_string(script);
+        if (yyparse(&root, &errors) != 0 || errors > 0) {
+            fprintf(stderr, "edify parse failed\n");
+            break;
+        }
+        parseSamples[run] = bench_now() - start;
+
+        State state;
+        state.cookie = NULL;
+        state.script = script;
+        state.errmsg = NULL;
+        start = bench_now();
+        char *result = Evaluate(&state, root);
+        evalSamples[run] = bench_now() - start;
+        free(state.errmsg);
+        if (result == NULL) {
+            fprintf(stderr, "edify evaluation failed\n");
+            break;
+        }
+        free(result);
+    }
+    if (run == gBenchRuns) {
+        bench_report("edify.parse", EDIFY_STATEMENTS /
+                     bench_median(parseSamples, gBenchRuns), "statements/s");
+        bench_report("edify.evaluate", EDIFY_STATEMENTS /
+                     bench_median(evalSamples, gBenchRuns), "statements/s");
+    }
+    free(script);
+}
+
+static void bench_mtd_read(const char *name) {
+    if (mtd_scan_partitions() <= 0) return;
+    const MtdPartition *partition = mtd_find_partition_by_name(name);
+    if (partition == NULL) {
+        fprintf(stderr, "no MTD partition %s\n", name);
+        return;
+    }
+    size_t size;
+    if (mtd_partition_info(partition, &size, NULL, NULL)) return;
+
+    char *buf = malloc(64 * 1024);
+    double samples[BENCH_MAX_RUNS];
+    int run;
+    for (run = 0; run < gBenchRuns && buf != NULL; ++run) {
+        MtdReadContext *in = mtd_read_partition(partition);
+        if (in == NULL) break;
+        double start = bench_now();
+        size_t total = 0;
+        ssize_t n;
+        while (total < size &&
+               (n = mtd_read_data(in, buf, 64 * 1024)) > 0) {
+            total += n;
+        }
+        samples[run] = bench_now() - start;
+        mtd_read_close(in);
+    }
+    if (run == gBenchRuns) {
+        bench_report("mtd.read.throughput", size / 1048576.0 /
+                     bench_median(samples, gBenchRuns), "MB/s");
+    }
+    free(buf);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: recovery_bench [-r runs] [-n files] "
+            "[-k keys -s signed.zip] [-m mtd-partition] [-v]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *keysPath = NULL, *packagePath = NULL, *mtdName = NULL;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:n:k:s:m:v")) != -1) {
+        switch (opt) {
+        case 'r': gBenchRuns = atoi(optarg); break;
+        case 'n': gNumFiles = atoi(optarg); break;
+        case 'k': keysPath = optarg; break;
+        case 's': packagePath = optarg; break;
+        case 'm': mtdName = optarg; break;
+        case 'v': verbose = true; break;
+        default: usage();
+        }
+    }
+    if (gBenchRuns < 1 || gBenchRuns > BENCH_MAX_RUNS || gNumFiles < 1 ||
+            (keysPath == NULL) != (packagePath == NULL)) {
+        usage();
+    }
+
+    // The libraries log every entry they touch; keep that out of the timing.
+    if (!verbose) bench_quiet();
+
+    strcpy(gScratch, "/tmp/recovery_bench.XXXXXX");
+    if (mkdtemp(gScratch) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char smallZip[PATH_MAX], largeZip[PATH_MAX];
+    snprintf(smallZip, sizeof(smallZip), "%s/small.zip", gScratch);
+    snprintf(largeZip, sizeof(largeZip), "%s/large.zip", gScratch);
+
+    int ret = 0;
+    if (build_small_archive(smallZip) || build_large_archive(largeZip)) {
+        bench_report("error.synthetic_archives", 1, "failed");
+        ret = 1;
+    } else {
+        bench_report("config.runs", gBenchRuns, "runs");
+        bench_report("config.files", gNumFiles, "files");
+        bench_zip_open(smallZip);
+        bench_zip_extract_entry(largeZip, "deflated.img",
+                                "zip.extract.deflated");
+        bench_zip_extract_entry(largeZip, "stored.img",
+                                "zip.extract.stored");
+        bench_zip_extract_recursive(smallZip);
+        bench_edify();
+        if (keysPath != NULL) bench_verify(keysPath, packagePath);
+        if (mtdName != NULL) bench_mtd_read(mtdName);
+    }
+
+    dirUnlinkHierarchy(gScratch);
+    return ret;
+}
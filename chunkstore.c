@@ -0,0 +1,731 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunkstore.h"
+#include "mincrypt/sha.h"
+#include "minzip/Hash.h"
+
+/* Chunks are cut where the rolling hash's top CHUNK_AVG_BITS bits are
+ * all zero, which averages one cut per 2^CHUNK_AVG_BITS bytes, but
+ * never before CHUNK_MIN_SIZE or after CHUNK_MAX_SIZE.  Changing any of
+ * these (or the gear table) moves every boundary: old chunks stay
+ * readable but new backups stop sharing them.
+ */
+#define CHUNK_MIN_SIZE      (16 * 1024)
+#define CHUNK_AVG_BITS      16
+#define CHUNK_MAX_SIZE      (256 * 1024)
+#define CHUNK_BUFFER_SIZE   (1024 * 1024)
+
+#define CHUNK_HEX_SIZE      (2 * SHA_DIGEST_SIZE + 1)
+#define MANIFEST_MAGIC      "nchunk 1"
+
+static uint32_t gGear[256];
+
+static void
+initGear(void)
+{
+    /* Any fixed random table will do; xorshift32 from a fixed seed
+     * gives the same one on every build.
+     */
+    uint32_t x = 0x2545f491;
+    int i;
+    if (gGear[0] != 0) {
+        return;
+    }
+    for (i = 0; i < 256; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        gGear[i] = x;
+    }
+}
+
+/* Length of the chunk at the start of data; len bytes are available,
+ * and if eof is false more may follow.  Returns 0 if it needs more.
+ */
+static size_t
+findBoundary(const unsigned char *data, size_t len, bool eof)
+{
+    const uint32_t mask = ~0U << (32 - CHUNK_AVG_BITS);
+    size_t end = len < CHUNK_MAX_SIZE ? len : CHUNK_MAX_SIZE;
+    uint32_t h = 0;
+    size_t i;
+
+    if (end <= CHUNK_MIN_SIZE) {
+        return (eof || len >= CHUNK_MAX_SIZE) ? end : 0;
+    }
+    /* Only the last 32 bytes count towards the top bits, so start the
+     * hash a little before the first place we could cut.
+     */
+    for (i = CHUNK_MIN_SIZE - 32; i < end; i++) {
+        h = (h << 1) + gGear[data[i]];
+        if (i >= CHUNK_MIN_SIZE && (h & mask) == 0) {
+            return i + 1;
+        }
+    }
+    return (eof || end == CHUNK_MAX_SIZE) ? end : 0;
+}
+
+static void
+toHex(const uint8_t *digest, char hex[CHUNK_HEX_SIZE])
+{
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < SHA_DIGEST_SIZE; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    hex[2 * SHA_DIGEST_SIZE] = '\0';
+}
+
+static int
+fromHex(const char *hex, uint8_t *digest)
+{
+    int i;
+    for (i = 0; i < 2 * SHA_DIGEST_SIZE; i++) {
+        int c = hex[i];
+        int v = (c >= '0' && c <= '9') ? c - '0' :
+                (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (v < 0) {
+            return -1;
+        }
+        if (i % 2 == 0) {
+            digest[i / 2] = v << 4;
+        } else {
+            digest[i / 2] |= v;
+        }
+    }
+    return 0;
+}
+
+static void
+chunkPath(char *path, size_t size, const char *store, const char *hex)
+{
+    snprintf(path, size, "%s/%.2s/%s", store, hex, hex);
+}
+
+static unsigned int
+digestHash(const uint8_t *digest)
+{
+    return digest[0] | (digest[1] << 8) | (digest[2] << 16) |
+            ((unsigned int)digest[3] << 24);
+}
+
+static int
+digestCompare(const void *tableItem, const void *looseItem)
+{
+    return memcmp(tableItem, looseItem, SHA_DIGEST_SIZE);
+}
+
+/* Adds digest to the set; returns true if it was already there. */
+static bool
+addDigest(HashTable *set, const uint8_t *digest)
+{
+    uint8_t *item = malloc(SHA_DIGEST_SIZE);
+    if (item == NULL) {
+        return false;
+    }
+    memcpy(item, digest, SHA_DIGEST_SIZE);
+    if (mzHashTableLookup(set, digestHash(item), item, digestCompare,
+            true) != item) {
+        free(item);
+        return true;
+    }
+    return false;
+}
+
+static bool
+hasDigest(HashTable *set, const uint8_t *digest)
+{
+    return mzHashTableLookup(set, digestHash(digest), (void *)digest,
+            digestCompare, false) != NULL;
+}
+
+static int
+writeFully(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write a chunk under a temporary name and rename it into place, so a
+ * chunk that has its final name is always complete.
+ */
+static int
+writeChunk(const char *store, const char *hex, const unsigned char *data,
+        size_t len)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    chunkPath(path, sizeof(path), store, hex);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 && errno == ENOENT) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%.2s", store, hex);
+        if (mkdir(store, 0755) < 0 && errno != EEXIST) {
+            return -1;
+        }
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            return -1;
+        }
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (writeFully(fd, data, len) < 0) {
+        int err = errno;
+        close(fd);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    if (close(fd) < 0 || rename(tmp, path) < 0) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+openInput(const char *path)
+{
+    if (!strcmp(path, "-")) {
+        return STDIN_FILENO;
+    }
+    int fd = open(path, O_RDONLY);
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+    return fd;
+}
+
+int
+chunk_store(const char *store, const char *input, const char *manifest,
+        ChunkStats *stats)
+{
+    char tmpManifest[PATH_MAX];
+    unsigned char *buf = NULL;
+    HashTable *seen = NULL;
+    FILE *out = NULL;
+    int in = -1;
+    int err = 0;
+    SHA_CTX whole;
+
+    initGear();
+    memset(stats, 0, sizeof(*stats));
+    SHA_init(&whole);
+    snprintf(tmpManifest, sizeof(tmpManifest), "%s.tmp", manifest);
+
+    buf = malloc(CHUNK_BUFFER_SIZE);
+    seen = mzHashTableCreate(1024, free);
+    if (buf == NULL || seen == NULL) {
+        err = ENOMEM;
+        goto done;
+    }
+    in = openInput(input);
+    if (in < 0) {
+        err = errno;
+        fprintf(stderr, "nchunk: can't open %s (%s)\n", input, strerror(err));
+        goto done;
+    }
+    out = fopen(tmpManifest, "w");
+    if (out == NULL) {
+        err = errno;
+        fprintf(stderr, "nchunk: can't create %s (%s)\n", tmpManifest,
+                strerror(err));
+        goto done;
+    }
+    fprintf(out, "%s\n", MANIFEST_MAGIC);
+
+    size_t start = 0;
+    size_t len = 0;
+    bool eof = false;
+    for (;;) {
+        size_t cut = findBoundary(buf + start, len - start, eof);
+        if (cut == 0) {
+            if (eof) {
+                break;          // nothing left
+            }
+            /* Need more data: slide what's left to the front and read. */
+            memmove(buf, buf + start, len - start);
+            len -= start;
+            start = 0;
+            ssize_t n = read(in, buf + len, CHUNK_BUFFER_SIZE - len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                err = errno;
+                fprintf(stderr, "nchunk: can't read %s (%s)\n", input,
+                        strerror(err));
+                goto done;
+            }
+            if (n == 0) {
+                eof = true;
+            }
+            len += n;
+            continue;
+        }
+
+        const unsigned char *chunk = buf + start;
+        SHA_CTX ctx;
+        char hex[CHUNK_HEX_SIZE];
+        SHA_init(&ctx);
+        SHA_update(&ctx, chunk, cut);
+        const uint8_t *digest = SHA_final(&ctx);
+        toHex(digest, hex);
+        SHA_update(&whole, chunk, cut);
+
+        /* Chunks repeat a lot within one image (think erased flash), so
+         * only go to the store the first time we see one.
+         */
+        if (!addDigest(seen, digest)) {
+            char path[PATH_MAX];
+            struct stat st;
+            chunkPath(path, sizeof(path), store, hex);
+            if (stat(path, &st) < 0 || st.st_size != (off_t)cut) {
+                if (writeChunk(store, hex, chunk, cut) < 0) {
+                    err = errno;
+                    fprintf(stderr, "nchunk: can't write %s (%s)\n", path,
+                            strerror(err));
+                    goto done;
+                }
+                stats->newChunks++;
+                stats->newBytes += cut;
+            }
+        }
+        fprintf(out, "%s %zu\n", hex, cut);
+        stats->chunks++;
+        stats->bytes += cut;
+        start += cut;
+    }
+
+    char hex[CHUNK_HEX_SIZE];
+    toHex(SHA_final(&whole), hex);
+    fprintf(out, "size %lld\nsha1 %s\n", stats->bytes, hex);
+    if (ferror(out)) {
+        err = EIO;
+    }
+    if (fclose(out) != 0 && err == 0) {
+        err = errno;
+    }
+    out = NULL;
+    if (err == 0 && rename(tmpManifest, manifest) < 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        fprintf(stderr, "nchunk: can't write %s (%s)\n", manifest,
+                strerror(err));
+    }
+
+done:
+    if (out != NULL) {
+        fclose(out);
+    }
+    if (err != 0) {
+        unlink(tmpManifest);
+    }
+    if (in >= 0 && in != STDIN_FILENO) {
+        close(in);
+    }
+    if (seen != NULL) {
+        mzHashTableFree(seen);
+    }
+    free(buf);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads one "<sha1> <length>" line.  Returns 1 for a chunk, 0 at the
+ * trailer (which is then checked against the totals), -1 on error.
+ */
+static int
+readManifestLine(FILE *f, uint8_t *digest, size_t *len, char *sizeLine,
+        char *shaLine)
+{
+    char line[128];
+    if (fgets(line, sizeof(line), f) == NULL) {
+        return -1;
+    }
+    char hex[CHUNK_HEX_SIZE];
+    unsigned long n;
+    if (sscanf(line, "%40s %lu", hex, &n) == 2 &&
+        strlen(hex) == 2 * SHA_DIGEST_SIZE && fromHex(hex, digest) == 0) {
+        if (n == 0 || n > CHUNK_MAX_SIZE) {
+            return -1;
+        }
+        *len = n;
+        return 1;
+    }
+    if (strncmp(line, "size ", 5) != 0) {
+        return -1;
+    }
+    strlcpy(sizeLine, line, 128);
+    if (fgets(shaLine, 128, f) == NULL || strncmp(shaLine, "sha1 ", 5) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static FILE *
+openManifest(const char *manifest)
+{
+    char line[32];
+    FILE *f = fopen(manifest, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+    if (fgets(line, sizeof(line), f) == NULL ||
+        strncmp(line, MANIFEST_MAGIC "\n", sizeof(MANIFEST_MAGIC)) != 0) {
+        fclose(f);
+        errno = EINVAL;
+        return NULL;
+    }
+    return f;
+}
+
+/* Reads the chunk into buf, which has room for one byte more than
+ * len so that a chunk that grew is caught too.
+ */
+static ssize_t
+readChunk(const char *store, const uint8_t *digest, unsigned char *buf,
+        size_t len)
+{
+    char hex[CHUNK_HEX_SIZE];
+    char path[PATH_MAX];
+    toHex(digest, hex);
+    chunkPath(path, sizeof(path), store, hex);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done <= len) {
+        ssize_t n = read(fd, buf + done, len + 1 - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    return done;
+}
+
+int
+chunk_restore(const char *store, const char *manifest, const char *output)
+{
+    unsigned char *buf = malloc(CHUNK_MAX_SIZE + 1);
+    FILE *f = NULL;
+    int out = -1;
+    int err = 0;
+    long long total = 0;
+    SHA_CTX whole;
+
+    SHA_init(&whole);
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    f = openManifest(manifest);
+    if (f == NULL) {
+        err = errno;
+        fprintf(stderr, "nchunk: can't read %s (%s)\n", manifest,
+                strerror(err));
+        goto done;
+    }
+    if (!strcmp(output, "-")) {
+        out = STDOUT_FILENO;
+    } else {
+        out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (out < 0) {
+        err = errno;
+        fprintf(stderr, "nchunk: can't create %s (%s)\n", output,
+                strerror(err));
+        goto done;
+    }
+
+    for (;;) {
+        uint8_t digest[SHA_DIGEST_SIZE];
+        char sizeLine[128];
+        char shaLine[128];
+        size_t len;
+        int r = readManifestLine(f, digest, &len, sizeLine, shaLine);
+        if (r < 0) {
+            err = EINVAL;
+            fprintf(stderr, "nchunk: %s is corrupt\n", manifest);
+            break;
+        }
+        if (r == 0) {
+            char hex[CHUNK_HEX_SIZE];
+            char want[128];
+            toHex(SHA_final(&whole), hex);
+            snprintf(want, sizeof(want), "sha1 %s\n", hex);
+            if (strtoll(sizeLine + 5, NULL, 10) != total ||
+                strcmp(shaLine, want) != 0) {
+                fprintf(stderr, "nchunk: %s doesn't match its checksum\n",
+                        manifest);
+                err = EIO;
+            }
+            break;
+        }
+
+        ssize_t n = readChunk(store, digest, buf, len);
+        SHA_CTX ctx;
+        SHA_init(&ctx);
+        SHA_update(&ctx, buf, n > 0 ? n : 0);
+        if (n != (ssize_t)len ||
+            memcmp(SHA_final(&ctx), digest, SHA_DIGEST_SIZE) != 0) {
+            char hex[CHUNK_HEX_SIZE];
+            toHex(digest, hex);
+            fprintf(stderr, "nchunk: chunk %s is %s\n", hex,
+                    n < 0 ? "missing" : "damaged");
+            err = n < 0 ? errno : EIO;
+            break;
+        }
+        SHA_update(&whole, buf, len);
+        if (writeFully(out, buf, len) < 0) {
+            err = errno;
+            fprintf(stderr, "nchunk: can't write %s (%s)\n", output,
+                    strerror(err));
+            break;
+        }
+        total += len;
+    }
+
+done:
+    if (f != NULL) {
+        fclose(f);
+    }
+    if (out >= 0 && out != STDOUT_FILENO && close(out) < 0 && err == 0) {
+        err = errno;
+    }
+    free(buf);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static bool
+endsWith(const char *s, const char *suffix)
+{
+    size_t len = strlen(s);
+    size_t slen = strlen(suffix);
+    return len >= slen && !strcmp(s + len - slen, suffix);
+}
+
+/* Add every chunk named by manifests under dir to the referenced set. */
+static int
+markManifests(HashTable *referenced, const char *dir, const struct stat *storeSt)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        fprintf(stderr, "nchunk: can't open %s (%s)\n", dir, strerror(errno));
+        return -1;
+    }
+    int ret = 0;
+    const struct dirent *de;
+    while (ret == 0 && (de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (lstat(path, &st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (st.st_dev != storeSt->st_dev || st.st_ino != storeSt->st_ino) {
+                ret = markManifests(referenced, path, storeSt);
+            }
+            continue;
+        }
+        if (strstr(de->d_name, ".chunks.") != NULL &&
+            !endsWith(de->d_name, ".tmp")) {
+            /* Compressed, most likely; we can't tell what it keeps alive. */
+            fprintf(stderr, "nchunk: can't read %s\n", path);
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+        if (!endsWith(de->d_name, ".chunks")) {
+            continue;
+        }
+
+        FILE *f = openManifest(path);
+        if (f == NULL) {
+            fprintf(stderr, "nchunk: can't read %s (%s)\n", path,
+                    strerror(errno));
+            ret = -1;
+            break;
+        }
+        for (;;) {
+            uint8_t digest[SHA_DIGEST_SIZE];
+            char sizeLine[128];
+            char shaLine[128];
+            size_t len;
+            int r = readManifestLine(f, digest, &len, sizeLine, shaLine);
+            if (r < 0) {
+                fprintf(stderr, "nchunk: %s is corrupt\n", path);
+                errno = EINVAL;
+                ret = -1;
+            }
+            if (r <= 0) {
+                break;
+            }
+            addDigest(referenced, digest);
+        }
+        fclose(f);
+    }
+    closedir(d);
+    return ret;
+}
+
+int
+chunk_gc(const char *store, const char *root, ChunkStats *stats)
+{
+    struct stat storeSt;
+    memset(stats, 0, sizeof(*stats));
+    if (stat(store, &storeSt) < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    HashTable *referenced = mzHashTableCreate(4096, free);
+    if (referenced == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (markManifests(referenced, root, &storeSt) < 0) {
+        int err = errno;
+        mzHashTableFree(referenced);
+        errno = err;
+        return -1;
+    }
+
+    int ret = 0;
+    DIR *top = opendir(store);
+    if (top == NULL) {
+        ret = -1;
+    }
+    const struct dirent *de;
+    while (top != NULL && (de = readdir(top)) != NULL) {
+        if (strlen(de->d_name) != 2) {
+            continue;
+        }
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%s", store, de->d_name);
+        DIR *d = opendir(dir);
+        if (d == NULL) {
+            continue;
+        }
+        const struct dirent *ce;
+        while ((ce = readdir(d)) != NULL) {
+            char path[PATH_MAX];
+            uint8_t digest[SHA_DIGEST_SIZE];
+            struct stat st;
+            bool isChunk = strlen(ce->d_name) == 2 * SHA_DIGEST_SIZE &&
+                    fromHex(ce->d_name, digest) == 0;
+            if (!isChunk && !endsWith(ce->d_name, ".tmp")) {
+                continue;
+            }
+            if (isChunk && hasDigest(referenced, digest)) {
+                stats->chunks++;
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s", dir, ce->d_name);
+            if (lstat(path, &st) == 0 && unlink(path) == 0) {
+                stats->newChunks++;
+                stats->newBytes += st.st_size;
+            }
+        }
+        closedir(d);
+        rmdir(dir);             // only goes if it's now empty
+    }
+    if (top != NULL) {
+        closedir(top);
+    }
+    mzHashTableFree(referenced);
+    return ret;
+}
+
+int
+nchunk_main(int argc, char **argv)
+{
+    ChunkStats stats;
+    int ret;
+
+    if (argc == 5 && !strcmp(argv[1], "store")) {
+        ret = chunk_store(argv[2], argv[3], argv[4], &stats);
+        if (ret == 0) {
+            fprintf(stderr, "nchunk: %lld chunks, %lld new "
+                    "(%lld of %lld bytes written)\n", stats.chunks,
+                    stats.newChunks, stats.newBytes, stats.bytes);
+        }
+    } else if (argc == 5 && !strcmp(argv[1], "restore")) {
+        ret = chunk_restore(argv[2], argv[3], argv[4]);
+    } else if (argc == 4 && !strcmp(argv[1], "gc")) {
+        ret = chunk_gc(argv[2], argv[3], &stats);
+        if (ret == 0) {
+            fprintf(stderr, "nchunk: removed %lld chunks (%lld bytes), "
+                    "%lld still in use\n", stats.newChunks, stats.newBytes,
+                    stats.chunks);
+        } else {
+            fprintf(stderr, "nchunk: not collecting %s (%s)\n", argv[2],
+                    strerror(errno));
+        }
+    } else {
+        fprintf(stderr, "usage: nchunk store <store> <input> <manifest>\n"
+                "       nchunk restore <store> <manifest> <output>\n"
+                "       nchunk gc <store> <root>\n");
+        return 2;
+    }
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_CHUNKSTORE_H
+#define _RECOVERY_CHUNKSTORE_H
+
+/* A chunk store is a directory of content-addressed chunks shared by
+ * every backup in a nandroid folder: store/ab/abcdef... holds the chunk
+ * whose SHA-1 is abcdef....  Backups keep a manifest per image instead
+ * of the image itself, listing its chunks in order:
+ *
+ *   nchunk 1
+ *   <sha1> <length>
+ *   ...
+ *   size <bytes>
+ *   sha1 <sha1 of the whole image>
+ *
+ * Chunk boundaries are picked by a rolling hash of the content, so an
+ * insertion or deletion only changes the chunks around it and the next
+ * backup of a mostly unchanged partition shares most of its chunks with
+ * the last one.
+ */
+
+typedef struct {
+    long long chunks;       // chunks in the manifest(s)
+    long long bytes;        // bytes they add up to
+    long long newChunks;    // chunks written to / removed from the store
+    long long newBytes;
+} ChunkStats;
+
+/* Splits input (a file, fifo, or "-" for stdin) into chunks, adds the
+ * ones the store doesn't have yet and writes the manifest.  Returns 0,
+ * or -1 with errno set; the manifest is only created on success.
+ */
+int chunk_store(const char *store, const char *input, const char *manifest,
+        ChunkStats *stats);
+
+/* Reassembles the image described by manifest into output (a file,
+ * fifo, or "-" for stdout), checking every chunk and the whole image
+ * against their SHA-1s.  Returns 0, or -1 with errno set (EIO if the
+ * data doesn't match).
+ */
+int chunk_restore(const char *store, const char *manifest,
+        const char *output);
+
+/* Deletes every chunk in store that isn't listed by a manifest
+ * ("*.chunks") somewhere under root.  Refuses, deleting nothing, if a
+ * manifest can't be read or has been compressed.  Returns 0, or -1
+ * with errno set.
+ */
+int chunk_gc(const char *store, const char *root, ChunkStats *stats);
+
+/* The "nchunk" applet:
+ *
+ *   nchunk store <store> <input> <manifest>
+ *   nchunk restore <store> <manifest> <output>
+ *   nchunk gc <store> <root>
+ */
+int nchunk_main(int argc, char **argv);
+
+#endif
@@ -35,6 +35,8 @@
 #include "cutils/misc.h"
 #include "cutils/properties.h"
 #include "firmware.h"
+#include "hashdir.h"
+#include "tracing/tracing.h"
 #include "minzip/DirUtil.h"
 #include "minzip/Zip.h"
 #include "roots.h"
@@ -278,12 +280,17 @@ cmd_copy_dir(const char *name, void *cookie, int argc, const char *argv[])
                     MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_DRY_RUN,
                     &timestamp, extract_count_cb, (void *) &ctx) ||
             !mzExtractRecursive(package, src_path, dst_path,
-                    MZ_EXTRACT_FILES_ONLY,
+                    MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_DEFER_SYNC,
                     &timestamp, extract_cb, (void *) &ctx)) {
             LOGW("Command %s: couldn't extract \"%s\" to \"%s\"\n",
                     name, src_root_path, dst_root_path);
             return 1;
         }
+        if (mzSyncFilesystem(dst_path) != 0) {
+            LOGW("Command %s: can't sync \"%s\" (%s)\n",
+                    name, dst_root_path, strerror(errno));
+            return 1;
+        }
     } else {
         LOGE("Command %s: non-package source path \"%s\" not yet supported\n",
                 name, src_root_path);
@@ -666,25 +673,23 @@ cmd_write_raw_image(const char *name, void *cookie,
 
     /* Extract and write the image.
      */
-    bool ok = mzProcessZipEntryContents(package, entry,
-            write_raw_image_process_fn, context);
-    if (!ok) {
+    long long start = trace_now_us();
+    ret = 0;
+    if (!mzProcessZipEntryContents(package, entry,
+            write_raw_image_process_fn, context)) {
         LOGE("Error writing %s\n", dst_root_path);
-        mtd_write_close(context);
-        return 1;
-    }
-
-    if (mtd_erase_blocks(context, -1) == (off_t) -1) {
+        ret = 1;
+    } else if (mtd_erase_blocks(context, -1) == (off_t) -1) {
         LOGE("Error finishing %s\n", dst_root_path);
-        mtd_write_close(context);
-        return -1;
+        ret = -1;
     }
 
-    if (mtd_write_close(context)) {
+    if (mtd_write_close(context) && ret == 0) {
         LOGE("Error closing %s\n", dst_root_path);
-        return -1;
+        ret = -1;
     }
-    return 0;
+    trace_span("flash", dst_root_path, start);
+    return ret;
 }
 
 /* mark <resource> dirty|clean
@@ -830,6 +835,29 @@ fn_hash_dir(const char *name, void *cookie, int argc, const char *argv[],
         dir = argv[0];
     }
 
+    /* Accept "SYSTEM:"-style roots as well as plain paths. */
+    char pathbuf[PATH_MAX];
+    const char *path = dir;
+    if (dir[0] != '/') {
+        path = translate_root_path(dir, pathbuf, sizeof(pathbuf));
+        if (path == NULL) {
+            LOGE("Command %s: bad path \"%s\"\n", name, dir);
+            return 1;
+        }
+        if (ensure_root_path_mounted(dir)) {
+            LOGE("Can't mount %s\n", dir);
+            return 1;
+        }
+    }
+
+    char digest[HASH_DIR_HEX_SIZE];
+    ret = hash_dir(path, digest);
+    if (ret == 0) {
+        *result = strdup(digest);
+        if (resultLen != NULL) {
+            *resultLen = strlen(*result);
+        }
+    }
     return ret;
 }
 
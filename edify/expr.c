@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "expr.h"
@@ -32,8 +33,30 @@ int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
-char* Evaluate(State* state, Expr* expr) {
+static CallObserver call_observer = NULL;
+
+void SetCallObserver(CallObserver observer) {
+    call_observer = observer;
+}
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static Value* CallFunction(State* state, Expr* expr) {
+    if (call_observer == NULL || expr->fn == Literal) {
+        return expr->fn(expr->name, state, expr->argc, expr->argv);
+    }
+    long long start = now_us();
     Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    call_observer(expr->name, start, now_us());
+    return v;
+}
+
+char* Evaluate(State* state, Expr* expr) {
+    Value* v = CallFunction(state, expr);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
@@ -46,7 +69,7 @@ char* Evaluate(State* state, Expr* expr) {
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    return CallFunction(state, expr);
 }
 
 Value* StringValue(char* str) {
@@ -125,6 +125,14 @@ void FinishRegistration();
 // exists.
 Function FindFunction(const char* name);
 
+// If set, called after every function call made while evaluating a
+// script (literals excluded) with the function's name and its start and
+// end times in microseconds on CLOCK_MONOTONIC.  Calls nest, so a
+// function's time includes the time spent evaluating its arguments.
+typedef void (*CallObserver)(const char* name,
+                             long long start_us, long long end_us);
+void SetCallObserver(CallObserver observer);
+
 
 // --- convenience functions for use in functions ---
 
@@ -7,6 +7,8 @@ To handle formatting non yaffs2 partitions like the ext3 /data & /cache on Incre
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +26,7 @@ To handle formatting non yaffs2 partitions like the ext3 /data & /cache on Incre
 #include "minzip/DirUtil.h"
 #include "minzip/Zip.h"
 #include "roots.h"
+#include "tracing/tracing.h"
 
 #include "extracommands.h"
 #include <signal.h>
@@ -36,6 +39,8 @@ To handle formatting non yaffs2 partitions like the ext3 /data & /cache on Incre
 
 #include <dirent.h>
 
+#include <poll.h>
+
 #include <sys/reboot.h>
 
 #include <time.h>
@@ -44,6 +49,7 @@ To handle formatting non yaffs2 partitions like the ext3 /data & /cache on Incre
 
 #include "bootloader.h"
 #include "install.h"
+#include "logger.h"
 #include "minui/minui.h"
 
 #include <sys/limits.h>
@@ -90,6 +96,149 @@ void key_logger_test()
            }               			
 }
 
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void sigchld_handler(int sig)
+{
+    int saved_errno = errno;
+    write(sigchld_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+// Handle one line of child output.  Scripts may drive the progress bar
+// with the same "progress <frac> <secs>" and "set_progress <frac>"
+// commands update binaries use; anything else is queued for display.
+static void handle_child_line(char *line, char *batch, size_t batch_size)
+{
+    if (strncmp(line, "progress ", 9) == 0) {
+        char *seconds_s;
+        float fraction = strtof(line + 9, &seconds_s);
+        ui_show_progress(fraction, strtol(seconds_s, NULL, 10));
+        return;
+    }
+    if (strncmp(line, "set_progress ", 13) == 0) {
+        ui_set_progress(strtof(line + 13, NULL));
+        return;
+    }
+
+    if (strlen(batch) + strlen(line) + 2 > batch_size) {
+        ui_print("%s", batch);
+        batch[0] = '\0';
+    }
+    strlcat(batch, line, batch_size);
+    strlcat(batch, "\n", batch_size);
+}
+
+// Split whatever has been read from the child into lines, keeping a
+// trailing partial line in buf for the next read.  Lines from one read
+// are shown with as few ui_print() calls as possible.
+static size_t handle_child_output(char *buf, size_t len, int flush)
+{
+    char batch[240] = "";
+    char *line = buf;
+    char *end = buf + len;
+    char *nl;
+
+    while ((nl = memchr(line, '\n', end - line)) != NULL) {
+        *nl = '\0';
+        handle_child_line(line, batch, sizeof(batch));
+        line = nl + 1;
+    }
+    if (flush && line < end) {
+        *end = '\0';
+        handle_child_line(line, batch, sizeof(batch));
+        line = end;
+    }
+    if (batch[0] != '\0') ui_print("%s", batch);
+
+    len = end - line;
+    memmove(buf, line, len);
+    return len;
+}
+
+int run_command_streaming(const char *command, const char *exec_error_fmt)
+{
+    int out[2];
+    if (pipe(out) < 0) return -1;
+    if (pipe(sigchld_pipe) < 0) {
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_NOCLDSTOP | SA_RESTART;
+    sigaction(SIGCHLD, &sa, &old_sa);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigaction(SIGCHLD, &old_sa, NULL);
+        close(out[0]);
+        close(sigchld_pipe[0]);
+        close(sigchld_pipe[1]);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(out[1], STDERR_FILENO);
+        close(out[1]);
+        char *args[] = { "/sbin/sh", "-c", (char *) command, NULL };
+        execv("/sbin/sh", args);
+        fprintf(stderr, exec_error_fmt, strerror(errno));
+        _exit(-1);
+    }
+    close(out[1]);
+
+    int status = -1;
+    if (pid > 0) {
+        char buf[4096];
+        size_t len = 0;
+        int reaped = 0, eof = 0;
+
+        // Wait for output or SIGCHLD; print a heartbeat dot for each
+        // second the child stays silent, as the old polling loop did.
+        while (!eof) {
+            struct pollfd fds[2];
+            fds[0].fd = out[0];
+            fds[0].events = POLLIN;
+            fds[1].fd = sigchld_pipe[0];
+            fds[1].events = POLLIN;
+            int n = poll(fds, reaped ? 1 : 2, reaped ? 0 : 1000);
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0) {
+                if (reaped) break;  // Child is gone and its output drained.
+                ui_print(".");
+                continue;
+            }
+
+            if (!reaped && (fds[1].revents & POLLIN)) {
+                char c;
+                while (read(sigchld_pipe[0], &c, 1) == 1);
+                if (waitpid(pid, &status, WNOHANG) == pid) reaped = 1;
+            }
+            if (fds[0].revents & (POLLIN | POLLHUP)) {
+                ssize_t r = read(out[0], buf + len, sizeof(buf) - 1 - len);
+                if (r <= 0) {
+                    eof = 1;
+                } else {
+                    len = handle_child_output(buf, len + r,
+                            len + r == sizeof(buf) - 1);
+                }
+            }
+        }
+        handle_child_output(buf, len, 1);
+        if (!reaped) waitpid(pid, &status, 0);
+    }
+
+    sigaction(SIGCHLD, &old_sa, NULL);
+    close(out[0]);
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    sigchld_pipe[0] = sigchld_pipe[1] = -1;
+    return status;
+}
+
 void run_script(char *str1,char *str2,char *str3,char *str4,char *str5,char *str6,char *str7)
 {
 	ui_print(str1);
@@ -100,20 +249,9 @@ void run_script(char *str1,char *str2,char *str3,char *str4,char *str5,char *str
 	int action_confirm_rs = device_handle_key(confirm, 1);
     				if (action_confirm_rs == SELECT_ITEM) {
                 	ui_print(str2);
-		        pid_t pid = fork();
-                	if (pid == 0) {
-                		char *args[] = { "/sbin/sh", "-c", str3, "1>&2", NULL };
-                	        execv("/sbin/sh", args);
-                	        fprintf(stderr, str4, strerror(errno));
-                	        _exit(-1);
-                	}
-			int status;
-			while (waitpid(pid, &status, WNOHANG) == 0) {
-				ui_print(".");
-               		        sleep(1);
-			}
+			int status = run_command_streaming(str3, str4);
                 	ui_print("\n");
-			if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+			if (status == -1 || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
                 		ui_print(str5);
                 	} else {
                 		ui_print(str6);
@@ -532,29 +670,35 @@ int copy_file(const char* source, const char* dest)
 {
 /* need to add a check to see if dest dir exists and volume is mounted */
 
-	if (0 == (is_dir(source))) {
-		char copy[PATH_MAX];
-		sprintf(copy, "cp -r %s %s", source, dest);
-		__system(copy);
-		return 0;
+	if (0 != check_file_exists(source)) {
+		return 1;
 	}
 
-	if (1 == (is_dir(source))) {
-		char copy[PATH_MAX];
-		sprintf(copy, "cp %s %s", source, dest);
-		__system(copy);
-		return 0;
+	/* Like cp, copying onto an existing directory puts source inside it. */
+	char target[PATH_MAX];
+	struct stat st;
+	if (0 == stat(dest, &st) && S_ISDIR(st.st_mode)) {
+		const char *base = strrchr(source, '/');
+		snprintf(target, sizeof(target), "%s/%s", dest,
+			 base != NULL ? base + 1 : source);
+	} else {
+		strlcpy(target, dest, sizeof(target));
 	}
 
-return 1;
+	/* cp -r: the copies belong to us, not to the sdcard's system:sdcard_rw. */
+	if (0 != dirCopyHierarchy(source, target, DIR_COPY_NO_OWNER, NULL, NULL)) {
+		LOGE("Can't copy %s to %s\n(%s)\n", source, target, strerror(errno));
+		return 1;
+	}
+	return 0;
 }
 
 void do_module()
 {
 	ensure_root_path_mounted("SYSTEM:");
 	ensure_root_path_mounted("SDCARD:");
-	__system("rm -rf /system/lib/modules");
-        __system("cp -r /sdcard/mkboot/modules /system/lib/modules");
+	dirUnlinkHierarchy("/system/lib/modules");
+	copy_file("/sdcard/mkboot/modules", "/system/lib/modules");
 	__system("chmod 0644 /system/lib/modules/*");
 	ensure_root_path_unmounted("SYSTEM:");
 	//ensure_root_path_unmounted("SDCARD:");
@@ -572,13 +716,28 @@ void make_hboot_zip()
 	zipid[4]='\0';
 	puts (zipid);
 	//LOGE("zipid is: %s\n", zipid);
-	char zippkg[PATH_MAX];
-	sprintf(zippkg, "/sbin/zip -j /tmp/mkboot/%sIMG /tmp/mkboot/android-info.txt /tmp/mkboot/boot.img", zipid);
-	//LOGE("zip command is : %s\n", zippkg);
-	__system(zippkg);
+	char zipsrc[PATH_MAX];
 	char zipcopy[PATH_MAX];
-	sprintf(zipcopy, "cp /tmp/mkboot/%sIMG.zip /sdcard/%sIMG.zip", zipid, zipid);
-	__system(zipcopy);
+	sprintf(zipsrc, "/tmp/mkboot/%sIMG.zip", zipid);
+	sprintf(zipcopy, "/sdcard/%sIMG.zip", zipid);
+	ZipWriter *zip = mzCreateZipArchive(zipsrc);
+	if (zip == NULL) {
+		LOGE("Can't create %s\n", zipsrc);
+		return;
+	}
+	if (!mzWriteZipEntryFromFile(zip, "android-info.txt", "/tmp/mkboot/android-info.txt", MZ_COMPRESSION_DEFLATED) ||
+	    !mzWriteZipEntryFromFile(zip, "boot.img", "/tmp/mkboot/boot.img", MZ_COMPRESSION_DEFLATED)) {
+		mzFinishZipArchive(zip);
+		unlink(zipsrc);
+		LOGE("Error adding files to %s\n", zipsrc);
+		return;
+	}
+	if (0 != mzFinishZipArchive(zip)) {
+		unlink(zipsrc);
+		LOGE("Error writing %s\n", zipsrc);
+		return;
+	}
+	copy_file(zipsrc, zipcopy);
 	//LOGE("zipcopy command is: %s\n", zipcopy);
 }
 
@@ -796,6 +955,7 @@ void rb_bootloader()
 #ifdef IS_ICONIA
 	ensure_root_path_unmounted("FLEXROM:");
 #endif
+	logger_flush();
 	__system("/sbin/reboot bootloader");
 }
 
@@ -813,6 +973,7 @@ void rb_recovery()
 #ifdef IS_ICONIA
 	ensure_root_path_unmounted("FLEXROM:");
 #endif
+	logger_flush();
 	__system("/sbin/reboot recovery");
 }
 
@@ -1052,7 +1213,8 @@ void write_fstab_root(const char *root_path, FILE *file)
 
 void create_fstab()
 {
-    __system("touch /etc/mtab");
+    int fd = open("/etc/mtab", O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0) close(fd);
     FILE *file = fopen("/etc/fstab", "w");
     if (file == NULL) {
         LOGW("Unable to create /etc/fstab!");
@@ -1171,22 +1333,26 @@ int detect_ums_path()
 int symlink_toolbox()
 {
 	__system("/sbin/busybox --install -s /sbin");
-	__system("ln -s /sbin/recovery /sbin/getprop");
-	__system("ln -s /sbin/recovery /sbin/setprop");
+	symlink("/sbin/recovery", "/sbin/getprop");
+	symlink("/sbin/recovery", "/sbin/setprop");
+	symlink("/sbin/recovery", "/sbin/ntar");
+	symlink("/sbin/recovery", "/sbin/nchunk");
+	symlink("/sbin/recovery", "/sbin/nverify");
+	symlink("/sbin/recovery", "/sbin/nrestore");
 /*
-	__system("ln -s /sbin/busybox /sbin/umount");
-	__system("ln -s /sbin/busybox /sbin/mount");
+	symlink("/sbin/busybox", "/sbin/umount");
+	symlink("/sbin/busybox", "/sbin/mount");
 */
 #ifdef USES_NAND_MTD
-	__system("ln -s /sbin/recovery /sbin/flash_image");
-	__system("ln -s /sbin/recovery /sbin/dump_image");
-	__system("ln -s /sbin/recovery /sbin/erase_image");
+	symlink("/sbin/recovery", "/sbin/flash_image");
+	symlink("/sbin/recovery", "/sbin/dump_image");
+	symlink("/sbin/recovery", "/sbin/erase_image");
 #endif	
 #ifdef IS_ICONIA
-	__system("ln -s /sbin/recovery /sbin/itsmagic");
+	symlink("/sbin/recovery", "/sbin/itsmagic");
 #endif
 #ifdef HBOOT_SON_KERNEL
-	__system("ln -s /sbin/recovery /sbin/misctool");
+	symlink("/sbin/recovery", "/sbin/misctool");
 #endif
 
 return 0;
@@ -1307,13 +1473,11 @@ void set_manufacturer_icon()
     	property_get("ro.product.manufacturer", manufacturer, "");
 	if(!strcmp(manufacturer, "HTC"))
     		 {
-		    __system("rm /res/images/icon_error.png");
-		    __system("cp /res/images/icon_error_htc.png /res/images/icon_error.png");
+		    copy_file("/res/images/icon_error_htc.png", "/res/images/icon_error.png");
 		 }
 		else if (!strcmp(manufacturer, "LGE"))
 		 {
-		    __system("rm /res/images/icon_error.png");
-		    __system("cp /res/images/icon_error_lg.png /res/images/icon_error.png");
+		    copy_file("/res/images/icon_error_lg.png", "/res/images/icon_error.png");
 		 }
 		manufacturer_icon_set = !manufacturer_icon_set;
 	}
@@ -1360,25 +1524,156 @@ void symlink_data_media()
 	__system("ln -s /data/media/ /internal_sdcard");
 }
 
-void preinit_setup()
-{
-/* Pre recovery setup items GNM */ 
-    symlink_toolbox();
-    set_root_table();
-    create_fstab();
-    setprop_func();
-    set_manufacturer_icon();
+/* Pre recovery setup items GNM */
+
+/*
+ * Startup steps, as a dependency graph.  Each step runs on its own thread
+ * as soon as the steps it needs are done.  Steps marked "deferred" aren't
+ * needed to show the first menu, so they are held back until it is on
+ * screen.  Each step's time is logged and traced.
+ */
+enum {
+    STEP_TOOLBOX,
+    STEP_ROOT_TABLE,
+    STEP_ICON,
+    STEP_FSTAB,
+    STEP_PROPS,
 #ifdef HBOOT_SON_KERNEL
-    create_htcmodelid_script();
+    STEP_HTCMODELID,
 #endif
-
 #ifdef LGE_RESET_BOOTMODE
-    check_lge_boot_mode();
+    STEP_LGE_BOOT_MODE,
+#endif
+#ifdef HAS_DATA_MEDIA_SDCARD
+    STEP_DATA_MEDIA,
+#endif
+    NUM_STEPS
+};
+
+#define STEP(s) (1u << (s))
+
+static void run_symlink_toolbox() { symlink_toolbox(); }
+
+static const struct {
+    const char *name;
+    void (*run)();
+    unsigned deps;      // STEP() bits that must finish first
+    int deferred;
+} preinit_steps[NUM_STEPS] = {
+    [STEP_TOOLBOX] = { "symlink_toolbox", run_symlink_toolbox, 0, 0 },
+    [STEP_ROOT_TABLE] = { "set_root_table", set_root_table, 0, 0 },
+    // before the error icon is first drawn
+    [STEP_ICON] = { "set_manufacturer_icon", set_manufacturer_icon, 0, 0 },
+    [STEP_FSTAB] = { "create_fstab", create_fstab, STEP(STEP_ROOT_TABLE), 1 },
+    // setprop is a toolbox link
+    [STEP_PROPS] = { "setprop_func", setprop_func,
+                     STEP(STEP_ROOT_TABLE) | STEP(STEP_TOOLBOX), 1 },
+#ifdef HBOOT_SON_KERNEL
+    [STEP_HTCMODELID] = { "create_htcmodelid_script",
+                          create_htcmodelid_script, STEP(STEP_TOOLBOX), 1 },
+#endif
+#ifdef LGE_RESET_BOOTMODE
+    [STEP_LGE_BOOT_MODE] = { "check_lge_boot_mode", check_lge_boot_mode,
+                             0, 1 },
 #endif
-
 #ifdef HAS_DATA_MEDIA_SDCARD
-    symlink_data_media();
+    [STEP_DATA_MEDIA] = { "symlink_data_media", symlink_data_media,
+                          STEP(STEP_TOOLBOX), 1 },
 #endif
+};
+
+// Steps needed before recovery can show anything.  That includes the
+// toolbox links: get_args() mounts CACHE: straight after, and an "auto"
+// root (CACHE: on eMMC) is mounted by running busybox's mount.
+#define EARLY_STEPS (STEP(STEP_ROOT_TABLE) | STEP(STEP_ICON) | \
+                     STEP(STEP_TOOLBOX))
+#define ALL_STEPS ((1u << NUM_STEPS) - 1)
+
+static pthread_mutex_t preinit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t preinit_cond = PTHREAD_COND_INITIALIZER;
+static unsigned preinit_done = 0;
+static int preinit_released = 0;    // deferred steps may run
+static int preinit_started = 0;
+
+static void *preinit_step_thread(void *cookie)
+{
+    int step = (int) (intptr_t) cookie;
+
+    pthread_mutex_lock(&preinit_mutex);
+    while ((preinit_done & preinit_steps[step].deps) !=
+               preinit_steps[step].deps ||
+           (preinit_steps[step].deferred && !preinit_released)) {
+        pthread_cond_wait(&preinit_cond, &preinit_mutex);
+    }
+    pthread_mutex_unlock(&preinit_mutex);
+
+    long long start = trace_now_us();
+    preinit_steps[step].run();
+    trace_span("preinit", preinit_steps[step].name, start);
+    fprintf(stderr, "preinit: %s took %lld ms\n", preinit_steps[step].name,
+            (trace_now_us() - start) / 1000);
+
+    pthread_mutex_lock(&preinit_mutex);
+    preinit_done |= STEP(step);
+    pthread_cond_broadcast(&preinit_cond);
+    pthread_mutex_unlock(&preinit_mutex);
+    return NULL;
+}
+
+static void preinit_wait_for(unsigned steps)
+{
+    pthread_mutex_lock(&preinit_mutex);
+    while ((preinit_done & steps) != steps) {
+        pthread_cond_wait(&preinit_cond, &preinit_mutex);
+    }
+    pthread_mutex_unlock(&preinit_mutex);
+}
+
+void preinit_setup()
+{
+    long long start = trace_now_us();
+    int i;
+
+    if (preinit_started) return;
+    preinit_started = 1;
+
+    for (i = 0; i < NUM_STEPS; ++i) {
+        pthread_t t;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&t, &attr, preinit_step_thread,
+                (void *) (intptr_t) i) != 0) {
+            // Run it here instead; everything it needs was created first.
+            LOGW("Can't start thread for %s\n", preinit_steps[i].name);
+            preinit_wait_for(preinit_steps[i].deps);
+            pthread_mutex_lock(&preinit_mutex);
+            preinit_released = preinit_released || preinit_steps[i].deferred;
+            pthread_mutex_unlock(&preinit_mutex);
+            preinit_step_thread((void *) (intptr_t) i);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    preinit_wait_for(EARLY_STEPS);
+    trace_span("preinit", "preinit_setup", start);
+}
+
+void preinit_menu_shown()
+{
+    pthread_mutex_lock(&preinit_mutex);
+    if (!preinit_released) {
+        preinit_released = 1;
+        pthread_cond_broadcast(&preinit_cond);
+    }
+    pthread_mutex_unlock(&preinit_mutex);
+}
+
+void preinit_wait()
+{
+    if (!preinit_started) return;
+    preinit_menu_shown();
+    preinit_wait_for(ALL_STEPS);
 }
 
 void source_and_credits()
@@ -3,6 +3,11 @@ extern int signature_check_enabled;
 void
 toggle_signature_check();
 
+// Runs "/sbin/sh -c command", streaming its stdout and stderr to the
+// screen and log.  Returns the wait status, or -1 if it couldn't start.
+int
+run_command_streaming(const char *command, const char *exec_error_fmt);
+
 void
 run_script(char *str1,char *str2,char *str3,char *str4,char *str5,char *str6,char *str7);
 
@@ -120,9 +125,20 @@ detect_ums_path();
 int
 symlink_toolbox();
 
+// Starts the startup steps on background threads and returns once the
+// ones needed to show the first menu are done.
 void
 preinit_setup();
 
+// Lets the steps held back for the first menu go ahead.
+void
+preinit_menu_shown();
+
+// Waits until every startup step has finished; call before acting on
+// anything the user (or a recovery command) asked for.
+void
+preinit_wait();
+
 #ifdef LGE_RESET_BOOTMODE
 void
 check_lge_boot_mode();
@@ -17,6 +17,7 @@
 #include "bootloader.h"
 #include "common.h"
 #include "firmware.h"
+#include "logger.h"
 #include "roots.h"
 
 #include <errno.h>
@@ -127,6 +128,7 @@ int maybe_install_firmware_update(const char *send_intent) {
         return -1;
     }
 
+    logger_flush();
     reboot(RB_AUTOBOOT);
 
     // Can't reboot?  WTF?
@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "hashdir.h"
+#include "mincrypt/sha.h"
+#include "minzip/Hash.h"
+
+#define HASH_READ_SIZE      (128 * 1024)
+#define HASH_MAX_THREADS    4
+
+#ifdef __BIONIC__
+#define CTIME_NSEC(st)  ((st)->st_ctime_nsec)
+#else
+#define CTIME_NSEC(st)  ((st)->st_ctim.tv_nsec)
+#endif
+
+/* A file's mtime can be set to anything (amend's copy_dir pins every
+ * file to the same one), but any write moves its ctime, so that is
+ * what tells a rewritten file from the copy that was hashed.
+ */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    time_t ctime;
+    long ctimeNsec;
+    off_t size;
+    uint8_t digest[SHA_DIGEST_SIZE];
+} CachedDigest;
+
+typedef struct {
+    char *path;         // relative to the root being hashed
+    struct stat st;
+    char *link;         // symlink target, or NULL
+    CachedDigest *digest;   // regular files only
+} TreeEntry;
+
+typedef struct {
+    const char *root;
+    TreeEntry *entries;
+    int count;
+    int alloc;
+
+    /* Files that missed the cache, handed out to the hashing threads. */
+    int *pending;
+    int pendingCount;
+    int next;
+    int firstErrno;
+    pthread_mutex_t lock;
+} TreeWalk;
+
+static HashTable *gDigestCache = NULL;
+
+static unsigned int
+digestKeyHash(const CachedDigest *key)
+{
+    return (unsigned int)key->ino * 31 + (unsigned int)key->dev * 17 +
+            (unsigned int)key->mtime + (unsigned int)key->ctime * 13 +
+            (unsigned int)key->ctimeNsec + (unsigned int)key->size;
+}
+
+static int
+digestKeyCompare(const void *tableItem, const void *looseItem)
+{
+    const CachedDigest *a = (const CachedDigest *)tableItem;
+    const CachedDigest *b = (const CachedDigest *)looseItem;
+    return !(a->dev == b->dev && a->ino == b->ino &&
+             a->mtime == b->mtime && a->ctime == b->ctime &&
+             a->ctimeNsec == b->ctimeNsec && a->size == b->size);
+}
+
+static bool
+isCached(CachedDigest *digest)
+{
+    return gDigestCache != NULL &&
+            mzHashTableLookup(gDigestCache, digestKeyHash(digest), digest,
+                    digestKeyCompare, false) == digest;
+}
+
+static int
+walkTree(TreeWalk *walk, const char *relPath)
+{
+    char path[PATH_MAX];
+    if (relPath[0] == '\0') {
+        strlcpy(path, walk->root, sizeof(path));
+    } else {
+        snprintf(path, sizeof(path), "%s/%s", walk->root, relPath);
+    }
+
+    if (walk->count == walk->alloc) {
+        int alloc = walk->alloc * 2 + 64;
+        TreeEntry *entries = realloc(walk->entries, alloc * sizeof(*entries));
+        if (entries == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        walk->entries = entries;
+        walk->alloc = alloc;
+    }
+    TreeEntry *entry = &walk->entries[walk->count];
+    memset(entry, 0, sizeof(*entry));
+    if (lstat(path, &entry->st) < 0) {
+        return -1;
+    }
+    entry->path = strdup(relPath);
+    if (entry->path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    walk->count++;
+
+    if (S_ISLNK(entry->st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(path, target, sizeof(target) - 1);
+        if (len < 0) {
+            return -1;
+        }
+        target[len] = '\0';
+        entry->link = strdup(target);
+        return entry->link != NULL ? 0 : -1;
+    }
+    if (!S_ISDIR(entry->st.st_mode)) {
+        return 0;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    const struct dirent *de;
+    int ret = 0;
+    while (ret == 0 && (de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+        char child[PATH_MAX];
+        if (relPath[0] == '\0') {
+            strlcpy(child, de->d_name, sizeof(child));
+        } else {
+            snprintf(child, sizeof(child), "%s/%s", relPath, de->d_name);
+        }
+        ret = walkTree(walk, child);
+    }
+    closedir(dir);
+    return ret;
+}
+
+static int
+compareEntries(const void *a, const void *b)
+{
+    return strcmp(((const TreeEntry *)a)->path, ((const TreeEntry *)b)->path);
+}
+
+static int
+hashFile(const char *path, uint8_t *buf, uint8_t digest[SHA_DIGEST_SIZE])
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    ssize_t n;
+    while ((n = read(fd, buf, HASH_READ_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        SHA_update(&ctx, buf, n);
+    }
+    close(fd);
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return 0;
+}
+
+static void *
+hashWorker(void *cookie)
+{
+    TreeWalk *walk = (TreeWalk *)cookie;
+    uint8_t *buf = malloc(HASH_READ_SIZE);
+
+    for (;;) {
+        pthread_mutex_lock(&walk->lock);
+        int i = walk->next < walk->pendingCount ?
+                walk->pending[walk->next++] : -1;
+        if (buf == NULL && walk->firstErrno == 0) {
+            walk->firstErrno = ENOMEM;
+        }
+        pthread_mutex_unlock(&walk->lock);
+        if (i < 0 || buf == NULL) {
+            break;
+        }
+
+        TreeEntry *entry = &walk->entries[i];
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", walk->root, entry->path);
+        if (hashFile(path, buf, entry->digest->digest) < 0) {
+            LOGE("hash_dir: can't read %s (%s)\n", path, strerror(errno));
+            pthread_mutex_lock(&walk->lock);
+            if (walk->firstErrno == 0) {
+                walk->firstErrno = errno;
+            }
+            pthread_mutex_unlock(&walk->lock);
+            free(entry->digest);
+            entry->digest = NULL;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Hash every regular file that isn't already in the cache. */
+static int
+hashFiles(TreeWalk *walk)
+{
+    if (gDigestCache == NULL) {
+        gDigestCache = mzHashTableCreate(1024, free);
+        if (gDigestCache == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    walk->pending = malloc((walk->count + 1) * sizeof(int));
+    if (walk->pending == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int i;
+    for (i = 0; i < walk->count; i++) {
+        TreeEntry *entry = &walk->entries[i];
+        if (!S_ISREG(entry->st.st_mode)) {
+            continue;
+        }
+        CachedDigest key;
+        key.dev = entry->st.st_dev;
+        key.ino = entry->st.st_ino;
+        key.mtime = entry->st.st_mtime;
+        key.ctime = entry->st.st_ctime;
+        key.ctimeNsec = CTIME_NSEC(&entry->st);
+        key.size = entry->st.st_size;
+        CachedDigest *cached = mzHashTableLookup(gDigestCache,
+                digestKeyHash(&key), &key, digestKeyCompare, false);
+        if (cached != NULL) {
+            entry->digest = cached;
+            continue;
+        }
+        entry->digest = malloc(sizeof(CachedDigest));
+        if (entry->digest == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        *entry->digest = key;
+        walk->pending[walk->pendingCount++] = i;
+    }
+
+    pthread_t threads[HASH_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus < 1 ? 1 : (cpus > HASH_MAX_THREADS ?
+            HASH_MAX_THREADS : (int)cpus);
+    if (wanted > walk->pendingCount) {
+        wanted = walk->pendingCount;
+    }
+    int workers = 0;
+    while (workers < wanted - 1 &&
+           pthread_create(&threads[workers], NULL, hashWorker, walk) == 0) {
+        workers++;
+    }
+    hashWorker(walk);
+    for (i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* Only remember digests once every thread is done with them.  yaffs2
+     * and ext3 keep ctime in whole seconds, so a file changed in the last
+     * second could still be rewritten without its key changing; those
+     * are hashed again next time.
+     */
+    time_t now = time(NULL);
+    for (i = 0; i < walk->pendingCount; i++) {
+        TreeEntry *entry = &walk->entries[walk->pending[i]];
+        if (entry->digest == NULL || entry->digest->ctime >= now - 1) {
+            continue;
+        }
+        /* A hard link to a file hashed earlier in this walk finds the
+         * first copy here; share it so this one can be freed.
+         */
+        CachedDigest *cached = mzHashTableLookup(gDigestCache,
+                digestKeyHash(entry->digest), entry->digest,
+                digestKeyCompare, true);
+        if (cached != NULL && cached != entry->digest) {
+            free(entry->digest);
+            entry->digest = cached;
+        }
+    }
+
+    if (walk->firstErrno != 0) {
+        errno = walk->firstErrno;
+        return -1;
+    }
+    return 0;
+}
+
+int
+hash_dir(const char *path, char out[HASH_DIR_HEX_SIZE])
+{
+    TreeWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.root = path;
+    pthread_mutex_init(&walk.lock, NULL);
+
+    int ret = walkTree(&walk, "");
+    if (ret < 0) {
+        LOGE("hash_dir: can't walk %s (%s)\n", path, strerror(errno));
+    } else {
+        qsort(walk.entries, walk.count, sizeof(TreeEntry), compareEntries);
+        ret = hashFiles(&walk);
+    }
+
+    if (ret == 0) {
+        SHA_CTX ctx;
+        SHA_init(&ctx);
+        int i;
+        for (i = 0; i < walk.count; i++) {
+            const TreeEntry *entry = &walk.entries[i];
+            char header[PATH_MAX + 16];
+            int len = snprintf(header, sizeof(header), "%s\n%o\n",
+                    entry->path, (unsigned int)entry->st.st_mode);
+            SHA_update(&ctx, header, len);
+            if (entry->link != NULL) {
+                SHA_update(&ctx, entry->link, strlen(entry->link) + 1);
+            } else if (entry->digest != NULL) {
+                SHA_update(&ctx, entry->digest->digest, SHA_DIGEST_SIZE);
+            }
+        }
+        const uint8_t *digest = SHA_final(&ctx);
+        for (i = 0; i < SHA_DIGEST_SIZE; i++) {
+            sprintf(out + i * 2, "%02x", digest[i]);
+        }
+    }
+
+    /* Digests that made it into the cache are owned by it now. */
+    int i;
+    for (i = 0; i < walk.count; i++) {
+        TreeEntry *entry = &walk.entries[i];
+        if (entry->digest != NULL && !isCached(entry->digest)) {
+            free(entry->digest);
+        }
+        free(entry->path);
+        free(entry->link);
+    }
+    free(walk.entries);
+    free(walk.pending);
+    pthread_mutex_destroy(&walk.lock);
+    return ret;
+}
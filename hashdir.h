@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_HASHDIR_H
+#define _RECOVERY_HASHDIR_H
+
+/* 40 hex digits of SHA-1 plus the terminating NUL. */
+#define HASH_DIR_HEX_SIZE 41
+
+/* Computes a deterministic digest of the tree rooted at path: the
+ * sorted relative paths, their modes, symlink targets and the SHA-1 of
+ * every regular file's contents.  File contents are hashed on several
+ * threads, and per-file digests are cached for the life of the process
+ * by (device, inode, mtime, ctime, size), so repeated calls over an
+ * unchanged tree only cost a stat() walk.  Files changed within the
+ * last second aren't cached, as ctime may only have whole seconds.
+ *
+ * Writes the digest as lowercase hex to out and returns 0, or returns
+ * -1 (with errno set) if any part of the tree couldn't be read.
+ */
+int hash_dir(const char *path, char out[HASH_DIR_HEX_SIZE]);
+
+#endif
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -35,6 +36,7 @@
 #include "verifier.h"
 #include "firmware.h"
 #include "extracommands.h"
+#include "tracing/tracing.h"
 
 /*
 // List of public keys 
@@ -197,8 +199,10 @@ try_update_binary(const char *path, ZipArchive *zip) {
         LOGE("Can't make %s\n", binary);
         return 1;
     }
+    long long start = trace_now_us();
     bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
     close(fd);
+    trace_span("install", "extract update-binary", start);
 
     if (!ok) {
         LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
@@ -247,6 +251,8 @@ try_update_binary(const char *path, ZipArchive *zip) {
     args[3] = (char*)path;
     args[4] = NULL;
 
+    unlink(TRACE_UPDATER_FILE);
+    start = trace_now_us();
     pid_t pid = fork();
     if (pid == 0) {
         close(pipefd[0]);
@@ -307,6 +313,8 @@ try_update_binary(const char *path, ZipArchive *zip) {
 
     int status;
     waitpid(pid, &status, 0);
+    trace_span("install", "run update-binary", start);
+    if (trace_load(TRACE_UPDATER_FILE) >= 0) unlink(TRACE_UPDATER_FILE);
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
         LOGE("Error in %s\n(Status %d)\n", path, WEXITSTATUS(status));
         return INSTALL_ERROR;
@@ -318,131 +326,53 @@ try_update_binary(const char *path, ZipArchive *zip) {
         return INSTALL_SUCCESS;
     }
 }
-// Reads a file containing one or more public keys as produced by
-// DumpPublicKey:  this is an RSAPublicKey struct as it would appear
-// as a C source literal, eg:
-//
-//  "{64,0xc926ad21,{1795090719,...,-695002876},{-857949815,...,1175080310}}"
-//
-// (Note that the braces and commas in this example are actual
-// characters the parser expects to find in the file; the ellipses
-// indicate more numbers omitted from this example.)
-//
-// The file may contain multiple keys in this format, separated by
-// commas.  The last key must not be followed by a comma.
-//
-// Returns NULL if the file failed to parse, or if it contain zero keys.
-static RSAPublicKey*
-load_keys(const char* filename, int* numKeys) {
-    RSAPublicKey* out = NULL;
-    *numKeys = 0;
-
-    FILE* f = fopen(filename, "r");
-    if (f == NULL) {
-        LOGE("opening %s: %s\n", filename, strerror(errno));
-        goto exit;
-    }
-
-    int i;
-    bool done = false;
-    while (!done) {
-        ++*numKeys;
-        out = realloc(out, *numKeys * sizeof(RSAPublicKey));
-        RSAPublicKey* key = out + (*numKeys - 1);
-        if (fscanf(f, " { %i , 0x%x , { %u",
-                   &(key->len), &(key->n0inv), &(key->n[0])) != 3) {
-            goto exit;
-        }
-        if (key->len != RSANUMWORDS) {
-            LOGE("key length (%d) does not match expected size\n", key->len);
-            goto exit;
-        }
-        for (i = 1; i < key->len; ++i) {
-            if (fscanf(f, " , %u", &(key->n[i])) != 1) goto exit;
-        }
-        if (fscanf(f, " } , { %u", &(key->rr[0])) != 1) goto exit;
-        for (i = 1; i < key->len; ++i) {
-            if (fscanf(f, " , %u", &(key->rr[i])) != 1) goto exit;
-        }
-        fscanf(f, " } } ");
 
-        // if the line ends in a comma, this file has more keys.
-        switch (fgetc(f)) {
-            case ',':
-                // more keys to come.
-                break;
+static void
+report_verify_failure(void)
+{
+    LOGE("Verification failed\n");
 
-            case EOF:
-                done = true;
-                break;
+    ui_print("\nZip verification failed!");
+    ui_print("\nZip isn't signed correctly!");
+}
 
-            default:
-                LOGE("unexpected character between keys\n");
-                goto exit;
-        }
+// Check the package signature.  When quiet is set the progress bar and
+// screen are left alone, since another package may be installing; the
+// caller reports a failure with report_verify_failure() when it's ready.
+static int
+verify_update_package(ZipArchive *zip, const RSAPublicKey *keys, int numKeys,
+                      bool quiet)
+{
+    if (!quiet) {
+        // Give verification half the progress bar...
+        ui_print("Verifying update package...\n");
+        ui_show_progress(
+                VERIFICATION_PROGRESS_FRACTION,
+                VERIFICATION_PROGRESS_TIME);
     }
 
-    fclose(f);
-    return out;
+    // Verify zip: a whole-file signature is one sequential pass over the
+    // mapped package; only fall back to per-entry jar verification without one.
+    long long start = trace_now_us();
+    int err = verify_file_signature(zip, keys, numKeys, !quiet);
+    if (err == VERIFY_FILE_UNSIGNED) {
+        err = verify_jar_signature(zip, keys, numKeys, !quiet);
+        trace_span("install", "verify_jar_signature", start);
+    } else {
+        err = (err == VERIFY_FILE_OK);
+        trace_span("install", "verify_file_signature", start);
+    }
 
-exit:
-    if (f) fclose(f);
-    free(out);
-    *numKeys = 0;
-    return NULL;
+    if (!err) {
+        if (!quiet) report_verify_failure();
+        return INSTALL_CORRUPT;
+    }
+    return INSTALL_SUCCESS;
 }
 
 static int
-handle_update_package(const char *path, ZipArchive *zip)
+run_update_package(const char *path, ZipArchive *zip)
 {
-    if (signature_check_enabled) 
-	{
-		/*
-		//RSAPublicKey loadedKeys == keys;
-		// List of public keys 
-	static const RSAPublicKey keys[] = {
-	#include "keys.inc"
-	};
-		*/
-
-		int numKeys;
-		RSAPublicKey* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
-		if (loadedKeys == NULL) {
-			LOGE("Failed to load keys\n");
-			return INSTALL_CORRUPT;
-		}
-		LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
-
-
-			if (loadedKeys == NULL) {
-			LOGE("Failed to load keys\n");
-			return INSTALL_CORRUPT;
-			}
-	
-
-	// Give verification half the progress bar...
-    ui_print("Verifying update package...\n");
-    ui_show_progress(
-            VERIFICATION_PROGRESS_FRACTION,
-            VERIFICATION_PROGRESS_TIME);
-int err;
-    /*err=verify_jar_signature(zip, keys, sizeof(keys) / sizeof(keys[0]));
-       //free(keys);
-	*/
-// Verify zip	
-	err=verify_jar_signature(zip,  loadedKeys, numKeys);
-	free(loadedKeys);
-
-if (!err)
-		{
-        LOGE("Verification failed\n");
-
-        ui_print("\nZip verification failed!");
-        ui_print("\nZip isn't signed correctly!");
-
-        return INSTALL_CORRUPT;
-		}
-    }
     // Update should take the rest of the progress bar.
     ui_print("Installing update...\n");
 
@@ -473,12 +403,30 @@ if (!err)
     return ret;
 }
 
-int
-install_package(const char *root_path)
+static int
+handle_update_package(const char *path, ZipArchive *zip)
+{
+    if (signature_check_enabled) {
+        int numKeys;
+        RSAPublicKey* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+        if (loadedKeys == NULL) {
+            LOGE("Failed to load keys\n");
+            return INSTALL_CORRUPT;
+        }
+        LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
+
+        int status = verify_update_package(zip, loadedKeys, numKeys, false);
+        free(loadedKeys);
+        if (status != INSTALL_SUCCESS) return status;
+    }
+
+    return run_update_package(path, zip);
+}
+
+// Mount the root holding a package and translate it to a file path.
+static int
+locate_package(const char *root_path, char *path, size_t pathLen)
 {
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
-    ui_print("Finding update package...\n");
-    ui_show_indeterminate_progress();
     LOGI("Update location: %s\n", root_path);
 
     if (ensure_root_path_mounted(root_path) != 0) {
@@ -486,21 +434,53 @@ install_package(const char *root_path)
         return INSTALL_CORRUPT;
     }
 
-    char path[PATH_MAX] = "";
-    if (translate_root_path(root_path, path, sizeof(path)) == NULL) {
+    path[0] = '\0';
+    if (translate_root_path(root_path, path, pathLen) == NULL) {
         LOGE("Bad path %s\n", root_path);
         return INSTALL_CORRUPT;
     }
+    return INSTALL_SUCCESS;
+}
 
-    ui_print("Opening update package...\n");
+// Returns the mzOpenZipArchive() error, 0 on success.  Nothing goes to
+// the screen, so this is safe to call from the verify-ahead thread.
+static int
+open_package(const char *path, ZipArchive *zip)
+{
     LOGI("Update file path: %s\n", path);
 
+    long long start = trace_now_us();
+    int err = mzOpenZipArchive(path, zip);
+    trace_span("zip", "mzOpenZipArchive", start);
+    return err;
+}
+
+static void
+report_open_failure(const char *path, int err)
+{
+    LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+}
+
+int
+install_package(const char *root_path)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_print("Finding update package...\n");
+    ui_show_indeterminate_progress();
+
+    char path[PATH_MAX];
+    if (locate_package(root_path, path, sizeof(path)) != INSTALL_SUCCESS) {
+        return INSTALL_CORRUPT;
+    }
+
+    ui_print("Opening update package...\n");
+
     /* Try to open the package.
      */
     ZipArchive zip;
-    int err = mzOpenZipArchive(path, &zip);
+    int err = open_package(path, &zip);
     if (err != 0) {
-        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        report_open_failure(path, err);
         return INSTALL_CORRUPT;
     }
 
@@ -510,3 +490,155 @@ install_package(const char *root_path)
     mzCloseZipArchive(&zip);
     return status;
 }
+
+/*
+ * One entry of an install queue.  The package after the one currently
+ * installing is opened and verified on a worker thread, so by the time
+ * its turn comes only the update binary is left to run.
+ */
+typedef struct {
+    char path[PATH_MAX];
+    ZipArchive zip;
+    bool opened;
+    int openErr;
+    int status;
+
+    const RSAPublicKey *keys;
+    int numKeys;
+    pthread_t thread;
+    bool started;
+} QueuedPackage;
+
+// With quiet set nothing is printed; a failure is left in pkg for
+// report_queued_failure() to show when the package's turn comes.
+static int
+prepare_queued_package(QueuedPackage *pkg, bool quiet)
+{
+    pkg->openErr = open_package(pkg->path, &pkg->zip);
+    if (pkg->openErr != 0) {
+        if (!quiet) report_open_failure(pkg->path, pkg->openErr);
+        pkg->status = INSTALL_CORRUPT;
+        return pkg->status;
+    }
+    pkg->opened = true;
+
+    if (pkg->keys != NULL) {
+        pkg->status = verify_update_package(&pkg->zip, pkg->keys,
+                                            pkg->numKeys, quiet);
+    }
+    return pkg->status;
+}
+
+static void*
+prepare_queued_package_thread(void *cookie)
+{
+    prepare_queued_package((QueuedPackage *) cookie, true);
+    return NULL;
+}
+
+static void
+report_queued_failure(const QueuedPackage *pkg)
+{
+    if (!pkg->opened) {
+        report_open_failure(pkg->path, pkg->openErr);
+    } else {
+        report_verify_failure();
+    }
+}
+
+static void
+release_queued_package(QueuedPackage *pkg)
+{
+    if (pkg->started) {
+        pthread_join(pkg->thread, NULL);
+        pkg->started = false;
+    }
+    if (pkg->opened) {
+        mzCloseZipArchive(&pkg->zip);
+        pkg->opened = false;
+    }
+}
+
+int
+install_packages(const char **root_paths, int count)
+{
+    if (count == 1) return install_package(root_paths[0]);
+
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_print("Finding %d update packages...\n", count);
+    ui_show_indeterminate_progress();
+
+    QueuedPackage *queue = calloc(count, sizeof(QueuedPackage));
+    if (queue == NULL) {
+        LOGE("Can't allocate install queue\n");
+        return INSTALL_ERROR;
+    }
+
+    // Resolve every package before touching the device, so a typo in
+    // the last path doesn't leave a half-flashed system behind.
+    int i;
+    int status = INSTALL_SUCCESS;
+    for (i = 0; i < count && status == INSTALL_SUCCESS; ++i) {
+        status = locate_package(root_paths[i], queue[i].path,
+                                sizeof(queue[i].path));
+    }
+
+    RSAPublicKey *loadedKeys = NULL;
+    int numKeys = 0;
+    if (status == INSTALL_SUCCESS && signature_check_enabled) {
+        loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+        if (loadedKeys == NULL) {
+            LOGE("Failed to load keys\n");
+            status = INSTALL_CORRUPT;
+        } else {
+            LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
+        }
+    }
+    for (i = 0; i < count; ++i) {
+        queue[i].keys = loadedKeys;
+        queue[i].numKeys = numKeys;
+    }
+
+    if (status == INSTALL_SUCCESS) {
+        ui_print("Opening update package...\n");
+        status = prepare_queued_package(&queue[0], false);
+    }
+
+    for (i = 0; i < count && status == INSTALL_SUCCESS; ++i) {
+        QueuedPackage *pkg = &queue[i];
+        if (pkg->started) {
+            pthread_join(pkg->thread, NULL);
+            pkg->started = false;
+            status = pkg->status;
+            if (status != INSTALL_SUCCESS) {
+                report_queued_failure(pkg);
+                ui_print("\nPackage %d of %d failed to verify.\n", i + 1, count);
+                break;
+            }
+        }
+
+        if (i + 1 < count) {
+            if (pthread_create(&queue[i + 1].thread, NULL,
+                               prepare_queued_package_thread, &queue[i + 1])) {
+                LOGW("Can't start verify-ahead thread; verifying inline\n");
+            } else {
+                queue[i + 1].started = true;
+            }
+        }
+
+        ui_print("\nPackage %d of %d: %s\n", i + 1, count, root_paths[i]);
+        status = run_update_package(pkg->path, &pkg->zip);
+        release_queued_package(pkg);
+
+        if (status == INSTALL_SUCCESS && i + 1 < count &&
+                !queue[i + 1].started) {
+            status = prepare_queued_package(&queue[i + 1], false);
+        }
+        if (status == INSTALL_SUCCESS) ui_set_background(BACKGROUND_ICON_INSTALLING);
+    }
+
+    for (i = 0; i < count; ++i) release_queued_package(&queue[i]);
+    free(loadedKeys);
+    free(queue);
+    return status;
+}
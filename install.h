@@ -22,4 +22,9 @@
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT };
 int install_package(const char *root_path);
 
+// Install several packages strictly in order, stopping at the first
+// failure.  Each package is opened and verified while the one before it
+// is still installing.
+int install_packages(const char **root_paths, int count);
+
 #endif  // RECOVERY_INSTALL_H_
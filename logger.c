@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define LOG_BUFFER_SIZE     (64 * 1024)
+#define LOG_HIGH_WATER      (LOG_BUFFER_SIZE / 2)
+#define LOG_IDLE_FLUSH_MS   200
+#define LOG_STDIO_SIZE      (16 * 1024)
+
+static int g_log_fd = -1;
+static int g_pipe_read = -1;
+static int g_wake[2] = { -1, -1 };
+
+static char g_buffer[LOG_BUFFER_SIZE];
+static volatile size_t g_buffered = 0;
+
+static pthread_mutex_t g_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_flush_cond = PTHREAD_COND_INITIALIZER;
+static unsigned g_flush_requested = 0;
+static unsigned g_flush_completed = 0;
+
+/* Our own stdout/stderr are fully buffered in-process, so a LOGI or
+ * ui_print is a memcpy rather than a write() into the pipe.
+ */
+static char g_stdout_buffer[LOG_STDIO_SIZE];
+static char g_stderr_buffer[LOG_STDIO_SIZE];
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void write_buffer(void) {
+    write_all(g_log_fd, g_buffer, g_buffered);
+    g_buffered = 0;
+}
+
+/* Pull everything currently in the pipe into the buffer (the read end is
+ * non-blocking), writing out whenever the buffer fills.  Returns -1 once
+ * every writer has gone away.
+ */
+static int drain_pipe(void) {
+    for (;;) {
+        if (g_buffered == LOG_BUFFER_SIZE) write_buffer();
+        ssize_t n = read(g_pipe_read, g_buffer + g_buffered,
+                         LOG_BUFFER_SIZE - g_buffered);
+        if (n > 0) {
+            g_buffered += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return n == 0 ? -1 : 0;
+        }
+    }
+}
+
+static void *logger_thread(void *cookie) {
+    struct pollfd fds[2];
+    fds[0].fd = g_pipe_read;
+    fds[0].events = POLLIN;
+    fds[1].fd = g_wake[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        int timeout = g_buffered > 0 ? LOG_IDLE_FLUSH_MS : -1;
+        int ready = poll(fds, 2, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            // A flush was requested.  Anything the requester wrote before
+            // asking is already in the pipe, so drain it all and write.
+            char junk[16];
+            while (read(g_wake[0], junk, sizeof(junk)) > 0) ;
+
+            pthread_mutex_lock(&g_flush_lock);
+            unsigned requested = g_flush_requested;
+            pthread_mutex_unlock(&g_flush_lock);
+
+            drain_pipe();
+            write_buffer();
+
+            pthread_mutex_lock(&g_flush_lock);
+            g_flush_completed = requested;
+            pthread_cond_broadcast(&g_flush_cond);
+            pthread_mutex_unlock(&g_flush_lock);
+            continue;
+        }
+
+        if (ready == 0) {
+            // Idle: nothing new arrived for a while.
+            write_buffer();
+        } else if (fds[0].revents & (POLLIN | POLLHUP)) {
+            if (drain_pipe() < 0) break;
+            if (g_buffered >= LOG_HIGH_WATER) write_buffer();
+        }
+    }
+
+    write_buffer();
+    return NULL;
+}
+
+/* Pushes our stdio buffers into the pipe on the idle interval.  This is
+ * kept off the logger thread: fflush() can block on a full pipe, and the
+ * logger thread is the only thing that empties it.
+ */
+static void *stdio_flusher_thread(void *cookie) {
+    for (;;) {
+        usleep(LOG_IDLE_FLUSH_MS * 1000);
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return NULL;
+}
+
+/* Empty the stdio buffers before fork(), so children start with nothing
+ * of ours to flush twice and our records stay ahead of theirs.
+ */
+static void flush_stdio(void) {
+    fflush(stdout);
+    fflush(stderr);
+}
+
+/* A child that prints and then exec()s or _exit()s must not lose it. */
+static void unbuffer_stdio(void) {
+    setbuf(stdout, NULL);
+    setbuf(stderr, NULL);
+}
+
+/* Fatal and termination signals: write out whatever the logger thread
+ * hasn't yet, then die the way we would have.  A record the thread was
+ * in the middle of writing may appear twice, but none are lost.
+ */
+static void flush_on_signal(int sig) {
+    size_t buffered = g_buffered;
+    if (buffered > LOG_BUFFER_SIZE) buffered = LOG_BUFFER_SIZE;
+    write_all(g_log_fd, g_buffer, buffered);
+
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read(g_pipe_read, chunk, sizeof(chunk))) > 0) {
+        write_all(g_log_fd, chunk, n);
+    }
+
+    // Newest of all is what's still in our stdio buffers.  Point the
+    // descriptors straight at the file so flushing can't block on the
+    // pipe, and skip a stream whose lock the crashing thread holds.
+    dup2(g_log_fd, STDOUT_FILENO);
+    dup2(g_log_fd, STDERR_FILENO);
+    if (ftrylockfile(stdout) == 0) {
+        fflush(stdout);
+        funlockfile(stdout);
+    }
+    if (ftrylockfile(stderr) == 0) {
+        fflush(stderr);
+        funlockfile(stderr);
+    }
+    fsync(g_log_fd);
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void install_signal_handlers(void) {
+    static const int signals[] = {
+        SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGTERM, SIGHUP, SIGINT
+    };
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = flush_on_signal;
+    sa.sa_flags = SA_RESETHAND;
+    unsigned i;
+    for (i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i) {
+        sigaction(signals[i], &sa, NULL);
+    }
+}
+
+int logger_init(const char *path) {
+    int pipefd[2] = { -1, -1 };
+
+    g_log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (g_log_fd < 0) return -1;
+    if (pipe(pipefd) < 0 || pipe(g_wake) < 0) goto fail;
+
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(g_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(g_wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(g_wake[1], F_SETFD, FD_CLOEXEC);
+    fcntl(g_log_fd, F_SETFD, FD_CLOEXEC);
+    g_pipe_read = pipefd[0];
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, logger_thread, NULL);
+    if (err != 0) {
+        pthread_attr_destroy(&attr);
+        goto fail;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    close(pipefd[1]);
+
+    // Children write straight into the pipe; our own records collect in
+    // stdio first and reach it on the idle interval, before every fork(),
+    // on logger_flush() and at exit.  Without the flusher thread nothing
+    // would bound how stale the log gets, so stay unbuffered instead.
+    if (pthread_create(&thread, &attr, stdio_flusher_thread, NULL) == 0) {
+        setvbuf(stdout, g_stdout_buffer, _IOFBF, sizeof(g_stdout_buffer));
+        setvbuf(stderr, g_stderr_buffer, _IOFBF, sizeof(g_stderr_buffer));
+        pthread_atfork(flush_stdio, NULL, unbuffer_stdio);
+    } else {
+        setbuf(stdout, NULL);
+        setbuf(stderr, NULL);
+    }
+    pthread_attr_destroy(&attr);
+    atexit(logger_flush);
+
+    install_signal_handlers();
+    return 0;
+
+fail:
+    if (pipefd[0] >= 0) close(pipefd[0]);
+    if (pipefd[1] >= 0) close(pipefd[1]);
+    if (g_wake[0] >= 0) close(g_wake[0]);
+    if (g_wake[1] >= 0) close(g_wake[1]);
+    close(g_log_fd);
+    g_log_fd = g_pipe_read = g_wake[0] = g_wake[1] = -1;
+    return -1;
+}
+
+void logger_flush(void) {
+    flush_stdio();
+    if (g_log_fd < 0) return;
+
+    pthread_mutex_lock(&g_flush_lock);
+    unsigned target = ++g_flush_requested;
+    write(g_wake[1], "", 1);
+    while ((int) (g_flush_completed - target) < 0) {
+        pthread_cond_wait(&g_flush_cond, &g_flush_lock);
+    }
+    pthread_mutex_unlock(&g_flush_lock);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_LOGGER_H
+#define _RECOVERY_LOGGER_H
+
+/* Routes stdout and stderr (ours and those of every child we start)
+ * through a pipe to a background thread that appends to path in large
+ * batched writes.  Our own stdout and stderr are fully buffered in
+ * process and only reach the pipe after a short idle period, before
+ * fork(), on logger_flush() and at exit.  Output is written to the file
+ * when the buffer fills, after a short idle period, on logger_flush(),
+ * and on fatal or termination signals.
+ *
+ * Returns 0 on success.  On failure nothing is redirected and the caller
+ * should fall back to writing the log directly.
+ */
+int logger_init(const char *path);
+
+/* Blocks until everything written to stdout/stderr so far is in the
+ * log file.  Call before reading the log back or rebooting.
+ */
+void logger_flush(void);
+
+#endif
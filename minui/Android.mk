@@ -39,6 +39,44 @@ ifeq ($(BOARD_USES_THIRTYTWO_BIT_FB),true)
 LOCAL_CFLAGS += -DTHIRTYTWO_BIT_FB
 endif 
 
+# Images linked into libminui already decoded (see png2raw.c), so the UI
+# doesn't run libpng on them at startup.  Boards can trim the list; any
+# image left out is still loaded from /res/images.
+MINUI_BUILTIN_IMAGES ?= \
+	icon_installing icon_error icon_firmware_install icon_firmware_error \
+	indeterminate1 indeterminate2 indeterminate3 \
+	indeterminate4 indeterminate5 indeterminate6 \
+	progress_bar_empty_left_round progress_bar_empty \
+	progress_bar_empty_right_round progress_bar_left_round \
+	progress_bar_fill progress_bar_right_round
+ifeq ($(ENABLE_TOUCH_UI),true)
+MINUI_BUILTIN_IMAGES += virtual_keys
+endif
+
 LOCAL_MODULE := libminui
+LOCAL_MODULE_CLASS := STATIC_LIBRARIES
+
+intermediates := $(call local-intermediates-dir)
+minui_png2raw := $(HOST_OUT_EXECUTABLES)/minui_png2raw$(HOST_EXECUTABLE_SUFFIX)
+minui_builtin_pngs := \
+	$(foreach i,$(MINUI_BUILTIN_IMAGES),$(LOCAL_PATH)/../res/images/$(i).png)
+
+GEN := $(intermediates)/builtin_images.c
+$(GEN): PRIVATE_PNGS := $(minui_builtin_pngs)
+$(GEN): PRIVATE_CUSTOM_TOOL = $(minui_png2raw) $@ $(PRIVATE_PNGS)
+$(GEN): $(minui_png2raw) $(minui_builtin_pngs)
+	$(transform-generated-source)
+LOCAL_GENERATED_SOURCES += $(GEN)
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
 
 include $(BUILD_STATIC_LIBRARY)
+
+# png2raw, the host tool that generates builtin_images.c.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := png2raw.c
+LOCAL_C_INCLUDES += external/libpng external/zlib
+LOCAL_STATIC_LIBRARIES := libpng libz
+LOCAL_MODULE := minui_png2raw
+
+include $(BUILD_HOST_EXECUTABLE)
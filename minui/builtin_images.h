@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_BUILTIN_IMAGES_H
+#define _MINUI_BUILTIN_IMAGES_H
+
+// An image from /res/images that png2raw decoded at build time.  The
+// pixels are 32 bits each (RGBX for 3-channel PNGs, RGBA for 4-channel
+// ones), ready to hand to pixelflinger without any conversion.
+typedef struct {
+    const char *name;           // e.g. "icon_installing"
+    unsigned int width, height;
+    int channels;               // of the source PNG: 3 or 4
+    long pngSize;               // size of the source PNG, in bytes
+    unsigned long pngCrc;       // zlib crc32() of the source PNG
+    const unsigned char *pixels;
+} BuiltinImage;
+
+// Generated by png2raw; ends with an entry whose name is NULL.
+extern const BuiltinImage gBuiltinImages[];
+
+#endif  // _MINUI_BUILTIN_IMAGES_H
@@ -18,8 +18,11 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/epoll.h>
 #include <sys/poll.h>
+#include <time.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include <linux/input.h>
 
@@ -28,6 +31,7 @@
 #include "minui.h"
 
 #define MAX_DEVICES 16
+#define MAX_MISC_FDS 16
 
 //#define VIBRATOR_TIMEOUT_FILE	"/sys/class/timed_output/vibrator/enable"
 //#define VIBRATOR_TIME_MS	50
@@ -65,10 +69,22 @@ struct ev {
     int sent, mt_idx;
 };
 
+struct fd_info {
+    int fd;
+    ev_callback cb;
+    void *data;
+};
+
 static struct pollfd ev_fds[MAX_DEVICES];
 static struct ev evs[MAX_DEVICES];
 static unsigned ev_count = 0;
 
+// Extra fds from ev_add_fd().  Their epoll tag is MAX_DEVICES + index.
+static struct fd_info ev_misc[MAX_MISC_FDS];
+static unsigned ev_misc_count = 0;
+
+static int ev_epollfd = -1;
+
 static inline int ABS(int x) {
     return x<0?-x:x;
 }
@@ -189,6 +205,10 @@ int ev_init(void)
     struct dirent *de;
     int fd;
 
+    ev_epollfd = epoll_create(MAX_DEVICES + MAX_MISC_FDS);
+    if (ev_epollfd < 0)
+        return -1;
+
     dir = opendir("/dev/input");
     if(dir != 0) {
         while((de = readdir(dir))) {
@@ -197,6 +217,14 @@ int ev_init(void)
             fd = openat(dirfd(dir), de->d_name, O_RDONLY);
             if(fd < 0) continue;
 
+            struct epoll_event epev;
+            epev.events = EPOLLIN;
+            epev.data.u32 = ev_count;
+            if (epoll_ctl(ev_epollfd, EPOLL_CTL_ADD, fd, &epev) < 0) {
+                close(fd);
+                continue;
+            }
+
             ev_fds[ev_count].fd = fd;
             ev_fds[ev_count].events = POLLIN;
             evs[ev_count].fd = &ev_fds[ev_count];
@@ -212,6 +240,25 @@ int ev_init(void)
     return 0;
 }
 
+int ev_add_fd(int fd, ev_callback cb, void *data)
+{
+    struct epoll_event epev;
+
+    if (ev_epollfd < 0 || ev_misc_count == MAX_MISC_FDS || cb == NULL)
+        return -1;
+
+    epev.events = EPOLLIN;
+    epev.data.u32 = MAX_DEVICES + ev_misc_count;
+    if (epoll_ctl(ev_epollfd, EPOLL_CTL_ADD, fd, &epev) < 0)
+        return -1;
+
+    ev_misc[ev_misc_count].fd = fd;
+    ev_misc[ev_misc_count].cb = cb;
+    ev_misc[ev_misc_count].data = data;
+    ev_misc_count++;
+    return 0;
+}
+
 void ev_exit(void)
 {
     while (ev_count-- > 0) {
@@ -221,6 +268,14 @@ void ev_exit(void)
 	}
         close(ev_fds[ev_count].fd);
     }
+    ev_count = 0;
+    // Extra fds belong to whoever passed them to ev_add_fd(); closing the
+    // epoll fd below is all it takes to stop watching them.
+    ev_misc_count = 0;
+    if (ev_epollfd >= 0) {
+        close(ev_epollfd);
+        ev_epollfd = -1;
+    }
 }
 
 static int vk_inside_display(__s32 value, struct input_absinfo *info, int screen_size)
@@ -383,22 +438,49 @@ int ev_get(struct input_event *ev, unsigned dont_wait, unsigned keyheld)
 int ev_get(struct input_event *ev, unsigned dont_wait)
 #endif
 {
-    int r;
-    unsigned n;
+    struct epoll_event ready[MAX_DEVICES + MAX_MISC_FDS];
+    int r, i;
+#ifdef USE_TOUCH_SCROLLING
+    // When keyheld is true, that means the previous event was an up/down
+    // keypress, so the caller wants to hear back KEYHOLD_DELAY from now.
+    // Timer and redraw wakeups mustn't push that back, so keep a deadline
+    // and only wait for what's left of it.
+    struct timespec now, deadline;
+    if (keyheld && !dont_wait) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += KEYHOLD_DELAY * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+#endif
 
     do {
+        // Extra fds are serviced here too, so callers blocked in ev_get()
+        // double as the event loop for them.
 #ifdef USE_TOUCH_SCROLLING
-		// When keyheld is true, that means the previous event
-        // was an up/down keypress so wait KEYHOLD_DELAY.
-        r = poll(ev_fds, ev_count, dont_wait ? 0 : keyheld ? KEYHOLD_DELAY : -1);
+        int timeout = dont_wait ? 0 : -1;
+        if (keyheld && !dont_wait) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long left = (deadline.tv_sec - now.tv_sec) * 1000LL +
+                    (deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+            timeout = left > 0 ? (int) left : 0;
+        }
+        r = epoll_wait(ev_epollfd, ready, MAX_DEVICES + MAX_MISC_FDS, timeout);
 #else
-        r = poll(ev_fds, ev_count, dont_wait ? 0 : -1);
+        r = epoll_wait(ev_epollfd, ready, MAX_DEVICES + MAX_MISC_FDS,
+                dont_wait ? 0 : -1);
 #endif
         if(r > 0) {
-            for(n = 0; n < ev_count; n++) {
-                if(ev_fds[n].revents & POLLIN) {
-                    r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                    if(r == sizeof(*ev)) {
+            // Devices we don't get to now stay ready for the next call.
+            for(i = 0; i < r; i++) {
+                unsigned n = ready[i].data.u32;
+                if (n >= MAX_DEVICES) {
+                    struct fd_info *info = &ev_misc[n - MAX_DEVICES];
+                    info->cb(info->fd, ready[i].events, info->data);
+                } else if(ready[i].events & EPOLLIN) {
+                    if(read(ev_fds[n].fd, ev, sizeof(*ev)) == sizeof(*ev)) {
                         if (!vk_modify(&evs[n], ev))
                             return 0;
                     }
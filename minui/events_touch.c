@@ -18,7 +18,9 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/epoll.h>
 #include <sys/poll.h>
+#include <unistd.h>
 
 #include <linux/input.h>
 
@@ -45,6 +47,21 @@ static unsigned ev_count = 0;
 static unsigned ev_dev_count = 0;
 static unsigned ev_misc_count = 0;
 
+// ev_wait() collects ready fds here for ev_dispatch().  Each is tagged
+// with its index in ev_fds.
+static int ev_epollfd = -1;
+static struct epoll_event ev_ready[MAX_DEVICES + MAX_MISC_FDS];
+static int ev_ready_count = 0;
+
+static int ev_watch(int fd)
+{
+    struct epoll_event epev;
+
+    epev.events = EPOLLIN;
+    epev.data.u32 = ev_count;
+    return epoll_ctl(ev_epollfd, EPOLL_CTL_ADD, fd, &epev);
+}
+
 //#define VIBRATOR_TIMEOUT_FILE "/sys/class/timed_output/vibrator/enable"
 //#define VIBRATOR_TIME_MS 50
 
@@ -72,6 +89,10 @@ int ev_init(ev_callback input_cb, void *data)
     struct dirent *de;
     int fd;
 
+    ev_epollfd = epoll_create(MAX_DEVICES + MAX_MISC_FDS);
+    if (ev_epollfd < 0)
+        return -1;
+
     dir = opendir("/dev/input");
     if(dir != 0) {
         while((de = readdir(dir))) {
@@ -96,6 +117,10 @@ int ev_init(ev_callback input_cb, void *data)
 	        close(fd);
 	        continue;
 	     }
+            if (ev_watch(fd) < 0) {
+                close(fd);
+                continue;
+            }
 
             ev_fds[ev_count].fd = fd;
             ev_fds[ev_count].events = POLLIN;
@@ -112,7 +137,9 @@ int ev_init(ev_callback input_cb, void *data)
 
 int ev_add_fd(int fd, ev_callback cb, void *data)
 {
-    if (ev_misc_count == MAX_MISC_FDS || cb == NULL)
+    if (ev_epollfd < 0 || ev_misc_count == MAX_MISC_FDS || cb == NULL)
+        return -1;
+    if (ev_watch(fd) < 0)
         return -1;
 
     ev_fds[ev_count].fd = fd;
@@ -126,33 +153,44 @@ int ev_add_fd(int fd, ev_callback cb, void *data)
 
 void ev_exit(void)
 {
-    while (ev_count > 0) {
-        close(ev_fds[--ev_count].fd);
+    // ev_init() fills the first ev_dev_count slots with input devices;
+    // fds from ev_add_fd() follow and belong to whoever passed them in.
+    while (ev_dev_count > 0) {
+        close(ev_fds[--ev_dev_count].fd);
     }
+    ev_count = 0;
     ev_misc_count = 0;
-    ev_dev_count = 0;
+    ev_ready_count = 0;
+    if (ev_epollfd >= 0) {
+        close(ev_epollfd);
+        ev_epollfd = -1;
+    }
 }
 
 int ev_wait(int timeout)
 {
     int r;
 
-    r = poll(ev_fds, ev_count, timeout);
-    if (r <= 0)
+    r = epoll_wait(ev_epollfd, ev_ready, MAX_DEVICES + MAX_MISC_FDS, timeout);
+    if (r <= 0) {
+        ev_ready_count = 0;
         return -1;
+    }
+    ev_ready_count = r;
     return 0;
 }
 
 void ev_dispatch(void)
 {
-    unsigned n;
-    int ret;
+    int i;
 
-    for (n = 0; n < ev_count; n++) {
+    for (i = 0; i < ev_ready_count; i++) {
+        unsigned n = ev_ready[i].data.u32;
         ev_callback cb = ev_fdinfo[n].cb;
-        if (cb && (ev_fds[n].revents & ev_fds[n].events))
-            cb(ev_fds[n].fd, ev_fds[n].revents, ev_fdinfo[n].data);
+        if (cb)
+            cb(ev_fds[n].fd, ev_ready[i].events, ev_fdinfo[n].data);
     }
+    ev_ready_count = 0;
 }
 
 int ev_get_input(int fd, short revents, struct input_event *ev)
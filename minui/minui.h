@@ -43,8 +43,14 @@ unsigned int gr_get_height(gr_surface surface);
 // see http://www.mjmwired.net/kernel/Documentation/input/ for info.
 struct input_event;
 
-#ifdef TOUCH_UI
 typedef int (*ev_callback)(int fd, short revents, void *data);
+
+// Watch another fd (a timerfd, eventfd, ...) along with the input devices.
+// cb is called from the event loop whenever fd is readable.  The caller
+// still owns fd: ev_exit() stops watching it but doesn't close it.
+int ev_add_fd(int fd, ev_callback cb, void *data);
+
+#ifdef TOUCH_UI
 typedef int (*ev_set_key_callback)(int code, int value, void *data);
 int ev_init(ev_callback input_cb, void *data);
 
@@ -56,7 +62,6 @@ int ev_init(ev_callback input_cb, void *data);
 int ev_wait(int timeout);
 int ev_get_input(int fd, short revents, struct input_event *ev);
 void ev_dispatch(void);
-int ev_add_fd(int fd, ev_callback cb, void *data);
 int ev_sync_key_state(ev_set_key_callback set_key_cb, void *data);
 #else
 int ev_init(void);
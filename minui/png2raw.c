@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool: decode recovery PNGs at build time.
+//
+//   png2raw output.c image.png...
+//
+// writes a C file defining gBuiltinImages (see builtin_images.h), with
+// each image expanded to the 32-bit pixels res_create_surface() would
+// have produced on the device.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <png.h>
+#include <zlib.h>
+
+typedef struct {
+    char name[256];
+    unsigned int width, height;
+    int channels;
+    long pngSize;
+    unsigned long pngCrc;
+} ImageInfo;
+
+// crc32() of everything left in fp, which is rewound afterwards.
+static int file_crc(FILE *fp, unsigned long *crc)
+{
+    unsigned char buf[4096];
+    size_t n;
+
+    *crc = crc32(0L, Z_NULL, 0);
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        *crc = crc32(*crc, buf, n);
+    }
+    if (ferror(fp)) return -1;
+    rewind(fp);
+    return 0;
+}
+
+// Decodes path and writes its pixels to out as array number index.
+// Returns 0 on success.
+static int convert(FILE *out, int index, const char *path, ImageInfo *info)
+{
+    FILE *fp = NULL;
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    unsigned char *row = NULL;
+    unsigned char header[8];
+    struct stat st;
+    int result = -1;
+
+    const char *base = strrchr(path, '/');
+    base = (base == NULL) ? path : base + 1;
+    size_t len = strlen(base);
+    if (len < 4 || len - 4 >= sizeof(info->name) ||
+        strcmp(base + len - 4, ".png") != 0) {
+        fprintf(stderr, "png2raw: %s: not a .png\n", path);
+        return -1;
+    }
+    memcpy(info->name, base, len - 4);
+    info->name[len - 4] = '\0';
+
+    fp = fopen(path, "rb");
+    if (fp == NULL || fstat(fileno(fp), &st) != 0) {
+        fprintf(stderr, "png2raw: can't open %s\n", path);
+        goto exit;
+    }
+    info->pngSize = st.st_size;
+    if (file_crc(fp, &info->pngCrc) != 0) {
+        fprintf(stderr, "png2raw: can't read %s\n", path);
+        goto exit;
+    }
+
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        png_sig_cmp(header, 0, sizeof(header))) {
+        fprintf(stderr, "png2raw: %s: not a PNG\n", path);
+        goto exit;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL) goto exit;
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) goto exit;
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        fprintf(stderr, "png2raw: %s: bad PNG data\n", path);
+        goto exit;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_set_sig_bytes(png_ptr, sizeof(header));
+    png_read_info(png_ptr, info_ptr);
+
+    info->width = png_get_image_width(png_ptr, info_ptr);
+    info->height = png_get_image_height(png_ptr, info_ptr);
+    info->channels = png_get_channels(png_ptr, info_ptr);
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    if (png_get_bit_depth(png_ptr, info_ptr) != 8 ||
+        (info->channels != 3 && info->channels != 4) ||
+        (color_type != PNG_COLOR_TYPE_RGB &&
+         color_type != PNG_COLOR_TYPE_RGBA)) {
+        // res_create_surface() doesn't take these either.
+        fprintf(stderr, "png2raw: %s: only 8-bit RGB and RGBA are supported\n",
+                path);
+        goto exit;
+    }
+
+    row = malloc(4 * info->width);
+    if (row == NULL) goto exit;
+
+    fprintf(out, "\n// %s\n", base);
+    fprintf(out, "static const unsigned char image%d[] "
+            "__attribute__((aligned(4))) = {\n", index);
+    unsigned int x, y;
+    for (y = 0; y < info->height; ++y) {
+        png_read_row(png_ptr, row, NULL);
+        for (x = 0; x < info->width; ++x) {
+            const unsigned char *p = row + x * info->channels;
+            fprintf(out, "%s0x%02x,0x%02x,0x%02x,0x%02x,",
+                    (x % 4) ? "" : "    ", p[0], p[1], p[2],
+                    info->channels == 4 ? p[3] : 0xff);
+            if (x % 4 == 3 || x + 1 == info->width) fputc('\n', out);
+        }
+    }
+    fprintf(out, "};\n");
+    result = 0;
+
+exit:
+    if (png_ptr != NULL) {
+        png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : NULL, NULL);
+    }
+    if (fp != NULL) fclose(fp);
+    free(row);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s output.c [image.png...]\n", argv[0]);
+        return 2;
+    }
+
+    int count = argc - 2;
+    ImageInfo *infos = calloc(count + 1, sizeof(ImageInfo));
+    FILE *out = fopen(argv[1], "w");
+    if (infos == NULL || out == NULL) {
+        fprintf(stderr, "png2raw: can't write %s\n", argv[1]);
+        return 1;
+    }
+
+    fprintf(out, "// Generated by png2raw.  Do not edit.\n\n");
+    fprintf(out, "#include <stddef.h>\n\n#include \"builtin_images.h\"\n");
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (convert(out, i, argv[i + 2], &infos[i]) != 0) {
+            fclose(out);
+            unlink(argv[1]);
+            return 1;
+        }
+    }
+
+    fprintf(out, "\nconst BuiltinImage gBuiltinImages[] = {\n");
+    for (i = 0; i < count; ++i) {
+        fprintf(out, "    { \"%s\", %u, %u, %d, %ld, 0x%08lxUL, image%d },\n",
+                infos[i].name, infos[i].width, infos[i].height,
+                infos[i].channels, infos[i].pngSize, infos[i].pngCrc, i);
+    }
+    fprintf(out, "    { NULL, 0, 0, 0, 0, 0, NULL },\n};\n");
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "png2raw: error writing %s\n", argv[1]);
+        unlink(argv[1]);
+        return 1;
+    }
+    free(infos);
+    return 0;
+}
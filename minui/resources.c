@@ -19,9 +19,11 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -30,8 +32,10 @@
 #include <pixelflinger/pixelflinger.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #include "minui.h"
+#include "builtin_images.h"
 
 // libpng gives "undefined reference to 'pow'" errors, and I have no
 // idea how to convince the build system to link with -lm.  We don't
@@ -41,6 +45,44 @@ double pow(double x, double y) {
     return x;
 }
 
+// Whether the PNG at path is still the one png2raw decoded.  A missing
+// file counts as a match, since the built-in copy is all there is.
+static int png_unchanged(const char* path, const BuiltinImage* image) {
+    unsigned char buf[4096];
+    struct stat st;
+    ssize_t n;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+    if (fstat(fd, &st) != 0 || st.st_size != image->pngSize) {
+        close(fd);
+        return 0;
+    }
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        crc = crc32(crc, buf, n);
+    }
+    close(fd);
+    return n == 0 && crc == image->pngCrc;
+}
+
+// Returns the copy of /res/images/<name>.png that was decoded at build
+// time, unless the PNG has been replaced since.  Size alone isn't enough:
+// extracommands.c swaps in per-manufacturer icons, which may well be the
+// same size as the stock ones.
+static const BuiltinImage* find_builtin_image(const char* name,
+                                              const char* resPath) {
+    const BuiltinImage* image;
+
+    for (image = gBuiltinImages; image->name != NULL; ++image) {
+        if (strcmp(image->name, name) == 0) {
+            return png_unchanged(resPath, image) ? image : NULL;
+        }
+    }
+    return NULL;
+}
+
 int res_create_surface(const char* name, gr_surface* pSurface) {
     char resPath[256];
     GGLSurface* surface = NULL;
@@ -51,6 +93,25 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
 
     snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
     resPath[sizeof(resPath)-1] = '\0';
+
+    // The pixels of a built-in image are used in place, with no decoding.
+    const BuiltinImage* image = find_builtin_image(name, resPath);
+    if (image != NULL) {
+        surface = malloc(sizeof(GGLSurface));
+        if (surface == NULL) {
+            return -8;
+        }
+        surface->version = sizeof(GGLSurface);
+        surface->width = image->width;
+        surface->height = image->height;
+        surface->stride = image->width;
+        surface->data = (GGLubyte*) image->pixels;
+        surface->format = (image->channels == 3) ?
+                GGL_PIXEL_FORMAT_RGBX_8888 : GGL_PIXEL_FORMAT_RGBA_8888;
+        *pSurface = (gr_surface) surface;
+        return 0;
+    }
+
     FILE* fp = fopen(resPath, "rb");
     if (fp == NULL) {
         result = -1;
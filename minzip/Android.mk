@@ -9,8 +9,7 @@ LOCAL_SRC_FILES := \
 	Zip.c
 
 LOCAL_C_INCLUDES += \
-	external/zlib \
-	external/safe-iop/include
+	external/zlib
 	
 LOCAL_MODULE := libminzip
 
@@ -22,7 +22,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 
 #include "DirUtil.h"
 
@@ -221,13 +225,106 @@ dirUnlinkHierarchy(const char *path)
     return rmdir(path);
 }
 
-int
-dirSetHierarchyPermissions(const char *path,
-        int uid, int gid, int dirMode, int fileMode)
+/*
+ * Permission engine for dirSetHierarchyPermissions().  Directories are
+ * walked relative to open directory fds, so the kernel never resolves
+ * more than one path component per call, and subtrees are spread over
+ * a small pool of worker threads.
+ *
+ * A queued directory is only a name inside its parent; it is opened
+ * when a worker takes it, and a parent's fd is closed once the last of
+ * its queued children has been opened.  Since the queue is LIFO, the
+ * number of fds held open follows the depth of the tree rather than
+ * its width.
+ */
+
+#define DIR_WORKER_THREADS  4
+
+typedef struct PermDir {
+    DIR *dir;
+    int refs;           // the reader plus each queued child; under lock
+} PermDir;
+
+typedef struct PermJob {
+    PermDir *parent;    // NULL for the top of the tree
+    char *name;         // relative to parent, or the path given
+    struct PermJob *next;
+} PermJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    PermJob *head;
+    int pending;        // directories queued or being processed
+    int firstErrno;
+    uid_t uid;
+    gid_t gid;
+    mode_t dirMode;
+    mode_t fileMode;
+} PermState;
+
+static void
+permFailed(PermState *state)
+{
+    int err = errno;
+    pthread_mutex_lock(&state->lock);
+    if (state->firstErrno == 0) {
+        state->firstErrno = err != 0 ? err : EIO;
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+static void
+permReleaseDir(PermState *state, PermDir *dir)
+{
+    if (dir == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&state->lock);
+    bool last = --dir->refs == 0;
+    pthread_mutex_unlock(&state->lock);
+    if (last) {
+        closedir(dir->dir);
+        free(dir);
+    }
+}
+
+static void
+permQueueDir(PermState *state, PermDir *parent, const char *name)
+{
+    PermJob *job = (PermJob *)malloc(sizeof(*job));
+    if (job != NULL && (job->name = strdup(name)) == NULL) {
+        free(job);
+        job = NULL;
+    }
+    if (job == NULL) {
+        errno = ENOMEM;
+        permFailed(state);
+        return;
+    }
+    job->parent = parent;
+    pthread_mutex_lock(&state->lock);
+    if (parent != NULL) {
+        parent->refs++;
+    }
+    job->next = state->head;
+    state->head = job;
+    state->pending++;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+/* Fix up one entry of dirFd.  Only issues chown/chmod when the current
+ * owner or mode differs from what was asked for.  Returns 1 if the
+ * entry is a directory that should be descended into.
+ */
+static int
+permFixEntry(PermState *state, int dirFd, const char *name)
 {
     struct stat st;
-    if (lstat(path, &st)) {
-        return -1;
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        permFailed(state);
+        return 0;
     }
 
     /* ignore symlinks */
@@ -236,45 +333,618 @@ dirSetHierarchyPermissions(const char *path,
     }
 
     /* directories and files get different permissions */
-    if (chown(path, uid, gid) ||
-        chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
+    mode_t mode = S_ISDIR(st.st_mode) ? state->dirMode : state->fileMode;
+    bool chowned = false;
+    if (st.st_uid != state->uid || st.st_gid != state->gid) {
+        if (fchownat(dirFd, name, state->uid, state->gid,
+                     AT_SYMLINK_NOFOLLOW) < 0) {
+            permFailed(state);
+            return 0;
+        }
+        chowned = true;     // may have cleared setuid/setgid
+    }
+    if (chowned || (st.st_mode & 07777) != mode) {
+        if (fchmodat(dirFd, name, mode, 0) < 0) {
+            permFailed(state);
+            return 0;
+        }
+    }
+    return S_ISDIR(st.st_mode);
+}
+
+static void
+permProcessDir(PermState *state, PermJob *job)
+{
+    int parentFd = job->parent != NULL ? dirfd(job->parent->dir) : AT_FDCWD;
+    int dirFd = openat(parentFd, job->name,
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    permReleaseDir(state, job->parent);
+    if (dirFd < 0) {
+        permFailed(state);
+        return;
+    }
+
+    PermDir *self = (PermDir *)malloc(sizeof(*self));
+    if (self == NULL) {
+        errno = ENOMEM;
+        permFailed(state);
+        close(dirFd);
+        return;
+    }
+    self->dir = fdopendir(dirFd);
+    if (self->dir == NULL) {
+        permFailed(state);
+        free(self);
+        close(dirFd);
+        return;
+    }
+    self->refs = 1;     // ours, until readdir() is done
+
+    const struct dirent *de;
+    while ((de = readdir(self->dir)) != NULL) {
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+        if (permFixEntry(state, dirFd, de->d_name)) {
+            permQueueDir(state, self, de->d_name);
+        }
+    }
+    permReleaseDir(state, self);
+}
+
+static void *
+permWorker(void *cookie)
+{
+    PermState *state = (PermState *)cookie;
+
+    pthread_mutex_lock(&state->lock);
+    for (;;) {
+        while (state->head == NULL && state->pending > 0) {
+            pthread_cond_wait(&state->cond, &state->lock);
+        }
+        PermJob *job = state->head;
+        if (job == NULL) {
+            break;      // nothing queued and nothing in flight
+        }
+        state->head = job->next;
+        pthread_mutex_unlock(&state->lock);
+
+        permProcessDir(state, job);
+        free(job->name);
+        free(job);
+
+        pthread_mutex_lock(&state->lock);
+        if (--state->pending == 0) {
+            pthread_cond_broadcast(&state->cond);
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+int
+dirSetHierarchyPermissions(const char *path,
+        int uid, int gid, int dirMode, int fileMode)
+{
+    PermState state;
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+    state.uid = uid;
+    state.gid = gid;
+    state.dirMode = dirMode;
+    state.fileMode = fileMode;
+
+    if (permFixEntry(&state, AT_FDCWD, path)) {
+        permQueueDir(&state, NULL, path);
+
+        pthread_t threads[DIR_WORKER_THREADS];
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int wanted = cpus < 1 ? 1 : (cpus > DIR_WORKER_THREADS ?
+                DIR_WORKER_THREADS : (int)cpus);
+        int workers = 0;
+        while (workers < wanted - 1 &&
+               pthread_create(&threads[workers], NULL, permWorker,
+                              &state) == 0) {
+            workers++;
+        }
+        permWorker(&state);     // the caller works too
+        int i;
+        for (i = 0; i < workers; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+    if (state.firstErrno != 0) {
+        errno = state.firstErrno;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Native copy engine for dirCopyHierarchy().
+ */
+
+#define COPY_BUFFER_SIZE    (256 * 1024)
+
+/* bionic names the nanosecond parts of struct stat's times
+ * st_*time_nsec; glibc only has the struct timespec st_*tim members.
+ */
+#ifdef __BIONIC__
+#define STAT_NSEC(st, which)    ((st)->st_##which##time_nsec)
+#else
+#define STAT_NSEC(st, which)    ((st)->st_##which##tim.tv_nsec)
+#endif
+
+typedef struct CopyJob {
+    char *src;
+    char *dst;
+    struct stat st;
+    struct CopyJob *next;
+} CopyJob;
+
+/* A directory whose owner, mode and times are set once everything
+ * inside it has been copied; creating its entries would disturb them.
+ */
+typedef struct CopyDir {
+    char *dst;
+    struct stat st;
+    struct CopyDir *next;
+} CopyDir;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    CopyJob *head;
+    CopyJob *tail;
+    bool walkDone;
+    int firstErrno;
+    int flags;
+    long long totalBytes;
+    DirCopyProgressFunction progressFunction;
+    void *cookie;
+    CopyDir *dirs;          // walker only; most recently created first
+    dev_t dstDev;           // the top destination directory, once made
+    ino_t dstIno;
+} CopyState;
+
+static void
+statTimes(const struct stat *st, struct timespec times[2])
+{
+    times[0].tv_sec = st->st_atime;
+    times[0].tv_nsec = STAT_NSEC(st, a);
+    times[1].tv_sec = st->st_mtime;
+    times[1].tv_nsec = STAT_NSEC(st, m);
+}
+
+static void
+copyFailed(CopyState *state, const char *what, const char *path)
+{
+    int err = errno;
+    fprintf(stderr, "copy: %s %s failed (%s)\n", what, path, strerror(err));
+    pthread_mutex_lock(&state->lock);
+    if (state->firstErrno == 0) {
+        state->firstErrno = err != 0 ? err : EIO;
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+/* Whether an in-kernel copy failed only because it can't be used for
+ * this pair of files (or this kernel), rather than on a real I/O error.
+ */
+static bool
+copyUnsupported(int err)
+{
+    return err == ENOSYS || err == EINVAL || err == EXDEV ||
+            err == EOPNOTSUPP || err == EBADF;
+}
+
+/* Copy everything from in's current offset to EOF.  Try the in-kernel
+ * paths first; fall back to a plain buffer if they aren't supported
+ * for this pair of files.  Any other error fails the copy.
+ */
+static int
+copyFileData(int in, int out, off_t size)
+{
+    off_t done = 0;
+    ssize_t n;
+
+#ifdef __NR_copy_file_range
+    while (done < size &&
+           (n = syscall(__NR_copy_file_range, in, NULL, out, NULL,
+                        (size_t)(size - done), 0)) > 0) {
+        done += n;
+    }
+    if (done < size && n < 0 && !copyUnsupported(errno)) {
+        return -1;
+    }
+#endif
+    while (done < size && (n = sendfile(out, in, NULL, size - done)) > 0) {
+        done += n;
+    }
+    if (done < size && n < 0 && !copyUnsupported(errno)) {
         return -1;
     }
 
-    /* recurse over directory components */
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        if (dir == NULL) {
+    /* Finish with read/write; this also picks up anything past the
+     * size we stat()ed, for files that don't report a size.
+     */
+    char *buf = malloc(COPY_BUFFER_SIZE);
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    while ((n = read(in, buf, COPY_BUFFER_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(buf);
             return -1;
         }
-
-        errno = 0;
-        const struct dirent *de;
-        while (errno == 0 && (de = readdir(dir)) != NULL) {
-            if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-                continue;
+        ssize_t w = 0;
+        while (w < n) {
+            ssize_t r = write(out, buf + w, n - w);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                free(buf);
+                return -1;
             }
+            w += r;
+        }
+    }
+    free(buf);
+    return 0;
+}
 
-            char dn[PATH_MAX];
-            snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-            if (!dirSetHierarchyPermissions(dn, uid, gid, dirMode, fileMode)) {
-                errno = 0;
-            } else if (errno == 0) {
-                errno = -1;
-            }
+static int
+copyRegularFile(CopyState *state, const char *src, const char *dst,
+        const struct stat *st)
+{
+    int in = open(src, O_RDONLY);
+    if (in < 0) {
+        copyFailed(state, "open", src);
+        return -1;
+    }
+    unlink(dst);
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 07777);
+    if (out < 0) {
+        copyFailed(state, "create", dst);
+        close(in);
+        return -1;
+    }
+
+    int ret = 0;
+    if (copyFileData(in, out, st->st_size) < 0) {
+        copyFailed(state, "write", dst);
+        ret = -1;
+    } else if (!(state->flags & DIR_COPY_NO_OWNER) &&
+            fchown(out, st->st_uid, st->st_gid) < 0 && errno != EPERM) {
+        copyFailed(state, "chown", dst);
+        ret = -1;
+    } else if (fchmod(out, st->st_mode & 07777) < 0) {
+        /* chown may have cleared setuid/setgid; put them back. */
+        copyFailed(state, "chmod", dst);
+        ret = -1;
+    } else {
+        struct timespec times[2];
+        statTimes(st, times);
+        if (futimens(out, times) < 0) {
+            copyFailed(state, "utime", dst);
+            ret = -1;
         }
+    }
+    close(in);
+    if (close(out) < 0 && ret == 0) {
+        copyFailed(state, "close", dst);
+        ret = -1;
+    }
 
-        if (errno != 0) {
-            int save = errno;
-            closedir(dir);
-            errno = save;
-            return -1;
+    if (ret == 0 && state->progressFunction != NULL) {
+        pthread_mutex_lock(&state->lock);
+        state->totalBytes += st->st_size;
+        state->progressFunction(dst, state->totalBytes, state->cookie);
+        pthread_mutex_unlock(&state->lock);
+    }
+    return ret;
+}
+
+static void *
+copyWorker(void *cookie)
+{
+    CopyState *state = (CopyState *)cookie;
+
+    for (;;) {
+        pthread_mutex_lock(&state->lock);
+        while (state->head == NULL && !state->walkDone) {
+            pthread_cond_wait(&state->cond, &state->lock);
+        }
+        CopyJob *job = state->head;
+        if (job == NULL) {
+            pthread_mutex_unlock(&state->lock);
+            return NULL;
+        }
+        state->head = job->next;
+        if (state->head == NULL) {
+            state->tail = NULL;
+        }
+        pthread_mutex_unlock(&state->lock);
+
+        copyRegularFile(state, job->src, job->dst, &job->st);
+        free(job->src);
+        free(job->dst);
+        free(job);
+    }
+}
+
+static void
+queueRegularFile(CopyState *state, int workers, const char *src,
+        const char *dst, const struct stat *st)
+{
+    CopyJob *job = NULL;
+    if (workers > 0) {
+        job = (CopyJob *)malloc(sizeof(*job));
+    }
+    if (job != NULL) {
+        job->src = strdup(src);
+        job->dst = strdup(dst);
+        if (job->src == NULL || job->dst == NULL) {
+            free(job->src);
+            free(job->dst);
+            free(job);
+            job = NULL;
+        }
+    }
+    if (job == NULL) {
+        /* No workers (or no memory to hand off); do it ourselves. */
+        copyRegularFile(state, src, dst, st);
+        return;
+    }
+
+    job->st = *st;
+    job->next = NULL;
+    pthread_mutex_lock(&state->lock);
+    if (state->tail != NULL) {
+        state->tail->next = job;
+    } else {
+        state->head = job;
+    }
+    state->tail = job;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+/* Give dst the owner (unless DIR_COPY_NO_OWNER) and times of st,
+ * without following a symlink.
+ */
+static void
+copyAttributes(CopyState *state, const char *dst, const struct stat *st)
+{
+    struct timespec times[2];
+    statTimes(st, times);
+    if (!(state->flags & DIR_COPY_NO_OWNER) &&
+            lchown(dst, st->st_uid, st->st_gid) < 0 && errno != EPERM) {
+        copyFailed(state, "chown", dst);
+    } else if (utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW) < 0) {
+        copyFailed(state, "utime", dst);
+    }
+}
+
+static void
+copyTree(CopyState *state, int workers, const char *src, const char *dst)
+{
+    struct stat st;
+    if (lstat(src, &st) < 0) {
+        copyFailed(state, "stat", src);
+        return;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        queueRegularFile(state, workers, src, dst, &st);
+        return;
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(src, target, sizeof(target) - 1);
+        if (len < 0) {
+            copyFailed(state, "readlink", src);
+            return;
         }
+        target[len] = '\0';
+        unlink(dst);
+        if (symlink(target, dst) < 0) {
+            copyFailed(state, "symlink", dst);
+        } else {
+            copyAttributes(state, dst, &st);
+        }
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        /* Device nodes, fifos and sockets. */
+        unlink(dst);
+        if (mknod(dst, st.st_mode, st.st_rdev) < 0) {
+            copyFailed(state, "mknod", dst);
+        } else {
+            copyAttributes(state, dst, &st);
+        }
+        return;
+    }
+
+    /* The destination's own directory turning up in the walk means it
+     * is inside the source (through a bind mount, say, since
+     * dirCopyHierarchy() refuses the plain case); don't copy it into
+     * itself.
+     */
+    if (state->dstIno != 0 &&
+            st.st_dev == state->dstDev && st.st_ino == state->dstIno) {
+        errno = ELOOP;
+        copyFailed(state, "copy into itself", src);
+        return;
+    }
+
+    /* Create the directory writable so its contents can be filled in;
+     * it gets its real mode, owner and times after the copy finishes.
+     */
+    if (mkdir(dst, 0700) < 0 && errno != EEXIST) {
+        copyFailed(state, "mkdir", dst);
+        return;
+    }
+    if (state->dstIno == 0) {
+        struct stat dst_st;
+        if (stat(dst, &dst_st) == 0) {
+            state->dstDev = dst_st.st_dev;
+            state->dstIno = dst_st.st_ino;
+        }
+    }
+    CopyDir *fixup = (CopyDir *)malloc(sizeof(*fixup));
+    if (fixup == NULL || (fixup->dst = strdup(dst)) == NULL) {
+        free(fixup);
+        errno = ENOMEM;
+        copyFailed(state, "mkdir", dst);
+        return;
+    }
+    fixup->st = st;
+    fixup->next = state->dirs;
+    state->dirs = fixup;
+
+    DIR *dir = opendir(src);
+    if (dir == NULL) {
+        copyFailed(state, "opendir", src);
+        return;
+    }
+    const struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+        char sn[PATH_MAX];
+        char dn[PATH_MAX];
+        snprintf(sn, sizeof(sn), "%s/%s", src, de->d_name);
+        snprintf(dn, sizeof(dn), "%s/%s", dst, de->d_name);
+        copyTree(state, workers, sn, dn);
+    }
+    closedir(dir);
+}
+
+/* Returns true if dst, or any directory above it, is src's directory. */
+static bool
+isInsideSource(const struct stat *src_st, const char *dst)
+{
+    char path[PATH_MAX];
+    struct stat st, prev;
+    bool first = true;
+
+    snprintf(path, sizeof(path), "%s", dst);
+    if (stat(path, &st) < 0) {
+        /* dst doesn't exist yet; start from the directory it goes in. */
+        char *slash = strrchr(path, '/');
+        while (slash != NULL && slash > path && slash[1] == '\0') {
+            *slash = '\0';
+            slash = strrchr(path, '/');
+        }
+        if (slash == NULL) {
+            strcpy(path, ".");
+        } else {
+            slash[slash == path ? 1 : 0] = '\0';
+        }
+        if (stat(path, &st) < 0) {
+            return false;
+        }
+    }
+    for (;;) {
+        if (st.st_dev == src_st->st_dev && st.st_ino == src_st->st_ino) {
+            return true;
+        }
+        if (!first && st.st_dev == prev.st_dev && st.st_ino == prev.st_ino) {
+            return false;   // reached "/"
+        }
+        prev = st;
+        first = false;
+        if (strlen(path) + 4 > sizeof(path)) {
+            return false;
+        }
+        strcat(path, "/..");
+        if (stat(path, &st) < 0) {
+            return false;
+        }
+    }
+}
 
-        if (closedir(dir)) {
+int
+dirCopyHierarchy(const char *src, const char *dst, int flags,
+        DirCopyProgressFunction progressFunction, void *cookie)
+{
+    CopyState state;
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+    state.flags = flags;
+    state.progressFunction = progressFunction;
+    state.cookie = cookie;
+
+    /* Only spin up workers for trees; a single file is copied inline. */
+    pthread_t threads[DIR_WORKER_THREADS];
+    int workers = 0;
+    struct stat st;
+    if (lstat(src, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (isInsideSource(&st, dst)) {
+            fprintf(stderr, "copy: can't copy %s into itself (%s)\n",
+                    src, dst);
+            pthread_cond_destroy(&state.cond);
+            pthread_mutex_destroy(&state.lock);
+            errno = EINVAL;
             return -1;
         }
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int wanted = cpus < 1 ? 1 : (cpus > DIR_WORKER_THREADS ?
+                DIR_WORKER_THREADS : (int)cpus);
+        while (workers < wanted &&
+               pthread_create(&threads[workers], NULL, copyWorker,
+                              &state) == 0) {
+            workers++;
+        }
     }
 
+    copyTree(&state, workers, src, dst);
+
+    pthread_mutex_lock(&state.lock);
+    state.walkDone = true;
+    pthread_cond_broadcast(&state.cond);
+    pthread_mutex_unlock(&state.lock);
+    int i;
+    for (i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* Every file is in place; finish the directories, deepest first. */
+    while (state.dirs != NULL) {
+        CopyDir *d = state.dirs;
+        state.dirs = d->next;
+        if (!(flags & DIR_COPY_NO_OWNER) &&
+                chown(d->dst, d->st.st_uid, d->st.st_gid) < 0 &&
+                errno != EPERM) {
+            copyFailed(&state, "chown", d->dst);
+        }
+        if (chmod(d->dst, d->st.st_mode & 07777) < 0) {
+            copyFailed(&state, "chmod", d->dst);
+        }
+        struct timespec times[2];
+        statTimes(&d->st, times);
+        if (utimensat(AT_FDCWD, d->dst, times, 0) < 0) {
+            copyFailed(&state, "utime", d->dst);
+        }
+        free(d->dst);
+        free(d);
+    }
+
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+    if (state.firstErrno != 0) {
+        errno = state.firstErrno;
+        return -1;
+    }
     return 0;
 }
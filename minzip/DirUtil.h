@@ -48,4 +48,36 @@ int dirUnlinkHierarchy(const char *path);
 int dirSetHierarchyPermissions(const char *path,
          int uid, int gid, int dirMode, int fileMode);
 
+/* Called after each regular file is copied by dirCopyHierarchy(), with
+ * the destination path and the running total of bytes copied.  May be
+ * called from worker threads, but never concurrently.
+ */
+typedef void (*DirCopyProgressFunction)(const char *path,
+        long long totalBytes, void *cookie);
+
+/* cp -a <src> <dst>, without the shell.
+ *
+ * Copies src (a file, symlink or directory tree) to exactly dst,
+ * preserving modes, owners, timestamps and symlinks.  Regular file data
+ * is moved with copy_file_range()/sendfile() where the kernel supports
+ * them and a large read/write buffer otherwise; files in a tree are
+ * copied by a small pool of worker threads while the tree is walked.
+ * progressFunction may be NULL.
+ *
+ * flags is zero or more of the following:
+ *
+ *     DIR_COPY_NO_OWNER - leave the copies owned by the caller, as
+ *         cp -r does, rather than by src's owner; for copying off the
+ *         sdcard, whose files all belong to system:sdcard_rw
+ *
+ * Refuses (EINVAL) to copy a directory to somewhere inside itself.
+ * Otherwise keeps going past per-file errors; returns 0 if everything
+ * was copied, or -1 (with errno from the first failure) otherwise.
+ */
+enum {
+    DIR_COPY_NO_OWNER = 1
+};
+int dirCopyHierarchy(const char *src, const char *dst, int flags,
+        DirCopyProgressFunction progressFunction, void *cookie);
+
 #endif  // MINZIP_DIRUTIL_H_
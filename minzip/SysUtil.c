@@ -44,19 +44,35 @@ static void* sysCreateAnonShmem(size_t length)
     return ptr;
 }
 
+/*
+ * Find the end of the file without disturbing fd's offset.
+ */
+static off64_t getFileEnd(int fd)
+{
+    off64_t start, end;
+
+    start = lseek64(fd, 0L, SEEK_CUR);
+    end = lseek64(fd, 0L, SEEK_END);
+    (void) lseek64(fd, start, SEEK_SET);
+
+    if (start == (off64_t) -1 || end == (off64_t) -1) {
+        LOGE("could not determine length of file\n");
+        return -1;
+    }
+    return end;
+}
+
 static int getFileStartAndLength(int fd, off_t *start_, size_t *length_)
 {
-    off_t start, end;
+    off64_t start, end;
     size_t length;
 
     assert(start_ != NULL);
     assert(length_ != NULL);
 
-    start = lseek(fd, 0L, SEEK_CUR);
-    end = lseek(fd, 0L, SEEK_END);
-    (void) lseek(fd, start, SEEK_SET);
-
-    if (start == (off_t) -1 || end == (off_t) -1) {
+    start = lseek64(fd, 0L, SEEK_CUR);
+    end = getFileEnd(fd);
+    if (start == (off64_t) -1 || end == (off64_t) -1) {
         LOGE("could not determine length of file\n");
         return -1;
     }
@@ -66,6 +82,11 @@ static int getFileStartAndLength(int fd, off_t *start_, size_t *length_)
         LOGE("file is empty\n");
         return -1;
     }
+    if ((off64_t) length != end - start || (off_t) start != start) {
+        LOGE("file is too large to map (%lld bytes)\n",
+            (long long) (end - start));
+        return -1;
+    }
 
     *start_ = start;
     *length_ = length;
@@ -140,29 +161,33 @@ int sysMapFileInShmem(int fd, MemMapping* pMap)
 }
 
 /*
- * Map part of a file (from fd's current offset) into a shared, read-only
- * memory segment.
+ * Map part of a file into a shared, read-only memory segment.
+ *
+ * Where mmap() can't be used -- the filesystem doesn't support it, or the
+ * offset doesn't fit in off_t on a 32-bit system -- the segment is copied
+ * into anonymous memory instead, so callers always get a usable mapping.
  *
  * On success, returns 0 and fills out "pMap".  On failure, returns a nonzero
  * value and does not disturb "pMap".
  */
-int sysMapFileSegmentInShmem(int fd, off_t start, long length,
+int sysMapFileSegmentInShmem(int fd, off64_t start, size_t length,
     MemMapping* pMap)
 {
-    off_t dummy;
-    size_t fileLength, actualLength;
-    off_t actualStart;
+    off64_t fileLength;
+    size_t actualLength;
+    off64_t actualStart;
     int adjust;
     void* memPtr;
 
     assert(pMap != NULL);
 
-    if (getFileStartAndLength(fd, &dummy, &fileLength) < 0)
+    fileLength = getFileEnd(fd);
+    if (fileLength < 0)
         return -1;
 
-    if (start + length > (long)fileLength) {
-        LOGW("bad segment: st=%d len=%ld flen=%d\n",
-            (int) start, length, (int) fileLength);
+    if (start < 0 || length == 0 || start + (off64_t) length > fileLength) {
+        LOGW("bad segment: st=%lld len=%zu flen=%lld\n",
+            (long long) start, length, (long long) fileLength);
         return -1;
     }
 
@@ -171,12 +196,31 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     actualStart = start - adjust;
     actualLength = length + adjust;
 
-    memPtr = mmap(NULL, actualLength, PROT_READ, MAP_FILE | MAP_SHARED,
-                fd, actualStart);
+    memPtr = MAP_FAILED;
+    if ((off_t) actualStart == actualStart) {
+        memPtr = mmap(NULL, actualLength, PROT_READ, MAP_FILE | MAP_SHARED,
+                    fd, (off_t) actualStart);
+    }
     if (memPtr == MAP_FAILED) {
-        LOGW("mmap(%d, R, FILE|SHARED, %d, %d) failed: %s\n",
-            (int) actualLength, fd, (int) actualStart, strerror(errno));
-        return -1;
+        LOGV("mmap(%d, R, FILE|SHARED, %d, %lld) failed; copying instead\n",
+            (int) actualLength, fd, (long long) actualStart);
+        memPtr = sysCreateAnonShmem(actualLength);
+        if (memPtr == NULL)
+            return -1;
+
+        size_t done = 0;
+        while (done < actualLength) {
+            ssize_t n = pread64(fd, (char*) memPtr + done,
+                    actualLength - done, actualStart + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                LOGE("only read %zu of %zu bytes\n", done, actualLength);
+                munmap(memPtr, actualLength);
+                return -1;
+            }
+            done += n;
+        }
     }
 
     pMap->baseAddr = memPtr;
@@ -184,8 +228,8 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     pMap->addr = (char*)memPtr + adjust;
     pMap->length = length;
 
-    LOGVV("mmap seg (st=%d ln=%d): bp=%p bl=%d ad=%p ln=%d\n",
-        (int) start, (int) length,
+    LOGVV("mmap seg (st=%lld ln=%d): bp=%p bl=%d ad=%p ln=%d\n",
+        (long long) start, (int) length,
         pMap->baseAddr, (int) pMap->baseLength,
         pMap->addr, (int) pMap->length);
 
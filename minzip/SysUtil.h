@@ -46,9 +46,10 @@ int sysLoadFileInShmem(int fd, MemMapping* pMap);
 int sysMapFileInShmem(int fd, MemMapping* pMap);
 
 /*
- * Like sysMapFileInShmem, but on only part of a file.
+ * Like sysMapFileInShmem, but on only part of a file.  The segment may
+ * lie anywhere in the file, including past the reach of a 32-bit off_t.
  */
-int sysMapFileSegmentInShmem(int fd, off_t start, long length,
+int sysMapFileSegmentInShmem(int fd, off64_t start, size_t length,
     MemMapping* pMap);
 
 /*
@@ -3,15 +3,18 @@
  *
  * Simple Zip file support.
  */
-#include "safe_iop.h"
 #include "zlib.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <stdint.h>     // for uintptr_t
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>   // for S_ISLNK()
+#include <time.h>
 #include <unistd.h>
 
 #define LOG_TAG "minzip"
@@ -64,6 +67,25 @@ enum {
     EXTSIZ =  8,
     EXTLEN = 12,
 
+    ZIP64_LOCSIG = 0x07064b50,  // PK67
+    ZIP64_LOCHDR = 20,
+
+    ZIP64_LOCOFF =  8,
+
+    ZIP64_ENDSIG = 0x06064b50,  // PK66
+    ZIP64_ENDHDR = 56,
+
+    ZIP64_ENDVEM =  12,
+    ZIP64_ENDVER =  14,
+    ZIP64_ENDSUB =  24,
+    ZIP64_ENDTOT =  32,
+    ZIP64_ENDSIZ =  40,
+    ZIP64_ENDOFF =  48,
+
+    ZIP64_EXTID = 0x0001,       // Zip64 extended information extra field
+    ZIP64_MAGIC = 0xffffffff,   // 32-bit field value meaning "see Zip64"
+    ZIP64_MAGIC16 = 0xffff,
+
     LOCSIG = 0x04034b50,      // PK34
     LOCHDR = 30,
 
@@ -91,7 +113,8 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
+    LOGI("   hdr=%lld comp=%lld uncomp=%lld how=%d\n",
+        (long long) pEntry->localHdrOffset,
         pEntry->compLen, pEntry->uncompLen, pEntry->compression);
 }
 #endif
@@ -177,18 +200,56 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/* How much of the file mzProcessArchiveRange() maps at a time. */
+#define RANGE_WINDOW_SIZE (1024 * 1024)
+
+static bool preadFully(int fd, void* buf, size_t len, off64_t offset)
+{
+    unsigned char* p = (unsigned char*) buf;
+    while (len > 0) {
+        ssize_t n = pread64(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
 /*
- * Parse the contents of a Zip archive.  After confirming that the file
- * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
- *
- * Returns "true" on success.
+ * Copy "len" bytes at file offset "offset" into "buf", from the mapping
+ * if it covers them and from the file otherwise.
+ */
+static bool readArchive(const ZipArchive* pArchive, off64_t offset,
+    void* buf, size_t len)
+{
+    if (offset >= pArchive->mapOffset &&
+        offset + (off64_t) len <= pArchive->mapOffset +
+            (off64_t) pArchive->map.length)
+    {
+        memcpy(buf, (const unsigned char*) pArchive->map.addr +
+            (offset - pArchive->mapOffset), len);
+        return true;
+    }
+    return preadFully(pArchive->fd, buf, len, offset);
+}
+
+/*
+ * Find the central directory through the end-of-central-directory record,
+ * and through the Zip64 end record if the archive has one.  Only the tail
+ * of the file is read.
  */
-static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
+static bool findCentralDirectory(int fd, off64_t length,
+    off64_t* pCdOffset, unsigned long long* pNumEntries)
 {
     bool result = false;
+    unsigned char buf[ZIP64_ENDHDR];
+    unsigned char* tail = NULL;
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    unsigned long long numEntries, cdOffset;
     unsigned int val;
 
     /*
@@ -196,7 +257,11 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
      */
-    val = get4LE(pMap->addr);
+    if (!preadFully(fd, buf, 4, 0)) {
+        LOGV("Can't read Zip header\n");
+        goto bail;
+    }
+    val = get4LE(buf);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
@@ -207,19 +272,27 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 
     /*
      * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
+     * comment, which can be at most 64k.
      */
-    ptr = pMap->addr + pMap->length - ENDHDR;
+    size_t tailLen = length < ENDHDR + 0xffff ? length : ENDHDR + 0xffff;
+    off64_t tailOffset = length - tailLen;
+    tail = (unsigned char*) malloc(tailLen);
+    if (tail == NULL || !preadFully(fd, tail, tailLen, tailOffset)) {
+        LOGW("Can't read end of Zip\n");
+        goto bail;
+    }
 
-    while (ptr >= (const unsigned char*) pMap->addr) {
+    ptr = tail + tailLen - ENDHDR;
+    while (ptr >= tail) {
         if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
             break;
         ptr--;
     }
-    if (ptr < (const unsigned char*) pMap->addr) {
+    if (ptr < tail) {
         LOGI("Could not find end-of-central-directory in Zip\n");
         goto bail;
     }
+    off64_t eocdOffset = tailOffset + (ptr - tail);
 
     /*
      * There are two interesting items in the EOCD block: the number of
@@ -229,13 +302,99 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     numEntries = get2LE(ptr + ENDSUB);
     cdOffset = get4LE(ptr + ENDOFF);
 
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+    /*
+     * A Zip64 archive has a locator immediately before the EOCD, pointing
+     * at a Zip64 end record with the real 64-bit values.
+     */
+    if (eocdOffset >= ZIP64_LOCHDR &&
+        preadFully(fd, buf, ZIP64_LOCHDR, eocdOffset - ZIP64_LOCHDR) &&
+        get4LE(buf) == ZIP64_LOCSIG)
+    {
+        unsigned long long endOffset = get8LE(buf + ZIP64_LOCOFF);
+        if (endOffset > (unsigned long long) (eocdOffset - ZIP64_LOCHDR) ||
+            (unsigned long long) (eocdOffset - ZIP64_LOCHDR) - endOffset <
+                ZIP64_ENDHDR ||
+            !preadFully(fd, buf, ZIP64_ENDHDR, endOffset) ||
+            get4LE(buf) != ZIP64_ENDSIG)
+        {
+            LOGW("Bad Zip64 end-of-central-directory record\n");
+            goto bail;
+        }
+        numEntries = get8LE(buf + ZIP64_ENDSUB);
+        cdOffset = get8LE(buf + ZIP64_ENDOFF);
+    } else if (numEntries == ZIP64_MAGIC16 || cdOffset == ZIP64_MAGIC) {
+        LOGV("EOCD wants Zip64, but there's no Zip64 end record\n");
+    }
+
+    LOGVV("numEntries=%llu cdOffset=%llu\n", numEntries, cdOffset);
+    if (numEntries == 0 || cdOffset >= (unsigned long long) eocdOffset ||
+        numEntries > ((unsigned long long) eocdOffset - cdOffset) / CENHDR)
+    {
+        LOGW("Invalid entries=%llu offset=%llu (len=%lld)\n",
+            numEntries, cdOffset, (long long) length);
         goto bail;
     }
 
+    *pCdOffset = cdOffset;
+    *pNumEntries = numEntries;
+    result = true;
+
+bail:
+    free(tail);
+    return result;
+}
+
+/*
+ * Pick the 64-bit sizes and local header offset out of an entry's Zip64
+ * extended information extra field.  Each one is only there if its 32-bit
+ * central directory field holds ZIP64_MAGIC, and they come in this order.
+ */
+static bool parseZip64Extra(const unsigned char* extra, unsigned int extraLen,
+    unsigned long long* pUncompLen, unsigned long long* pCompLen,
+    unsigned long long* pLocalHdrOffset)
+{
+    while (extraLen >= 4) {
+        unsigned int id = get2LE(extra);
+        unsigned int size = get2LE(extra + 2);
+        if (size > extraLen - 4)
+            return false;
+        if (id == ZIP64_EXTID) {
+            unsigned long long* fields[3] =
+                { pUncompLen, pCompLen, pLocalHdrOffset };
+            const unsigned char* p = extra + 4;
+            int i;
+            for (i = 0; i < 3; i++) {
+                if (*fields[i] != ZIP64_MAGIC)
+                    continue;
+                if (p + 8 > extra + 4 + size)
+                    return false;
+                *fields[i] = get8LE(p);
+                p += 8;
+            }
+            return true;
+        }
+        extra += 4 + size;
+        extraLen -= 4 + size;
+    }
+    return true;
+}
+
+/*
+ * Parse the contents of a Zip archive.  We scan out the contents of the
+ * central directory, which must be covered by pArchive->map, and store
+ * it in a hash table.
+ *
+ * Returns "true" on success.
+ */
+static bool parseZipArchive(ZipArchive* pArchive, off64_t cdOffset,
+    unsigned int numEntries)
+{
+    bool result = false;
+    const unsigned char* mapEnd =
+        (const unsigned char*) pArchive->map.addr + pArchive->map.length;
+    const unsigned char* ptr;
+    unsigned int i;
+
     /*
      * Create data structures to hold entries.
      */
@@ -245,14 +404,15 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
         goto bail;
 
-    ptr = pMap->addr + cdOffset;
+    ptr = (const unsigned char*) pArchive->map.addr +
+        (cdOffset - pArchive->mapOffset);
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
+        unsigned int fileNameLen, extraLen, commentLen;
+        unsigned long long compLen, uncompLen, localHdrOffset;
         const char *fileName;
 
-        if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
+        if (ptr + CENHDR > mapEnd) {
             LOGW("Ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -262,11 +422,13 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
 
         localHdrOffset = get4LE(ptr + CENOFF);
+        compLen = get4LE(ptr + CENSIZ);
+        uncompLen = get4LE(ptr + CENLEN);
         fileNameLen = get2LE(ptr + CENNAM);
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pMap->addr + pMap->length) {
+        if ((const unsigned char*) fileName + fileNameLen + extraLen > mapEnd) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -274,6 +436,11 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             LOGW("Invalid filename (at %d)\n", i);
             goto bail;
         }
+        if (!parseZip64Extra((const unsigned char*) fileName + fileNameLen,
+                extraLen, &uncompLen, &compLen, &localHdrOffset)) {
+            LOGW("Bad Zip64 extra field (at %d)\n", i);
+            goto bail;
+        }
 
 #if SORT_ENTRIES
         /* Figure out where this entry should go (binary search).
@@ -328,14 +495,12 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         pEntry = &pArchive->pEntries[i];
 #endif
 
-        //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
+        //LOGI("%d: localHdr=%lld fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
 
         pEntry->fileNameLen = fileNameLen;
         pEntry->fileName = fileName;
 
-        pEntry->compLen = get4LE(ptr + CENSIZ);
-        pEntry->uncompLen = get4LE(ptr + CENLEN);
         pEntry->compression = get2LE(ptr + CENHOW);
         pEntry->modTime = get4LE(ptr + CENTIM);
         pEntry->crc32 = get4LE(ptr + CENCRC);
@@ -352,32 +517,23 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
+        // localHdrOffset and the sizes are untrusted; keep every sum
+        // before the central directory so none of them can overflow.
+        // The local header itself isn't read until the entry is.
+        if (localHdrOffset + LOCHDR > (unsigned long long) cdOffset) {
+            LOGW("Bad offset to local header: %lld (at %d)\n",
+                localHdrOffset, i);
             goto bail;
         }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
-            goto bail;
-        }
-        if (get4LE(localHdr) != LOCSIG) {
-            LOGW("Missed a local header sig (at %d)\n", i);
-            goto bail;
-        }
-        pEntry->offset = localHdrOffset + LOCHDR
-            + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
+        if (compLen > cdOffset - localHdrOffset - LOCHDR ||
+            uncompLen > LLONG_MAX)
+        {
             LOGW("Data ran off the end (at %d)\n", i);
             goto bail;
         }
+        pEntry->localHdrOffset = localHdrOffset;
+        pEntry->compLen = compLen;
+        pEntry->uncompLen = uncompLen;
 
 #if !SORT_ENTRIES
         /* Add to hash table; no need to lock here.
@@ -416,10 +572,10 @@ bail:
 /*
  * Open a Zip archive and scan out the contents.
  *
- * The easiest way to do this is to mmap() the whole thing and do the
- * traditional backward scan for central directory.  Since the EOCD is
- * a relatively small bit at the end, we should end up only touching a
- * small set of pages.
+ * The EOCD (and Zip64 end record) are found by reading the tail of the
+ * file, and then only the central directory is mapped.  Entry data is
+ * mapped a window at a time when it is used, so opening costs the size of
+ * the central directory rather than the size of the file.
  *
  * This will be called on non-Zip files, especially during startup, so
  * we don't want to be too noisy about failures.  (Do we want a "quiet"
@@ -429,48 +585,61 @@ bail:
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
-    MemMapping map;
+    off64_t cdOffset;
+    unsigned long long numEntries;
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
-    map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
 
-    pArchive->fd = open(fileName, O_RDONLY, 0);
+    pArchive->fd = open(fileName, O_RDONLY | O_LARGEFILE, 0);
     if (pArchive->fd < 0) {
         err = errno ? errno : -1;
         LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
         goto bail;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
+    pArchive->length = lseek64(pArchive->fd, 0, SEEK_END);
+    if (pArchive->length < ENDHDR) {
         err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
+        LOGV("File '%s' too small to be zip (%lld)\n", fileName,
+            (long long) pArchive->length);
+        goto bail;
+    }
+    lseek64(pArchive->fd, 0, SEEK_SET);
+
+    if (!findCentralDirectory(pArchive->fd, pArchive->length,
+            &cdOffset, &numEntries)) {
+        err = -1;
+        LOGV("Parsing '%s' failed\n", fileName);
+        goto bail;
+    }
+    if (numEntries > UINT_MAX / sizeof(ZipEntry)) {
+        err = -1;
+        LOGW("Too many entries in '%s' (%llu)\n", fileName, numEntries);
         goto bail;
     }
 
-    if (map.length < ENDHDR) {
+    if (sysMapFileSegmentInShmem(pArchive->fd, cdOffset,
+            pArchive->length - cdOffset, &pArchive->map) != 0) {
         err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
+        LOGW("Map of '%s' failed\n", fileName);
         goto bail;
     }
+    pArchive->mapOffset = cdOffset;
 
-    if (!parseZipArchive(pArchive, &map)) {
+    if (!parseZipArchive(pArchive, cdOffset, numEntries)) {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
     }
 
     err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
 
 bail:
     if (err != 0)
         mzCloseZipArchive(pArchive);
-    if (map.addr != NULL)
-        sysReleaseShmem(&map);
     return err;
 }
 
@@ -522,68 +691,230 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
-/* Call processFunction on the uncompressed data of a STORED entry.
+/*
+ * Ask the kernel to start reading [offset, offset + length) before we get
+ * to it.  This is only a hint, and not every libc has posix_fadvise().
  */
-static bool processStoredEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+static void adviseWillNeed(const ZipArchive *pArchive, off64_t offset,
+    off64_t length)
+{
+#ifdef POSIX_FADV_WILLNEED
+    if (offset < pArchive->length && length > 0) {
+        if (length > pArchive->length - offset) {
+            length = pArchive->length - offset;
+        }
+        posix_fadvise64(pArchive->fd, offset, length, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
+/*
+ * Find where an entry's data starts.  That depends on the name and extra
+ * field lengths in the entry's local header, which we only read now so
+ * that opening an archive doesn't have to visit every entry.
+ *
+ * Returns -1 if the local header is bad.
+ */
+off64_t mzGetZipEntryOffset(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    unsigned char localHdr[LOCHDR];
+    off64_t offset;
+
+    if (!readArchive(pArchive, pEntry->localHdrOffset, localHdr, LOCHDR)) {
+        LOGW("Can't read local header for '%.*s'\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return -1;
+    }
+    if (get4LE(localHdr) != LOCSIG) {
+        LOGW("Missed a local header sig for '%.*s'\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return -1;
+    }
+    offset = pEntry->localHdrOffset + LOCHDR
+        + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
+    if (pEntry->compLen > pArchive->mapOffset - offset) {
+        LOGW("Data ran off the end for '%.*s'\n",
+            pEntry->fileNameLen, pEntry->fileName);
+        return -1;
+    }
+    return offset;
+}
+
+/*
+ * Hint that pEntry is about to be read.  Extracting several entries in a
+ * row, call this on the next one before starting on the current one.
+ */
+void mzPrefetchZipEntry(const ZipArchive *pArchive, const ZipEntry *pEntry)
+{
+    adviseWillNeed(pArchive, pEntry->localHdrOffset,
+        pEntry->compLen < RANGE_WINDOW_SIZE ?
+            pEntry->compLen + LOCHDR + pEntry->fileNameLen :
+            RANGE_WINDOW_SIZE);
+}
+
+/*
+ * Stream the raw bytes [start, start + length) of the archive file
+ * through processFunction.  The archive's own mapping is used where it
+ * covers the range; the rest is mapped a window at a time, and the
+ * kernel is asked to read the next window while we work on this one.
+ */
+bool mzProcessArchiveRange(const ZipArchive *pArchive, off64_t start,
+    off64_t length, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
-    while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
-        size_t count;
+    const off64_t mapEnd = pArchive->mapOffset + pArchive->map.length;
+
+    if (start < 0 || length < 0 || start > pArchive->length ||
+        length > pArchive->length - start) {
+        LOGE("Bad archive range %lld+%lld\n", (long long) start,
+            (long long) length);
+        return false;
+    }
+
+    while (length > 0) {
+        MemMapping window;
+        const unsigned char* data;
+        size_t count = RANGE_WINDOW_SIZE;
         bool ret;
 
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
+        if (length < (off64_t) count) {
+            count = length;
         }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
-            return false;
+        window.baseAddr = NULL;
+        window.baseLength = 0;
+        if (start >= pArchive->mapOffset && start < mapEnd) {
+            if (mapEnd - start < (off64_t) count) {
+                count = mapEnd - start;
+            }
+            data = (const unsigned char*) pArchive->map.addr +
+                (start - pArchive->mapOffset);
+        } else {
+            if (start < pArchive->mapOffset &&
+                pArchive->mapOffset - start < (off64_t) count) {
+                count = pArchive->mapOffset - start;
+            }
+            if (sysMapFileSegmentInShmem(pArchive->fd, start, count,
+                    &window) != 0) {
+                LOGE("Can't map %zu bytes at %lld\n", count,
+                    (long long) start);
+                return false;
+            }
+            madvise(window.baseAddr, window.baseLength, MADV_SEQUENTIAL);
+            data = (const unsigned char*) window.addr;
         }
-        ret = processFunction(buf, n, cookie);
+        if (length > (off64_t) count) {
+            adviseWillNeed(pArchive, start + count, RANGE_WINDOW_SIZE);
+        }
+
+        ret = processFunction(data, count, cookie);
+        sysReleaseShmem(&window);
         if (!ret) {
             return false;
         }
-        bytesLeft -= count;
+        start += count;
+        length -= count;
     }
     return true;
 }
 
-static bool processDeflatedEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+/*
+ * Inflation state carried from one window of compressed data to the next.
+ */
+typedef struct {
+    z_stream zstream;
+    unsigned char procBuf[32 * 1024];
+    ProcessZipEntryContentsFunction processFunction;
+    void *cookie;
+    long long totalOut;     // zstream.total_out is only 32 bits on some systems
+    bool done;
+} InflateState;
+
+/*
+ * (This is a mzProcessArchiveRange callback.)
+ *
+ * Inflate one window of compressed data, passing the output on to the
+ * real process function 32k at a time.
+ */
+static bool inflateProcessFunction(const unsigned char *data, int dataLen,
     void *cookie)
 {
-    long result = -1;
-    unsigned char readBuf[32 * 1024];
-    unsigned char procBuf[32 * 1024];
-    z_stream zstream;
+    InflateState *st = (InflateState *) cookie;
+
+    if (st->done) {
+        return true;            // ignore anything past the end of stream
+    }
+    st->zstream.next_in = (Bytef*) data;
+    st->zstream.avail_in = dataLen;
+
+    for (;;) {
+        /* uncompress the data */
+        int zerr = inflate(&st->zstream, Z_NO_FLUSH);
+        if (zerr == Z_BUF_ERROR) {
+            return true;        // no progress possible; wants more input
+        }
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+            return false;
+        }
+
+        /* write when we're full or when we're done */
+        long procSize = st->zstream.next_out - st->procBuf;
+        if (st->zstream.avail_out == 0 ||
+            (zerr == Z_STREAM_END && procSize != 0))
+        {
+            LOGVV("+++ processing %d bytes\n", (int) procSize);
+            st->totalOut += procSize;
+            if (!st->processFunction(st->procBuf, procSize, st->cookie)) {
+                LOGW("Process function elected to fail (in inflate)\n");
+                return false;
+            }
+
+            st->zstream.next_out = st->procBuf;
+            st->zstream.avail_out = sizeof(st->procBuf);
+        }
+        if (zerr == Z_STREAM_END) {
+            st->done = true;
+            return true;
+        }
+    }
+}
+
+static bool processDeflatedEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, off64_t offset,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    InflateState *st;
     int zerr;
-    long compRemaining;
+    bool ret = false;
 
-    compRemaining = pEntry->compLen;
+    st = (InflateState *) malloc(sizeof(*st));
+    if (st == NULL) {
+        return false;
+    }
 
     /*
      * Initialize the zlib stream.
      */
-    memset(&zstream, 0, sizeof(zstream));
-    zstream.zalloc = Z_NULL;
-    zstream.zfree = Z_NULL;
-    zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
-    zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
-    zstream.data_type = Z_UNKNOWN;
+    memset(&st->zstream, 0, sizeof(st->zstream));
+    st->zstream.zalloc = Z_NULL;
+    st->zstream.zfree = Z_NULL;
+    st->zstream.opaque = Z_NULL;
+    st->zstream.next_in = NULL;
+    st->zstream.avail_in = 0;
+    st->zstream.next_out = (Bytef*) st->procBuf;
+    st->zstream.avail_out = sizeof(st->procBuf);
+    st->zstream.data_type = Z_UNKNOWN;
+    st->processFunction = processFunction;
+    st->cookie = cookie;
+    st->totalOut = 0;
+    st->done = false;
 
     /*
      * Use the undocumented "negative window bits" feature to tell zlib
      * that there's no zlib header waiting for it.
      */
-    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    zerr = inflateInit2(&st->zstream, -MAX_WBITS);
     if (zerr != Z_OK) {
         if (zerr == Z_VERSION_ERROR) {
             LOGE("Installed zlib is not compatible with linked version (%s)\n",
@@ -591,72 +922,23 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
         } else {
             LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
         }
-        goto bail;
+        free(st);
+        return false;
     }
 
-    /*
-     * Loop while we have data.
-     */
-    do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
-
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
-        }
-
-        /* uncompress the data */
-        zerr = inflate(&zstream, Z_NO_FLUSH);
-        if (zerr != Z_OK && zerr != Z_STREAM_END) {
-            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
-            goto z_bail;
-        }
-
-        /* write when we're full or when we're done */
-        if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
-        {
-            long procSize = zstream.next_out - procBuf;
-            LOGVV("+++ processing %d bytes\n", (int) procSize);
-            bool ret = processFunction(procBuf, procSize, cookie);
-            if (!ret) {
-                LOGW("Process function elected to fail (in inflate)\n");
-                goto z_bail;
-            }
-
-            zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
+    if (mzProcessArchiveRange(pArchive, offset, pEntry->compLen,
+            inflateProcessFunction, st)) {
+        if (!st->done || st->totalOut != pEntry->uncompLen) {
+            LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
+                st->totalOut, pEntry->uncompLen);
+        } else {
+            ret = true;
         }
-    } while (zerr == Z_OK);
-
-    assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
-
-    // success!
-    result = zstream.total_out;
-
-z_bail:
-    inflateEnd(&zstream);        /* free up any allocated structures */
-
-bail:
-    if (result != pEntry->uncompLen) {
-        if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
-                result, pEntry->uncompLen);
-        return false;
     }
-    return true;
+
+    inflateEnd(&st->zstream);        /* free up any allocated structures */
+    free(st);
+    return ret;
 }
 
 /*
@@ -674,29 +956,29 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
+    off64_t offset;
 
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
+    offset = mzGetZipEntryOffset(pArchive, pEntry);
+    if (offset < 0) {
+        return false;
+    }
 
     switch (pEntry->compression) {
     case STORED:
-        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
+        /* The data goes to processFunction straight from the mapping. */
+        ret = mzProcessArchiveRange(pArchive, offset, pEntry->compLen,
+                processFunction, cookie);
         break;
     case DEFLATED:
-        ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie);
+        ret = processDeflatedEntry(pArchive, pEntry, offset,
+                processFunction, cookie);
         break;
     default:
-        LOGE("Unsupported compression type %d for entry '%s'\n",
-                pEntry->compression, pEntry->fileName);
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -731,22 +1013,160 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
     return true;
 }
 
-typedef struct {
-    char *buf;
-    int bufLen;
-} CopyProcessArgs;
+/*
+ * Where readEntry() is putting an entry's data.  If "drain" is set, it is
+ * called whenever the output space runs out, to empty it and make more.
+ */
+typedef struct BufferReadState {
+    z_stream zstream;
+    unsigned char *out;
+    size_t outLeft;
+    bool (*drain)(struct BufferReadState *st);
+    bool inflating;
+    bool done;
+} BufferReadState;
 
-static bool copyProcessFunction(const unsigned char *data, int dataLen,
-        void *cookie)
+/*
+ * (This is a mzProcessArchiveRange callback.)
+ *
+ * Copy STORED data, or inflate DEFLATED data, straight into the caller's
+ * buffer rather than through an intermediate one.
+ */
+static bool bufferReadFunction(const unsigned char *data, int dataLen,
+    void *cookie)
 {
-    CopyProcessArgs *args = (CopyProcessArgs *)cookie;
-    if (dataLen <= args->bufLen) {
-        memcpy(args->buf, data, dataLen);
-        args->buf += dataLen;
-        args->bufLen -= dataLen;
+    BufferReadState *st = (BufferReadState *) cookie;
+
+    if (!st->inflating) {
+        while (dataLen > 0) {
+            if (st->outLeft == 0 && st->drain != NULL && !st->drain(st)) {
+                return false;
+            }
+            if (st->outLeft == 0) {
+                LOGW("Stored entry is bigger than its buffer\n");
+                return false;
+            }
+            size_t count = (size_t) dataLen < st->outLeft ?
+                (size_t) dataLen : st->outLeft;
+            memcpy(st->out, data, count);
+            st->out += count;
+            st->outLeft -= count;
+            data += count;
+            dataLen -= count;
+        }
         return true;
     }
-    return false;
+
+    if (st->done) {
+        return true;            // ignore anything past the end of stream
+    }
+    st->zstream.next_in = (Bytef*) data;
+    st->zstream.avail_in = dataLen;
+    for (;;) {
+        if (st->outLeft == 0 && st->drain != NULL && !st->drain(st)) {
+            return false;
+        }
+
+        /* avail_out is only a uInt, so hand zlib the buffer in pieces. */
+        uInt avail = st->outLeft > UINT_MAX ? UINT_MAX : (uInt) st->outLeft;
+        st->zstream.next_out = st->out;
+        st->zstream.avail_out = avail;
+
+        int zerr = inflate(&st->zstream, Z_NO_FLUSH);
+        st->out += avail - st->zstream.avail_out;
+        st->outLeft -= avail - st->zstream.avail_out;
+
+        if (zerr == Z_STREAM_END) {
+            st->done = true;
+            return true;
+        }
+        if (zerr == Z_BUF_ERROR && st->zstream.avail_in == 0) {
+            return true;        // wants more input
+        }
+        if (zerr == Z_BUF_ERROR) {
+            LOGW("Inflated entry is bigger than its buffer\n");
+            return false;
+        }
+        if (zerr != Z_OK) {
+            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+            return false;
+        }
+        if (st->zstream.avail_in == 0 && st->zstream.avail_out != 0) {
+            return true;
+        }
+    }
+}
+
+/*
+ * Read an entry's uncompressed data into the space described by "st"
+ * (out, outLeft and drain; the rest must be zero).  STORED data is copied
+ * straight from the mapping and DEFLATED data is inflated directly into
+ * the output space.
+ */
+static bool readEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
+    BufferReadState *st)
+{
+    off64_t offset;
+    bool ret;
+
+    offset = mzGetZipEntryOffset(pArchive, pEntry);
+    if (offset < 0) {
+        return false;
+    }
+
+    switch (pEntry->compression) {
+    case STORED:
+        break;
+    case DEFLATED:
+        /* No zlib header; see processDeflatedEntry(). */
+        if (inflateInit2(&st->zstream, -MAX_WBITS) != Z_OK) {
+            LOGE("Call to inflateInit2 failed\n");
+            return false;
+        }
+        st->inflating = true;
+        break;
+    default:
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+
+    ret = mzProcessArchiveRange(pArchive, offset, pEntry->compLen,
+            bufferReadFunction, st);
+    if (st->inflating) {
+        ret = ret && st->done;
+        inflateEnd(&st->zstream);
+    }
+    return ret;
+}
+
+/*
+ * Read an entry's uncompressed data into "buf", which has room for
+ * "bufLen" bytes.
+ */
+static bool readEntryToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buf, size_t bufLen)
+{
+    BufferReadState st;
+
+    if ((unsigned long long) pEntry->uncompLen > bufLen) {
+        LOGW("Entry '%.*s' doesn't fit in buffer (%lld > %zu)\n",
+            pEntry->fileNameLen, pEntry->fileName, pEntry->uncompLen, bufLen);
+        return false;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.out = buf;
+    st.outLeft = pEntry->uncompLen;
+    if (!readEntry(pArchive, pEntry, &st)) {
+        return false;
+    }
+    if (st.outLeft != 0) {
+        LOGW("Size mismatch on inflated file (%lld vs %lld)\n",
+            pEntry->uncompLen - (long long) st.outLeft, pEntry->uncompLen);
+        return false;
+    }
+    return true;
 }
 
 /*
@@ -755,44 +1175,81 @@ static bool copyProcessFunction(const unsigned char *data, int dataLen,
 bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
         char *buf, int bufLen)
 {
-    CopyProcessArgs args;
-    bool ret;
-
-    args.buf = buf;
-    args.bufLen = bufLen;
-    ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
-            (void *)&args);
-    if (!ret) {
+    if (bufLen < 0 ||
+        !readEntryToBuffer(pArchive, pEntry, (unsigned char *) buf, bufLen)) {
         LOGE("Can't extract entry to buffer.\n");
         return false;
     }
     return true;
 }
 
-static bool writeProcessFunction(const unsigned char *data, int dataLen,
-                                 void *cookie)
+/*
+ * Extraction to a file goes through a sink that collects the output in a
+ * large buffer and writes it out in big, block-aligned chunks.
+ */
+#define SINK_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+    BufferReadState st;     // must be first
+    int fd;
+    unsigned char *buf;
+    size_t bufSize;
+    long long left;         // bytes not yet given to st as output space
+} FileSink;
+
+static bool writeFully(int fd, const void* data, size_t len);
+
+/*
+ * (This is a BufferReadState drain function.)
+ *
+ * Write out what's in the sink buffer and hand it back as fresh space.
+ */
+static bool sinkDrain(BufferReadState *st)
 {
-    int fd = (int)cookie;
-
-    ssize_t soFar = 0;
-    while (true) {
-        ssize_t n = write(fd, data+soFar, dataLen-soFar);
-        if (n <= 0) {
-            LOGE("Error writing %ld bytes from zip file from %p: %s\n",
-                 dataLen-soFar, data+soFar, strerror(errno));
-            if (errno != EINTR) {
-              return false;
-            }
-        } else if (n > 0) {
-            soFar += n;
-            if (soFar == dataLen) return true;
-            if (soFar > dataLen) {
-                LOGE("write overrun?  (%ld bytes instead of %d)\n",
-                     soFar, dataLen);
-                return false;
-            }
-        }
+    FileSink *sink = (FileSink *) st;
+    size_t used = st->out - sink->buf;
+
+    if (used > 0 && !writeFully(sink->fd, sink->buf, used)) {
+        return false;
     }
+    st->out = sink->buf;
+    st->outLeft = sink->left < (long long) sink->bufSize ?
+        (size_t) sink->left : sink->bufSize;
+    sink->left -= st->outLeft;
+    return true;
+}
+
+/*
+ * Reserve the blocks for "length" bytes at fd's current offset, so the
+ * filesystem can allocate them in one piece instead of as each write
+ * arrives.  This is only a hint: filesystems such as yaffs2 and vfat
+ * don't support it.  bionic has no fallocate() wrapper, so go straight to
+ * the system call; on 32-bit targets each 64-bit argument is passed as a
+ * (low, high) pair of words, which is what the ARM EABI and x86 kernels
+ * expect from a little-endian caller.
+ */
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+static void preallocate(int fd, long long length)
+{
+#ifdef __NR_fallocate
+    off64_t offset = lseek64(fd, 0, SEEK_CUR);
+    if (offset < 0 || length <= 0) return;
+
+#if defined(__LP64__)
+    long ret = syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE,
+            (long) offset, (long) length);
+#else
+    long ret = syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE,
+            (uint32_t) offset, (uint32_t) ((uint64_t) offset >> 32),
+            (uint32_t) length, (uint32_t) ((uint64_t) length >> 32));
+#endif
+    if (ret < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        LOGW("Can't preallocate %lld bytes (%s)\n", length, strerror(errno));
+    }
+#endif
 }
 
 /*
@@ -801,8 +1258,38 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
-                                         (void*)fd);
+    FileSink sink;
+    bool ret = false;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.fd = fd;
+    sink.left = pEntry->uncompLen;
+    sink.bufSize = SINK_BUFFER_SIZE;
+    if (sink.left < SINK_BUFFER_SIZE) {
+        sink.bufSize = sink.left > 0 ? sink.left : 1;
+    }
+    sink.buf = (unsigned char *) malloc(sink.bufSize);
+    if (sink.buf == NULL) {
+        LOGE("Can't allocate %zu bytes for extraction\n", sink.bufSize);
+        return false;
+    }
+    sink.st.drain = sinkDrain;
+    sink.st.out = sink.buf;
+
+    preallocate(fd, pEntry->uncompLen);
+    if (sinkDrain(&sink.st) &&
+        readEntry(pArchive, pEntry, &sink.st) &&
+        sinkDrain(&sink.st))
+    {
+        if (sink.left != 0 || sink.st.outLeft != 0) {
+            LOGW("Size mismatch on inflated file (%lld short of %lld)\n",
+                sink.left + (long long) sink.st.outLeft, pEntry->uncompLen);
+        } else {
+            ret = true;
+        }
+    }
+    free(sink.buf);
+
     if (!ret) {
         LOGE("Can't extract entry to file.\n");
         return false;
@@ -810,22 +1297,6 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     return true;
 }
 
-typedef struct {
-    unsigned char* buffer;
-    long len;
-} BufferExtractCookie;
-
-static bool bufferProcessFunction(const unsigned char *data, int dataLen,
-    void *cookie) {
-    BufferExtractCookie *bec = (BufferExtractCookie*)cookie;
-
-    memmove(bec->buffer, data, dataLen);
-    bec->buffer += dataLen;
-    bec->len -= dataLen;
-
-    return true;
-}
-
 /*
  * Uncompress "pEntry" in "pArchive" to buffer, which must be large
  * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
@@ -833,13 +1304,8 @@ static bool bufferProcessFunction(const unsigned char *data, int dataLen,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char *buffer)
 {
-    BufferExtractCookie bec;
-    bec.buffer = buffer;
-    bec.len = mzGetZipEntryUncompLen(pEntry);
-
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry,
-        bufferProcessFunction, (void*)&bec);
-    if (!ret || bec.len != 0) {
+    if ((unsigned long long) pEntry->uncompLen > SIZE_MAX ||
+        !readEntryToBuffer(pArchive, pEntry, buffer, pEntry->uncompLen)) {
         LOGE("Can't extract entry to memory buffer.\n");
         return false;
     }
@@ -1021,6 +1487,13 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
          */
         seenMatch = true;
 
+        /* Have the kernel start reading the next entry while we work on
+         * this one; with sorted entries it's usually the next we want.
+         */
+        if (i + 1 < pArchive->numEntries && !(flags & MZ_EXTRACT_DRY_RUN)) {
+            mzPrefetchZipEntry(pArchive, pEntry + 1);
+        }
+
         /* Find the target location of the entry.
          */
         const char *targetFile = targetEntryPath(&helper, pEntry);
@@ -1111,8 +1584,15 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 free(linkTarget);
             } else {
                 /* The entry is a regular file.
-                 * Open the target for writing.
+                 * Open the target for writing.  When the caller will
+                 * sync, replace any old file instead of truncating it:
+                 * ext4 flushes a truncated-and-rewritten file on close.
                  */
+                if ((flags & MZ_EXTRACT_DEFER_SYNC) &&
+                    unlink(targetFile) != 0 && errno != ENOENT) {
+                    LOGW("Can't remove old \"%s\": %s\n",
+                            targetFile, strerror(errno));
+                }
                 int fd = creat(targetFile, UNZIP_FILEMODE);
                 if (fd < 0) {
                     LOGE("Can't create target file \"%s\": %s\n",
@@ -1121,9 +1601,9 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     break;
                 }
 
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+                bool extracted = mzExtractZipEntryToFile(pArchive, pEntry, fd);
                 close(fd);
-                if (!ok) {
+                if (!extracted) {
                     LOGE("Error extracting \"%s\"\n", targetFile);
                     ok = false;
                     break;
@@ -1147,3 +1627,640 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
     return ok;
 }
+
+/*
+ * Flush everything written to the filesystem holding "path".
+ */
+int mzSyncFilesystem(const char *path)
+{
+#ifdef __NR_syncfs
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        int ret = syscall(__NR_syncfs, fd);
+        int err = errno;
+        close(fd);
+        if (ret == 0 || err != ENOSYS) {
+            errno = err;
+            return ret;
+        }
+    }
+#endif
+    sync();
+    return 0;
+}
+
+
+/*
+ * Streaming Zip archive writer.
+ *
+ * Entries are written one after another: a local header with the CRC
+ * and sizes left blank, then the data, then the header is patched in
+ * place.  The central directory and end record go out when the archive
+ * is finished.  DEFLATE input is cut into chunks that are compressed
+ * independently on worker threads, each primed with the previous
+ * 32 KB of input as its dictionary, and ended with a sync flush so the
+ * pieces concatenate into one valid deflate stream.  The workers are
+ * started with the first batch that needs them and kept until the
+ * archive is finished.
+ */
+
+#define WRITE_CHUNK_SIZE    (256 * 1024)
+#define WRITE_DICT_SIZE     (32 * 1024)
+#define WRITE_MAX_THREADS   4
+
+/*
+ * Entries whose input is at least this big get a Zip64 extra field in
+ * their local header, since the header is written before the sizes are
+ * known.  The margin covers DEFLATE's worst-case expansion.
+ */
+#define ZIP64_ENTRY_THRESHOLD   0xf0000000LL
+#define ZIP64_LOCEXTLEN         20      // id, size, uncompLen, compLen
+
+typedef struct {
+    char*       fileName;
+    unsigned int fileNameLen;
+    off64_t     offset;
+    long long   compLen;
+    long long   uncompLen;
+    int         compression;
+    long        modTime;
+    unsigned long crc32;
+    long        externalFileAttributes;
+} ZipWriterEntry;
+
+typedef struct {
+    const unsigned char* in;
+    size_t      inLen;
+    const unsigned char* dict;
+    size_t      dictLen;
+    bool        last;
+    unsigned char* out;
+    size_t      outLen;
+    bool        ok;
+} DeflateChunk;
+
+struct ZipWriter {
+    int         fd;
+    off64_t     offset;         // current end of the archive
+    ZipWriterEntry* pEntries;
+    unsigned int numEntries;
+    unsigned int allocEntries;
+    int         numThreads;
+    bool        failed;
+
+    /* The worker pool; the writing thread takes chunks too. */
+    pthread_t   workers[WRITE_MAX_THREADS];
+    int         numWorkers;
+    bool        workersStarted;
+    bool        quit;
+    pthread_mutex_t lock;       // guards the batch and quit
+    pthread_cond_t batchReady;
+    pthread_cond_t batchDone;
+    DeflateChunk* pBatch;
+    int         batchCount;
+    int         batchNext;      // next chunk to hand out
+    int         batchFinished;
+};
+
+typedef ssize_t (*ZipWriterSource)(void* cookie, unsigned char* buf,
+    size_t len);
+
+static bool writeFully(int fd, const void* data, size_t len)
+{
+    const unsigned char* p = (const unsigned char*) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOGE("Zip write failed: %s\n", strerror(errno));
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool writerEmit(ZipWriter* pWriter, const void* data, size_t len)
+{
+    if (!writeFully(pWriter->fd, data, len)) {
+        pWriter->failed = true;
+        return false;
+    }
+    pWriter->offset += len;
+    return true;
+}
+
+/* Convert a time_t into the MS-DOS date (high 16 bits) and time. */
+static long dosTime(time_t when)
+{
+    struct tm tm;
+    localtime_r(&when, &tm);
+    if (tm.tm_year < 80) {
+        return (1 << 21) | (1 << 16);   // 1980-01-01 00:00
+    }
+    return ((tm.tm_year - 80) << 25) | ((tm.tm_mon + 1) << 21) |
+        (tm.tm_mday << 16) | (tm.tm_hour << 11) | (tm.tm_min << 5) |
+        (tm.tm_sec >> 1);
+}
+
+static void* deflateChunk(void* arg)
+{
+    DeflateChunk* pChunk = (DeflateChunk*) arg;
+    z_stream zstream;
+
+    pChunk->ok = false;
+    memset(&zstream, 0, sizeof(zstream));
+    if (deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+            8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    if (pChunk->dictLen > 0) {
+        deflateSetDictionary(&zstream, pChunk->dict, pChunk->dictLen);
+    }
+
+    /* deflateBound() doesn't count the sync flush marker. */
+    size_t bound = deflateBound(&zstream, pChunk->inLen) + 16;
+    pChunk->out = (unsigned char*) malloc(bound);
+    if (pChunk->out != NULL) {
+        zstream.next_in = (Bytef*) pChunk->in;
+        zstream.avail_in = pChunk->inLen;
+        zstream.next_out = pChunk->out;
+        zstream.avail_out = bound;
+        int zerr = deflate(&zstream, pChunk->last ? Z_FINISH : Z_SYNC_FLUSH);
+        pChunk->outLen = bound - zstream.avail_out;
+        pChunk->ok = zstream.avail_in == 0 &&
+            (pChunk->last ? zerr == Z_STREAM_END : zerr == Z_OK);
+    }
+    deflateEnd(&zstream);
+    return NULL;
+}
+
+/*
+ * Deflate chunks of the current batch until there are none left to
+ * take.  Called with pWriter->lock held, and returns with it held.
+ */
+static void deflateBatchChunks(ZipWriter* pWriter)
+{
+    while (pWriter->batchNext < pWriter->batchCount) {
+        DeflateChunk* pChunk = &pWriter->pBatch[pWriter->batchNext++];
+        pthread_mutex_unlock(&pWriter->lock);
+        deflateChunk(pChunk);
+        pthread_mutex_lock(&pWriter->lock);
+        if (++pWriter->batchFinished == pWriter->batchCount) {
+            pthread_cond_signal(&pWriter->batchDone);
+        }
+    }
+}
+
+static void* deflateWorker(void* arg)
+{
+    ZipWriter* pWriter = (ZipWriter*) arg;
+
+    pthread_mutex_lock(&pWriter->lock);
+    while (!pWriter->quit) {
+        if (pWriter->batchNext < pWriter->batchCount) {
+            deflateBatchChunks(pWriter);
+        } else {
+            pthread_cond_wait(&pWriter->batchReady, &pWriter->lock);
+        }
+    }
+    pthread_mutex_unlock(&pWriter->lock);
+    return NULL;
+}
+
+static void startDeflateWorkers(ZipWriter* pWriter)
+{
+    pWriter->workersStarted = true;
+    pthread_mutex_init(&pWriter->lock, NULL);
+    pthread_cond_init(&pWriter->batchReady, NULL);
+    pthread_cond_init(&pWriter->batchDone, NULL);
+    while (pWriter->numWorkers < pWriter->numThreads - 1 &&
+           pthread_create(&pWriter->workers[pWriter->numWorkers], NULL,
+               deflateWorker, pWriter) == 0) {
+        pWriter->numWorkers++;
+    }
+}
+
+static void stopDeflateWorkers(ZipWriter* pWriter)
+{
+    if (!pWriter->workersStarted) {
+        return;
+    }
+    pthread_mutex_lock(&pWriter->lock);
+    pWriter->quit = true;
+    pthread_cond_broadcast(&pWriter->batchReady);
+    pthread_mutex_unlock(&pWriter->lock);
+    int i;
+    for (i = 0; i < pWriter->numWorkers; i++) {
+        pthread_join(pWriter->workers[i], NULL);
+    }
+    pthread_cond_destroy(&pWriter->batchDone);
+    pthread_cond_destroy(&pWriter->batchReady);
+    pthread_mutex_destroy(&pWriter->lock);
+}
+
+/*
+ * Deflate every chunk, on the pool and this thread.  With only one
+ * chunk there's nothing to share, so it's done here directly.
+ */
+static void deflateBatch(ZipWriter* pWriter, DeflateChunk* pChunks,
+    int count)
+{
+    if (count == 1) {
+        deflateChunk(pChunks);
+        return;
+    }
+    if (!pWriter->workersStarted) {
+        startDeflateWorkers(pWriter);
+    }
+    pthread_mutex_lock(&pWriter->lock);
+    pWriter->pBatch = pChunks;
+    pWriter->batchCount = count;
+    pWriter->batchNext = 0;
+    pWriter->batchFinished = 0;
+    pthread_cond_broadcast(&pWriter->batchReady);
+    deflateBatchChunks(pWriter);
+    while (pWriter->batchFinished < pWriter->batchCount) {
+        pthread_cond_wait(&pWriter->batchDone, &pWriter->lock);
+    }
+    pWriter->pBatch = NULL;
+    pWriter->batchCount = 0;
+    pWriter->batchNext = 0;
+    pthread_mutex_unlock(&pWriter->lock);
+}
+
+/*
+ * Pull the entry's data from "source", writing it STORED or DEFLATED.
+ * Fills in the CRC and sizes of pEntry.
+ */
+static bool writeEntryData(ZipWriter* pWriter, ZipWriterEntry* pEntry,
+    ZipWriterSource source, void* cookie)
+{
+    const int numChunks =
+        pEntry->compression == DEFLATED ? pWriter->numThreads : 1;
+    const size_t batchSize = numChunks * WRITE_CHUNK_SIZE;
+    unsigned char* buf = (unsigned char*) malloc(WRITE_DICT_SIZE + batchSize);
+    if (buf == NULL) {
+        return false;
+    }
+    unsigned char* data = buf + WRITE_DICT_SIZE;
+    size_t dictLen = 0;
+    bool ok = true;
+    bool done = false;
+
+    pEntry->crc32 = crc32(0L, Z_NULL, 0);
+    pEntry->compLen = 0;
+    pEntry->uncompLen = 0;
+
+    while (ok && !done) {
+        /* Fill a whole batch so we know whether this is the last one. */
+        size_t len = 0;
+        while (len < batchSize) {
+            ssize_t n = source(cookie, data + len, batchSize - len);
+            if (n < 0) {
+                ok = false;
+                break;
+            }
+            if (n == 0) {
+                done = true;
+                break;
+            }
+            len += n;
+        }
+        if (!ok) {
+            break;
+        }
+        pEntry->crc32 = crc32(pEntry->crc32, data, len);
+        pEntry->uncompLen += len;
+
+        if (pEntry->compression == STORED) {
+            ok = writerEmit(pWriter, data, len);
+            pEntry->compLen += len;
+            continue;
+        }
+
+        /* A full batch followed by EOF still needs a final block; it
+         * comes out of an empty last chunk on the next pass.
+         */
+        DeflateChunk chunks[WRITE_MAX_THREADS];
+        int count = (len + WRITE_CHUNK_SIZE - 1) / WRITE_CHUNK_SIZE;
+        if (count == 0) {
+            if (!done) continue;
+            count = 1;
+        }
+        int i;
+        for (i = 0; i < count; i++) {
+            size_t start = i * WRITE_CHUNK_SIZE;
+            DeflateChunk* pChunk = &chunks[i];
+            pChunk->in = data + start;
+            pChunk->inLen = len - start < WRITE_CHUNK_SIZE ?
+                len - start : WRITE_CHUNK_SIZE;
+            pChunk->dictLen = start + dictLen < WRITE_DICT_SIZE ?
+                start + dictLen : WRITE_DICT_SIZE;
+            pChunk->dict = pChunk->in - pChunk->dictLen;
+            pChunk->last = done && i == count - 1;
+            pChunk->out = NULL;
+        }
+        deflateBatch(pWriter, chunks, count);
+        for (i = 0; i < count; i++) {
+            if (ok && chunks[i].ok) {
+                ok = writerEmit(pWriter, chunks[i].out, chunks[i].outLen);
+                pEntry->compLen += chunks[i].outLen;
+            } else {
+                ok = false;
+            }
+            free(chunks[i].out);
+        }
+
+        /* Keep the tail of this batch as the next batch's dictionary. */
+        size_t keep = len + dictLen < WRITE_DICT_SIZE ?
+            len + dictLen : WRITE_DICT_SIZE;
+        memmove(buf + WRITE_DICT_SIZE - keep, data + len - keep, keep);
+        dictLen = keep;
+    }
+
+    free(buf);
+    return ok;
+}
+
+ZipWriter* mzCreateZipArchive(const char* fileName)
+{
+    ZipWriter* pWriter = (ZipWriter*) calloc(1, sizeof(ZipWriter));
+    if (pWriter == NULL) {
+        return NULL;
+    }
+    pWriter->fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+        0644);
+    if (pWriter->fd < 0) {
+        LOGE("Can't create zip \"%s\": %s\n", fileName, strerror(errno));
+        free(pWriter);
+        return NULL;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pWriter->numThreads = cpus < 1 ? 1 :
+        (cpus > WRITE_MAX_THREADS ? WRITE_MAX_THREADS : (int) cpus);
+    return pWriter;
+}
+
+static bool addEntry(ZipWriter* pWriter, const char* entryName,
+    int compression, time_t modTime, mode_t mode, long long sizeHint,
+    ZipWriterSource source, void* cookie)
+{
+    const bool zip64 = sizeHint >= ZIP64_ENTRY_THRESHOLD;
+
+    if (pWriter->failed) {
+        return false;
+    }
+    if (compression != STORED && compression != DEFLATED) {
+        LOGE("Unsupported zip compression %d\n", compression);
+        pWriter->failed = true;
+        return false;
+    }
+    if (pWriter->numEntries == pWriter->allocEntries) {
+        unsigned int alloc = pWriter->allocEntries * 2 + 16;
+        ZipWriterEntry* pEntries = (ZipWriterEntry*) realloc(
+            pWriter->pEntries, alloc * sizeof(ZipWriterEntry));
+        if (pEntries == NULL) {
+            pWriter->failed = true;
+            return false;
+        }
+        pWriter->pEntries = pEntries;
+        pWriter->allocEntries = alloc;
+    }
+
+    ZipWriterEntry* pEntry = &pWriter->pEntries[pWriter->numEntries];
+    memset(pEntry, 0, sizeof(*pEntry));
+    pEntry->fileName = strdup(entryName);
+    if (pEntry->fileName == NULL) {
+        pWriter->failed = true;
+        return false;
+    }
+    pEntry->fileNameLen = strlen(entryName);
+    pEntry->offset = pWriter->offset;
+    pEntry->compression = compression;
+    pEntry->modTime = dosTime(modTime);
+    pEntry->externalFileAttributes = (long) (mode & 0xffff) << 16;
+
+    unsigned char hdr[LOCHDR];
+    unsigned char extra[ZIP64_LOCEXTLEN];
+    memset(hdr, 0, sizeof(hdr));
+    set4LE(hdr, LOCSIG);
+    set2LE(hdr + LOCVER, zip64 ? 45 : 20);
+    set2LE(hdr + LOCHOW, compression);
+    set4LE(hdr + LOCTIM, pEntry->modTime);
+    set2LE(hdr + LOCNAM, pEntry->fileNameLen);
+    set2LE(hdr + LOCEXT, zip64 ? sizeof(extra) : 0);
+    memset(extra, 0, sizeof(extra));
+    set2LE(extra, ZIP64_EXTID);
+    set2LE(extra + 2, sizeof(extra) - 4);
+    if (!writerEmit(pWriter, hdr, sizeof(hdr)) ||
+        !writerEmit(pWriter, entryName, pEntry->fileNameLen) ||
+        (zip64 && !writerEmit(pWriter, extra, sizeof(extra)))) {
+        free(pEntry->fileName);
+        pWriter->failed = true;
+        return false;
+    }
+
+    if (!writeEntryData(pWriter, pEntry, source, cookie)) {
+        LOGE("Can't write zip entry \"%s\"\n", entryName);
+        free(pEntry->fileName);
+        pWriter->failed = true;
+        return false;
+    }
+
+    if (!zip64 && (pEntry->compLen >= ZIP64_MAGIC ||
+            pEntry->uncompLen >= ZIP64_MAGIC)) {
+        LOGE("Zip entry \"%s\" grew past 4GB\n", entryName);
+        free(pEntry->fileName);
+        pWriter->failed = true;
+        return false;
+    }
+
+    /* Go back and fill in what we now know. */
+    unsigned char sizes[12];
+    set4LE(sizes, pEntry->crc32);
+    set4LE(sizes + 4, zip64 ? ZIP64_MAGIC : pEntry->compLen);
+    set4LE(sizes + 8, zip64 ? ZIP64_MAGIC : pEntry->uncompLen);
+    set8LE(extra + 4, pEntry->uncompLen);
+    set8LE(extra + 12, pEntry->compLen);
+    if (pwrite64(pWriter->fd, sizes, sizeof(sizes),
+            pEntry->offset + LOCCRC) != (ssize_t) sizeof(sizes) ||
+        (zip64 && pwrite64(pWriter->fd, extra, sizeof(extra),
+            pEntry->offset + LOCHDR + pEntry->fileNameLen) !=
+            (ssize_t) sizeof(extra))) {
+        LOGE("Can't update zip entry \"%s\": %s\n", entryName,
+            strerror(errno));
+        free(pEntry->fileName);
+        pWriter->failed = true;
+        return false;
+    }
+
+    pWriter->numEntries++;
+    return true;
+}
+
+static ssize_t fdSource(void* cookie, unsigned char* buf, size_t len)
+{
+    int fd = *(int*) cookie;
+    ssize_t n;
+    do {
+        n = read(fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+typedef struct {
+    const unsigned char* data;
+    size_t left;
+} BufferSource;
+
+static ssize_t bufferSource(void* cookie, unsigned char* buf, size_t len)
+{
+    BufferSource* pSource = (BufferSource*) cookie;
+    if (len > pSource->left) {
+        len = pSource->left;
+    }
+    memcpy(buf, pSource->data, len);
+    pSource->data += len;
+    pSource->left -= len;
+    return len;
+}
+
+bool mzWriteZipEntryFromFile(ZipWriter* pWriter, const char* entryName,
+    const char* path, int compression)
+{
+    if (pWriter->failed) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        LOGE("Can't open \"%s\": %s\n", path, strerror(errno));
+        pWriter->failed = true;
+        return false;
+    }
+    struct stat64 st;
+    if (fstat64(fd, &st) < 0) {
+        LOGE("Can't stat \"%s\": %s\n", path, strerror(errno));
+        close(fd);
+        pWriter->failed = true;
+        return false;
+    }
+    bool ok = addEntry(pWriter, entryName, compression, st.st_mtime,
+        st.st_mode, st.st_size, fdSource, &fd);
+    close(fd);
+    return ok;
+}
+
+bool mzWriteZipEntryFromBuffer(ZipWriter* pWriter, const char* entryName,
+    const unsigned char* data, size_t len, int compression)
+{
+    BufferSource source;
+    source.data = data;
+    source.left = len;
+    return addEntry(pWriter, entryName, compression, time(NULL),
+        S_IFREG | 0644, len, bufferSource, &source);
+}
+
+int mzFinishZipArchive(ZipWriter* pWriter)
+{
+    bool ok = !pWriter->failed;
+    off64_t cdOffset = pWriter->offset;
+    unsigned int i;
+
+    for (i = 0; ok && i < pWriter->numEntries; i++) {
+        const ZipWriterEntry* pEntry = &pWriter->pEntries[i];
+        bool bigUncomp = pEntry->uncompLen >= ZIP64_MAGIC;
+        bool bigComp = pEntry->compLen >= ZIP64_MAGIC;
+        bool bigOffset = pEntry->offset >= ZIP64_MAGIC;
+
+        /* The Zip64 field only holds the values that overflowed. */
+        unsigned char extra[4 + 3 * 8];
+        size_t extraLen = 4;
+        if (bigUncomp) {
+            set8LE(extra + extraLen, pEntry->uncompLen);
+            extraLen += 8;
+        }
+        if (bigComp) {
+            set8LE(extra + extraLen, pEntry->compLen);
+            extraLen += 8;
+        }
+        if (bigOffset) {
+            set8LE(extra + extraLen, pEntry->offset);
+            extraLen += 8;
+        }
+        set2LE(extra, ZIP64_EXTID);
+        set2LE(extra + 2, extraLen - 4);
+        if (extraLen == 4) {
+            extraLen = 0;
+        }
+
+        unsigned char hdr[CENHDR];
+        memset(hdr, 0, sizeof(hdr));
+        set4LE(hdr, CENSIG);
+        set2LE(hdr + CENVEM, CENVEM_UNIX | (extraLen ? 45 : 20));
+        set2LE(hdr + CENVER, extraLen ? 45 : 20);
+        set2LE(hdr + CENHOW, pEntry->compression);
+        set4LE(hdr + CENTIM, pEntry->modTime);
+        set4LE(hdr + CENCRC, pEntry->crc32);
+        set4LE(hdr + CENSIZ, bigComp ? ZIP64_MAGIC : pEntry->compLen);
+        set4LE(hdr + CENLEN, bigUncomp ? ZIP64_MAGIC : pEntry->uncompLen);
+        set2LE(hdr + CENNAM, pEntry->fileNameLen);
+        set2LE(hdr + CENEXT, extraLen);
+        set4LE(hdr + CENATX, pEntry->externalFileAttributes);
+        set4LE(hdr + CENOFF, bigOffset ? ZIP64_MAGIC : pEntry->offset);
+        ok = writerEmit(pWriter, hdr, sizeof(hdr)) &&
+            writerEmit(pWriter, pEntry->fileName, pEntry->fileNameLen) &&
+            writerEmit(pWriter, extra, extraLen);
+    }
+
+    off64_t cdSize = pWriter->offset - cdOffset;
+    bool zip64 = pWriter->numEntries >= ZIP64_MAGIC16 ||
+        cdOffset >= ZIP64_MAGIC || cdSize >= ZIP64_MAGIC;
+    if (ok && zip64) {
+        off64_t endOffset = pWriter->offset;
+        unsigned char end[ZIP64_ENDHDR];
+        memset(end, 0, sizeof(end));
+        set4LE(end, ZIP64_ENDSIG);
+        set8LE(end + 4, ZIP64_ENDHDR - 12);
+        set2LE(end + ZIP64_ENDVEM, CENVEM_UNIX | 45);
+        set2LE(end + ZIP64_ENDVER, 45);
+        set8LE(end + ZIP64_ENDSUB, pWriter->numEntries);
+        set8LE(end + ZIP64_ENDTOT, pWriter->numEntries);
+        set8LE(end + ZIP64_ENDSIZ, cdSize);
+        set8LE(end + ZIP64_ENDOFF, cdOffset);
+
+        unsigned char loc[ZIP64_LOCHDR];
+        memset(loc, 0, sizeof(loc));
+        set4LE(loc, ZIP64_LOCSIG);
+        set8LE(loc + ZIP64_LOCOFF, endOffset);
+        set4LE(loc + 16, 1);    // total number of disks
+        ok = writerEmit(pWriter, end, sizeof(end)) &&
+            writerEmit(pWriter, loc, sizeof(loc));
+    }
+
+    if (ok) {
+        unsigned int count = pWriter->numEntries < ZIP64_MAGIC16 ?
+            pWriter->numEntries : ZIP64_MAGIC16;
+        unsigned char end[ENDHDR];
+        memset(end, 0, sizeof(end));
+        set4LE(end, ENDSIG);
+        set2LE(end + ENDSUB, count);
+        set2LE(end + ENDTOT, count);
+        set4LE(end + ENDSIZ, cdSize < ZIP64_MAGIC ? cdSize : ZIP64_MAGIC);
+        set4LE(end + ENDOFF, cdOffset < ZIP64_MAGIC ? cdOffset : ZIP64_MAGIC);
+        ok = writerEmit(pWriter, end, sizeof(end));
+    }
+
+    stopDeflateWorkers(pWriter);
+    if (close(pWriter->fd) != 0) {
+        ok = false;
+    }
+    for (i = 0; i < pWriter->numEntries; i++) {
+        free(pWriter->pEntries[i].fileName);
+    }
+    free(pWriter->pEntries);
+    free(pWriter);
+    return ok ? 0 : -1;
+}
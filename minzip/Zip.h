@@ -25,9 +25,9 @@
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    long         offset;
-    long         compLen;
-    long         uncompLen;
+    off64_t      localHdrOffset;
+    long long    compLen;
+    long long    uncompLen;
     int          compression;
     long         modTime;
     long         crc32;
@@ -40,10 +40,12 @@ typedef struct ZipEntry {
  */
 typedef struct ZipArchive {
     int         fd;
+    off64_t     length;         // of the whole file
     unsigned int numEntries;
     ZipEntry*   pEntries;
     HashTable*  pHash;          // maps file name to ZipEntry
-    MemMapping  map;
+    MemMapping  map;            // the central directory to the end of file
+    off64_t     mapOffset;      // == offset of the central directory
 } ZipArchive;
 
 /*
@@ -56,7 +58,9 @@ typedef struct {
 } UnterminatedString;
 
 /*
- * Open a Zip archive.
+ * Open a Zip archive.  Zip64 archives are supported.  Only the central
+ * directory is mapped; entry data is mapped a window at a time as it is
+ * read, so the archive needn't fit in the address space.
  *
  * On success, returns 0 and populates "pArchive".  Returns nonzero errno
  * value on failure.
@@ -114,10 +118,7 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
-    return pEntry->offset;
-}
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE long long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
@@ -128,6 +129,20 @@ INLINE long mzGetZipEntryCrc32(const ZipEntry* pEntry) {
 }
 bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
 
+/*
+ * Get the file offset of the entry's data, which means reading its local
+ * header.  Returns -1 if the header is bad.
+ */
+off64_t mzGetZipEntryOffset(const ZipArchive* pArchive,
+    const ZipEntry* pEntry);
+
+/*
+ * Hint that pEntry will be read soon, so the kernel can start reading it
+ * in.  When reading entries one after another, prefetch the next one
+ * before processing the current one.
+ */
+void mzPrefetchZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry);
+
 
 /*
  * Type definition for the callback function used by
@@ -150,6 +165,15 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie);
 
+/*
+ * Stream the raw bytes [start, start + length) of the archive file
+ * through processFunction, one window at a time.  This works on archives
+ * too large to map in one piece.
+ */
+bool mzProcessArchiveRange(const ZipArchive *pArchive, off64_t start,
+    off64_t length, ProcessZipEntryContentsFunction processFunction,
+    void *cookie);
+
 /*
  * Read an entry into a buffer allocated by the caller.
  */
@@ -163,7 +187,9 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
 /*
- * Inflate and write an entry to a file.
+ * Inflate and write an entry to a file, at the file's current offset.
+ * The space is preallocated where the filesystem allows, and the data
+ * goes out in large writes.  Nothing is synced.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd);
@@ -197,6 +223,9 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_DEFER_SYNC - the caller will flush the files itself (see
+ *         mzSyncFilesystem()), so replace existing files rather than
+ *         rewriting them, which some filesystems flush on close
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
@@ -204,10 +233,60 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum {
+    MZ_EXTRACT_FILES_ONLY = 1,
+    MZ_EXTRACT_DRY_RUN = 2,
+    MZ_EXTRACT_DEFER_SYNC = 4
+};
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
         void (*callback)(const char *fn, void*), void *cookie);
 
+/*
+ * Flush all data written to the filesystem that "path" is on, e.g. once
+ * after a batch of MZ_EXTRACT_DEFER_SYNC extractions.  Falls back to
+ * sync() if the kernel can't sync a single filesystem.
+ *
+ * Returns 0 on success, -1 (with errno set) on failure.
+ */
+int mzSyncFilesystem(const char *path);
+
+/*
+ * Zip archive writer.  Treat as opaque.
+ */
+typedef struct ZipWriter ZipWriter;
+
+/* Compression methods accepted by the writer. */
+enum { MZ_COMPRESSION_STORED = 0, MZ_COMPRESSION_DEFLATED = 8 };
+
+/*
+ * Create (or truncate) fileName and start writing a Zip archive to it.
+ * Returns NULL on failure.
+ */
+ZipWriter* mzCreateZipArchive(const char* fileName);
+
+/*
+ * Append an entry named entryName holding the contents of the file at
+ * path, keeping its modification time and mode.  Large DEFLATE entries
+ * are compressed in parallel chunks.  Zip64 records are written for
+ * entries and archives that outgrow the 32-bit fields.  Returns false on failure, after
+ * which the archive can only be finished (and will be reported bad).
+ */
+bool mzWriteZipEntryFromFile(ZipWriter* pWriter, const char* entryName,
+    const char* path, int compression);
+
+/*
+ * Append an entry holding len bytes of data, stamped with the current
+ * time and mode 0644.
+ */
+bool mzWriteZipEntryFromBuffer(ZipWriter* pWriter, const char* entryName,
+    const unsigned char* data, size_t len, int compression);
+
+/*
+ * Write the central directory, close the file and free pWriter.
+ * Returns 0 if the whole archive was written successfully.
+ */
+int mzFinishZipArchive(ZipWriter* pWriter);
+
 #endif /*_MINZIP_ZIP*/
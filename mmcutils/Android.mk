@@ -4,8 +4,7 @@ ifeq ($(TARGET_ARCH),arm)
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := \
-	mmcutils.c
+LOCAL_SRC_FILES := mmcutils.c
 
 ifeq ($(LGE_MMC_TYPES),true)
 LOCAL_CFLAGS += -DUSE_LGE_DTYPES
@@ -19,5 +18,16 @@ LOCAL_MODULE := libmmcutils
 
 include $(BUILD_STATIC_LIBRARY)
 
+# The same, backed by a disk image when MMC_EMULATOR is set, for host
+# tests; see mmc_emulator_load().
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := \
+	mmcutils.c \
+	mmc_emulator.c
+LOCAL_CFLAGS += -DMMCUTILS_EMULATOR
+LOCAL_MODULE := libmmcutils_host
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_STATIC_LIBRARY)
+
 endif	# TARGET_ARCH == arm
 endif	# !TARGET_SIMULATOR
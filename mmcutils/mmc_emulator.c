@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "mmcutils.h"
+
+#define MMC_DEVICENAME "/dev/block/mmcblk0"
+#define SECTOR_SIZE 512
+
+static char g_image[PATH_MAX];
+static unsigned int g_read_us = 0;   // per sector read
+static unsigned int g_write_us = 0;  // per sector written
+
+/* A partition is a window [start, start + size) onto the image. */
+typedef struct {
+    FILE *image;
+    off64_t start;
+    off64_t size;
+    off64_t pos;
+} Window;
+
+static void delay(unsigned int us_per_sector, size_t bytes)
+{
+    unsigned long long us = (unsigned long long) us_per_sector *
+            ((bytes + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    if (us == 0) return;
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) ;
+}
+
+static ssize_t window_read(void *cookie, char *buf, size_t size)
+{
+    Window *w = cookie;
+    if (w->pos >= w->size) return 0;
+    if ((off64_t) size > w->size - w->pos) size = w->size - w->pos;
+    if (fseeko64(w->image, w->start + w->pos, SEEK_SET) < 0) return -1;
+    size_t n = fread(buf, 1, size, w->image);
+    if (n == 0 && ferror(w->image)) return -1;
+    w->pos += n;
+    delay(g_read_us, n);
+    return n;
+}
+
+static ssize_t window_write(void *cookie, const char *buf, size_t size)
+{
+    Window *w = cookie;
+    if ((off64_t) size > w->size - w->pos) {
+        errno = ENOSPC;
+        return w->pos < w->size ? 0 : -1;
+    }
+    if (fseeko64(w->image, w->start + w->pos, SEEK_SET) < 0) return -1;
+    size_t n = fwrite(buf, 1, size, w->image);
+    if (n == 0) return -1;
+    w->pos += n;
+    delay(g_write_us, n);
+    return n;
+}
+
+static int window_seek(void *cookie, off64_t *offset, int whence)
+{
+    Window *w = cookie;
+    off64_t pos;
+    switch (whence) {
+    case SEEK_SET: pos = *offset; break;
+    case SEEK_CUR: pos = w->pos + *offset; break;
+    case SEEK_END: pos = w->size + *offset; break;
+    default: errno = EINVAL; return -1;
+    }
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    w->pos = *offset = pos;
+    return 0;
+}
+
+static int window_close(void *cookie)
+{
+    Window *w = cookie;
+    int ret = fclose(w->image);
+    free(w);
+    return ret;
+}
+
+#ifndef __GLIBC__
+/* bionic only has the BSD funopen() interface. */
+static int window_funread(void *cookie, char *buf, int size)
+{
+    return window_read(cookie, buf, size);
+}
+
+static int window_funwrite(void *cookie, const char *buf, int size)
+{
+    return window_write(cookie, buf, size);
+}
+
+static fpos_t window_funseek(void *cookie, fpos_t offset, int whence)
+{
+    off64_t pos = offset;
+    return window_seek(cookie, &pos, whence) < 0 ? -1 : (fpos_t) pos;
+}
+#endif
+
+static FILE *open_window(const char *mode, off64_t start, off64_t size)
+{
+    // Partitions are opened "r" or "w"; either way the rest of the image
+    // must be left alone, so always open it for update.
+    Window *w = calloc(1, sizeof(*w));
+    if (w == NULL) return NULL;
+    w->image = fopen(g_image, mode[0] == 'r' && mode[1] != '+' ? "r" : "r+");
+    if (w->image == NULL) {
+        free(w);
+        return NULL;
+    }
+    w->start = start;
+    w->size = size;
+
+#ifdef __GLIBC__
+    cookie_io_functions_t io = {
+        window_read, window_write, window_seek, window_close
+    };
+    FILE *f = fopencookie(w, mode, io);
+#else
+    FILE *f = funopen(w, window_funread, window_funwrite, window_funseek,
+                      window_close);
+#endif
+    if (f == NULL) window_close(w);
+    return f;
+}
+
+static FILE *emu_open(const char *path, const char *mode)
+{
+    if (!strcmp(path, MMC_DEVICENAME)) {
+        return open_window(mode, 0, (off64_t) 1 << 62);
+    }
+
+    const MmcPartition *p = mmc_find_partition_by_device_index(path);
+    if (p == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+    return open_window(mode, (off64_t) p->dfirstsec * SECTOR_SIZE,
+                       (off64_t) p->dsize * SECTOR_SIZE);
+}
+
+static const MmcBackend g_emulator_backend = {
+    emu_open,
+};
+
+int mmc_emulator_load(const char *image_path)
+{
+    if (access(image_path, R_OK | W_OK) < 0 ||
+            strlen(image_path) >= sizeof(g_image)) {
+        fprintf(stderr, "mmc emulator: can't use %s\n", image_path);
+        return -1;
+    }
+    strcpy(g_image, image_path);
+
+    const char *latency = getenv("MMC_EMULATOR_LATENCY");
+    if (latency != NULL) {
+        sscanf(latency, "%u %u", &g_read_us, &g_write_us);
+    }
+
+    mmc_set_backend(&g_emulator_backend);
+    return 0;
+}
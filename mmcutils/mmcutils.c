@@ -74,6 +74,31 @@ static MmcState g_mmc_state = {
 
 #define MMC_DEVICENAME "/dev/block/mmcblk0"
 
+static const MmcBackend g_stdio_backend = {
+    fopen,
+};
+
+static const MmcBackend *g_backend = NULL;
+
+void
+mmc_set_backend(const MmcBackend *backend) {
+    g_backend = backend;
+}
+
+static const MmcBackend *
+backend(void) {
+    if (g_backend == NULL) {
+#ifdef MMCUTILS_EMULATOR
+        const char *image = getenv("MMC_EMULATOR");
+        if (image != NULL && mmc_emulator_load(image) == 0) {
+            return g_backend;
+        }
+#endif
+        g_backend = &g_stdio_backend;
+    }
+    return g_backend;
+}
+
 static void
 mmc_partition_name (MmcPartition *mbr, unsigned int type) {
     switch(type)
@@ -144,7 +169,7 @@ mmc_read_mbr (const char *device, MmcPartition *mbr) {
     unsigned int EBR_current_sec;
     int ret = -1;
 
-    fd = fopen(device, "r");
+    fd = backend()->open(device, "r");
     if(fd == NULL)
     {
         printf("Can't open device: \"%s\"\n", device);
@@ -341,7 +366,7 @@ mmc_find_partition_by_device_index(const char *device_index)
         for (i = 0; i < g_mmc_state.partitions_allocd; i++) {
             MmcPartition *p = &g_mmc_state.partitions[i];
 		if (p->device_index !=NULL && p->name != NULL) {
-                if (strcmp(device_index, device_index) == 0) {
+                if (strcmp(p->device_index, device_index) == 0) {
                     return p;
                 }
             }
@@ -532,7 +557,7 @@ mmc_raw_copy (const MmcPartition *partition, char *in_file) {
     if (in == NULL)
         goto ERROR3;
     
-    out = fopen ( out_file,  "w" );
+    out = backend()->open ( out_file,  "w" );
     if (out == NULL)
         goto ERROR2;
     
@@ -557,7 +582,8 @@ mmc_raw_copy (const MmcPartition *partition, char *in_file) {
     }
 
 
-   fsync(out);
+   fflush(out);
+   fsync(fileno(out));
     ret = 0;
 ERROR1:
     fclose ( out );
@@ -30,6 +30,8 @@
 #ifndef MMCUTILS_H_
 #define MMCUTILS_H_
 
+#include <stdio.h>
+
 /* Some useful define used to access the MBR/EBR table */
 #define BLOCK_SIZE                0x200
 #define TABLE_ENTRY_0             0x1BE
@@ -125,6 +127,26 @@ typedef struct {
 	unsigned dsize;
 } MmcPartition;
 
+/* Where the raw block device gets opened.  The default is plain fopen();
+ * mmc_emulator_load() swaps in a file-backed one for host testing.
+ */
+typedef struct {
+    FILE *(*open)(const char *path, const char *mode);
+} MmcBackend;
+
+void mmc_set_backend(const MmcBackend *backend);
+
+/* Back /dev/block/mmcblk0 with the existing disk image at |image_path|.
+ * /dev/block/mmcblk0pN opens a window onto the image covering partition
+ * N as described by its MBR/EBRs.  Per-operation delays can be set with
+ * the MMC_EMULATOR_LATENCY environment variable ("<read-us> <write-us>",
+ * charged per 512-byte sector).  In builds with -DMMCUTILS_EMULATOR,
+ * mmc_scan_partitions() loads this automatically when MMC_EMULATOR is
+ * set.  Only the host libmmcutils_host builds the emulator; libmmcutils
+ * on the device always opens the real block devices.
+ */
+int mmc_emulator_load(const char *image_path);
+
 /* Functions */
 int mmc_scan_partitions();
 const MmcPartition *mmc_find_partition_by_name(const char *name);
@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <mtd/mtd-user.h>
+
+#include "mtdutils.h"
+
+#define EMU_MAX_PARTITIONS 32
+#define EMU_MAX_FDS 64
+#define EMU_DEFAULT_WRITESIZE 2048
+
+typedef struct {
+    unsigned int corrected;
+    unsigned int failed;
+} EmuEcc;
+
+typedef struct {
+    char name[64];
+    char image[256];
+    loff_t size;
+    unsigned int erasesize;
+    unsigned int writesize;
+    unsigned char *bad;     // one byte per erase block
+    EmuEcc *ecc;            // injected per read of each erase block
+    struct mtd_ecc_stats stats;
+} EmuPartition;
+
+static EmuPartition g_parts[EMU_MAX_PARTITIONS];
+static int g_num_parts = 0;
+
+static struct {
+    unsigned int read_us;   // per page read
+    unsigned int write_us;  // per page written
+    unsigned int erase_us;  // per erase block
+} g_latency;
+
+/* Which partition each open emulated fd refers to; -1 for the fake
+ * /proc/mtd.  Partitions are erased and written from several threads at
+ * once, so the table and the ECC stats are only touched under g_lock.
+ */
+static struct {
+    int fd;
+    int part;
+} g_fds[EMU_MAX_FDS];
+static int g_num_fds = 0;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static EmuPartition *find_part(const char *name)
+{
+    int i;
+    for (i = 0; i < g_num_parts; ++i) {
+        if (!strcmp(g_parts[i].name, name)) return &g_parts[i];
+    }
+    return NULL;
+}
+
+static EmuPartition *part_for_fd(int fd)
+{
+    EmuPartition *p = NULL;
+    int i;
+    pthread_mutex_lock(&g_lock);
+    for (i = 0; i < g_num_fds; ++i) {
+        if (g_fds[i].fd == fd) {
+            if (g_fds[i].part >= 0) p = &g_parts[g_fds[i].part];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    return p;
+}
+
+static void delay(unsigned int us)
+{
+    if (us == 0) return;
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) ;
+}
+
+static unsigned int pages(const EmuPartition *p, size_t count)
+{
+    return (count + p->writesize - 1) / p->writesize;
+}
+
+/* Make the image exactly p->size bytes, filling anything new with 0xff
+ * (erased flash).
+ */
+static int prepare_image(const EmuPartition *p)
+{
+    int fd = open(p->image, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char ff[64 * 1024];
+    memset(ff, 0xff, sizeof(ff));
+    loff_t pos = st.st_size;
+    while (pos < p->size) {
+        size_t n = p->size - pos < (loff_t) sizeof(ff) ?
+                (size_t) (p->size - pos) : sizeof(ff);
+        if (pwrite64(fd, ff, n, pos) != (ssize_t) n) {
+            close(fd);
+            return -1;
+        }
+        pos += n;
+    }
+    int ret = ftruncate64(fd, p->size);
+    close(fd);
+    return ret;
+}
+
+static int parse_config(FILE *f)
+{
+    char line[512];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash != NULL) *hash = '\0';
+
+        char cmd[16], name[64], image[256];
+        unsigned long long size, a, b, c;
+        int n;
+        if (sscanf(line, " %15s", cmd) != 1) continue;
+
+        if (!strcmp(cmd, "partition")) {
+            n = sscanf(line, " %*s %63s %255s %lli %lli %lli",
+                       name, image, &size, &a, &b);
+            if (n < 4 || g_num_parts == EMU_MAX_PARTITIONS ||
+                    a == 0 || size % a != 0) goto bad;
+            EmuPartition *p = &g_parts[g_num_parts];
+            memset(p, 0, sizeof(*p));
+            strcpy(p->name, name);
+            strcpy(p->image, image);
+            p->size = size;
+            p->erasesize = a;
+            p->writesize = n == 5 ? b : EMU_DEFAULT_WRITESIZE;
+            p->bad = calloc(size / a, 1);
+            p->ecc = calloc(size / a, sizeof(EmuEcc));
+            if (p->bad == NULL || p->ecc == NULL) return -1;
+            if (prepare_image(p) < 0) {
+                fprintf(stderr, "mtd emulator: can't prepare %s (%s)\n",
+                        image, strerror(errno));
+                return -1;
+            }
+            ++g_num_parts;
+        } else if (!strcmp(cmd, "bad") || !strcmp(cmd, "ecc")) {
+            n = sscanf(line, " %*s %63s %lli %lli %lli", name, &a, &b, &c);
+            EmuPartition *p = find_part(name);
+            if (p == NULL || a >= p->size / p->erasesize) goto bad;
+            if (!strcmp(cmd, "bad")) {
+                if (n != 2) goto bad;
+                p->bad[a] = 1;
+            } else {
+                if (n != 4) goto bad;
+                p->ecc[a].corrected = b;
+                p->ecc[a].failed = c;
+            }
+        } else if (!strcmp(cmd, "latency")) {
+            if (sscanf(line, " %*s %lli %lli %lli", &a, &b, &c) != 3) goto bad;
+            g_latency.read_us = a;
+            g_latency.write_us = b;
+            g_latency.erase_us = c;
+        } else {
+            goto bad;
+        }
+        continue;
+
+bad:
+        fprintf(stderr, "mtd emulator: bad config line %d\n", lineno);
+        return -1;
+    }
+    return 0;
+}
+
+static int track_fd(int fd, int part)
+{
+    pthread_mutex_lock(&g_lock);
+    if (g_num_fds == EMU_MAX_FDS) {
+        pthread_mutex_unlock(&g_lock);
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    g_fds[g_num_fds].fd = fd;
+    g_fds[g_num_fds].part = part;
+    ++g_num_fds;
+    pthread_mutex_unlock(&g_lock);
+    return fd;
+}
+
+/* /proc/mtd is served from an unlinked temporary file. */
+static int open_proc_mtd(void)
+{
+    FILE *f = tmpfile();
+    if (f == NULL) return -1;
+    fprintf(f, "dev:    size   erasesize  name\n");
+    int i;
+    for (i = 0; i < g_num_parts; ++i) {
+        fprintf(f, "mtd%d: %08llx %08x \"%s\"\n", i,
+                (unsigned long long) g_parts[i].size,
+                g_parts[i].erasesize, g_parts[i].name);
+    }
+    fflush(f);
+    int fd = dup(fileno(f));
+    fclose(f);
+    if (fd < 0) return -1;
+    lseek(fd, 0, SEEK_SET);
+    return track_fd(fd, -1);
+}
+
+static int emu_open(const char *path, int flags)
+{
+    if (!strcmp(path, "/proc/mtd")) return open_proc_mtd();
+
+    int index;
+    char extra;
+    if (sscanf(path, "/dev/mtd/mtd%d%c", &index, &extra) != 1 ||
+            index < 0 || index >= g_num_parts) {
+        errno = ENOENT;
+        return -1;
+    }
+    int fd = open(g_parts[index].image, flags & O_ACCMODE);
+    if (fd < 0) return -1;
+    return track_fd(fd, index);
+}
+
+static int emu_close(int fd)
+{
+    int i;
+    pthread_mutex_lock(&g_lock);
+    for (i = 0; i < g_num_fds; ++i) {
+        if (g_fds[i].fd == fd) {
+            g_fds[i] = g_fds[--g_num_fds];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    return close(fd);
+}
+
+/* Fail with EIO if [pos, pos + count) touches a bad block. */
+static int check_bad(const EmuPartition *p, loff_t pos, size_t count)
+{
+    loff_t block;
+    for (block = pos / p->erasesize;
+         count > 0 && block * p->erasesize < pos + (loff_t) count; ++block) {
+        if (block < p->size / p->erasesize && p->bad[block]) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static ssize_t emu_read(int fd, void *buf, size_t count)
+{
+    EmuPartition *p = part_for_fd(fd);
+    if (p == NULL) return read(fd, buf, count);
+
+    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    ssize_t n = read(fd, buf, count);
+    if (n <= 0) return n;
+
+    loff_t block;
+    pthread_mutex_lock(&g_lock);
+    for (block = pos / p->erasesize; block * p->erasesize < pos + n; ++block) {
+        p->stats.corrected += p->ecc[block].corrected;
+        p->stats.failed += p->ecc[block].failed;
+    }
+    pthread_mutex_unlock(&g_lock);
+    delay(g_latency.read_us * pages(p, n));
+    return n;
+}
+
+static ssize_t emu_write(int fd, const void *buf, size_t count)
+{
+    EmuPartition *p = part_for_fd(fd);
+    if (p == NULL) return write(fd, buf, count);
+
+    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    if (pos + (loff_t) count > p->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (check_bad(p, pos, count) < 0) return -1;
+
+    // Programming NAND can only turn 1s into 0s.
+    unsigned char *merged = malloc(count);
+    if (merged == NULL) return -1;
+    if (pread64(fd, merged, count, pos) != (ssize_t) count) {
+        free(merged);
+        errno = EIO;
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < count; ++i) merged[i] &= ((const unsigned char *) buf)[i];
+    ssize_t n = write(fd, merged, count);
+    free(merged);
+
+    if (n > 0) delay(g_latency.write_us * pages(p, n));
+    return n;
+}
+
+static loff_t emu_lseek(int fd, loff_t offset, int whence)
+{
+    return lseek64(fd, offset, whence);
+}
+
+static int emu_erase(int fd, EmuPartition *p,
+        const struct erase_info_user *erase)
+{
+    if (erase->start % p->erasesize || erase->length % p->erasesize ||
+            (loff_t) erase->start + erase->length > p->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (check_bad(p, erase->start, erase->length) < 0) return -1;
+
+    char ff[64 * 1024];
+    memset(ff, 0xff, sizeof(ff));
+    loff_t pos = erase->start, end = (loff_t) erase->start + erase->length;
+    while (pos < end) {
+        size_t n = end - pos < (loff_t) sizeof(ff) ?
+                (size_t) (end - pos) : sizeof(ff);
+        if (pwrite64(fd, ff, n, pos) != (ssize_t) n) return -1;
+        pos += n;
+    }
+    delay(g_latency.erase_us * (erase->length / p->erasesize));
+    return 0;
+}
+
+static int emu_ioctl(int fd, int request, void *arg)
+{
+    EmuPartition *p = part_for_fd(fd);
+    if (p == NULL) {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    loff_t block;
+    switch (request) {
+    case MEMGETINFO: {
+        struct mtd_info_user *info = arg;
+        memset(info, 0, sizeof(*info));
+        info->type = MTD_NANDFLASH;
+        info->flags = MTD_CAP_NANDFLASH;
+        info->size = p->size;
+        info->erasesize = p->erasesize;
+        info->writesize = p->writesize;
+        info->oobsize = p->writesize / 32;
+        return 0;
+    }
+    case MEMGETBADBLOCK:
+    case MEMSETBADBLOCK:
+        block = *(loff_t *) arg / p->erasesize;
+        if (*(loff_t *) arg < 0 || block >= p->size / p->erasesize) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (request == MEMSETBADBLOCK) {
+            p->bad[block] = 1;
+            return 0;
+        }
+        return p->bad[block];
+    case MEMERASE:
+        return emu_erase(fd, p, arg);
+    case ECCGETSTATS:
+        pthread_mutex_lock(&g_lock);
+        *(struct mtd_ecc_stats *) arg = p->stats;
+        pthread_mutex_unlock(&g_lock);
+        return 0;
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+static const MtdBackend g_emulator_backend = {
+    emu_open,
+    emu_close,
+    emu_read,
+    emu_write,
+    emu_lseek,
+    emu_ioctl,
+};
+
+int mtd_emulator_load(const char *config_path)
+{
+    FILE *f = fopen(config_path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "mtd emulator: can't open %s (%s)\n",
+                config_path, strerror(errno));
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < g_num_parts; ++i) {
+        free(g_parts[i].bad);
+        free(g_parts[i].ecc);
+    }
+    g_num_parts = 0;
+    memset(&g_latency, 0, sizeof(g_latency));
+
+    int ret = parse_config(f);
+    fclose(f);
+    if (ret < 0) return -1;
+
+    mtd_set_backend(&g_emulator_backend);
+    return 0;
+}
@@ -22,32 +22,75 @@
 #include <errno.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
+#include <time.h>
 #include <mtd/mtd-user.h>
 #undef NDEBUG
 #include <assert.h>
 
 #include "mtdutils.h"
 
+/* Latency histogram bucket i counts operations that took
+ * [2^i, 2^(i+1)) microseconds; the last bucket catches everything slower.
+ */
+#define MTD_LATENCY_BUCKETS 24
+
+typedef struct {
+    unsigned int count;
+    unsigned long long total_us;
+    unsigned int buckets[MTD_LATENCY_BUCKETS];
+} MtdLatency;
+
+typedef struct {
+    unsigned int corrected;
+    unsigned int failed;
+} MtdBlockEcc;
+
+typedef struct {
+    unsigned int ecc_corrected;
+    unsigned int ecc_failed;
+    unsigned int zero_skips;
+    unsigned int bad_skips;
+    unsigned int write_failures;
+    unsigned int erase_failures;    // blocks the driver wouldn't erase
+    MtdLatency read;
+    MtdLatency write;
+    MtdLatency erase;           // single blocks
+    MtdLatency erase_range;     // runs of blocks merged into one MEMERASE
+    MtdBlockEcc *block_ecc;  // per erase block, allocated on first ECC event
+} MtdStats;
+
 struct MtdPartition {
     int device_index;
     unsigned int size;
     unsigned int erase_size;
     char *name;
+
+    /* One bit per erase block, set if the block is bad.  Built lazily
+     * the first time a read, write or erase touches the partition.
+     */
+    unsigned char *bad_block_map;
+
+    /* Flash-health counters accumulated over the life of the process.
+     */
+    MtdStats stats;
 };
 
 struct MtdReadContext {
-    const MtdPartition *partition;
+    MtdPartition *partition;
     char *buffer;
     size_t consumed;
     int fd;
 };
 
 struct MtdWriteContext {
-    const MtdPartition *partition;
+    MtdPartition *partition;
     char *buffer;
     size_t stored;
     int fd;
 
+    /* Blocks that failed to write, kept here only if the partition's
+     * bad-block map couldn't be built to record them in.
+     */
     off_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
@@ -67,6 +110,60 @@ static MtdState g_mtd_state = {
 
 #define MTD_PROC_FILENAME   "/proc/mtd"
 
+static int kernel_open(const char *path, int flags)
+{
+    return open(path, flags);
+}
+
+static loff_t kernel_lseek(int fd, loff_t offset, int whence)
+{
+    return lseek64(fd, offset, whence);
+}
+
+static int kernel_ioctl(int fd, int request, void *arg)
+{
+    return ioctl(fd, request, arg);
+}
+
+static const MtdBackend g_kernel_backend = {
+    kernel_open,
+    close,
+    read,
+    write,
+    kernel_lseek,
+    kernel_ioctl,
+};
+
+static const MtdBackend *g_backend = NULL;
+
+void mtd_set_backend(const MtdBackend *backend)
+{
+    g_backend = backend;
+}
+
+static const MtdBackend *backend(void)
+{
+    if (g_backend == NULL) {
+#ifdef MTDUTILS_EMULATOR
+        const char *config = getenv("MTD_EMULATOR");
+        if (config != NULL && mtd_emulator_load(config) == 0) {
+            return g_backend;
+        }
+#endif
+        g_backend = &g_kernel_backend;
+    }
+    return g_backend;
+}
+
+/* Callers only ever see partitions as const, but the bad-block map and
+ * stats hanging off them are ours to update.  Every partition lives in
+ * g_mtd_state, so find the table entry again instead of casting.
+ */
+static MtdPartition *partition_entry(const MtdPartition *partition)
+{
+    return &g_mtd_state.partitions[partition->device_index];
+}
+
 int
 mtd_scan_partitions()
 {
@@ -99,17 +196,20 @@ mtd_scan_partitions()
             free(p->name);
             p->name = NULL;
         }
+        /* Don't free bad_block_map here; it is kept across rescans
+         * as long as the partition geometry doesn't change.
+         */
         p->device_index = -1;
     }
 
     /* Open and read the file contents.
      */
-    fd = open(MTD_PROC_FILENAME, O_RDONLY);
+    fd = backend()->open(MTD_PROC_FILENAME, O_RDONLY);
     if (fd < 0) {
         goto bail;
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
+    nbytes = backend()->read(fd, buf, sizeof(buf) - 1);
+    backend()->close(fd);
     if (nbytes < 0) {
         goto bail;
     }
@@ -141,6 +241,13 @@ mtd_scan_partitions()
          */
         if (matches == 4) {
             MtdPartition *p = &g_mtd_state.partitions[mtdnum];
+            if (p->size != (unsigned int) mtdsize ||
+                    p->erase_size != (unsigned int) mtderasesize) {
+                free(p->bad_block_map);
+                p->bad_block_map = NULL;
+                free(p->stats.block_ecc);
+                memset(&p->stats, 0, sizeof(p->stats));
+            }
             p->device_index = mtdnum;
             p->size = mtdsize;
             p->erase_size = mtderasesize;
@@ -240,12 +347,12 @@ mtd_partition_info(const MtdPartition *partition,
 {
     char mtddevname[32];
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    int fd = open(mtddevname, O_RDONLY);
+    int fd = backend()->open(mtddevname, O_RDONLY);
     if (fd < 0) return -1;
 
     struct mtd_info_user mtd_info;
-    int ret = ioctl(fd, MEMGETINFO, &mtd_info);
-    close(fd);
+    int ret = backend()->ioctl(fd, MEMGETINFO, &mtd_info);
+    backend()->close(fd);
     if (ret < 0) return -1;
 
     if (total_size != NULL) *total_size = mtd_info.size;
@@ -267,46 +374,147 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
 
     char mtddevname[32];
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    ctx->fd = open(mtddevname, O_RDONLY);
+    ctx->fd = backend()->open(mtddevname, O_RDONLY);
     if (ctx->fd < 0) {
         free(ctx);
         free(ctx->buffer);
         return NULL;
     }
 
-    ctx->partition = partition;
+    ctx->partition = partition_entry(partition);
     ctx->consumed = partition->erase_size;
     return ctx;
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+/* Query every erase block of the partition once and remember which
+ * ones are bad.  Returns 0 on success, -1 if the map can't be built
+ * (in which case callers fall back to asking the driver directly).
+ */
+static int load_bad_block_map(MtdPartition *partition, int fd)
+{
+    const int blocks = partition->size / partition->erase_size;
+    unsigned char *map = calloc((blocks + 7) / 8, 1);
+    if (map == NULL) return -1;
+
+    int i;
+    for (i = 0; i < blocks; ++i) {
+        loff_t bpos = (loff_t) i * partition->erase_size;
+        if (backend()->ioctl(fd, MEMGETBADBLOCK, &bpos) > 0) {
+            map[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    partition->bad_block_map = map;
+    return 0;
+}
+
+static int block_is_bad(MtdPartition *partition, int fd, loff_t pos)
+{
+    if (partition->bad_block_map == NULL &&
+            load_bad_block_map(partition, fd) < 0) {
+        loff_t bpos = pos;
+        return backend()->ioctl(fd, MEMGETBADBLOCK, &bpos) > 0;
+    }
+    const int i = pos / partition->erase_size;
+    return (partition->bad_block_map[i / 8] >> (i % 8)) & 1;
+}
+
+/* Returns -1 if there's no map to record the block in.
+ */
+static int mark_bad_block(MtdPartition *partition, int fd, loff_t pos)
+{
+    if (partition->bad_block_map == NULL &&
+            load_bad_block_map(partition, fd) < 0) {
+        return -1;
+    }
+    const int i = pos / partition->erase_size;
+    partition->bad_block_map[i / 8] |= 1 << (i % 8);
+    return 0;
+}
+
+static MtdStats *partition_stats(MtdPartition *partition)
+{
+    return &partition->stats;
+}
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void record_latency(MtdLatency *latency, long long start_us)
+{
+    long long us = now_us() - start_us;
+    int bucket = 0;
+    latency->count++;
+    latency->total_us += us;
+    while (us > 1 && bucket < MTD_LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    latency->buckets[bucket]++;
+}
+
+static void record_ecc(MtdPartition *partition, loff_t pos,
+        unsigned int corrected, unsigned int failed)
+{
+    MtdStats *stats = partition_stats(partition);
+    if (corrected == 0 && failed == 0) return;
+    stats->ecc_corrected += corrected;
+    stats->ecc_failed += failed;
+
+    const int blocks = partition->size / partition->erase_size;
+    if (stats->block_ecc == NULL) {
+        stats->block_ecc = calloc(blocks, sizeof(MtdBlockEcc));
+        if (stats->block_ecc == NULL) return;
+    }
+    const int i = pos / partition->erase_size;
+    stats->block_ecc[i].corrected += corrected;
+    stats->block_ecc[i].failed += failed;
+}
+
+static int read_block(MtdPartition *partition, int fd, char *data)
 {
+    MtdStats *stats = partition_stats(partition);
     struct mtd_ecc_stats before, after;
-    if (ioctl(fd, ECCGETSTATS, &before)) {
+    if (backend()->ioctl(fd, ECCGETSTATS, &before)) {
         fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
         return -1;
     }
 
-    loff_t pos = lseek64(fd, 0, SEEK_CUR);
+    loff_t pos = backend()->lseek(fd, 0, SEEK_CUR);
 
     ssize_t size = partition->erase_size;
-    int mgbb;
 
-    while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
+    for (; pos + size <= (int) partition->size; pos += partition->erase_size) {
+        if (block_is_bad(partition, fd, pos)) {
+            fprintf(stderr, "mtd: not reading bad block at 0x%08llx\n", pos);
+            stats->bad_skips++;
+            continue;
+        }
+
+        long long start = now_us();
+        if (backend()->lseek(fd, pos, SEEK_SET) != pos ||
+                backend()->read(fd, data, size) != size) {
             fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
                     pos, strerror(errno));
-        } else if (ioctl(fd, ECCGETSTATS, &after)) {
+            continue;
+        }
+        record_latency(&stats->read, start);
+
+        if (backend()->ioctl(fd, ECCGETSTATS, &after)) {
             fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
             return -1;
-        } else if (after.failed != before.failed) {
+        }
+        record_ecc(partition, pos, after.corrected - before.corrected,
+                after.failed - before.failed);
+
+        if (after.failed != before.failed) {
             fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
                     after.corrected - before.corrected,
                     after.failed - before.failed, pos);
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
         } else {
             int i;
             for (i = 0; i < size; ++i) {
@@ -316,9 +524,9 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
             }
             fprintf(stderr, "mtd: read all-zero block at 0x%08llx; skipping\n",
                     pos);
+            stats->zero_skips++;
         }
-
-        pos += partition->erase_size;
+        before = after;
     }
 
     errno = ENOSPC;
@@ -360,7 +568,7 @@ ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 
 void mtd_read_close(MtdReadContext *ctx)
 {
-    close(ctx->fd);
+    backend()->close(ctx->fd);
     free(ctx->buffer);
     free(ctx);
 }
@@ -370,10 +578,6 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
     if (ctx == NULL) return NULL;
 
-    ctx->bad_block_offsets = NULL;
-    ctx->bad_block_alloc = 0;
-    ctx->bad_block_count = 0;
-
     ctx->buffer = malloc(partition->erase_size);
     if (ctx->buffer == NULL) {
         free(ctx);
@@ -382,41 +586,48 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 
     char mtddevname[32];
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
-    ctx->fd = open(mtddevname, O_RDWR);
+    ctx->fd = backend()->open(mtddevname, O_RDWR);
     if (ctx->fd < 0) {
         free(ctx->buffer);
         free(ctx);
         return NULL;
     }
 
-    ctx->partition = partition;
+    ctx->partition = partition_entry(partition);
     ctx->stored = 0;
+    ctx->bad_block_offsets = NULL;
+    ctx->bad_block_alloc = 0;
+    ctx->bad_block_count = 0;
     return ctx;
 }
 
 static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
+    if (mark_bad_block(ctx->partition, ctx->fd, pos) == 0) return;
     if (ctx->bad_block_count + 1 > ctx->bad_block_alloc) {
-        ctx->bad_block_alloc = (ctx->bad_block_alloc*2) + 1;
-        ctx->bad_block_offsets = realloc(ctx->bad_block_offsets,
-                                         ctx->bad_block_alloc * sizeof(off_t));
+        int alloc = (ctx->bad_block_alloc*2) + 1;
+        off_t *offsets = realloc(ctx->bad_block_offsets,
+                                 alloc * sizeof(off_t));
+        if (offsets == NULL) return;
+        ctx->bad_block_offsets = offsets;
+        ctx->bad_block_alloc = alloc;
     }
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
 static int write_block(MtdWriteContext *ctx, const char *data)
 {
-    const MtdPartition *partition = ctx->partition;
+    MtdPartition *partition = ctx->partition;
+    MtdStats *stats = partition_stats(partition);
     int fd = ctx->fd;
 
-    off_t pos = lseek(fd, 0, SEEK_CUR);
+    off_t pos = backend()->lseek(fd, 0, SEEK_CUR);
     if (pos == (off_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
     while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        if (ioctl(fd, MEMGETBADBLOCK, &bpos) > 0) {
-            add_bad_block_offset(ctx, pos);
+        if (block_is_bad(partition, fd, pos)) {
             fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", pos);
+            stats->bad_skips++;
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
@@ -426,20 +637,27 @@ static int write_block(MtdWriteContext *ctx, const char *data)
         erase_info.length = size;
         int retry;
         for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+            long long start = now_us();
+            if (backend()->ioctl(fd, MEMERASE, &erase_info) < 0) {
                 fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
                         pos, strerror(errno));
+                stats->erase_failures++;
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+            record_latency(&stats->erase, start);
+
+            start = now_us();
+            if (backend()->lseek(fd, pos, SEEK_SET) != pos ||
+                backend()->write(fd, data, size) != size) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
+            } else {
+                record_latency(&stats->write, start);
             }
 
             char verify[size];
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
+            if (backend()->lseek(fd, pos, SEEK_SET) != pos ||
+                backend()->read(fd, verify, size) != size) {
                 fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
@@ -458,8 +676,9 @@ static int write_block(MtdWriteContext *ctx, const char *data)
 
         // Try to erase it once more as we give up on this block
         add_bad_block_offset(ctx, pos);
+        stats->write_failures++;
         fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
-        ioctl(fd, MEMERASE, &erase_info);
+        backend()->ioctl(fd, MEMERASE, &erase_info);
         pos += partition->erase_size;
     }
 
@@ -497,6 +716,39 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
     return wrote;
 }
 
+/* Erase a run of good blocks with one ioctl.  If the driver rejects
+ * the whole range, retry it a block at a time so the failure is
+ * pinned to the block that caused it.  A range's latency goes in its
+ * own histogram, as it covers any number of blocks.
+ */
+static void erase_range(MtdWriteContext *ctx, off_t start, off_t length)
+{
+    if (length <= 0) return;
+
+    MtdStats *stats = partition_stats(ctx->partition);
+    long long start_us = now_us();
+    struct erase_info_user erase_info;
+    erase_info.start = start;
+    erase_info.length = length;
+    if (backend()->ioctl(ctx->fd, MEMERASE, &erase_info) >= 0) {
+        record_latency(&stats->erase_range, start_us);
+        return;
+    }
+
+    off_t pos;
+    for (pos = start; pos < start + length; pos += ctx->partition->erase_size) {
+        erase_info.start = pos;
+        erase_info.length = ctx->partition->erase_size;
+        start_us = now_us();
+        if (backend()->ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
+            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+            stats->erase_failures++;
+        } else {
+            record_latency(&stats->erase, start_us);
+        }
+    }
+}
+
 off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 {
     // Zero-pad and write any pending data to get us to a block boundary
@@ -507,7 +759,7 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         ctx->stored = 0;
     }
 
-    off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
+    off_t pos = backend()->lseek(ctx->fd, 0, SEEK_CUR);
     if ((off_t) pos == (off_t) -1) return pos;
 
     const int total = (ctx->partition->size - pos) / ctx->partition->erase_size;
@@ -517,23 +769,21 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         return -1;
     }
 
-    // Erase the specified number of blocks
+    // Erase the specified number of blocks, merging runs of good blocks
+    // into a single MEMERASE and splitting only around bad ones.
+    off_t run_start = pos;
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (block_is_bad(ctx->partition, ctx->fd, pos)) {
+            erase_range(ctx, run_start, pos - run_start);
             fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
+            partition_stats(ctx->partition)->bad_skips++;
             pos += ctx->partition->erase_size;
+            run_start = pos;
             continue;  // Don't try to erase known factory-bad blocks.
         }
-
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = ctx->partition->erase_size;
-        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
-        }
         pos += ctx->partition->erase_size;
     }
+    erase_range(ctx, run_start, pos - run_start);
 
     return pos;
 }
@@ -543,7 +793,7 @@ int mtd_write_close(MtdWriteContext *ctx)
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
-    if (close(ctx->fd)) r = -1;
+    if (backend()->close(ctx->fd)) r = -1;
     free(ctx->bad_block_offsets);
     free(ctx->buffer);
     free(ctx);
@@ -554,17 +804,117 @@ int mtd_write_close(MtdWriteContext *ctx)
  * might be pos itself).
  */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
-    int i;
-    for (i = 0; i < ctx->bad_block_count; ++i) {
-        if (ctx->bad_block_offsets[i] == pos) {
-            pos += ctx->partition->erase_size;
-        } else if (ctx->bad_block_offsets[i] > pos) {
-            return pos;
+    MtdPartition *partition = ctx->partition;
+    int i = 0;
+    while (pos + partition->erase_size <= partition->size) {
+        while (i < ctx->bad_block_count && ctx->bad_block_offsets[i] < pos) {
+            ++i;
+        }
+        if (!block_is_bad(partition, ctx->fd, pos) &&
+                (i == ctx->bad_block_count ||
+                 ctx->bad_block_offsets[i] != pos)) {
+            break;
         }
+        pos += partition->erase_size;
     }
     return pos;
 }
 
+static void print_latency(FILE *out, const char *name, const char *op,
+        const MtdLatency *latency)
+{
+    int i;
+    fprintf(out, "latency %s %s count %u total_us %llu buckets", name, op,
+            latency->count, latency->total_us);
+    for (i = 0; i < MTD_LATENCY_BUCKETS; ++i) {
+        fprintf(out, " %u", latency->buckets[i]);
+    }
+    fprintf(out, "\n");
+}
+
+int mtd_write_stats_report(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL) return -1;
+
+    fprintf(out, "# mtdutils flash stats v2\n");
+    fprintf(out, "# latency buckets: [2^i, 2^(i+1)) us, i = 0..%d\n",
+            MTD_LATENCY_BUCKETS - 1);
+
+    int i;
+    for (i = 0; g_mtd_state.partitions != NULL &&
+                i < g_mtd_state.partitions_allocd; ++i) {
+        const MtdPartition *p = &g_mtd_state.partitions[i];
+        const MtdStats *stats = &p->stats;
+        if (p->device_index < 0 || p->name == NULL) continue;
+        if (stats->read.count == 0 && stats->write.count == 0 &&
+                stats->erase.count == 0 && stats->erase_range.count == 0 &&
+                stats->bad_skips == 0 && stats->erase_failures == 0) {
+            continue;
+        }
+
+        fprintf(out, "partition %s mtd %d erase_size %u "
+                "ecc_corrected %u ecc_failed %u zero_skips %u "
+                "bad_skips %u write_failures %u erase_failures %u\n",
+                p->name, p->device_index, p->erase_size,
+                stats->ecc_corrected, stats->ecc_failed, stats->zero_skips,
+                stats->bad_skips, stats->write_failures,
+                stats->erase_failures);
+        print_latency(out, p->name, "read", &stats->read);
+        print_latency(out, p->name, "write", &stats->write);
+        print_latency(out, p->name, "erase", &stats->erase);
+        print_latency(out, p->name, "erase_range", &stats->erase_range);
+
+        if (stats->block_ecc != NULL) {
+            const int blocks = p->size / p->erase_size;
+            int b;
+            for (b = 0; b < blocks; ++b) {
+                const MtdBlockEcc *ecc = &stats->block_ecc[b];
+                if (ecc->corrected == 0 && ecc->failed == 0) continue;
+                fprintf(out, "block %s 0x%08x corrected %u failed %u\n",
+                        p->name, b * p->erase_size,
+                        ecc->corrected, ecc->failed);
+            }
+        }
+    }
+
+    return fclose(out) ? -1 : 0;
+}
+
+void mtd_print_stats_summary(FILE *out)
+{
+    int i;
+    for (i = 0; g_mtd_state.partitions != NULL &&
+                i < g_mtd_state.partitions_allocd; ++i) {
+        const MtdPartition *p = &g_mtd_state.partitions[i];
+        const MtdStats *stats = &p->stats;
+        if (p->device_index < 0 || p->name == NULL) continue;
+        if (stats->read.count == 0 && stats->write.count == 0 &&
+                stats->erase.count == 0 && stats->erase_range.count == 0 &&
+                stats->erase_failures == 0) {
+            continue;
+        }
+
+        fprintf(out, "mtd: %s: %u reads (%llu ms), %u writes (%llu ms), "
+                "%u block erases (%llu ms), %u range erases (%llu ms)\n",
+                p->name,
+                stats->read.count, stats->read.total_us / 1000,
+                stats->write.count, stats->write.total_us / 1000,
+                stats->erase.count, stats->erase.total_us / 1000,
+                stats->erase_range.count, stats->erase_range.total_us / 1000);
+        if (stats->ecc_corrected || stats->ecc_failed || stats->zero_skips ||
+                stats->bad_skips || stats->write_failures ||
+                stats->erase_failures) {
+            fprintf(out, "mtd: %s: ECC %u soft / %u hard, %u zero blocks, "
+                    "%u bad blocks skipped, %u write failures, "
+                    "%u erase failures\n", p->name,
+                    stats->ecc_corrected, stats->ecc_failed,
+                    stats->zero_skips, stats->bad_skips,
+                    stats->write_failures, stats->erase_failures);
+        }
+    }
+}
+
 int mtd_get_partition_device(const char *partition, char *device)
 {
     mtd_scan_partitions();
@@ -17,6 +17,7 @@
 #ifndef MTDUTILS_H_
 #define MTDUTILS_H_
 
+#include <stdio.h>
 #include <sys/types.h>  // for size_t, etc.
 
 typedef struct MtdPartition MtdPartition;
@@ -54,4 +55,52 @@ int mtd_write_close(MtdWriteContext *);
 
 int mtd_get_partition_device(const char *partition, char *device);
 
+/* ECC, bad-block and latency counters gathered by the read, write and
+ * erase calls above.  The report is a line-oriented machine-readable
+ * dump (per partition, per latency histogram, and per block that saw
+ * ECC events); the summary is a couple of human-readable lines per
+ * partition that has been touched.
+ */
+int mtd_write_stats_report(const char *path);
+void mtd_print_stats_summary(FILE *out);
+
+/* The device operations everything above is built on, with the same
+ * semantics as the system calls they're named after.  By default they
+ * go to the kernel's /proc/mtd and /dev/mtd/mtdN; a replacement (such
+ * as the emulator below) sees the same paths and ioctls.  Pass NULL to
+ * go back to the kernel.
+ */
+typedef struct {
+    int (*open)(const char *path, int flags);
+    int (*close)(int fd);
+    ssize_t (*read)(int fd, void *buf, size_t count);
+    ssize_t (*write)(int fd, const void *buf, size_t count);
+    loff_t (*lseek)(int fd, loff_t offset, int whence);
+    int (*ioctl)(int fd, int request, void *arg);
+} MtdBackend;
+
+void mtd_set_backend(const MtdBackend *backend);
+
+/* File-backed NAND emulator (mtd_emulator.c).  The config file has one
+ * directive per line; '#' starts a comment:
+ *
+ *     partition <name> <image-file> <size> <erasesize> [<writesize>]
+ *     bad <name> <block>
+ *     ecc <name> <block> <corrected> <failed>
+ *     latency <read-us-per-page> <write-us-per-page> <erase-us-per-block>
+ *
+ * Image files are created (erased, all 0xff) or grown as needed.  Bad
+ * blocks refuse writes and erases, "ecc" adds the given counts to
+ * ECCGETSTATS every time the block is read, and writes can only clear
+ * bits, as on real NAND.  In builds with -DMTDUTILS_EMULATOR,
+ * mtd_scan_partitions() loads the file named by the MTD_EMULATOR
+ * environment variable automatically, so code written against the kernel
+ * runs against it unchanged.  Only host targets (see bench/Android.mk)
+ * build the emulator; libmtdutils on the device always talks to the
+ * kernel, whatever the environment says.
+ *
+ * Returns 0 and switches mtdutils to the emulator, or -1 on error.
+ */
+int mtd_emulator_load(const char *config_path);
+
 #endif  // MTDUTILS_H_
@@ -0,0 +1,927 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "md5.h"
+#include "nrestore.h"
+#include "nverify.h"
+
+/* Each stage hands RESTORE_BLOCK_SIZE blocks to the next through a
+ * queue of at most RESTORE_QUEUE_DEPTH, so a job holds about a dozen
+ * megabytes however large the image.
+ */
+#define RESTORE_BLOCK_SIZE  (1024 * 1024)
+#define RESTORE_QUEUE_DEPTH 4
+#define RESTORE_MAX_VOLUMES 26      // .a to .z
+#define RESTORE_MAX_QUEUES  3
+
+enum {
+    RESTORE_RAW,        // write the image to a block device
+    RESTORE_TAR,        // unpack with ntar
+    RESTORE_YAFFS,      // unpack with unyaffs
+    RESTORE_CHECK,      // read and checksum only
+};
+
+typedef struct Block {
+    struct Block *next;
+    int volume;
+    bool endOfVolume;   // the volume's last block; may be empty
+    size_t len;
+    unsigned char data[RESTORE_BLOCK_SIZE];
+} Block;
+
+typedef struct {
+    Block *head;
+    Block *tail;
+    int count;
+    bool closed;        // nothing more will be pushed
+    pthread_cond_t changed;
+} BlockQueue;
+
+typedef struct {
+    char path[PATH_MAX];    // the file to read
+    char name[PATH_MAX];    // its name in the checksum list
+    bool compressed;
+    const VerifyEntry *sum; // NULL if the list doesn't have it
+} Volume;
+
+typedef struct {
+    const char *source;
+    const char *target;
+    char disk[32];
+    int kind;
+    Volume volumes[RESTORE_MAX_VOLUMES];
+    int volumeCount;
+    bool anyCompressed;
+    bool checking;          // hash the volumes with sums this pass
+    bool writing;           // false for the check-only pass of a raw image
+
+    pthread_mutex_t lock;   // guards the queues and failed
+    BlockQueue queues[RESTORE_MAX_QUEUES];
+    int queueCount;
+    bool failed;
+    long long written;
+} Job;
+
+typedef struct {
+    Job **jobs;
+    int count;
+} DiskWorker;
+
+/* Held around pipe() and fork() so that no child inherits another
+ * job's pipe before it's been marked close-on-exec.
+ */
+static pthread_mutex_t gForkLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+jobFail(Job *job, const char *fmt, ...)
+{
+    int i;
+    pthread_mutex_lock(&job->lock);
+    if (!job->failed) {
+        va_list ap;
+        job->failed = true;
+        fprintf(stderr, "nrestore: %s: ", job->source);
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+    }
+    for (i = 0; i < job->queueCount; i++) {
+        pthread_cond_broadcast(&job->queues[i].changed);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static Block *
+newBlock(Job *job, int volume)
+{
+    Block *b = malloc(sizeof(Block));
+    if (b == NULL) {
+        jobFail(job, "out of memory");
+        return NULL;
+    }
+    b->next = NULL;
+    b->volume = volume;
+    b->endOfVolume = false;
+    b->len = 0;
+    return b;
+}
+
+/* Returns -1 (having freed b) if the job has failed. */
+static int
+queuePush(Job *job, BlockQueue *q, Block *b)
+{
+    pthread_mutex_lock(&job->lock);
+    while (q->count >= RESTORE_QUEUE_DEPTH && !job->failed) {
+        pthread_cond_wait(&q->changed, &job->lock);
+    }
+    if (job->failed) {
+        pthread_mutex_unlock(&job->lock);
+        free(b);
+        return -1;
+    }
+    b->next = NULL;
+    if (q->tail != NULL) {
+        q->tail->next = b;
+    } else {
+        q->head = b;
+    }
+    q->tail = b;
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&job->lock);
+    return 0;
+}
+
+static void
+queueClose(Job *job, BlockQueue *q)
+{
+    pthread_mutex_lock(&job->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Returns NULL once the queue is closed and empty, or the job failed. */
+static Block *
+queuePop(Job *job, BlockQueue *q)
+{
+    Block *b = NULL;
+    pthread_mutex_lock(&job->lock);
+    while (q->head == NULL && !q->closed && !job->failed) {
+        pthread_cond_wait(&q->changed, &job->lock);
+    }
+    if (!job->failed && q->head != NULL) {
+        b = q->head;
+        q->head = b->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        q->count--;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return b;
+}
+
+static void
+queueFree(BlockQueue *q)
+{
+    while (q->head != NULL) {
+        Block *b = q->head;
+        q->head = b->next;
+        free(b);
+    }
+    q->tail = NULL;
+    q->count = 0;
+    q->closed = false;
+}
+
+static bool
+fileExists(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+static const char *
+baseName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash == NULL ? path : slash + 1;
+}
+
+/* Fills in vol for name, or its gzipped copy.  Returns false if
+ * neither exists.
+ */
+static bool
+findVolume(Volume *vol, const char *name)
+{
+    snprintf(vol->name, sizeof(vol->name), "%s", name);
+    snprintf(vol->path, sizeof(vol->path), "%s", name);
+    vol->compressed = false;
+    if (fileExists(vol->path)) {
+        return true;
+    }
+    snprintf(vol->path, sizeof(vol->path), "%s.gz", name);
+    vol->compressed = true;
+    return fileExists(vol->path);
+}
+
+/* Works out which files make up job->source: the file itself, or the
+ * volumes "source.a", "source.b", ... (each maybe gzipped) that
+ * nandroid-mobile.sh and Clockwork split large tars into.
+ */
+static int
+findVolumes(Job *job)
+{
+    char base[PATH_MAX];
+    size_t len = strlen(job->source);
+
+    snprintf(base, sizeof(base), "%s", job->source);
+    if (len > 2 && strcmp(job->source + len - 2, ".a") == 0) {
+        base[len - 2] = '\0';
+    } else if (findVolume(&job->volumes[0], job->source)) {
+        job->volumeCount = 1;
+        job->anyCompressed = job->volumes[0].compressed;
+        return 0;
+    }
+
+    char name[PATH_MAX];
+    int i;
+    for (i = 0; i < RESTORE_MAX_VOLUMES; i++) {
+        snprintf(name, sizeof(name), "%s.%c", base, 'a' + i);
+        if (!findVolume(&job->volumes[i], name)) {
+            break;
+        }
+        job->anyCompressed |= job->volumes[i].compressed;
+    }
+    job->volumeCount = i;
+    if (i == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+/* The directory an archive unpacks into.  Backups of whole partitions
+ * are made from / and hold "data/app/...", so they're restored to the
+ * rootfs, which is on no disk; the one they really write is that of the
+ * directory named like the archive ("data" for "data.ext4.tar"), if
+ * there is one.
+ */
+static void
+archiveDest(const Job *job, char *dest, size_t size)
+{
+    const char *name = baseName(job->source);
+    const char *dot = strchr(name + 1, '.');
+    char top[PATH_MAX];
+    struct stat st;
+
+    snprintf(dest, size, "%s", job->target);
+    if (dot == NULL || dot - name >= (int)sizeof(top)) {
+        return;
+    }
+    memcpy(top, name, dot - name);
+    top[dot - name] = '\0';
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", job->target, top);
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        snprintf(dest, size, "%s", path);
+    }
+}
+
+/* Which disk target is on, so that jobs only run together when they
+ * don't share one: "mmcblk0" for /dev/block/mmcblk0p25 or anything
+ * mounted from it.  All of the MTD partitions are one NAND chip.
+ */
+static void
+findDisk(Job *job)
+{
+    struct stat st;
+    char path[PATH_MAX];
+    char real[PATH_MAX];
+
+    if (job->kind == RESTORE_TAR) {
+        archiveDest(job, path, sizeof(path));
+    } else {
+        snprintf(path, sizeof(path), "%s", job->target);
+    }
+    if (job->kind == RESTORE_CHECK || stat(path, &st) != 0) {
+        strcpy(job->disk, "-");
+        return;
+    }
+    dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    snprintf(job->disk, sizeof(job->disk), "%u:%u", major(dev), minor(dev));
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+            major(dev), minor(dev));
+    if (realpath(path, real) == NULL) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/partition", real);
+    if (fileExists(path)) {
+        char *slash = strrchr(real, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+    }
+    if (strncmp(baseName(real), "mtdblock", 8) == 0) {
+        strcpy(job->disk, "mtd");
+    } else {
+        snprintf(job->disk, sizeof(job->disk), "%s", baseName(real));
+    }
+}
+
+static void *
+readStage(void *cookie)
+{
+    Job *job = (Job *)cookie;
+    BlockQueue *out = &job->queues[0];
+    int v;
+
+    for (v = 0; v < job->volumeCount; v++) {
+        Volume *vol = &job->volumes[v];
+        int fd = open(vol->path, O_RDONLY);
+        if (fd < 0) {
+            jobFail(job, "can't open %s (%s)", vol->path, strerror(errno));
+            return NULL;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        bool eof = false;
+        while (!eof) {
+            Block *b = newBlock(job, v);
+            if (b == NULL) {
+                close(fd);
+                return NULL;
+            }
+            while (b->len < RESTORE_BLOCK_SIZE) {
+                ssize_t n = read(fd, b->data + b->len,
+                        RESTORE_BLOCK_SIZE - b->len);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    jobFail(job, "can't read %s (%s)", vol->path,
+                            strerror(errno));
+                    free(b);
+                    close(fd);
+                    return NULL;
+                }
+                if (n == 0) {
+                    eof = true;
+                    break;
+                }
+                b->len += n;
+            }
+            b->endOfVolume = eof;
+            if (queuePush(job, out, b) < 0) {
+                close(fd);
+                return NULL;
+            }
+        }
+        close(fd);
+    }
+    queueClose(job, out);
+    return NULL;
+}
+
+/* Passes uncompressed volumes straight through. */
+static void *
+inflateStage(void *cookie)
+{
+    Job *job = (Job *)cookie;
+    BlockQueue *in = &job->queues[0];
+    BlockQueue *out = &job->queues[1];
+    z_stream zs;
+    bool started = false;
+    bool ended = false;
+    int current = -1;
+    Block *b;
+    Block *o = NULL;
+
+    memset(&zs, 0, sizeof(zs));
+    while ((b = queuePop(job, in)) != NULL) {
+        Volume *vol = &job->volumes[b->volume];
+        if (!vol->compressed) {
+            if (queuePush(job, out, b) < 0) {
+                goto exit;
+            }
+            continue;
+        }
+
+        if (b->volume != current) {
+            int ret = started ? inflateReset(&zs) :
+                    inflateInit2(&zs, 16 + MAX_WBITS);
+            if (ret != Z_OK) {
+                jobFail(job, "can't start gunzip (%d)", ret);
+                free(b);
+                goto exit;
+            }
+            started = true;
+            ended = false;
+            current = b->volume;
+        }
+
+        zs.next_in = b->data;
+        zs.avail_in = b->len;
+        bool full;
+        do {
+            if (o == NULL && (o = newBlock(job, b->volume)) == NULL) {
+                free(b);
+                goto exit;
+            }
+            zs.next_out = o->data + o->len;
+            zs.avail_out = RESTORE_BLOCK_SIZE - o->len;
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            o->len = RESTORE_BLOCK_SIZE - zs.avail_out;
+            if (ret == Z_STREAM_END) {
+                /* gzip allows several members one after another. */
+                if (zs.avail_in > 0) {
+                    inflateReset(&zs);
+                } else {
+                    ended = true;
+                }
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                jobFail(job, "%s is corrupt (%s)", vol->path,
+                        zs.msg != NULL ? zs.msg : "bad gzip data");
+                free(b);
+                goto exit;
+            }
+            full = o->len == RESTORE_BLOCK_SIZE;
+            if (full) {
+                Block *done = o;
+                o = NULL;
+                if (queuePush(job, out, done) < 0) {
+                    free(b);
+                    goto exit;
+                }
+            }
+        } while (zs.avail_in > 0 || full);
+
+        if (b->endOfVolume) {
+            if (!ended) {
+                jobFail(job, "%s is truncated", vol->path);
+                free(b);
+                goto exit;
+            }
+            if (o == NULL && (o = newBlock(job, b->volume)) == NULL) {
+                free(b);
+                goto exit;
+            }
+            o->endOfVolume = true;
+            Block *done = o;
+            o = NULL;
+            current = -1;
+            if (queuePush(job, out, done) < 0) {
+                free(b);
+                goto exit;
+            }
+        }
+        free(b);
+    }
+    queueClose(job, out);
+
+exit:
+    free(o);
+    if (started) {
+        inflateEnd(&zs);
+    }
+    return NULL;
+}
+
+/* Checks each volume's data against its sum as it goes by, holding
+ * back the volume's last block until it has.
+ */
+static void *
+checksumStage(void *cookie)
+{
+    Job *job = (Job *)cookie;
+    BlockQueue *in = &job->queues[job->queueCount - 2];
+    BlockQueue *out = &job->queues[job->queueCount - 1];
+    MD5_CTX md5;
+    uLong crc = 0;
+    int current = -1;
+    Block *b;
+
+    while ((b = queuePop(job, in)) != NULL) {
+        Volume *vol = &job->volumes[b->volume];
+        if (b->volume != current) {
+            MD5_init(&md5);
+            crc = crc32(0L, Z_NULL, 0);
+            current = b->volume;
+        }
+        if (vol->sum != NULL && vol->sum->md5) {
+            MD5_update(&md5, b->data, b->len);
+        } else if (vol->sum != NULL) {
+            crc = crc32(crc, b->data, b->len);
+        }
+
+        if (b->endOfVolume && vol->sum != NULL) {
+            bool ok = vol->sum->md5 ?
+                    memcmp(MD5_final(&md5), vol->sum->digest,
+                            MD5_DIGEST_SIZE) == 0 :
+                    crc == vol->sum->crc;
+            if (!ok) {
+                jobFail(job, "%s doesn't match its checksum",
+                        baseName(vol->name));
+                free(b);
+                return NULL;
+            }
+        }
+        if (b->endOfVolume) {
+            current = -1;
+        }
+        if (queuePush(job, out, b) < 0) {
+            return NULL;
+        }
+    }
+    queueClose(job, out);
+    return NULL;
+}
+
+/* Starts the unpacker for an archive job reading from a pipe, and
+ * returns the pipe's write end.
+ */
+static int
+startUnpacker(Job *job, pid_t *pid)
+{
+    int fds[2];
+
+    pthread_mutex_lock(&gForkLock);
+    if (pipe(fds) < 0) {
+        pthread_mutex_unlock(&gForkLock);
+        jobFail(job, "can't create a pipe (%s)", strerror(errno));
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    *pid = fork();
+    if (*pid == 0) {
+        /* Only async-signal-safe calls between fork and exec: the
+         * other threads' locks are gone with them.
+         */
+        dup2(fds[0], STDIN_FILENO);
+        if (chdir(job->target) < 0) {
+            _exit(126);
+        }
+        if (job->kind == RESTORE_TAR) {
+            /* ntar is this binary under another name. */
+            execl("/proc/self/exe", "ntar", "-x", "-f", "-", (char *)NULL);
+        } else {
+            execlp("unyaffs", "unyaffs", "/proc/self/fd/0", (char *)NULL);
+        }
+        _exit(127);
+    }
+    int saved = errno;
+    pthread_mutex_unlock(&gForkLock);
+    close(fds[0]);
+    if (*pid < 0) {
+        close(fds[1]);
+        jobFail(job, "can't fork (%s)", strerror(saved));
+        return -1;
+    }
+    return fds[1];
+}
+
+static int
+writeFully(int fd, const unsigned char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) errno = ENOSPC;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* The last stage, run on the job's disk thread. */
+static void
+writeStage(Job *job)
+{
+    BlockQueue *in = &job->queues[job->queueCount - 1];
+    int fd = -1;
+    pid_t pid = -1;
+    Block *b;
+
+    if (job->writing && job->kind == RESTORE_RAW) {
+        fd = open(job->target, O_WRONLY);
+        if (fd < 0) {
+            jobFail(job, "can't open %s (%s)", job->target, strerror(errno));
+        }
+    } else if (job->writing && job->kind != RESTORE_CHECK) {
+        fd = startUnpacker(job, &pid);
+    }
+
+    while ((b = queuePop(job, in)) != NULL) {
+        if (fd >= 0 && writeFully(fd, b->data, b->len) < 0) {
+            jobFail(job, pid > 0 ? "unpacking into %s failed (%s)" :
+                    "can't write %s (%s)", job->target, strerror(errno));
+        }
+        job->written += b->len;
+        free(b);
+    }
+
+    if (fd >= 0 && pid < 0 && fsync(fd) < 0) {
+        jobFail(job, "can't write %s (%s)", job->target, strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (pid > 0) {
+        /* The unpacker sees end of file (or a short archive, if the job
+         * failed) once the pipe closes.
+         */
+        int status;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            jobFail(job, "%s couldn't unpack it into %s",
+                    job->kind == RESTORE_TAR ? "ntar" : "unyaffs",
+                    job->target);
+        }
+    }
+}
+
+/* One pass over the job's volumes through every stage it needs. */
+static void
+runPipeline(Job *job)
+{
+    pthread_t threads[RESTORE_MAX_QUEUES];
+    void *(*stages[RESTORE_MAX_QUEUES])(void *);
+    int stageCount = 0;
+    int started = 0;
+    int i;
+
+    stages[stageCount++] = readStage;
+    if (job->anyCompressed) {
+        stages[stageCount++] = inflateStage;
+    }
+    if (job->checking) {
+        stages[stageCount++] = checksumStage;
+    }
+    job->queueCount = stageCount;
+    job->written = 0;
+
+    for (i = 0; i < stageCount; i++) {
+        if (pthread_create(&threads[i], NULL, stages[i], job) != 0) {
+            jobFail(job, "can't start a thread");
+            break;
+        }
+        started++;
+    }
+    if (started == stageCount) {
+        writeStage(job);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < stageCount; i++) {
+        queueFree(&job->queues[i]);
+    }
+}
+
+static void
+runJob(Job *job)
+{
+    bool sums = false;
+    int v;
+    time_t start = time(NULL);
+
+    for (v = 0; v < job->volumeCount; v++) {
+        sums |= job->volumes[v].sum != NULL;
+    }
+
+    printf("Restoring %s to %s...\n", baseName(job->source), job->target);
+    fflush(stdout);
+
+    /* Don't write a bad boot or recovery image over a good one. */
+    if (job->kind == RESTORE_RAW && sums) {
+        job->checking = true;
+        job->writing = false;
+        runPipeline(job);
+        if (job->failed) {
+            return;
+        }
+    }
+    job->checking = sums;
+    job->writing = true;
+    runPipeline(job);
+
+    if (!job->failed) {
+        printf("Restored %s (%lld MB in %ld s)\n", baseName(job->source),
+                job->written >> 20, (long)(time(NULL) - start));
+        fflush(stdout);
+    }
+}
+
+static void *
+diskWorker(void *cookie)
+{
+    DiskWorker *worker = (DiskWorker *)cookie;
+    int i;
+    for (i = 0; i < worker->count; i++) {
+        runJob(worker->jobs[i]);
+    }
+    return NULL;
+}
+
+static int
+setUpJob(Job *job, const RestoreJob *spec, VerifyEntry *sums, int sumCount)
+{
+    struct stat st;
+    int i, v;
+
+    memset(job, 0, sizeof(*job));
+    job->source = spec->source;
+    job->target = spec->target;
+    pthread_mutex_init(&job->lock, NULL);
+    for (i = 0; i < RESTORE_MAX_QUEUES; i++) {
+        pthread_cond_init(&job->queues[i].changed, NULL);
+    }
+
+    if (strcmp(job->target, "-") == 0) {
+        job->kind = RESTORE_CHECK;
+    } else if (stat(job->target, &st) != 0) {
+        jobFail(job, "can't find %s (%s)", job->target, strerror(errno));
+        return -1;
+    } else if (S_ISBLK(st.st_mode)) {
+        job->kind = RESTORE_RAW;
+    } else if (S_ISDIR(st.st_mode)) {
+        job->kind = strstr(baseName(job->source), ".tar") != NULL ?
+                RESTORE_TAR : RESTORE_YAFFS;
+    } else {
+        jobFail(job, "%s isn't a block device or a directory", job->target);
+        return -1;
+    }
+
+    if (findVolumes(job) < 0) {
+        jobFail(job, "not found");
+        return -1;
+    }
+    for (v = 0; v < job->volumeCount; v++) {
+        Volume *vol = &job->volumes[v];
+        for (i = 0; i < sumCount; i++) {
+            if (strcmp(baseName(sums[i].name), baseName(vol->name)) == 0) {
+                vol->sum = &sums[i];
+                break;
+            }
+        }
+    }
+    findDisk(job);
+    return 0;
+}
+
+int
+restore_files(const RestoreJob *specs, int count, const char *list)
+{
+    VerifyEntry *sums = NULL;
+    int sumCount = 0;
+    int failures = 0;
+    int i, j;
+
+    if (list != NULL && verify_read_list(list, &sums, &sumCount) < 0) {
+        fprintf(stderr, "nrestore: can't read %s (%s)\n", list,
+                strerror(errno));
+        return -1;
+    }
+
+    Job *jobs = calloc(count + 1, sizeof(Job));
+    Job **byDisk = calloc(count + 1, sizeof(Job *));
+    DiskWorker *workers = calloc(count + 1, sizeof(DiskWorker));
+    pthread_t *threads = calloc(count + 1, sizeof(pthread_t));
+    bool *threaded = calloc(count + 1, sizeof(bool));
+    if (jobs == NULL || byDisk == NULL || workers == NULL ||
+        threads == NULL || threaded == NULL) {
+        free(jobs);
+        free(byDisk);
+        free(workers);
+        free(threads);
+        free(threaded);
+        verify_free_list(sums, sumCount);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Group the jobs by disk, keeping their order within each. */
+    for (i = 0; i < count; i++) {
+        setUpJob(&jobs[i], &specs[i], sums, sumCount);
+    }
+    int workerCount = 0;
+    int placed = 0;
+    for (i = 0; i < count; i++) {
+        if (jobs[i].failed) {
+            continue;
+        }
+        for (j = 0; j < workerCount; j++) {
+            if (strcmp(workers[j].jobs[0]->disk, jobs[i].disk) == 0) {
+                break;
+            }
+        }
+        if (j == workerCount) {
+            workerCount++;
+            workers[j].jobs = byDisk + placed;
+            workers[j].count = 0;
+            /* Leave room for every later job on this disk. */
+            int k;
+            for (k = i; k < count; k++) {
+                if (!jobs[k].failed &&
+                    strcmp(jobs[k].disk, jobs[i].disk) == 0) {
+                    placed++;
+                }
+            }
+        }
+        workers[j].jobs[workers[j].count++] = &jobs[i];
+    }
+
+    for (i = 0; i < workerCount; i++) {
+        threaded[i] = pthread_create(&threads[i], NULL, diskWorker,
+                &workers[i]) == 0;
+    }
+    for (i = 0; i < workerCount; i++) {
+        if (threaded[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            diskWorker(&workers[i]);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (jobs[i].failed) {
+            failures++;
+        }
+        for (j = 0; j < RESTORE_MAX_QUEUES; j++) {
+            pthread_cond_destroy(&jobs[i].queues[j].changed);
+        }
+        pthread_mutex_destroy(&jobs[i].lock);
+    }
+    if (failures > 0) {
+        fprintf(stderr, "nrestore: %d of %d files FAILED to restore\n",
+                failures, count);
+    }
+
+    free(jobs);
+    free(byDisk);
+    free(workers);
+    free(threads);
+    free(threaded);
+    verify_free_list(sums, sumCount);
+    return failures > 0 ? 1 : 0;
+}
+
+int
+nrestore_main(int argc, char **argv)
+{
+    const char *list = NULL;
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        list = argv[2];
+        first = 3;
+    }
+    int count = (argc - first) / 2;
+    if (count == 0 || (argc - first) % 2 != 0) {
+        fprintf(stderr, "usage: nrestore [-c <checksum list>] "
+                "<backup file> <target> ...\n");
+        return 2;
+    }
+
+    RestoreJob *jobs = malloc(count * sizeof(RestoreJob));
+    if (jobs == NULL) {
+        fprintf(stderr, "nrestore: out of memory\n");
+        return 1;
+    }
+    int i;
+    for (i = 0; i < count; i++) {
+        jobs[i].source = argv[first + 2 * i];
+        jobs[i].target = argv[first + 2 * i + 1];
+    }
+
+    /* A dead unpacker should fail its job, not kill the rest. */
+    signal(SIGPIPE, SIG_IGN);
+    int ret = restore_files(jobs, count, list);
+    free(jobs);
+    return ret != 0 ? 1 : 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_NRESTORE_H
+#define _RECOVERY_NRESTORE_H
+
+/* One backup file and where it goes.  The kind of restore follows from
+ * the target:
+ *
+ *   a block device   the image is written to it raw
+ *   a directory      the archive is unpacked into it: with ntar if its
+ *                    name has ".tar" in it, otherwise with unyaffs
+ *   "-"              the file is only read and checked
+ *
+ * The source may be compressed with gzip ("system.img.gz" is found for
+ * "system.img") and may be split into volumes ("data.ext4.tar" is
+ * found as "data.ext4.tar.a", "data.ext4.tar.b", ...).
+ */
+typedef struct {
+    const char *source;
+    const char *target;
+} RestoreJob;
+
+/* Restores each job through its own reader -> gunzip -> checksum ->
+ * writer pipeline of threads, with a few blocks buffered between each
+ * stage.  Jobs whose targets are on the same disk run one after
+ * another, in order; those on different disks (the internal eMMC and
+ * the sdcard, say) run at the same time.  An archive restored to "/"
+ * counts as being on the disk of the directory it's named for, so
+ * "data.ext4.tar" to "/" goes with the other jobs for /data's disk.
+ *
+ * If list isn't NULL, every file it has a checksum for (see nverify.h)
+ * is checked as it's read, and a job fails if one doesn't match.  Raw
+ * images are checked completely before anything is written to the
+ * device; archives are checked as they're unpacked, so a bad one fails
+ * with its partition half restored.
+ *
+ * Returns 0 if every job succeeded, 1 if any failed (after running the
+ * rest), or -1 with errno set if list couldn't be read.
+ */
+int restore_files(const RestoreJob *jobs, int count, const char *list);
+
+/* The "nrestore" applet:
+ *
+ *   nrestore [-c <checksum list>] <backup file> <target> ...
+ */
+int nrestore_main(int argc, char **argv);
+
+#endif
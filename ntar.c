@@ -0,0 +1,1767 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native tar for nandroid backups.
+ *
+ * Forking busybox tar costs us a read() and a write() per file on the
+ * way in and out, one file at a time; on /data, with tens of thousands
+ * of small files, that is where a backup spends most of its time.  Here
+ * the tree is walked up front, several threads open and read the small
+ * files ahead of the writer, and the archive goes out in 1MB writes.
+ * Restoring, the archive is read in 1MB blocks and small files are
+ * handed to threads that create and fill them.
+ *
+ * Archives are GNU tar format (ustar with 'L'/'K' long names), which
+ * both busybox and GNU tar read.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "ntar.h"
+
+#define TAR_BLOCK_SIZE      512
+#define TAR_RECORD_SIZE     (20 * TAR_BLOCK_SIZE)   // GNU tar's default
+#define TAR_BUFFER_SIZE     (1024 * 1024)
+#define TAR_SMALL_FILE      (256 * 1024)
+#define TAR_WINDOW_FILES    256
+#define TAR_WINDOW_BYTES    (16 * 1024 * 1024)
+#define TAR_MAX_THREADS     4
+#define TAR_MAX_VOLUMES     26
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TarHeader;
+
+static void
+tarFailed(int *firstErrno, const char *what, const char *path)
+{
+    int err = errno;
+    fprintf(stderr, "ntar: %s %s failed (%s)\n", what, path, strerror(err));
+    if (*firstErrno == 0) {
+        *firstErrno = err != 0 ? err : EIO;
+    }
+}
+
+static int
+writeFully(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Name of volume n (0 for ".a") of a split archive. */
+static void
+volumeName(char *out, size_t size, const char *archive, int n)
+{
+    snprintf(out, size, "%s.%c", archive, 'a' + n);
+}
+
+/*
+ * Writing
+ */
+
+typedef struct {
+    const char *archive;
+    long long splitSize;
+    int fd;
+    int volume;             // volumes started so far, less one
+    long long volumeBytes;  // written to the current volume
+    long long totalBytes;
+    char *buf;
+    size_t used;
+} TarOutput;
+
+static int
+openOutput(TarOutput *out, const char *archive, long long splitSize)
+{
+    memset(out, 0, sizeof(*out));
+    out->archive = archive;
+    out->buf = malloc(TAR_BUFFER_SIZE);
+    if (out->buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (!strcmp(archive, "-")) {
+        out->fd = STDOUT_FILENO;
+        return 0;
+    }
+    out->splitSize = splitSize;
+
+    /* Don't leave the volumes of an older, bigger backup lying around
+     * to be read back after this one.
+     */
+    int i;
+    for (i = 0; i < TAR_MAX_VOLUMES; i++) {
+        char name[PATH_MAX];
+        volumeName(name, sizeof(name), archive, i);
+        unlink(name);
+    }
+    out->fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out->fd < 0) {
+        free(out->buf);
+        return -1;
+    }
+    return 0;
+}
+
+/* The first volume only gets its ".a" once we know there's a second. */
+static int
+nextVolume(TarOutput *out)
+{
+    char name[PATH_MAX];
+    if (out->volume + 1 >= TAR_MAX_VOLUMES) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (close(out->fd) < 0) {
+        out->fd = -1;
+        return -1;
+    }
+    out->fd = -1;
+    if (out->volume == 0) {
+        volumeName(name, sizeof(name), out->archive, 0);
+        if (rename(out->archive, name) < 0) {
+            return -1;
+        }
+    }
+    out->volume++;
+    volumeName(name, sizeof(name), out->archive, out->volume);
+    out->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out->fd < 0) {
+        return -1;
+    }
+    out->volumeBytes = 0;
+    return 0;
+}
+
+static int
+flushOutput(TarOutput *out)
+{
+    size_t done = 0;
+    while (done < out->used) {
+        size_t count = out->used - done;
+        if (out->splitSize > 0) {
+            if (out->volumeBytes == out->splitSize && nextVolume(out) < 0) {
+                return -1;
+            }
+            if ((long long)count > out->splitSize - out->volumeBytes) {
+                count = out->splitSize - out->volumeBytes;
+            }
+        }
+        if (writeFully(out->fd, out->buf + done, count) < 0) {
+            return -1;
+        }
+        out->volumeBytes += count;
+        done += count;
+    }
+    out->used = 0;
+    return 0;
+}
+
+/* Room to read straight into; at least a block, at most len bytes. */
+static char *
+outputSpace(TarOutput *out, size_t *len)
+{
+    if (out->used == TAR_BUFFER_SIZE && flushOutput(out) < 0) {
+        return NULL;
+    }
+    if (*len > TAR_BUFFER_SIZE - out->used) {
+        *len = TAR_BUFFER_SIZE - out->used;
+    }
+    return out->buf + out->used;
+}
+
+static void
+commitOutput(TarOutput *out, size_t len)
+{
+    out->used += len;
+    out->totalBytes += len;
+}
+
+static int
+writeOutput(TarOutput *out, const char *data, size_t len)
+{
+    while (len > 0) {
+        size_t count = len;
+        char *space = outputSpace(out, &count);
+        if (space == NULL) {
+            return -1;
+        }
+        if (data != NULL) {
+            memcpy(space, data, count);
+            data += count;
+        } else {
+            memset(space, 0, count);
+        }
+        commitOutput(out, count);
+        len -= count;
+    }
+    return 0;
+}
+
+static int
+padOutput(TarOutput *out, size_t multiple)
+{
+    size_t extra = out->totalBytes % multiple;
+    return extra == 0 ? 0 : writeOutput(out, NULL, multiple - extra);
+}
+
+static int
+closeOutput(TarOutput *out)
+{
+    int ret = flushOutput(out);
+    if (out->fd >= 0 && out->fd != STDOUT_FILENO &&
+        close(out->fd) < 0 && ret == 0) {
+        ret = -1;
+    }
+    free(out->buf);
+    return ret;
+}
+
+/* Numeric fields are octal, or GNU's base-256 when they don't fit. */
+static void
+formatNumber(char *field, size_t len, unsigned long long value)
+{
+    if (value < (1ULL << (3 * (len - 1)))) {
+        snprintf(field, len, "%0*llo", (int)len - 1, value);
+        return;
+    }
+    size_t i;
+    for (i = len - 1; i > 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+static void
+finishHeader(TarHeader *h)
+{
+    unsigned int sum = 0;
+    size_t i;
+    memcpy(h->magic, "ustar ", 6);  // GNU: "ustar  \0"
+    memcpy(h->version, " ", 2);
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (i = 0; i < sizeof(*h); i++) {
+        sum += ((unsigned char *)h)[i];
+    }
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+}
+
+/* A GNU 'L' or 'K' record carrying a name too long for its field. */
+static int
+writeLongName(TarOutput *out, char type, const char *name)
+{
+    TarHeader h;
+    size_t len = strlen(name) + 1;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, "././@LongLink");
+    formatNumber(h.mode, sizeof(h.mode), 0);
+    formatNumber(h.uid, sizeof(h.uid), 0);
+    formatNumber(h.gid, sizeof(h.gid), 0);
+    formatNumber(h.size, sizeof(h.size), len);
+    formatNumber(h.mtime, sizeof(h.mtime), 0);
+    h.typeflag = type;
+    finishHeader(&h);
+    if (writeOutput(out, (char *)&h, sizeof(h)) < 0 ||
+        writeOutput(out, name, len) < 0) {
+        return -1;
+    }
+    return padOutput(out, TAR_BLOCK_SIZE);
+}
+
+static int
+writeHeader(TarOutput *out, const char *name, const struct stat *st,
+        const char *link)
+{
+    char dirName[PATH_MAX + 1];
+    TarHeader h;
+
+    if (S_ISDIR(st->st_mode)) {
+        snprintf(dirName, sizeof(dirName), "%s/", name);
+        name = dirName;
+    }
+    if (strlen(name) > sizeof(h.name) && writeLongName(out, 'L', name) < 0) {
+        return -1;
+    }
+    if (link != NULL && strlen(link) > sizeof(h.linkname) &&
+        writeLongName(out, 'K', link) < 0) {
+        return -1;
+    }
+
+    memset(&h, 0, sizeof(h));
+    strncpy(h.name, name, sizeof(h.name));
+    formatNumber(h.mode, sizeof(h.mode), st->st_mode & 07777);
+    formatNumber(h.uid, sizeof(h.uid), st->st_uid);
+    formatNumber(h.gid, sizeof(h.gid), st->st_gid);
+    formatNumber(h.size, sizeof(h.size),
+            S_ISREG(st->st_mode) ? st->st_size : 0);
+    formatNumber(h.mtime, sizeof(h.mtime), st->st_mtime);
+    if (S_ISREG(st->st_mode)) {
+        h.typeflag = '0';
+    } else if (S_ISDIR(st->st_mode)) {
+        h.typeflag = '5';
+    } else if (S_ISLNK(st->st_mode)) {
+        h.typeflag = '2';
+        strncpy(h.linkname, link, sizeof(h.linkname));
+    } else {
+        h.typeflag = S_ISCHR(st->st_mode) ? '3' :
+                S_ISBLK(st->st_mode) ? '4' : '6';
+        formatNumber(h.devmajor, sizeof(h.devmajor), major(st->st_rdev));
+        formatNumber(h.devminor, sizeof(h.devminor), minor(st->st_rdev));
+    }
+    finishHeader(&h);
+    return writeOutput(out, (char *)&h, sizeof(h));
+}
+
+enum { ENTRY_PENDING, ENTRY_LOADING, ENTRY_READY };
+
+typedef struct {
+    char *path;         // to open
+    const char *name;   // in the archive; points into path
+    struct stat st;
+    char *link;         // symlink target, or NULL
+
+    /* Filled in by the readers for regular files. */
+    int state;
+    char *data;         // the whole of a small file
+    int fd;             // a large file, opened and being read ahead
+    int err;
+} TarEntry;
+
+typedef struct {
+    const NtarOptions *opts;
+    struct stat archiveSt;
+    bool haveArchiveSt;
+    int firstErrno;
+
+    TarEntry *entries;
+    int count;
+    int alloc;
+
+    /* The readers stay at most a window ahead of the writer. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int nextLoad;
+    int nextWrite;
+    long long buffered;
+    bool stop;
+} TarCreate;
+
+static bool
+isExcluded(const NtarOptions *opts, const char *name)
+{
+    const char *base = strrchr(name, '/');
+    base = base == NULL ? name : base + 1;
+    int i;
+    for (i = 0; i < opts->excludeCount; i++) {
+        if (fnmatch(opts->excludes[i], base, 0) == 0 ||
+            fnmatch(opts->excludes[i], name, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* What a loaded entry counts against the readers' window: a small
+ * file's contents, or the readahead we asked for on a large one.
+ */
+static long long
+entryCharge(const TarEntry *entry)
+{
+    return entry->st.st_size <= TAR_SMALL_FILE ?
+            entry->st.st_size : TAR_BUFFER_SIZE;
+}
+
+static void
+walkTree(TarCreate *tc, const char *path, size_t nameOffset)
+{
+    const char *name = path + nameOffset;
+    if (*name != '\0' && isExcluded(tc->opts, name)) {
+        return;
+    }
+
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        tarFailed(&tc->firstErrno, "stat", path);
+        return;
+    }
+    if (S_ISSOCK(st.st_mode)) {
+        return;                 // tar can't store these either
+    }
+    if (tc->haveArchiveSt && st.st_dev == tc->archiveSt.st_dev &&
+        st.st_ino == tc->archiveSt.st_ino) {
+        return;                 // don't archive the archive
+    }
+
+    if (tc->count == tc->alloc) {
+        int alloc = tc->alloc * 2 + 256;
+        TarEntry *entries = realloc(tc->entries, alloc * sizeof(*entries));
+        if (entries == NULL) {
+            errno = ENOMEM;
+            tarFailed(&tc->firstErrno, "walk", path);
+            return;
+        }
+        tc->entries = entries;
+        tc->alloc = alloc;
+    }
+    TarEntry *entry = &tc->entries[tc->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->fd = -1;
+    entry->st = st;
+    entry->state = S_ISREG(st.st_mode) ? ENTRY_PENDING : ENTRY_READY;
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        errno = ENOMEM;
+        tarFailed(&tc->firstErrno, "walk", path);
+        return;
+    }
+    entry->name = entry->path + nameOffset;
+
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(path, target, sizeof(target) - 1);
+        if (len < 0) {
+            tarFailed(&tc->firstErrno, "readlink", path);
+            free(entry->path);
+            return;
+        }
+        target[len] = '\0';
+        entry->link = strdup(target);
+        if (entry->link == NULL) {
+            errno = ENOMEM;
+            tarFailed(&tc->firstErrno, "walk", path);
+            free(entry->path);
+            return;
+        }
+    }
+    tc->count++;
+
+    if (!S_ISDIR(st.st_mode)) {
+        return;
+    }
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        tarFailed(&tc->firstErrno, "opendir", path);
+        return;
+    }
+    const struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+        char child[PATH_MAX];
+        size_t len = strlen(path);
+        snprintf(child, sizeof(child), "%s%s%s", path,
+                (len > 0 && path[len - 1] == '/') ? "" : "/", de->d_name);
+        walkTree(tc, child, nameOffset);
+    }
+    closedir(dir);
+}
+
+/* Read a small file whole, or open a large one and start it coming in
+ * from storage.  A file that shrank since we stat()ed it is padded
+ * with zeros, as tar does, so the header stays right.
+ */
+static void
+loadEntry(TarEntry *entry)
+{
+    int fd = open(entry->path, O_RDONLY);
+    if (fd < 0) {
+        entry->err = errno;
+        return;
+    }
+    if (entry->st.st_size > TAR_SMALL_FILE) {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, TAR_BUFFER_SIZE, POSIX_FADV_WILLNEED);
+#endif
+        entry->fd = fd;
+        return;
+    }
+
+    size_t size = entry->st.st_size;
+    entry->data = malloc(size > 0 ? size : 1);
+    if (entry->data == NULL) {
+        entry->err = ENOMEM;
+        close(fd);
+        return;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, entry->data + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            entry->err = errno;
+            break;
+        }
+        if (n == 0) {
+            fprintf(stderr, "ntar: %s shrank while being read\n",
+                    entry->path);
+            memset(entry->data + done, 0, size - done);
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    if (entry->err != 0) {
+        free(entry->data);
+        entry->data = NULL;
+    }
+}
+
+static void *
+readWorker(void *cookie)
+{
+    TarCreate *tc = (TarCreate *)cookie;
+
+    pthread_mutex_lock(&tc->lock);
+    for (;;) {
+        while (tc->nextLoad < tc->count &&
+               tc->entries[tc->nextLoad].state != ENTRY_PENDING) {
+            tc->nextLoad++;
+        }
+        if (tc->stop || tc->nextLoad == tc->count) {
+            break;
+        }
+        if (tc->nextLoad - tc->nextWrite >= TAR_WINDOW_FILES ||
+            tc->buffered >= TAR_WINDOW_BYTES) {
+            pthread_cond_wait(&tc->cond, &tc->lock);
+            continue;
+        }
+        TarEntry *entry = &tc->entries[tc->nextLoad++];
+        entry->state = ENTRY_LOADING;
+        tc->buffered += entryCharge(entry);
+        pthread_mutex_unlock(&tc->lock);
+
+        loadEntry(entry);
+
+        pthread_mutex_lock(&tc->lock);
+        entry->state = ENTRY_READY;
+        pthread_cond_broadcast(&tc->cond);
+    }
+    pthread_mutex_unlock(&tc->lock);
+    return NULL;
+}
+
+/* Copy a large file into the archive, reading straight into the
+ * output buffer.
+ */
+static int
+writeLargeFile(TarCreate *tc, TarOutput *out, TarEntry *entry)
+{
+    off_t left = entry->st.st_size;
+    while (left > 0) {
+        size_t count = left < TAR_BUFFER_SIZE ? (size_t)left : TAR_BUFFER_SIZE;
+        char *space = outputSpace(out, &count);
+        if (space == NULL) {
+            return -1;
+        }
+        ssize_t n = read(entry->fd, space, count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                tarFailed(&tc->firstErrno, "read", entry->path);
+            } else {
+                fprintf(stderr, "ntar: %s shrank while being read\n",
+                        entry->path);
+            }
+            return writeOutput(out, NULL, left);
+        }
+        commitOutput(out, n);
+        left -= n;
+    }
+    return 0;
+}
+
+int
+ntar_create(const char *archive, const char **paths, int count,
+        const NtarOptions *opts)
+{
+    TarCreate tc;
+    TarOutput out;
+    int i;
+
+    memset(&tc, 0, sizeof(tc));
+    tc.opts = opts;
+    if (openOutput(&out, archive, opts->splitSize) < 0) {
+        fprintf(stderr, "ntar: can't create %s (%s)\n", archive,
+                strerror(errno));
+        return -1;
+    }
+    tc.haveArchiveSt = out.fd != STDOUT_FILENO &&
+            fstat(out.fd, &tc.archiveSt) == 0;
+
+    for (i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        if (paths[i][0] == '/' || opts->root == NULL) {
+            strlcpy(path, paths[i], sizeof(path));
+        } else {
+            snprintf(path, sizeof(path), "%s/%s", opts->root, paths[i]);
+        }
+        size_t nameOffset = strlen(path) - strlen(paths[i]);
+        nameOffset += strspn(paths[i], "/");
+        walkTree(&tc, path, nameOffset);
+    }
+
+    pthread_mutex_init(&tc.lock, NULL);
+    pthread_cond_init(&tc.cond, NULL);
+    pthread_t threads[TAR_MAX_THREADS];
+    int workers = 0;
+    while (workers < TAR_MAX_THREADS &&
+           pthread_create(&threads[workers], NULL, readWorker, &tc) == 0) {
+        workers++;
+    }
+
+    int ret = 0;
+    for (i = 0; i < tc.count && ret == 0; i++) {
+        TarEntry *entry = &tc.entries[i];
+
+        pthread_mutex_lock(&tc.lock);
+        tc.nextWrite = i;
+        pthread_cond_broadcast(&tc.cond);
+        if (workers == 0 && entry->state == ENTRY_PENDING) {
+            entry->state = ENTRY_READY;
+            tc.buffered += entryCharge(entry);
+            pthread_mutex_unlock(&tc.lock);
+            loadEntry(entry);
+            pthread_mutex_lock(&tc.lock);
+        }
+        while (entry->state != ENTRY_READY) {
+            pthread_cond_wait(&tc.cond, &tc.lock);
+        }
+        pthread_mutex_unlock(&tc.lock);
+
+        const char *name = *entry->name != '\0' ? entry->name : ".";
+        if (entry->err != 0) {
+            errno = entry->err;
+            tarFailed(&tc.firstErrno, "read", entry->path);
+        } else {
+            if (opts->verbose) {
+                printf("%s%s\n", name, S_ISDIR(entry->st.st_mode) ? "/" : "");
+            }
+            ret = writeHeader(&out, name, &entry->st, entry->link);
+            if (ret == 0 && entry->data != NULL) {
+                ret = writeOutput(&out, entry->data, entry->st.st_size);
+            } else if (ret == 0 && entry->fd >= 0) {
+                ret = writeLargeFile(&tc, &out, entry);
+            }
+            if (ret == 0) {
+                ret = padOutput(&out, TAR_BLOCK_SIZE);
+            }
+        }
+
+        free(entry->data);
+        entry->data = NULL;
+        if (entry->fd >= 0) {
+            close(entry->fd);
+            entry->fd = -1;
+        }
+        if (S_ISREG(entry->st.st_mode)) {
+            pthread_mutex_lock(&tc.lock);
+            tc.buffered -= entryCharge(entry);
+            pthread_cond_broadcast(&tc.cond);
+            pthread_mutex_unlock(&tc.lock);
+        }
+    }
+    int err = errno;
+
+    pthread_mutex_lock(&tc.lock);
+    tc.stop = true;
+    pthread_cond_broadcast(&tc.cond);
+    pthread_mutex_unlock(&tc.lock);
+    for (i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* End of archive: two zero blocks, padded out to a whole record. */
+    if (ret == 0) {
+        ret = writeOutput(&out, NULL, 2 * TAR_BLOCK_SIZE);
+    }
+    if (ret == 0) {
+        ret = padOutput(&out, TAR_RECORD_SIZE);
+    }
+    if (ret < 0) {
+        err = errno;
+    }
+    if (closeOutput(&out) < 0 && ret == 0) {
+        err = errno;
+        ret = -1;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "ntar: can't write %s (%s)\n", archive,
+                strerror(err));
+        if (tc.firstErrno == 0) {
+            tc.firstErrno = err;
+        }
+    }
+
+    for (i = 0; i < tc.count; i++) {
+        TarEntry *entry = &tc.entries[i];
+        free(entry->data);
+        if (entry->fd >= 0) {
+            close(entry->fd);
+        }
+        free(entry->path);
+        free(entry->link);
+    }
+    free(tc.entries);
+    pthread_cond_destroy(&tc.cond);
+    pthread_mutex_destroy(&tc.lock);
+
+    if (tc.firstErrno != 0) {
+        errno = tc.firstErrno;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reading
+ */
+
+typedef struct {
+    const char *archive;    // for a split archive, without the ".a"
+    bool split;
+    int fd;
+    int volume;
+    char *buf;
+    size_t pos;
+    size_t len;
+} TarInput;
+
+static int
+openVolume(TarInput *in)
+{
+    char name[PATH_MAX];
+    if (in->split) {
+        volumeName(name, sizeof(name), in->archive, in->volume);
+    } else {
+        strlcpy(name, in->archive, sizeof(name));
+    }
+    in->fd = open(name, O_RDONLY);
+    if (in->fd < 0) {
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return 0;
+}
+
+static int
+openInput(TarInput *in, const char *archive, char *base, size_t baseSize)
+{
+    memset(in, 0, sizeof(*in));
+    in->buf = malloc(TAR_BUFFER_SIZE);
+    if (in->buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    in->archive = archive;
+    if (!strcmp(archive, "-")) {
+        in->fd = STDIN_FILENO;
+        return 0;
+    }
+
+    size_t len = strlen(archive);
+    if (len > 2 && !strcmp(archive + len - 2, ".a") && len - 2 < baseSize) {
+        /* Named by its first volume. */
+        memcpy(base, archive, len - 2);
+        base[len - 2] = '\0';
+        in->archive = base;
+        in->split = true;
+    } else if (access(archive, F_OK) < 0) {
+        in->split = true;
+    }
+    if (openVolume(in) < 0) {
+        int err = errno;
+        free(in->buf);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+closeInput(TarInput *in)
+{
+    if (in->fd >= 0 && in->fd != STDIN_FILENO) {
+        close(in->fd);
+    }
+    free(in->buf);
+}
+
+/* Make sure there's something in the buffer.  Returns 0 at the end of
+ * an unsplit archive.  A split archive has no way to say which volume is
+ * the last, so running out of volumes is an error: a complete archive
+ * ends with its end-of-archive blocks before that.
+ */
+static ssize_t
+fillInput(TarInput *in)
+{
+    while (in->pos == in->len) {
+        ssize_t n = read(in->fd, in->buf, TAR_BUFFER_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n > 0) {
+            in->pos = 0;
+            in->len = n;
+            break;
+        }
+        if (!in->split) {
+            return 0;
+        }
+        close(in->fd);
+        in->fd = -1;
+        in->volume++;
+        if (in->volume == TAR_MAX_VOLUMES) {
+            errno = EFBIG;
+            return -1;
+        }
+        if (openVolume(in) < 0) {
+            int err = errno;
+            char name[PATH_MAX];
+            volumeName(name, sizeof(name), in->archive, in->volume);
+            fprintf(stderr, "ntar: missing volume %s (%s)\n", name,
+                    strerror(err));
+            in->fd = -1;
+            errno = err;
+            return -1;
+        }
+    }
+    return in->len - in->pos;
+}
+
+/* Hands out up to want bytes from the buffer without copying them. */
+static const char *
+peekInput(TarInput *in, size_t *want)
+{
+    ssize_t avail = fillInput(in);
+    if (avail <= 0) {
+        if (avail == 0) {
+            errno = EPIPE;      // truncated
+        }
+        return NULL;
+    }
+    if (*want > (size_t)avail) {
+        *want = avail;
+    }
+    const char *p = in->buf + in->pos;
+    in->pos += *want;
+    return p;
+}
+
+static int
+readInput(TarInput *in, void *data, size_t len)
+{
+    while (len > 0) {
+        size_t count = len;
+        const char *p = peekInput(in, &count);
+        if (p == NULL) {
+            return -1;
+        }
+        if (data != NULL) {
+            memcpy(data, p, count);
+            data = (char *)data + count;
+        }
+        len -= count;
+    }
+    return 0;
+}
+
+static size_t
+blockPadding(unsigned long long size)
+{
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+static int
+skipMember(TarInput *in, unsigned long long size)
+{
+    return readInput(in, NULL, size + blockPadding(size));
+}
+
+static unsigned long long
+parseNumber(const char *field, size_t len)
+{
+    unsigned long long value = 0;
+    size_t i;
+    if ((unsigned char)field[0] & 0x80) {
+        for (i = 1; i < len; i++) {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+    for (i = 0; i < len && field[i] == ' '; i++)
+        ;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+static bool
+checkHeader(const TarHeader *h)
+{
+    const unsigned char *p = (const unsigned char *)h;
+    unsigned int sum = 0;
+    int ssum = 0;
+    size_t i;
+    for (i = 0; i < sizeof(*h); i++) {
+        bool inChksum = i >= offsetof(TarHeader, chksum) &&
+                i < offsetof(TarHeader, chksum) + sizeof(h->chksum);
+        sum += inChksum ? ' ' : p[i];
+        ssum += inChksum ? ' ' : (signed char)p[i];
+    }
+    unsigned int want = parseNumber(h->chksum, sizeof(h->chksum));
+    return want == sum || (int)want == ssum;
+}
+
+/* Reads the data of an 'L', 'K' or 'x' member into a new string. */
+static char *
+readMemberData(TarInput *in, unsigned long long size)
+{
+    if (size > 16 * PATH_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    char *data = malloc(size + 1);
+    if (data == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (readInput(in, data, size) < 0 ||
+        readInput(in, NULL, blockPadding(size)) < 0) {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+/* Picks the path, linkpath and size out of a pax extended header. */
+static void
+parsePax(char *data, char **name, char **link, long long *size)
+{
+    char *p = data;
+    while (*p != '\0') {
+        char *end;
+        unsigned long len = strtoul(p, &end, 10);
+        if (end == p || *end != ' ' || len == 0 || len > strlen(p)) {
+            break;
+        }
+        char *record = end + 1;
+        char *next = p + len;
+        next[-1] = '\0';
+        char *eq = strchr(record, '=');
+        if (eq != NULL) {
+            *eq = '\0';
+            if (!strcmp(record, "path")) {
+                free(*name);
+                *name = strdup(eq + 1);
+            } else if (!strcmp(record, "linkpath")) {
+                free(*link);
+                *link = strdup(eq + 1);
+            } else if (!strcmp(record, "size")) {
+                *size = strtoll(eq + 1, NULL, 10);
+            }
+        }
+        p = next;
+    }
+}
+
+typedef struct FileJob {
+    char *path;
+    char *data;
+    size_t size;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    struct FileJob *next;
+} FileJob;
+
+typedef struct {
+    char *path;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+} DirFixup;
+
+typedef struct {
+    const NtarOptions *opts;
+    TarInput in;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    FileJob *head;
+    FileJob *tail;
+    long long queuedBytes;
+    int busy;               // jobs taken but not finished
+    bool done;
+    int firstErrno;
+
+    DirFixup *dirs;
+    int dirCount;
+    int dirAlloc;
+    char lastParent[PATH_MAX];
+} TarExtract;
+
+static void
+extractFailed(TarExtract *tx, const char *what, const char *path)
+{
+    pthread_mutex_lock(&tx->lock);
+    tarFailed(&tx->firstErrno, what, path);
+    pthread_mutex_unlock(&tx->lock);
+}
+
+/* Open a new file, replacing (not writing through) whatever is there. */
+static int
+createFile(const char *path, mode_t mode)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, mode & 0777);
+    if (fd < 0 && errno == EEXIST && unlink(path) == 0) {
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, mode & 0777);
+    }
+    return fd;
+}
+
+static void
+setTimes(const char *path, time_t mtime)
+{
+    struct timeval tv[2];
+    tv[0].tv_sec = tv[1].tv_sec = mtime;
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+    utimes(path, tv);
+}
+
+/* chown may clear setuid/setgid, so the mode goes on after it. */
+static int
+finishFile(TarExtract *tx, int fd, const char *path, mode_t mode,
+        uid_t uid, gid_t gid)
+{
+    if (fchown(fd, uid, gid) < 0 && errno != EPERM) {
+        extractFailed(tx, "chown", path);
+        return -1;
+    }
+    if (fchmod(fd, mode & 07777) < 0) {
+        extractFailed(tx, "chmod", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+writeJob(TarExtract *tx, FileJob *job)
+{
+    int fd = createFile(job->path, job->mode);
+    if (fd < 0) {
+        extractFailed(tx, "create", job->path);
+        return;
+    }
+    bool ok = true;
+    if (writeFully(fd, job->data, job->size) < 0) {
+        extractFailed(tx, "write", job->path);
+        ok = false;
+    } else if (finishFile(tx, fd, job->path, job->mode, job->uid,
+            job->gid) < 0) {
+        ok = false;
+    }
+    if (close(fd) < 0 && ok) {
+        extractFailed(tx, "close", job->path);
+        ok = false;
+    }
+    if (ok) {
+        setTimes(job->path, job->mtime);
+    }
+}
+
+static void *
+writeWorker(void *cookie)
+{
+    TarExtract *tx = (TarExtract *)cookie;
+
+    pthread_mutex_lock(&tx->lock);
+    for (;;) {
+        while (tx->head == NULL && !tx->done) {
+            pthread_cond_wait(&tx->cond, &tx->lock);
+        }
+        FileJob *job = tx->head;
+        if (job == NULL) {
+            break;
+        }
+        tx->head = job->next;
+        if (tx->head == NULL) {
+            tx->tail = NULL;
+        }
+        tx->busy++;
+        pthread_mutex_unlock(&tx->lock);
+
+        writeJob(tx, job);
+
+        pthread_mutex_lock(&tx->lock);
+        tx->busy--;
+        tx->queuedBytes -= job->size;
+        pthread_cond_broadcast(&tx->cond);
+        free(job->path);
+        free(job->data);
+        free(job);
+    }
+    pthread_mutex_unlock(&tx->lock);
+    return NULL;
+}
+
+/* Wait for the queue to empty, e.g. before linking to a queued file. */
+static void
+drainQueue(TarExtract *tx)
+{
+    pthread_mutex_lock(&tx->lock);
+    while (tx->head != NULL || tx->busy > 0) {
+        pthread_cond_wait(&tx->cond, &tx->lock);
+    }
+    pthread_mutex_unlock(&tx->lock);
+}
+
+static int
+makeDirs(char *path)
+{
+    if (mkdir(path, 0755) == 0 || errno == EEXIST) {
+        return 0;
+    }
+    char *slash = strrchr(path, '/');
+    if (errno != ENOENT || slash == NULL || slash == path) {
+        return -1;
+    }
+    *slash = '\0';
+    int ret = makeDirs(path);
+    *slash = '/';
+    if (ret < 0) {
+        return -1;
+    }
+    return (mkdir(path, 0755) == 0 || errno == EEXIST) ? 0 : -1;
+}
+
+/* Members usually come grouped by directory, so remember the last
+ * parent we made sure of.
+ */
+static int
+makeParent(TarExtract *tx, const char *path)
+{
+    char parent[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL || slash == path) {
+        return 0;
+    }
+    size_t len = slash - path;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    if (!strcmp(parent, tx->lastParent)) {
+        return 0;
+    }
+    if (makeDirs(parent) < 0) {
+        extractFailed(tx, "mkdir", parent);
+        return -1;
+    }
+    strcpy(tx->lastParent, parent);
+    return 0;
+}
+
+static void
+extractDir(TarExtract *tx, const char *path, mode_t mode, uid_t uid,
+        gid_t gid, time_t mtime)
+{
+    struct stat st;
+    if (mkdir(path, 0700) < 0) {
+        if (errno != EEXIST || lstat(path, &st) < 0) {
+            extractFailed(tx, "mkdir", path);
+            return;
+        }
+        if (!S_ISDIR(st.st_mode) &&
+            (unlink(path) < 0 || mkdir(path, 0700) < 0)) {
+            extractFailed(tx, "mkdir", path);
+            return;
+        }
+    }
+
+    if (tx->dirCount == tx->dirAlloc) {
+        int alloc = tx->dirAlloc * 2 + 64;
+        DirFixup *dirs = realloc(tx->dirs, alloc * sizeof(*dirs));
+        if (dirs == NULL) {
+            errno = ENOMEM;
+            extractFailed(tx, "mkdir", path);
+            return;
+        }
+        tx->dirs = dirs;
+        tx->dirAlloc = alloc;
+    }
+    DirFixup *dir = &tx->dirs[tx->dirCount];
+    dir->path = strdup(path);
+    if (dir->path == NULL) {
+        errno = ENOMEM;
+        extractFailed(tx, "mkdir", path);
+        return;
+    }
+    dir->mode = mode;
+    dir->uid = uid;
+    dir->gid = gid;
+    dir->mtime = mtime;
+    tx->dirCount++;
+}
+
+/* Write a file too big to queue straight from the archive buffer. */
+static int
+extractLargeFile(TarExtract *tx, const char *path, unsigned long long size,
+        mode_t mode, uid_t uid, gid_t gid, time_t mtime)
+{
+    int fd = createFile(path, mode);
+    if (fd < 0) {
+        extractFailed(tx, "create", path);
+    }
+    bool ok = fd >= 0;
+    while (size > 0) {
+        size_t count = size < TAR_BUFFER_SIZE ? size : TAR_BUFFER_SIZE;
+        const char *p = peekInput(&tx->in, &count);
+        if (p == NULL) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        if (ok && writeFully(fd, p, count) < 0) {
+            extractFailed(tx, "write", path);
+            ok = false;
+        }
+        size -= count;
+    }
+    if (fd >= 0) {
+        if (ok && finishFile(tx, fd, path, mode, uid, gid) < 0) {
+            ok = false;
+        }
+        if (close(fd) < 0 && ok) {
+            extractFailed(tx, "close", path);
+            ok = false;
+        }
+        if (ok) {
+            setTimes(path, mtime);
+        }
+    }
+    return 0;
+}
+
+static int
+queueFile(TarExtract *tx, int workers, const char *path,
+        unsigned long long size, mode_t mode, uid_t uid, gid_t gid,
+        time_t mtime)
+{
+    FileJob *job = NULL;
+    if (workers > 0 && size <= TAR_SMALL_FILE) {
+        job = (FileJob *)calloc(1, sizeof(*job));
+    }
+    if (job != NULL) {
+        job->path = strdup(path);
+        job->data = malloc(size > 0 ? size : 1);
+        if (job->path == NULL || job->data == NULL) {
+            free(job->path);
+            free(job->data);
+            free(job);
+            job = NULL;
+        }
+    }
+    if (job == NULL) {
+        return extractLargeFile(tx, path, size, mode, uid, gid, mtime);
+    }
+
+    if (readInput(&tx->in, job->data, size) < 0) {
+        free(job->path);
+        free(job->data);
+        free(job);
+        return -1;
+    }
+    job->size = size;
+    job->mode = mode;
+    job->uid = uid;
+    job->gid = gid;
+    job->mtime = mtime;
+
+    pthread_mutex_lock(&tx->lock);
+    while (tx->queuedBytes >= TAR_WINDOW_BYTES) {
+        pthread_cond_wait(&tx->cond, &tx->lock);
+    }
+    tx->queuedBytes += size;
+    if (tx->tail != NULL) {
+        tx->tail->next = job;
+    } else {
+        tx->head = job;
+    }
+    tx->tail = job;
+    pthread_cond_broadcast(&tx->cond);
+    pthread_mutex_unlock(&tx->lock);
+    return 0;
+}
+
+/* Member names are made relative, and any with a ".." in them are
+ * refused so an archive can't write outside the target directory.
+ */
+static bool
+cleanName(char *name)
+{
+    size_t len;
+    while (*name == '/') {
+        memmove(name, name + 1, strlen(name));
+    }
+    while ((len = strlen(name)) > 1 && name[len - 1] == '/') {
+        name[len - 1] = '\0';
+    }
+    const char *p = name;
+    while (p != NULL) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+            return false;
+        }
+        p = strchr(p, '/');
+        if (p != NULL) {
+            p++;
+        }
+    }
+    return true;
+}
+
+static int
+readArchive(const char *archive, const NtarOptions *opts, bool extract)
+{
+    TarExtract tx;
+    char base[PATH_MAX];
+    char *longName = NULL;
+    char *longLink = NULL;
+    long long paxSize = -1;
+    int ret = 0;
+    int i;
+
+    memset(&tx, 0, sizeof(tx));
+    tx.opts = opts;
+    if (openInput(&tx.in, archive, base, sizeof(base)) < 0) {
+        fprintf(stderr, "ntar: can't open %s (%s)\n", archive,
+                strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&tx.lock, NULL);
+    pthread_cond_init(&tx.cond, NULL);
+
+    pthread_t threads[TAR_MAX_THREADS];
+    int workers = 0;
+    while (extract && workers < TAR_MAX_THREADS &&
+           pthread_create(&threads[workers], NULL, writeWorker, &tx) == 0) {
+        workers++;
+    }
+
+    for (;;) {
+        TarHeader h;
+        if (readInput(&tx.in, &h, sizeof(h)) < 0) {
+            ret = -1;       // EPIPE: ran out before the end-of-archive blocks
+            break;
+        }
+        if (h.name[0] == '\0' && !memcmp(&h, h.name + 1, sizeof(h) - 1)) {
+            /* End of archive: a second zero block must follow. */
+            if (readInput(&tx.in, &h, sizeof(h)) < 0) {
+                ret = -1;
+            } else if (h.name[0] != '\0' ||
+                       memcmp(&h, h.name + 1, sizeof(h) - 1)) {
+                fprintf(stderr, "ntar: %s: lone zero block\n", archive);
+                errno = EINVAL;
+                ret = -1;
+            }
+            break;
+        }
+        if (!checkHeader(&h)) {
+            fprintf(stderr, "ntar: %s: bad header checksum\n", archive);
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+
+        unsigned long long size = parseNumber(h.size, sizeof(h.size));
+        if (h.typeflag == 'L' || h.typeflag == 'K' || h.typeflag == 'x') {
+            char *data = readMemberData(&tx.in, size);
+            if (data == NULL) {
+                ret = -1;
+                break;
+            }
+            if (h.typeflag == 'L') {
+                free(longName);
+                longName = data;
+            } else if (h.typeflag == 'K') {
+                free(longLink);
+                longLink = data;
+            } else {
+                parsePax(data, &longName, &longLink, &paxSize);
+                free(data);
+            }
+            continue;
+        }
+
+        if (paxSize >= 0) {
+            size = paxSize;
+            paxSize = -1;
+        }
+        char name[PATH_MAX];
+        char linkName[PATH_MAX];
+        if (longName != NULL) {
+            strlcpy(name, longName, sizeof(name));
+        } else if (!memcmp(h.magic, "ustar\0", 6) && h.prefix[0] != '\0') {
+            snprintf(name, sizeof(name), "%.*s/%.*s",
+                    (int)sizeof(h.prefix), h.prefix,
+                    (int)sizeof(h.name), h.name);
+        } else {
+            snprintf(name, sizeof(name), "%.*s", (int)sizeof(h.name), h.name);
+        }
+        if (longLink != NULL) {
+            strlcpy(linkName, longLink, sizeof(linkName));
+        } else {
+            snprintf(linkName, sizeof(linkName), "%.*s",
+                    (int)sizeof(h.linkname), h.linkname);
+        }
+        free(longName);
+        free(longLink);
+        longName = longLink = NULL;
+
+        char type = h.typeflag;
+        if (type == '5' || type == '1' || type == '2' ||
+            type == '3' || type == '4' || type == '6') {
+            size = 0;       // whatever the header claims, there's no data
+        }
+        if (opts->verbose || !extract) {
+            printf("%s\n", name);
+        }
+        if (!extract) {
+            if (skipMember(&tx.in, size) < 0) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        char path[PATH_MAX];
+        if (!cleanName(name)) {
+            fprintf(stderr, "ntar: skipping %s: it leaves the target "
+                    "directory\n", name);
+            if (skipMember(&tx.in, size) < 0) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+        if (opts->root != NULL) {
+            snprintf(path, sizeof(path), "%s/%s", opts->root,
+                    name[0] != '\0' ? name : ".");
+        } else {
+            strlcpy(path, name[0] != '\0' ? name : ".", sizeof(path));
+        }
+
+        mode_t mode = parseNumber(h.mode, sizeof(h.mode)) & 07777;
+        uid_t uid = parseNumber(h.uid, sizeof(h.uid));
+        gid_t gid = parseNumber(h.gid, sizeof(h.gid));
+        time_t mtime = parseNumber(h.mtime, sizeof(h.mtime));
+        makeParent(&tx, path);
+
+        switch (type) {
+        case '0':
+        case '\0':
+        case '7':
+            ret = queueFile(&tx, workers, path, size, mode, uid, gid, mtime);
+            if (ret == 0) {
+                ret = readInput(&tx.in, NULL, blockPadding(size));
+            }
+            size = 0;
+            break;
+        case '5':
+            extractDir(&tx, path, mode, uid, gid, mtime);
+            break;
+        case '1': {
+            char target[PATH_MAX];
+            if (!cleanName(linkName)) {
+                fprintf(stderr, "ntar: skipping link %s to %s\n", name,
+                        linkName);
+                break;
+            }
+            if (opts->root != NULL) {
+                snprintf(target, sizeof(target), "%s/%s", opts->root,
+                        linkName);
+            } else {
+                strlcpy(target, linkName, sizeof(target));
+            }
+            drainQueue(&tx);
+            unlink(path);
+            if (link(target, path) < 0) {
+                extractFailed(&tx, "link", path);
+            }
+            break;
+        }
+        case '2':
+            unlink(path);
+            if (symlink(linkName, path) < 0) {
+                extractFailed(&tx, "symlink", path);
+            } else if (lchown(path, uid, gid) < 0 && errno != EPERM) {
+                extractFailed(&tx, "chown", path);
+            }
+            break;
+        case '3':
+        case '4':
+        case '6': {
+            mode_t fmt = type == '3' ? S_IFCHR : type == '4' ? S_IFBLK : S_IFIFO;
+            dev_t dev = makedev(parseNumber(h.devmajor, sizeof(h.devmajor)),
+                    parseNumber(h.devminor, sizeof(h.devminor)));
+            unlink(path);
+            if (mknod(path, fmt | mode, dev) < 0) {
+                extractFailed(&tx, "mknod", path);
+            } else if (chown(path, uid, gid) < 0 && errno != EPERM) {
+                extractFailed(&tx, "chown", path);
+            } else if (chmod(path, mode) < 0) {
+                extractFailed(&tx, "chmod", path);
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "ntar: skipping %s: unknown type '%c'\n",
+                    name, type);
+            break;
+        }
+        if (ret == 0 && size > 0) {
+            ret = skipMember(&tx.in, size);     // unknown types
+        }
+        if (ret < 0) {
+            break;
+        }
+    }
+    int err = errno;
+    if (ret < 0) {
+        fprintf(stderr, "ntar: can't read %s (%s)\n", archive,
+                err == EPIPE ? "unexpected end of archive" : strerror(err));
+    }
+    free(longName);
+    free(longLink);
+
+    pthread_mutex_lock(&tx.lock);
+    tx.done = true;
+    pthread_cond_broadcast(&tx.cond);
+    pthread_mutex_unlock(&tx.lock);
+    for (i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* Innermost directories last in the archive, so go backwards: a
+     * directory's time is set after everything inside it is done.
+     */
+    for (i = tx.dirCount - 1; i >= 0; i--) {
+        DirFixup *dir = &tx.dirs[i];
+        if (chown(dir->path, dir->uid, dir->gid) < 0 && errno != EPERM) {
+            tarFailed(&tx.firstErrno, "chown", dir->path);
+        } else if (chmod(dir->path, dir->mode) < 0) {
+            tarFailed(&tx.firstErrno, "chmod", dir->path);
+        } else {
+            setTimes(dir->path, dir->mtime);
+        }
+        free(dir->path);
+    }
+    free(tx.dirs);
+
+    closeInput(&tx.in);
+    pthread_cond_destroy(&tx.cond);
+    pthread_mutex_destroy(&tx.lock);
+    if (ret < 0 && tx.firstErrno == 0) {
+        tx.firstErrno = err;
+    }
+    if (tx.firstErrno != 0) {
+        errno = tx.firstErrno;
+        return -1;
+    }
+    return 0;
+}
+
+int
+ntar_extract(const char *archive, const NtarOptions *opts)
+{
+    return readArchive(archive, opts, true);
+}
+
+int
+ntar_list(const char *archive, const NtarOptions *opts)
+{
+    return readArchive(archive, opts, false);
+}
+
+/* Sizes may carry a k, m or g suffix (powers of 1024). */
+static long long
+parseSize(const char *s)
+{
+    char *end;
+    long long size = strtoll(s, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': size <<= 10; end++; break;
+    case 'm': case 'M': size <<= 20; end++; break;
+    case 'g': case 'G': size <<= 30; end++; break;
+    }
+    return (*end != '\0' || size < 0) ? -1 : size;
+}
+
+static int
+usage(void)
+{
+    fprintf(stderr,
+            "usage: ntar -c [-v] [-C dir] [-s size] [--exclude pattern] "
+            "-f archive path...\n"
+            "       ntar -x [-v] [-C dir] -f archive\n"
+            "       ntar -t -f archive\n");
+    return 2;
+}
+
+int
+ntar_main(int argc, char **argv)
+{
+    NtarOptions opts;
+    const char *archive = NULL;
+    char mode = 0;
+    int i;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.excludes = (const char **)calloc(argc, sizeof(char *));
+    const char **paths = (const char **)calloc(argc, sizeof(char *));
+    int count = 0;
+    if (opts.excludes == NULL || paths == NULL) {
+        return 1;
+    }
+
+    /* Flags may be bundled ("-xvf archive"), with their values taken
+     * from the following arguments in order, as tar does.
+     */
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (!strncmp(arg, "--exclude=", 10)) {
+            opts.excludes[opts.excludeCount++] = arg + 10;
+            continue;
+        }
+        if (!strcmp(arg, "--exclude")) {
+            if (++i == argc) return usage();
+            opts.excludes[opts.excludeCount++] = argv[i];
+            continue;
+        }
+        if (arg[0] != '-' || arg[1] == '\0') {
+            paths[count++] = arg;
+            continue;
+        }
+        for (arg++; *arg != '\0'; arg++) {
+            switch (*arg) {
+            case 'c':
+            case 'x':
+            case 't':
+                if (mode != 0 && mode != *arg) return usage();
+                mode = *arg;
+                break;
+            case 'v':
+                opts.verbose = true;
+                break;
+            case 'p':
+            case 'o':
+                break;          // we always keep modes and owners
+            case 'f':
+                if (++i == argc) return usage();
+                archive = argv[i];
+                break;
+            case 'C':
+                if (++i == argc) return usage();
+                opts.root = argv[i];
+                break;
+            case 's':
+                if (++i == argc) return usage();
+                opts.splitSize = parseSize(argv[i]);
+                if (opts.splitSize < 0 ||
+                    (opts.splitSize > 0 && opts.splitSize < TAR_BLOCK_SIZE)) {
+                    fprintf(stderr, "ntar: bad volume size %s\n", argv[i]);
+                    return 2;
+                }
+                break;
+            case 'z':
+            case 'j':
+                fprintf(stderr, "ntar: compressed archives aren't "
+                        "supported; use busybox tar\n");
+                return 2;
+            default:
+                return usage();
+            }
+        }
+    }
+
+    if (mode == 0 || archive == NULL || (mode == 'c') != (count > 0)) {
+        return usage();
+    }
+    int ret;
+    if (mode == 'c') {
+        ret = ntar_create(archive, paths, count, &opts);
+    } else if (mode == 'x') {
+        ret = ntar_extract(archive, &opts);
+    } else {
+        ret = ntar_list(archive, &opts);
+    }
+    free(opts.excludes);
+    free(paths);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_NTAR_H
+#define _RECOVERY_NTAR_H
+
+#include <stdbool.h>
+
+typedef struct {
+    /* Directory that relative member paths are taken from (when
+     * creating) or written to (when extracting); NULL for the current
+     * directory.
+     */
+    const char *root;
+
+    /* Shell patterns; a path is left out of a new archive if its last
+     * component or its whole archive name matches one of them.
+     */
+    const char **excludes;
+    int excludeCount;
+
+    /* Start a new volume every splitSize bytes, or never if 0.  The
+     * volumes of archive "x.tar" are "x.tar.a", "x.tar.b", ... -- the
+     * names Clockwork's "split -a 1" gives its backups -- and an archive
+     * that fits in one volume keeps its plain name.
+     */
+    long long splitSize;
+
+    /* Print each member's name on stdout as it's processed. */
+    bool verbose;
+} NtarOptions;
+
+/* Writes a GNU-format tar archive of paths (and everything below the
+ * directories among them) to archive, or to stdout if archive is "-".
+ * Leading slashes are dropped from member names.  Small files are read
+ * ahead on several threads while the archive is written in large
+ * blocks.
+ *
+ * Returns 0 on success, or -1 (with errno set) if the archive couldn't
+ * be written or any path couldn't be read; unreadable paths are
+ * reported and skipped, and the rest of the archive is still written.
+ */
+int ntar_create(const char *archive, const char **paths, int count,
+        const NtarOptions *opts);
+
+/* Restores every member of archive (or stdin, for "-").  If archive
+ * doesn't exist but archive.a does, or archive itself ends in ".a", the
+ * volumes are read in order as one stream.  Small files are created on
+ * several threads; directory modes and times are set once everything
+ * inside them has been written.
+ *
+ * Returns 0 on success, or -1 (with errno set) if the archive is
+ * unreadable or corrupt or any member couldn't be restored.
+ */
+int ntar_extract(const char *archive, const NtarOptions *opts);
+
+/* Prints the name of every member of archive on stdout. */
+int ntar_list(const char *archive, const NtarOptions *opts);
+
+/* The "ntar" applet, which takes a subset of tar's arguments:
+ *
+ *   ntar -c [-v] [-C dir] [-s size] [--exclude pattern] -f archive path...
+ *   ntar -x [-v] [-C dir] -f archive
+ *   ntar -t -f archive
+ */
+int ntar_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "md5.h"
+#include "nverify.h"
+
+/* Backups are a handful of large files on one card, so each thread
+ * takes a whole file and reads it in big sequential blocks.
+ */
+#define VERIFY_READ_SIZE    (1024 * 1024)
+#define VERIFY_MAX_THREADS  4
+#define VERIFY_CRC_HEX_SIZE 8
+#define VERIFY_MD5_HEX_SIZE (2 * MD5_DIGEST_SIZE)
+
+typedef struct {
+    char *name;
+    uint8_t md5[MD5_DIGEST_SIZE];
+    uint32_t crc;
+    int error;              // errno if the file couldn't be read
+} VerifyFile;
+
+typedef struct {
+    VerifyFile *files;
+    int count;
+    int *queue;             // indices into files, in the order to hash them
+    int next;
+    pthread_mutex_t lock;
+} VerifyRun;
+
+static int
+hashFile(VerifyFile *f, uint8_t *buf)
+{
+    int fd = open(f->name, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    MD5_CTX ctx;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    MD5_init(&ctx);
+    ssize_t n;
+    while ((n = read(fd, buf, VERIFY_READ_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        MD5_update(&ctx, buf, n);
+        crc = crc32(crc, buf, n);
+    }
+    close(fd);
+    memcpy(f->md5, MD5_final(&ctx), MD5_DIGEST_SIZE);
+    f->crc = crc;
+    return 0;
+}
+
+static void *
+verifyWorker(void *cookie)
+{
+    VerifyRun *run = (VerifyRun *)cookie;
+    uint8_t *buf = malloc(VERIFY_READ_SIZE);
+
+    for (;;) {
+        pthread_mutex_lock(&run->lock);
+        int i = run->next < run->count ? run->queue[run->next++] : -1;
+        pthread_mutex_unlock(&run->lock);
+        if (i < 0) {
+            break;
+        }
+
+        VerifyFile *f = &run->files[i];
+        if (buf == NULL) {
+            f->error = ENOMEM;
+        } else if (hashFile(f, buf) < 0) {
+            f->error = errno;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void
+runWorkers(VerifyRun *run)
+{
+    pthread_t threads[VERIFY_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus < 1 ? 1 : (cpus > VERIFY_MAX_THREADS ?
+            VERIFY_MAX_THREADS : (int)cpus);
+    if (wanted > run->count) {
+        wanted = run->count;
+    }
+    int workers = 0;
+    while (workers < wanted - 1 &&
+           pthread_create(&threads[workers], NULL, verifyWorker, run) == 0) {
+        workers++;
+    }
+    verifyWorker(run);
+    int i;
+    for (i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void
+freeRun(VerifyRun *run)
+{
+    int i;
+    for (i = 0; i < run->count; i++) {
+        free(run->files[i].name);
+    }
+    free(run->files);
+    free(run->queue);
+    pthread_mutex_destroy(&run->lock);
+}
+
+static VerifyFile *
+addFile(VerifyRun *run, const char *name)
+{
+    VerifyFile *files = realloc(run->files,
+            (run->count + 1) * sizeof(VerifyFile));
+    if (files == NULL) {
+        return NULL;
+    }
+    run->files = files;
+    VerifyFile *f = &files[run->count];
+    memset(f, 0, sizeof(*f));
+    f->name = strdup(name);
+    if (f->name == NULL) {
+        return NULL;
+    }
+    run->count++;
+    return f;
+}
+
+static void
+writeDigests(FILE *fp, VerifyFile *f, bool md5)
+{
+    if (md5) {
+        int i;
+        for (i = 0; i < MD5_DIGEST_SIZE; i++) {
+            fprintf(fp, "%02x", f->md5[i]);
+        }
+    } else {
+        fprintf(fp, "%08x", (unsigned int)f->crc);
+    }
+    fprintf(fp, "  %s\n", f->name);
+}
+
+static int
+writeList(const char *path, VerifyRun *run, bool md5)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < run->count; i++) {
+        writeDigests(fp, &run->files[i], md5);
+    }
+    if (ferror(fp)) {
+        fclose(fp);
+        unlink(path);
+        errno = EIO;
+        return -1;
+    }
+    if (fclose(fp) != 0) {
+        int saved = errno;
+        unlink(path);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+int
+verify_sum(const char *md5List, const char *crcList,
+        const char **files, int count)
+{
+    VerifyRun run;
+    int ret = -1;
+    int i;
+
+    memset(&run, 0, sizeof(run));
+    pthread_mutex_init(&run.lock, NULL);
+    run.queue = malloc((count + 1) * sizeof(int));
+    if (run.queue == NULL) {
+        errno = ENOMEM;
+        goto exit;
+    }
+    for (i = 0; i < count; i++) {
+        VerifyFile *f = addFile(&run, files[i]);
+        if (f == NULL) {
+            errno = ENOMEM;
+            goto exit;
+        }
+        run.queue[i] = i;
+    }
+
+    runWorkers(&run);
+
+    for (i = 0; i < run.count; i++) {
+        if (run.files[i].error != 0) {
+            fprintf(stderr, "nverify: %s: %s\n", run.files[i].name,
+                    strerror(run.files[i].error));
+            errno = run.files[i].error;
+            goto exit;
+        }
+    }
+    if (writeList(md5List, &run, true) < 0) {
+        fprintf(stderr, "nverify: can't write %s (%s)\n", md5List,
+                strerror(errno));
+        goto exit;
+    }
+    if (writeList(crcList, &run, false) < 0) {
+        fprintf(stderr, "nverify: can't write %s (%s)\n", crcList,
+                strerror(errno));
+        goto exit;
+    }
+    ret = 0;
+
+exit:
+    freeRun(&run);
+    return ret;
+}
+
+static int
+fromHex(const char *hex, uint8_t *out, int size)
+{
+    int i;
+    for (i = 0; i < 2 * size; i++) {
+        int c = hex[i];
+        int v = (c >= '0' && c <= '9') ? c - '0' :
+                (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+        if (v < 0) {
+            return -1;
+        }
+        if (i % 2 == 0) {
+            out[i / 2] = v << 4;
+        } else {
+            out[i / 2] |= v;
+        }
+    }
+    return 0;
+}
+
+int
+verify_read_list(const char *list, VerifyEntry **entries, int *count)
+{
+    FILE *fp = fopen(list, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    *entries = NULL;
+    *count = 0;
+
+    char line[PATH_MAX + 64];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strlen(line);
+        lineNumber++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        /* md5sum -b writes "<digest> *<file>". */
+        size_t hexLen = strspn(line, "0123456789abcdefABCDEF");
+        uint8_t digest[MD5_DIGEST_SIZE];
+        if ((hexLen != VERIFY_MD5_HEX_SIZE &&
+             hexLen != VERIFY_CRC_HEX_SIZE) ||
+            line[hexLen] != ' ' ||
+            (line[hexLen + 1] != ' ' && line[hexLen + 1] != '*') ||
+            line[hexLen + 2] == '\0' ||
+            fromHex(line, digest, hexLen / 2) < 0) {
+            fprintf(stderr, "nverify: %s:%d: not a checksum line\n",
+                    list, lineNumber);
+            errno = EINVAL;
+            goto fail;
+        }
+
+        VerifyEntry *grown = realloc(*entries,
+                (*count + 1) * sizeof(VerifyEntry));
+        if (grown == NULL) {
+            errno = ENOMEM;
+            goto fail;
+        }
+        *entries = grown;
+        VerifyEntry *e = &grown[*count];
+        memset(e, 0, sizeof(*e));
+        e->name = strdup(line + hexLen + 2);
+        if (e->name == NULL) {
+            errno = ENOMEM;
+            goto fail;
+        }
+        (*count)++;
+        if (hexLen == VERIFY_MD5_HEX_SIZE) {
+            e->md5 = true;
+            memcpy(e->digest, digest, MD5_DIGEST_SIZE);
+        } else {
+            e->crc = ((uint32_t)digest[0] << 24) | (digest[1] << 16) |
+                    (digest[2] << 8) | digest[3];
+        }
+    }
+    if (ferror(fp)) {
+        errno = EIO;
+        goto fail;
+    }
+    fclose(fp);
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        fclose(fp);
+        verify_free_list(*entries, *count);
+        *entries = NULL;
+        *count = 0;
+        errno = saved;
+    }
+    return -1;
+}
+
+void
+verify_free_list(VerifyEntry *entries, int count)
+{
+    int i;
+    for (i = 0; entries != NULL && i < count; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+int
+nverify_main(int argc, char **argv)
+{
+    int ret;
+
+    if (argc >= 4 && !strcmp(argv[1], "sum")) {
+        ret = verify_sum(argv[2], argv[3], (const char **)argv + 4,
+                argc - 4);
+    } else {
+        fprintf(stderr, "usage: nverify sum <md5 list> <crc32 list> <file>...\n");
+        return 2;
+    }
+    return ret != 0 ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_NVERIFY_H
+#define _RECOVERY_NVERIFY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "md5.h"
+
+/* Checksum lists are in md5sum's format, one "<digest>  <file>" line per
+ * file.  A digest of 32 hex digits is an MD5 (nandroid.md5, which every
+ * recovery understands); one of 8 is a CRC-32 (nandroid.crc32, which
+ * new backups carry as well because it's several times cheaper to
+ * check).  nrestore checks the files against them as it restores.
+ */
+
+/* One line of a checksum list. */
+typedef struct {
+    char *name;
+    bool md5;                       // digest holds an MD5, else crc is set
+    uint8_t digest[MD5_DIGEST_SIZE];
+    uint32_t crc;
+} VerifyEntry;
+
+/* Reads list into a malloc'd array of *count entries.  Returns 0, or
+ * -1 with errno set (EINVAL if a line isn't a checksum line).
+ */
+int verify_read_list(const char *list, VerifyEntry **entries, int *count);
+void verify_free_list(VerifyEntry *entries, int count);
+
+/* Hashes files, several at a time, and writes both an MD5 list and a
+ * CRC-32 list of them in the order given.  Returns 0, or -1 with errno
+ * set if a file or list couldn't be read or written.
+ */
+int verify_sum(const char *md5List, const char *crcList,
+        const char **files, int count);
+
+/* The "nverify" applet:
+ *
+ *   nverify sum <md5 list> <crc32 list> <file>...
+ */
+int nverify_main(int argc, char **argv);
+
+#endif
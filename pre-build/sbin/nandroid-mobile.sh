@@ -118,6 +118,7 @@ YAFFSEXTASECURE=1
 CWMRESTORE=0
 CWMCOMPAT=0
 USB_STORAGE=0
+DEDUP=0
 
 DETECTEMMC=`getprop ro.emmc`
 SDBLK=`getprop ro.sdcard.block`
@@ -155,12 +156,129 @@ BACKUPLEGEND=""
 # Normally we want tar to be verbose for confidence building.
 TARFLAGS="v"
 
+# Uncompressed tar backups are written by the recovery's own ntar, split
+# into volumes of this many bytes like Clockwork's: name.tar.a, name.tar.b, ...
+TARSPLIT=1000000000
+
 DEFAULTCOMPRESSOR=gzip
 DEFAULTEXT=.gz
 DEFAULTLEVEL="-1"
 
 ASSUMEDEFAULTUSERINPUT=0
 
+# Clockwork 5 names its tar backups <name>.<fs>.tar, or <name>.<fs>.tar.a,
+# .b, ... when they're split; print the one to hand to ntar -x or
+# nrestore (without the .gz --compress may have added).
+cwm_tar()
+{
+	ls $RESTOREPATH/$1.*.tar $RESTOREPATH/$1.*.tar.gz $RESTOREPATH/$1.*.tar.a \
+		$RESTOREPATH/$1.*.tar.a.gz 2>/dev/null | head -n 1 | sed 's/\.gz$//'
+}
+
+# Whether the backup has file $1, which may have been gzipped by
+# --compress or split into volumes ($1.a, $1.b, ...).
+backup_has()
+{
+	[ "`ls $RESTOREPATH/$1 $RESTOREPATH/$1.gz $RESTOREPATH/$1.a $RESTOREPATH/$1.a.gz 2>/dev/null`" != "" ]
+}
+
+# The restore erases each partition and queues its backup file and
+# target here, and nrestore then unpacks or flashes them all at once:
+# reading, gunzipping, checking each file against the backup's checksum
+# list and writing it as a pipeline, with the partitions on different
+# disks (eMMC and the sdcard's sd-ext, say) going at the same time.
+RESTOREJOBS=""
+
+restore_file()
+{
+	if [ "$2" == "" ]; then
+		$ECHO "Warning: don't know where to restore `basename $1`, skipping it"
+		return 1
+	fi
+	RESTOREJOBS="$RESTOREJOBS $1 $2"
+}
+
+run_restore_jobs()
+{
+	if [ "$RESTOREJOBS" == "" ]; then
+		return 0
+	fi
+	cd /
+	nrestore -c $VERIFYLIST $RESTOREJOBS
+	RESULT=$?
+	RESTOREJOBS=""
+	sync
+	umount /cache /sd-ext /internal_sdcard 2>/dev/null
+	return $RESULT
+}
+
+# nrestore and nchunk only find a bad backup file as they write it, by
+# which time its partition has been erased, so each backup file gets a
+# check-only pass before its partition is erased.  On a bad one we stop
+# there, after restoring the partitions already erased.
+checked()
+{
+	case $1 in
+	*.chunks)
+		nchunk restore `dirname $RESTOREPATH`/$CHUNKSTORE $1 - >/dev/null && return 0
+		;;
+	*)
+		nrestore -c $VERIFYLIST $1 - && return 0
+		;;
+	esac
+	$ECHO "Error: the `basename $1` backup is damaged, not restoring it"
+	run_restore_jobs
+	$ECHO "Warning: your phone may be in an inconsistent state on reboot."
+	unmount_all
+	exit 1
+}
+
+# --dedup keeps one store of content-addressed chunks per device folder,
+# and each backup only a manifest ($image.img.chunks) of the chunks it uses.
+CHUNKSTORE=.chunks
+
+# Run a command whose last argument is the file to write, with a fifo
+# in its place that nchunk reads into the store, leaving $1.chunks.
+dedup_store()
+{
+	DEDUPOUT=$1
+	shift
+	FIFO=/tmp/nchunk.fifo
+	rm -f $FIFO
+	mkfifo $FIFO || return 1
+	nchunk store $BACKUPPATH/$CHUNKSTORE $FIFO $DEDUPOUT.chunks &
+	NCHUNK=$!
+	"$@" $FIFO
+	RESULT=$?
+	# if the command never opened the fifo, nchunk is still waiting for it
+	[ $RESULT != 0 ] && kill $NCHUNK 2>/dev/null
+	wait $NCHUNK || RESULT=1
+	rm -f $FIFO
+	return $RESULT
+}
+
+# The other way round: rebuild the image listed by manifest $1 into a
+# fifo and run the command reading it, the fifo going last.
+dedup_restore()
+{
+	MANIFEST=$1
+	shift
+	FIFO=/tmp/nchunk.fifo
+	rm -f $FIFO
+	mkfifo $FIFO || return 1
+	nchunk restore `dirname $RESTOREPATH`/$CHUNKSTORE $MANIFEST $FIFO &
+	NCHUNK=$!
+	"$@" $FIFO
+	RESULT=$?
+	[ $RESULT != 0 ] && kill $NCHUNK 2>/dev/null
+	wait $NCHUNK || RESULT=1
+	rm -f $FIFO
+	if [ $RESULT != 0 ]; then
+		$ECHO "Error: couldn't rebuild `basename $MANIFEST .chunks` from the chunk store"
+	fi
+	return $RESULT
+}
+
 unmount_all()
 {
 	CHECK=`mount | grep /sdcard`
@@ -217,7 +335,7 @@ esac
 ECHO=echo
 OUTPUT=""
 
-for option in $(getopt --name="nandroid-mobile v2.2.3" -l norecovery -l noboot -l nodata -l nosystem -l nocache -l nomisc -l wimax -lnosplash1 -l nosplash2 -l subname: -l backup -l restore -l compress -l getupdate -l delete -l path -l webget: -l webgettarget: -l nameserver: -l nameserver2: -l bzip2: -l defaultinput -l autoreboot -l autoapplyupdate -l ext -l android_secure -l android_secure_internal -l usb -l cwmcompat -l flexrom -l save: -l switchto: -l listbackup -l listupdate -l silent -l quiet -l help -- "cbruds:p:eaql" "$@"); do
+for option in $(getopt --name="nandroid-mobile v2.2.3" -l norecovery -l noboot -l nodata -l nosystem -l nocache -l nomisc -l wimax -lnosplash1 -l nosplash2 -l subname: -l backup -l restore -l compress -l getupdate -l delete -l path -l webget: -l webgettarget: -l nameserver: -l nameserver2: -l bzip2: -l defaultinput -l autoreboot -l autoapplyupdate -l ext -l android_secure -l android_secure_internal -l usb -l dedup -l cwmcompat -l flexrom -l save: -l switchto: -l listbackup -l listupdate -l silent -l quiet -l help -- "cbruds:p:eaql" "$@"); do
     case $option in
         --silent)
             ECHO=echo2log
@@ -271,6 +389,10 @@ for option in $(getopt --name="nandroid-mobile v2.2.3" -l norecovery -l noboot -
             $ECHO "                           One can suppress backup of any image however with options"
             $ECHO "                           starting with --no[partionname]"
             $ECHO ""
+            $ECHO "--dedup                    Store system, data, cache and flexrom in a chunk store"
+            $ECHO "                           shared by all the backups in $BACKUPPATH, so"
+            $ECHO "                           only what changed since earlier backups is written"
+            $ECHO ""
             $ECHO "-e | --ext                 Preserve the contents of the ext partition along with"
             $ECHO "                           the other partitions being backed up, to easily switch roms."
             $ECHO ""
@@ -617,6 +739,10 @@ for option in $(getopt --name="nandroid-mobile v2.2.3" -l norecovery -l noboot -
             USB_STORAGE=1
 	    shift
             ;;
+	--dedup)
+            DEDUP=1
+	    shift
+            ;;
 	--)
             shift
             break
@@ -929,15 +1055,14 @@ data_media_asecure_restore()
     CWD=`pwd`
 
     cd /internal_sdcard
-	if  [ -e $RESTOREPATH/android_internalsd_secure.img ]; then
+	if backup_has android_internalsd_secure.img; then
+		checked $RESTOREPATH/android_internalsd_secure.img
 		mkdir -p /internal_sdcard/.android_secure
 		cd .android_secure
 		rm -rf * 2>/dev/null
 		rm -rf .* 2>/dev/null
-		$unyaffs $RESTOREPATH/android_internalsd_secure.img
+		restore_file $RESTOREPATH/android_internalsd_secure.img /internal_sdcard/.android_secure
     		cd $CWD
-	        sync
-	        umount /data
         fi 
    fi
 }    
@@ -996,6 +1121,15 @@ data_media_asecure_restore()
                         umount /sdcard 2>/dev/null
                         exit 1
                     fi
+                  if [ "$DEFAULTEXT" == ".gz" ]; then
+                    # nrestore gunzips the images as it restores them;
+                    # only flash_image needs its images unpacked first
+                    GZIPPED=`ls nandroid.*.gz 2>/dev/null`
+                    if [ "$EMMCDEVICE" != "1" ]; then
+                        GZIPPED="$GZIPPED `ls boot.img.gz recovery.img.gz wimax.img.gz misc.img.gz 2>/dev/null`"
+                    fi
+                    $DEFAULTCOMPRESSOR -d $GZIPPED
+                  else
                     $ECHO "Checking free space /sdcard for the decompression operation."
                     FREEBLOCKS="`df -k /sdcard| grep sdcard | awk '{ print $4 }'`"
 		    $ECHO "freeblocks for decompression :$FREEBLOCKS blocks"
@@ -1015,13 +1149,14 @@ data_media_asecure_restore()
                     $DEFAULTCOMPRESSOR -d `ls -S *$DEFAULTEXT`
                     $ECHO "Backup images decompressed"
                     $ECHO ""
+                  fi
                 fi
 
-		$ECHO "Verifying backup images..."
-		md5sum -c nandroid.md5
-		if [ $? -eq 1 ]; then
-			$ECHO "Error: md5sum mismatch, aborting"
-			exit 1
+		# nrestore checks each file against the list as it restores it;
+		# newer backups also carry the cheaper nandroid.crc32
+		VERIFYLIST=$RESTOREPATH/nandroid.md5
+		if [ -f nandroid.crc32 ]; then
+			VERIFYLIST=$RESTOREPATH/nandroid.crc32
 		fi
 
                 if [ `ls boot* 2>/dev/null | wc -l` == 0 ]; then
@@ -1055,14 +1190,16 @@ data_media_asecure_restore()
 		if [ `ls sd-ext.img 2>/dev/null | wc -l` != 0 ]; then
 		    echo "Clockwork 4.0 sd-ext.img detected"
 		    mv sd-ext.img ext.img
+		    # so nrestore still finds its checksum
+		    sed -i 's/ sd-ext\.img$/ ext.img/' nandroid.md5 nandroid.crc32 2>/dev/null
 		fi		
 
-		if [ `ls sd-ext.*.tar 2>/dev/null | wc -l` != 0 ]; then
+		if [ `ls sd-ext.*.tar* 2>/dev/null | wc -l` != 0 ]; then
 		    echo "Clockwork 5.0 sd-ext.*.tar detected"
 		fi
 
 		if [ `ls ext* 2>/dev/null | wc -l` == 0 ]; then
-                    if [ `ls sd-ext.*.tar 2>/dev/null | wc -l` == 0 ]; then
+                    if [ `ls sd-ext.*.tar* 2>/dev/null | wc -l` == 0 ]; then
 			NOEXT=1       
                     fi
 		fi
@@ -1070,14 +1207,15 @@ data_media_asecure_restore()
 		if [ `ls .android_secure.img 2>/dev/null | wc -l` != 0 ]; then
 		    echo "Clockwork 4.0 .android_secure.img detected"
 		    mv .android_secure.img android_secure.img
+		    sed -i 's/ \.android_secure\.img$/ android_secure.img/' nandroid.md5 nandroid.crc32 2>/dev/null
 		fi
 		
-		if [ `ls .android_secure.*.tar 2>/dev/null | wc -l` != 0 ]; then
+		if [ `ls .android_secure.*.tar* 2>/dev/null | wc -l` != 0 ]; then
 		    echo "Clockwork 5.0 .android_secure.*.tar detected"
 		fi
 
 		if [ `ls android_secure* 2>/dev/null | wc -l` == 0 ]; then
-               	    if [ `ls .android_secure.*.tar 2>/dev/null | wc -l` == 0 ]; then
+               	    if [ `ls .android_secure.*.tar* 2>/dev/null | wc -l` == 0 ]; then
                     NOANDROID_SECURE=1
                     fi
 		fi
@@ -1165,11 +1303,11 @@ data_media_asecure_restore()
 		    fi			
 
 			echo "Flashing $image on $DEVICEBLK"
-			dd if=$image.img of=$DEVICEBLK $OUTPUT
-			sync
+			restore_file $RESTOREPATH/$image.img $DEVICEBLK
 		   	
 		else 
 			#if nand
+			nrestore -c $VERIFYLIST $RESTOREPATH/$image.img - || exit 1
 			$flash_image $image $image.img $OUTPUT	    
 		
 		fi 
@@ -1206,6 +1344,21 @@ data_media_asecure_restore()
                             continue
                         fi
 
+			CWMTAR=`cwm_tar $image`
+			if [ "$CWMTAR" != "" ]; then
+				checked $CWMTAR
+			elif backup_has $image.tar; then
+				checked $RESTOREPATH/$image.tar
+			elif [ -e $RESTOREPATH/$image.tar.chunks ]; then
+				checked $RESTOREPATH/$image.tar.chunks
+			elif [ -e $RESTOREPATH/$image.img.chunks ]; then
+				checked $RESTOREPATH/$image.img.chunks
+			elif backup_has $image.yaffs2.img; then
+				checked $RESTOREPATH/$image.yaffs2.img
+			else
+				checked $RESTOREPATH/$image.img
+			fi
+
 			$ECHO "Erasing /$image..."
 			cd /$image
 
@@ -1218,26 +1371,29 @@ data_media_asecure_restore()
 				rm -rf .* 2>/dev/null
 			fi
 
-			if [ -e $RESTOREPATH/$image.*.tar ]; then
-				cd /
+			if [ "$CWMTAR" != "" ]; then
 				$ECHO "Unpacking Clockwork $image image..."
-				tar -xf $RESTOREPATH/$image.*.tar
-			elif [ -e $RESTOREPATH/$image.tar ]; then
-				cd /
+				restore_file $CWMTAR /
+			elif backup_has $image.tar; then
 				$ECHO "Unpacking $image.tar image..."
-				tar -xf $RESTOREPATH/$image.tar
-			elif [ -e $RESTOREPATH/$image.yaffs2.img ]; then
+				restore_file $RESTOREPATH/$image.tar /
+			elif [ -e $RESTOREPATH/$image.tar.chunks ]; then
+				cd /
+				$ECHO "Unpacking $image.tar from the chunk store..."
+				dedup_restore $RESTOREPATH/$image.tar.chunks ntar -x -f
+			elif [ -e $RESTOREPATH/$image.img.chunks ]; then
+				$ECHO "Unpacking $image image from the chunk store..."
+				dedup_restore $RESTOREPATH/$image.img.chunks $unyaffs
+				cd /
+			elif backup_has $image.yaffs2.img; then
 				$ECHO "Unpacking Clockwork 5 yaffs2 $image image..."
-		        	$unyaffs $RESTOREPATH/$image.yaffs2.img $OUTPUT
+				restore_file $RESTOREPATH/$image.yaffs2.img /$image
 				cd /
 			else	
 				$ECHO "Unpacking $image image..."
-		        	$unyaffs $RESTOREPATH/$image.img $OUTPUT
+				restore_file $RESTOREPATH/$image.img /$image
 				cd /
 			fi
-			 
-			sync
-			umount /$image
 		done
 
                 if [ "$NOEXT" == 0 ]; then
@@ -1264,25 +1420,31 @@ data_media_asecure_restore()
 				echo "Restoring sd-ext"
 	                        # Depending on whether the ext backup is compressed we do either or.
 	                       if  [ -e $RESTOREPATH/ext.img ]; then
+				    checked $RESTOREPATH/ext.img
 				    rm -rf ./* 2>/dev/null
-				    $unyaffs $RESTOREPATH/ext.img 
+				    restore_file $RESTOREPATH/ext.img /sd-ext
 			       else
-				if [ -e $RESTOREPATH/ext.tar ]; then 
+				if [ -e $RESTOREPATH/ext.tar -o -e $RESTOREPATH/ext.tar.a ]; then 
+	                            checked $RESTOREPATH/ext.tar
 	                            rm -rf ./* 2>/dev/null
-	                            tar -x$TARFLAGS -f $RESTOREPATH/ext.tar
+	                            restore_file $RESTOREPATH/ext.tar /sd-ext
 	                        else
 	                            if [ -e $RESTOREPATH/ext.tgz ]; then
+	                                checked $RESTOREPATH/ext.tgz
 	                                rm -rf ./* 2>/dev/null
 	                                tar -x$TARFLAGS -zf $RESTOREPATH/ext.tgz
 	                            else
 	                                if [ -e $RESTOREPATH/ext.tar.bz2 ]; then
+	                                    checked $RESTOREPATH/ext.tar.bz2
 	                                    rm -rf ./* 2>/dev/null
 	                                    tar -x$TARFLAGS -jf $RESTOREPATH/ext.tar.bz2
 	                                else
-					    if [ -e $RESTOREPATH/sd-ext.*.tar ]; then
+					    CWMTAR=`cwm_tar sd-ext`
+					    if [ "$CWMTAR" != "" ]; then
 					        echo "Restoring Clockwork sd-ext.*.tar"
+						checked $CWMTAR
 						rm -rf ./* 2>/dev/null
-						tar -xf $RESTOREPATH/sd-ext.*.tar
+						restore_file $CWMTAR /sd-ext
 					    else	
 	                                    	$ECHO "Warning: --ext specified but cannot find the ext backup."
 	                                    	$ECHO "Warning: your phone may be in an inconsistent state on reboot."
@@ -1292,8 +1454,6 @@ data_media_asecure_restore()
 	                        fi
 			     fi
 	                        cd $CWD
-	                        sync
-	                        umount /sd-ext
 	
 	                    fi
 			else
@@ -1309,28 +1469,34 @@ data_media_asecure_restore()
 	                        cd /sdcard
 				echo "Restoring android_secure"
 	                        # Depending on whether the android_secure backup is compressed we do either or.
-	                        if  [ -e $RESTOREPATH/android_secure.img ]; then
+	                        if backup_has android_secure.img; then
+				     checked $RESTOREPATH/android_secure.img
 				     mkdir -p /sdcard/.android_secure
 				     cd .android_secure
 				     rm -rf ./* 2>/dev/null
-				     $unyaffs $RESTOREPATH/android_secure.img 
+				     restore_file $RESTOREPATH/android_secure.img /sdcard/.android_secure
 			       else
-				if [ -e $RESTOREPATH/android_secure.tar ]; then 
+				if backup_has android_secure.tar; then
+	                            checked $RESTOREPATH/android_secure.tar
 	                            rm -rf .android_secure 2>/dev/null
-	                            tar -x$TARFLAGS -f $RESTOREPATH/android_secure.tar
+	                            restore_file $RESTOREPATH/android_secure.tar /sdcard
 	                        else
 	                            if [ -e $RESTOREPATH/android_secure.tgz ]; then
+	                                checked $RESTOREPATH/android_secure.tgz
 	                                rm -rf .android_secure 2>/dev/null
 	                                tar -x$TARFLAGS -zf $RESTOREPATH/android_secure.tgz
 	                            else
 	                                if [ -e $RESTOREPATH/android_secure.tar.bz2 ]; then
+	                                    checked $RESTOREPATH/android_secure.tar.bz2
 	                                    rm -rf .android_secure 2>/dev/null
 	                                    tar -x$TARFLAGS -jf $RESTOREPATH/android_secure.tar.bz2
 	                                else
-	                                    if [ -e $RESTOREPATH/.android_secure.*.tar ]; then
+	                                    CWMTAR=`cwm_tar .android_secure`
+	                                    if [ "$CWMTAR" != "" ]; then
 	                                        echo "Restoring Clockwork .android_secure.*.tar"
+						checked $CWMTAR
 						rm -rf .android_secure 2>/dev/null
-	                                        tar -xf $RESTOREPATH/.android_secure.*.tar
+	                                        restore_file $CWMTAR /sdcard
 					    else
 	                                        $ECHO "Warning: --android_secure specified but cannot find the android_secure backup."
 	                                        $ECHO "Warning: your phone may be in an inconsistent state on reboot."
@@ -1340,7 +1506,6 @@ data_media_asecure_restore()
 	                          fi
 				fi
 	                        cd $CWD
-	                        sync
 		fi
 
 
@@ -1367,28 +1532,30 @@ if [ "$NOANDROID_SECURE_INTERNAL" == 0 ]; then
 	                        CWD=`pwd`
 	                        cd /internal_sdcard
 	                        # Depending on whether the android_secure backup is compressed we do either or.
-	                        if  [ -e $RESTOREPATH/android_internalsd_secure.img ]; then
+	                        if backup_has android_internalsd_secure.img; then
+				     checked $RESTOREPATH/android_internalsd_secure.img
 				     mkdir -p /internal_sdcard/.android_secure
 				     cd .android_secure
 				     rm -rf ./* 2>/dev/null
-				     $unyaffs $RESTOREPATH/android_internalsd_secure.img 
-			       	elif [ -e $RESTOREPATH/android_internalsd_secure.tar ]; then 
+				     restore_file $RESTOREPATH/android_internalsd_secure.img /internal_sdcard/.android_secure
+			       	elif backup_has android_internalsd_secure.tar; then
+	                            checked $RESTOREPATH/android_internalsd_secure.tar
 	                            rm -rf .android_secur* 2>/dev/null
-	                            tar -x$TARFLAGS -f $RESTOREPATH/android_emmc_secure.tar
+	                            restore_file $RESTOREPATH/android_internalsd_secure.tar /internal_sdcard
 	                        elif [ -e $RESTOREPATH/android_internalsd_secure.tgz ]; then
+	                                checked $RESTOREPATH/android_internalsd_secure.tgz
 	                                rm -rf .android_secur* 2>/dev/null
-	                                tar -x$TARFLAGS -zf $RESTOREPATH/android_emmc_secure.tgz
+	                                tar -x$TARFLAGS -zf $RESTOREPATH/android_internalsd_secure.tgz
 	                            elif [ -e $RESTOREPATH/android_internalsd_secure.tar.bz2 ]; then
+	                                    checked $RESTOREPATH/android_internalsd_secure.tar.bz2
 	                                    rm -rf .android_secur* 2>/dev/null
-	                                    tar -x$TARFLAGS -jf $RESTOREPATH/android_emmc_secure.tar.bz2
+	                                    tar -x$TARFLAGS -jf $RESTOREPATH/android_internalsd_secure.tar.bz2
 	                                else
 	                                    $ECHO "Warning: --android_secure internal sd specified but cannot find the android_secure backup."
 	                                   # $ECHO "Warning: your phone may be in an inconsistent state on reboot."
 	                                fi
 	                     	                     			      
 	                        cd $CWD
-	                        sync
-	                        umount /internal_sdcard
 	
 	                    fi
 			else
@@ -1396,6 +1563,12 @@ if [ "$NOANDROID_SECURE_INTERNAL" == 0 ]; then
 				data_media_asecure_restore
 		     fi
 		fi
+		run_restore_jobs
+		if [ $? != 0 ]; then
+			$ECHO "Error: restore failed, your phone may be in an inconsistent state"
+			unmount_all
+			exit 1
+		fi
 		$ECHO "Restore done"
 		unmount_all
 		exit 0
@@ -1721,7 +1894,13 @@ for image in system data cache flexrom; do
 	$ECHO -n "Dumping $image to $DESTDIR/$image.img..."
 	if [ "$ICONIA" == "1" -a "$image" == "data" ]; then
 		cd /
-		tar -cf $DESTDIR/$image.tar /$image --exclude media
+		if [ "$DEDUP" == "1" ]; then
+			dedup_store $DESTDIR/$image.tar ntar -c /$image --exclude media -f
+		else
+			ntar -c -s $TARSPLIT -f $DESTDIR/$image.tar /$image --exclude media
+		fi
+	elif [ "$DEDUP" == "1" ]; then
+		dedup_store $DESTDIR/$image.img $mkyaffs2image /$image
 	else
 		$mkyaffs2image /$image $DESTDIR/$image.img $OUTPUT
 	fi
@@ -1771,7 +1950,7 @@ if [ "$NOEXT" == 0 ]; then
 	$mkyaffs2image /sd-ext $DESTDIR/ext.img
 	else
 	if [ "$COMPRESS" == 0 ]; then 
-            tar -cvf $DESTDIR/ext.tar ./*
+            ntar -c$TARFLAGS -s $TARSPLIT -f $DESTDIR/ext.tar ./*
         else
             if [ "$DEFAULTCOMPRESSOR" == "bzip2" ]; then
                 tar -cvjf $DESTDIR/ext.tar.bz2 ./*
@@ -1796,7 +1975,7 @@ if [ "$NOANDROID_SECURE" == 0 ]; then
 	$mkyaffs2image /sdcard/.android_secure $DESTDIR/android_secure.img
 	else
 	if [ "$COMPRESS" == 0 ]; then 
-            tar -cvf $DESTDIR/android_secure.tar ./.android_secure*
+            ntar -c$TARFLAGS -s $TARSPLIT -f $DESTDIR/android_secure.tar ./.android_secure*
         else
             if [ "$DEFAULTCOMPRESSOR" == "bzip2" ]; then
                 tar -cvjf $DESTDIR/android_secure.tar.bz2 ./.android_secure*
@@ -1831,7 +2010,7 @@ if [ "$NOANDROID_SECURE_INTERNAL" == 0 ]; then
         if [ "$YAFFSEXTASECURE" == 1 ]; then
 	$mkyaffs2image /internal_sdcard/.android_secure $DESTDIR/android_internalsd_secure.img
 	elif [ "$COMPRESS" == 0 ]; then 
-            tar -cvf $DESTDIR/android_internalsd_secure.tar .android_secur*
+            ntar -c$TARFLAGS -s $TARSPLIT -f $DESTDIR/android_internalsd_secure.tar .android_secur*
         elif [ "$DEFAULTCOMPRESSOR" == "bzip2" ]; then
                 tar -cvjf $DESTDIR/android_internalsd_secure.tar.bz2 .android_secur*
         else
@@ -1855,11 +2034,11 @@ $ECHO -n "generating md5sum file..."
 CWD=$PWD
 cd $DESTDIR
 
-if [ `ls *.tar| wc -l` != 0 ]; then 
-	md5sum *img *tar > nandroid.md5
-else
-	md5sum *img > nandroid.md5
-fi
+# split tar backups are checked volume by volume; nandroid.md5 is for
+# every recovery, nandroid.crc32 for a quicker check on restore
+IMGS=`ls *img 2>/dev/null`
+TARS=`ls *.tar *.tar.? *.chunks 2>/dev/null`
+nverify sum nandroid.md5 nandroid.crc32 $IMGS $TARS
 
 # 7b.
 if [ "$COMPRESS" == 1 ]; then
@@ -1875,7 +2054,8 @@ if [ "$COMPRESS" == 1 ]; then
         # we are already in $DESTDIR, start compression from the smallest files
         # to maximize space for the largest's compression, less likely to fail.
         # To decompress reverse the order.
-        $DEFAULTCOMPRESSOR $DEFAULTLEVEL `ls -S -r * | grep -v ext`
+        # (chunk manifests stay readable for the store's garbage collection)
+        $DEFAULTCOMPRESSOR $DEFAULTLEVEL `ls -S -r * | grep -v ext | grep -v chunks`
     fi
 fi
 
@@ -2239,6 +2419,10 @@ if [ "$COMPRESS" == 1 -o "$DELETE" == 1 ]; then
          $ECHO ""
          if [ "$ANSWER" == "yes" -o "$ANSWER" == "YES" -o "$ANSWER" == "Yes" ]; then
              rm -rf $RESTOREPATH
+             if [ -d $BACKUPPATH/$CHUNKSTORE ]; then
+                 $ECHO "Removing chunks no other backup uses..."
+                 nchunk gc $BACKUPPATH/$CHUNKSTORE $BACKUPPATH
+             fi
              $ECHO ""
              $ECHO "$RESTOREPATH has been permanently removed from your SDCARD."
              $ECHO "Post deletion size of the /sdcard FAT32 filesystem is `du /sdcard | tail -1 | cut -f 1 -d '/'`Kb"
@@ -38,9 +38,15 @@
 #include "cutils/properties.h"
 #include "firmware.h"
 #include "install.h"
+#include "logger.h"
 #include "minui/minui.h"
 #include "minzip/DirUtil.h"
+#include "chunkstore.h"
+#include "nrestore.h"
+#include "ntar.h"
+#include "nverify.h"
 #include "roots.h"
+#include "tracing/tracing.h"
 
 #include "extracommands.h"
 #include "recovery_ui_keys.h"
@@ -61,6 +67,8 @@ static const char *NANDROID_PATH = "SDCARD:/nandroid/";
 #define SDCARD_PATH_LENGTH 7
 #define NANDROID_PATH_LENGTH 17
 static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
+static const char *MTD_STATS_FILE = "/tmp/mtd_stats.txt";
+static const char *TRACE_FILE = "/tmp/recovery_trace.json";
 static const char *CLOCKWORK_PATH = "SDCARD:/clockworkmod/backup/";
 #define CLOCKWORK_PATH_LENGTH 28
 void free_string_array(char** array);
@@ -76,6 +84,7 @@ char** gather_files(const char* directory, const char* fileExtensionOrDirectory,
  * The arguments which may be supplied in the recovery.command file:
  *   --send_intent=anystring - write the text out to recovery.intent
  *   --update_package=root:path - verify install an OTA package file
+ *       (may be repeated; packages install in order, stopping on failure)
  *   --wipe_data - erase user data (and cache), then reboot
  *   --wipe_cache - wipe cache (but not user data), then reboot
  *
@@ -239,6 +248,8 @@ get_args(int *argc, char ***argv) {
 static void
 finish_recovery(const char *send_intent)
 {
+    long long start = trace_now_us();
+
     // By this point, we're ready to return to the main system...
     if (send_intent != NULL) {
         FILE *fp = fopen_root_path(INTENT_FILE, "w");
@@ -250,21 +261,39 @@ finish_recovery(const char *send_intent)
         }
     }
 
+    // Record flash health for anything mtdutils touched this session.
+    mtd_print_stats_summary(stdout);
+    if (mtd_write_stats_report(MTD_STATS_FILE)) {
+        LOGW("Can't write %s\n", MTD_STATS_FILE);
+    }
+
+    // Phase timings go into the log we're about to copy; the span for
+    // this function covers everything up to the copy.
+    trace_span("recovery", "finish_recovery", start);
+    trace_print_summary(stdout);
+    if (trace_write_chrome_json(TRACE_FILE)) {
+        LOGW("Can't write %s\n", TRACE_FILE);
+    }
+
     // Copy logs to cache so the system can find out what happened.
     FILE *log = fopen_root_path(LOG_FILE, "a");
     if (log == NULL) {
         LOGE("Can't open %s\n", LOG_FILE);
     } else {
-        FILE *tmplog = fopen(TEMPORARY_LOG_FILE, "r");
-        if (tmplog == NULL) {
+        logger_flush();
+        int tmplog = open(TEMPORARY_LOG_FILE, O_RDONLY);
+        if (tmplog < 0) {
             LOGE("Can't open %s\n", TEMPORARY_LOG_FILE);
         } else {
-            static long tmplog_offset = 0;
-            fseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
-            char buf[4096];
-            while (fgets(buf, sizeof(buf), tmplog)) fputs(buf, log);
-            tmplog_offset = ftell(tmplog);
-            check_and_fclose(tmplog, TEMPORARY_LOG_FILE);
+            static off_t tmplog_offset = 0;
+            lseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
+            char buf[64 * 1024];
+            ssize_t n;
+            while ((n = read(tmplog, buf, sizeof(buf))) > 0) {
+                fwrite(buf, 1, n, log);
+                tmplog_offset += n;
+            }
+            close(tmplog);
         }
         check_and_fclose(log, LOG_FILE);
     }
@@ -311,6 +340,18 @@ erase_root(const char *root)
     return format_root_device(root);
 }
 
+static int
+erase_roots(const char **roots, int count)
+{
+    int i;
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+    for (i = 0; i < count; i++) {
+        ui_print("Formatting %s...\n", roots[i]);
+    }
+    return format_root_devices(roots, count);
+}
+
 
 
 static void
@@ -1492,6 +1533,81 @@ void show_choose_zip_menu()
 	ensure_root_path_unmounted("SDCARD:");
 }
 
+// Pick several zips from the sdcard (say ROM, then gapps, then kernel)
+// and install them in that order with install_packages(), which verifies
+// each one while the one before it is still installing.
+#define MAX_QUEUED_ZIPS 8
+
+void show_choose_zip_queue_menu()
+{
+    if (ensure_root_path_mounted("SDCARD:") != 0) {
+        LOGE ("Can't mount /sdcard\n");
+        return;
+    }
+
+    static char* headers[] = {  "Choose zips in install order,",
+                                "go back when done",
+                                "",
+                                NULL
+    };
+
+    char queued_files[MAX_QUEUED_ZIPS][1024];
+    const char* queued[MAX_QUEUED_ZIPS];
+    int count = 0;
+
+    while (count < MAX_QUEUED_ZIPS) {
+        char* file = choose_file_menu("/sdcard/", ".zip", headers);
+        if (file == NULL)
+            break;
+
+        snprintf(queued_files[count], sizeof(queued_files[count]),
+                 "SDCARD:%s", file + strlen("/sdcard/"));
+        queued[count] = queued_files[count];
+        ++count;
+
+        ui_end_menu();
+        ui_print("\nQueued %d: %s\n", count, file + strlen("/sdcard/"));
+    }
+
+    if (count == 0) {
+        ensure_root_path_unmounted("SDCARD:");
+        return;
+    }
+
+    ui_end_menu();
+
+    int i;
+    ui_print("\nInstall in order:\n");
+    for (i = 0; i < count; ++i) {
+        ui_print("  %d. %s\n", i + 1, queued[i] + strlen("SDCARD:"));
+    }
+    ui_clear_key_queue();
+    ui_print("Press %s to confirm,", CONFIRM);
+    ui_print("\nany other key to abort.\n");
+
+    int confirm_apply = ui_wait_key();
+    int action_confirm = device_handle_key(confirm_apply, 1);
+    if (action_confirm == SELECT_ITEM) {
+        ui_print("\nInstall %d zips from sdcard...\n", count);
+        int status = install_packages(queued, count);
+        if (status != INSTALL_SUCCESS) {
+            ui_set_background(BACKGROUND_ICON_ERROR);
+            ui_print("\nInstallation aborted.\n");
+        } else {
+            if (firmware_update_pending()) {
+                ui_print("\nReboot via vol-up+vol-down or menu\n"
+                         "to complete installation.\n");
+            } else {
+                ui_print("\nInstall from sdcard complete.\n");
+            }
+        }
+    } else {
+        ui_print("\nInstallation aborted.\n");
+    }
+
+    ensure_root_path_unmounted("SDCARD:");
+}
+
 #if defined (HAS_INTERNAL_SD) || defined (HAS_DATA_MEDIA_SDCARD)
 void show_choose_zip_menu_internal()
 {
@@ -1680,7 +1796,7 @@ show_menu_wipe()
                     int confirm_wipe_all = ui_wait_key();
                     int action_confirm_wipe_all = device_handle_key(confirm_wipe_all, 1);
     		    if (action_confirm_wipe_all == SELECT_ITEM) {
-                        erase_root("DATA:");
+                        const char *wipe_roots[] = { "DATA:", "CACHE:" };
                         erase_root("SDCARD:.android_secure");
 #ifdef HAS_INTERNAL_SD
 			erase_root("INTERNALSD:.android_secure");
@@ -1688,7 +1804,7 @@ show_menu_wipe()
 #ifdef IS_ICONIA
 			erase_root("FLEXROM:");
 #endif
-                        erase_root("CACHE:");
+                        erase_roots(wipe_roots, 2);
 
 			char device_sdext[PATH_MAX];
     			get_device_index("SDEXT:", device_sdext);
@@ -2413,12 +2529,14 @@ show_menu_flash()
 #define ITEM_FLASH_EXIT 0
 #define ITEM_FLASHZIP 1
 #define ITEM_FLASH_TOGGLE 2
+#define ITEM_FLASH_QUEUE 3
 #if defined (HAS_INTERNAL_SD) || defined (HAS_DATA_MEDIA_SDCARD)
-#define ITEM_FLASH_INTERNAL  3
+#define ITEM_FLASH_INTERNAL  4
 #endif
     static char* items[] = { "- Return",
 			     "- Choose zip from sdcard",
                              "- Toggle signature verification",
+			     "- Queue zips from sdcard",
 #if defined (HAS_INTERNAL_SD) || defined (HAS_DATA_MEDIA_SDCARD)
 			     "- Choose zip from internal_sd",
 #endif
@@ -2467,6 +2585,10 @@ show_menu_flash()
 		case ITEM_FLASHZIP:
         	        show_choose_zip_menu();
         	        break;
+
+		case ITEM_FLASH_QUEUE:
+			show_choose_zip_queue_menu();
+			break;
 		
 #if defined (HAS_INTERNAL_SD) || defined (HAS_DATA_MEDIA_SDCARD)		
 		case ITEM_FLASH_INTERNAL:
@@ -3380,6 +3502,7 @@ prompt_and_wait()
                              NULL };
 
     ui_start_menu(headers, items);
+    preinit_menu_shown();
     int selected = 0;
     int chosen_item = -1;
 
@@ -3408,6 +3531,9 @@ prompt_and_wait()
 	}	
 
         if (chosen_item >= 0) {
+            // make sure startup has finished before doing anything
+            preinit_wait();
+
             // turn off the menu, letting ui_print() to scroll output
             // on the screen.
             ui_end_menu();
@@ -3497,6 +3623,14 @@ main(int argc, char **argv)
             return setprop_main(argc, argv);
 	if (strstr(argv[0], "getprop"))
             return getprop_main(argc, argv);
+	if (strstr(argv[0], "ntar"))
+            return ntar_main(argc, argv);
+	if (strstr(argv[0], "nchunk"))
+            return nchunk_main(argc, argv);
+	if (strstr(argv[0], "nverify"))
+            return nverify_main(argc, argv);
+	if (strstr(argv[0], "nrestore"))
+            return nrestore_main(argc, argv);
 #ifdef IS_ICONIA
 	if (strstr(argv[0], "itsmagic"))
             return itsmagic_main(argc, argv);
@@ -3520,8 +3654,10 @@ main(int argc, char **argv)
     time_t start = time(NULL);
 
     // If these fail, there's not really anywhere to complain...
-    freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
-    freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
+    if (logger_init(TEMPORARY_LOG_FILE) != 0) {
+        freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
+        freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
+    }
     fprintf(stderr, "Starting recovery on %s", ctime(&start));
 
     tcflow(STDIN_FILENO, TCOOFF);
@@ -3530,6 +3666,8 @@ main(int argc, char **argv)
     property_get("ro.modversion", &prop_value[0], "not set");
 
 /* Pre recovery setup items GNM */ 
+    // Only what the UI needs is done when this returns; the rest runs in
+    // the background.  See preinit_wait().
     preinit_setup();
     
     ui_init();
@@ -3546,7 +3684,8 @@ main(int argc, char **argv)
     
     int previous_runs = 0;
     const char *send_intent = NULL;
-    const char *update_package = NULL;
+    const char *update_packages[MAX_ARGS];
+    int num_update_packages = 0;
     int wipe_data = 0, wipe_cache = 0;
 
     int arg;
@@ -3554,7 +3693,11 @@ main(int argc, char **argv)
         switch (arg) {
         case 'p': previous_runs = atoi(optarg); break;
         case 's': send_intent = optarg; break;
-        case 'u': update_package = optarg; break;
+        case 'u':
+            if (num_update_packages < MAX_ARGS) {
+                update_packages[num_update_packages++] = optarg;
+            }
+            break;
         case 'w': wipe_data = wipe_cache = 1; break;
         case 'c': wipe_cache = 1; break;
         case '?':
@@ -3583,10 +3726,12 @@ main(int argc, char **argv)
 
     int status = INSTALL_SUCCESS;
 
-    if (update_package != NULL) {
-        status = install_package(update_package);
+    if (num_update_packages > 0) {
+        preinit_wait();
+        status = install_packages(update_packages, num_update_packages);
         if (status != INSTALL_SUCCESS) ui_print("Installation aborted.\n");
     } else if (wipe_data || wipe_cache) {
+        preinit_wait();
         if (wipe_data && erase_root("DATA:")) status = INSTALL_ERROR;
         if (wipe_cache && erase_root("CACHE:")) status = INSTALL_ERROR;
         if (status != INSTALL_SUCCESS) ui_print("Data wipe failed.\n");
@@ -3606,6 +3751,7 @@ main(int argc, char **argv)
     if (do_reboot)
     {
     	ui_print("Rebooting...\n");
+    	logger_flush();
     	reboot(RB_AUTOBOOT);
 	}
 	
@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <cutils/properties.h>
 
 #include "mtdutils/mtdutils.h"
@@ -30,6 +31,7 @@
 #include "roots.h"
 #include "common.h"
 #include "mmcutils/mmcutils.h"
+#include "tracing/tracing.h"
 
 #include "extracommands.h"
 #include "define_roots.h"
@@ -289,6 +291,8 @@ static int mount_internal(const char* device, const char* mount_point, const cha
 
 }
 
+static int mount_root(const RootInfo *info);
+
 int
 ensure_root_path_mounted(const char *root_path)
 {
@@ -306,6 +310,15 @@ ensure_root_path_mounted(const char *root_path)
 
     /* It's not mounted.
      */
+    long long start = trace_now_us();
+    ret = mount_root(info);
+    trace_span("mount", info->name, start);
+    return ret;
+}
+
+static int
+mount_root(const RootInfo *info)
+{
     if (info->device == g_mtd_device) {
         if (info->partition_name == NULL) {
             return -1;
@@ -539,6 +552,102 @@ format_root_device(const char *root)
 }
 
 
+typedef struct {
+    const char *root;
+    MtdWriteContext *write;
+    int ret;
+} FormatJob;
+
+static void *erase_mtd_thread(void *cookie)
+{
+    FormatJob *job = (FormatJob *) cookie;
+    if (mtd_erase_blocks(job->write, -1) == (off_t) -1) {
+        LOGW("format_root_devices: can't erase \"%s\"\n", job->root);
+        mtd_write_close(job->write);
+        job->ret = -1;
+    } else if (mtd_write_close(job->write)) {
+        LOGW("format_root_devices: can't close \"%s\"\n", job->root);
+        job->ret = -1;
+    } else {
+        job->ret = 0;
+    }
+    return NULL;
+}
+
+int
+format_root_devices(const char **roots, int count)
+{
+    FormatJob jobs[count];
+    pthread_t threads[count];
+    int erase[count];
+    int i, ret = 0;
+
+    /* Everything but raw/yaffs2 MTD partitions goes through
+     * format_root_device() one at a time, first, since it may rescan the
+     * MTD partition table.  Then every MTD partition is unmounted, looked
+     * up in a single scan and opened before any erase starts, so the
+     * erase threads never see the table change under them.
+     */
+    int scanned = 0;
+    for (i = 0; i < count; i++) {
+        jobs[i].root = roots[i];
+        jobs[i].write = NULL;
+        jobs[i].ret = 0;
+
+        const RootInfo *info = get_root_info_for_path(roots[i]);
+        erase[i] = info != NULL && info->device == g_mtd_device &&
+                (info->filesystem == g_raw ||
+                 !strcmp(info->filesystem, "yaffs2"));
+        if (!erase[i]) {
+            jobs[i].ret = format_root_device(roots[i]);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (!erase[i]) {
+            continue;
+        }
+        const RootInfo *info = get_root_info_for_path(roots[i]);
+        if (info->mount_point != NULL &&
+                ensure_root_path_unmounted(roots[i]) < 0) {
+            LOGW("format_root_devices: can't unmount \"%s\"\n", roots[i]);
+            jobs[i].ret = -1;
+            continue;
+        }
+        if (!scanned) {
+            mtd_scan_partitions();
+            scanned = 1;
+        }
+        const MtdPartition *partition =
+                mtd_find_partition_by_name(info->partition_name);
+        if (partition == NULL) {
+            LOGW("format_root_devices: can't find mtd partition \"%s\"\n",
+                    info->partition_name);
+            jobs[i].ret = -1;
+            continue;
+        }
+        jobs[i].write = mtd_write_partition(partition);
+        if (jobs[i].write == NULL) {
+            LOGW("format_root_devices: can't open \"%s\"\n", roots[i]);
+            jobs[i].ret = -1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (jobs[i].write != NULL &&
+                pthread_create(&threads[i], NULL, erase_mtd_thread, &jobs[i])) {
+            erase_mtd_thread(&jobs[i]);
+            jobs[i].write = NULL;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (jobs[i].write != NULL) {
+            pthread_join(threads[i], NULL);
+        }
+        if (jobs[i].ret < 0) ret = -1;
+    }
+    return ret;
+}
+
 const RootInfo *get_device_info(const char *root)
 {
 const char *c;
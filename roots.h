@@ -96,6 +96,12 @@ const MmcPartition *get_root_mmc_partition(const char *root_path);
  */
 int format_root_device(const char *root);
 
+/* Formats each of the given roots.  Raw and yaffs2 MTD partitions are
+ * erased concurrently; everything else is formatted in order.  Returns
+ * -1 if any of them failed.
+ */
+int format_root_devices(const char **roots, int count);
+
 const RootInfo *get_device_info(const char *root);
 
 void set_root_table();
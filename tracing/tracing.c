@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tracing.h"
+
+typedef struct {
+    char category[16];
+    char name[64];
+    long long start_us;
+    long long end_us;
+    int pid;
+    int tid;
+} TraceEvent;
+
+static pthread_mutex_t gTraceLock = PTHREAD_MUTEX_INITIALIZER;
+static TraceEvent *gEvents = NULL;
+static int gEventCount = 0;
+static int gEventsAllocd = 0;
+
+long long trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Copy a label, replacing anything that would break the saved line format. */
+static void copy_label(char *dst, size_t size, const char *src) {
+    size_t i;
+    if (src == NULL) src = "";
+    for (i = 0; i + 1 < size && src[i] != '\0'; ++i) {
+        dst[i] = (src[i] == '\t' || src[i] == '\n' || src[i] == '\r') ?
+                ' ' : src[i];
+    }
+    dst[i] = '\0';
+}
+
+static void add_event(const char *category, const char *name,
+        long long start_us, long long end_us, int pid, int tid) {
+    pthread_mutex_lock(&gTraceLock);
+    if (gEventCount == gEventsAllocd) {
+        int allocd = gEventsAllocd ? gEventsAllocd * 2 : 256;
+        TraceEvent *events = realloc(gEvents, allocd * sizeof(TraceEvent));
+        if (events == NULL) {
+            pthread_mutex_unlock(&gTraceLock);
+            return;
+        }
+        gEvents = events;
+        gEventsAllocd = allocd;
+    }
+    TraceEvent *ev = &gEvents[gEventCount++];
+    copy_label(ev->category, sizeof(ev->category), category);
+    copy_label(ev->name, sizeof(ev->name), name);
+    ev->start_us = start_us;
+    ev->end_us = end_us;
+    ev->pid = pid;
+    ev->tid = tid;
+    pthread_mutex_unlock(&gTraceLock);
+}
+
+void trace_record(const char *category, const char *name,
+        long long start_us, long long end_us) {
+    add_event(category, name, start_us, end_us,
+            getpid(), (int) syscall(__NR_gettid));
+}
+
+void trace_span(const char *category, const char *name, long long start_us) {
+    trace_record(category, name, start_us, trace_now_us());
+}
+
+int trace_save(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return -1;
+
+    int i;
+    pthread_mutex_lock(&gTraceLock);
+    for (i = 0; i < gEventCount; ++i) {
+        const TraceEvent *ev = &gEvents[i];
+        fprintf(f, "%s\t%s\t%lld\t%lld\t%d\t%d\n", ev->category, ev->name,
+                ev->start_us, ev->end_us, ev->pid, ev->tid);
+    }
+    pthread_mutex_unlock(&gTraceLock);
+
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+int trace_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+
+    char line[256];
+    int count = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *category = strtok(line, "\t");
+        char *name = strtok(NULL, "\t");
+        char *rest = strtok(NULL, "\n");
+        long long start_us, end_us;
+        int pid, tid;
+        if (category == NULL || name == NULL || rest == NULL ||
+                sscanf(rest, "%lld\t%lld\t%d\t%d",
+                       &start_us, &end_us, &pid, &tid) != 4) {
+            continue;
+        }
+        add_event(category, name, start_us, end_us, pid, tid);
+        ++count;
+    }
+    fclose(f);
+    return count;
+}
+
+static void write_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; ++s) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+int trace_write_chrome_json(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return -1;
+
+    int i;
+    fputs("{\"traceEvents\":[\n", f);
+    pthread_mutex_lock(&gTraceLock);
+    for (i = 0; i < gEventCount; ++i) {
+        const TraceEvent *ev = &gEvents[i];
+        fputs("{\"name\":", f);
+        write_json_string(f, ev->name);
+        fputs(",\"cat\":", f);
+        write_json_string(f, ev->category);
+        fprintf(f, ",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                "\"pid\":%d,\"tid\":%d}%s\n",
+                ev->start_us, ev->end_us - ev->start_us, ev->pid, ev->tid,
+                i + 1 < gEventCount ? "," : "");
+    }
+    pthread_mutex_unlock(&gTraceLock);
+    fputs("],\"displayTimeUnit\":\"ms\"}\n", f);
+
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+typedef struct {
+    const char *category;
+    const char *name;
+    int count;
+    long long total_us;
+    long long min_us;
+    long long max_us;
+} TracePhase;
+
+void trace_print_summary(FILE *out) {
+    pthread_mutex_lock(&gTraceLock);
+    if (gEventCount == 0) {
+        pthread_mutex_unlock(&gTraceLock);
+        return;
+    }
+
+    TracePhase *phases = calloc(gEventCount, sizeof(TracePhase));
+    if (phases == NULL) {
+        pthread_mutex_unlock(&gTraceLock);
+        return;
+    }
+
+    int i, j, numPhases = 0;
+    for (i = 0; i < gEventCount; ++i) {
+        const TraceEvent *ev = &gEvents[i];
+        long long dur = ev->end_us - ev->start_us;
+        for (j = 0; j < numPhases; ++j) {
+            if (!strcmp(phases[j].category, ev->category) &&
+                    !strcmp(phases[j].name, ev->name)) break;
+        }
+        TracePhase *p = &phases[j];
+        if (j == numPhases) {
+            p->category = ev->category;
+            p->name = ev->name;
+            p->min_us = dur;
+            ++numPhases;
+        }
+        ++p->count;
+        p->total_us += dur;
+        if (dur < p->min_us) p->min_us = dur;
+        if (dur > p->max_us) p->max_us = dur;
+    }
+
+    fprintf(out, "Trace summary (ms, nested spans are inclusive):\n");
+    fprintf(out, "%-10s %-32s %6s %10s %9s %9s\n",
+            "category", "name", "count", "total", "min", "max");
+    for (j = 0; j < numPhases; ++j) {
+        const TracePhase *p = &phases[j];
+        fprintf(out, "%-10s %-32.32s %6d %10.1f %9.1f %9.1f\n",
+                p->category, p->name, p->count,
+                p->total_us / 1000.0, p->min_us / 1000.0, p->max_us / 1000.0);
+    }
+
+    free(phases);
+    pthread_mutex_unlock(&gTraceLock);
+}
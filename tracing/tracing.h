@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRACING_H_
+#define TRACING_H_
+
+#include <stdio.h>
+
+/*
+ * Lightweight span tracing.  Spans are timed on CLOCK_MONOTONIC, so spans
+ * recorded by recovery and by the update binary it runs share one
+ * timeline.  Recording is thread-safe.
+ *
+ * Typical use:
+ *
+ *     long long start = trace_now_us();
+ *     ...
+ *     trace_span("mount", root_path, start);
+ */
+
+/* Where the update binary leaves its spans for recovery to merge. */
+#define TRACE_UPDATER_FILE "/tmp/updater.trace"
+
+long long trace_now_us(void);
+
+/* Record a span of category/name that started at start_us and ends now. */
+void trace_span(const char *category, const char *name, long long start_us);
+
+/* Record a span with explicit start and end times. */
+void trace_record(const char *category, const char *name,
+        long long start_us, long long end_us);
+
+/*
+ * Save recorded spans in a simple line format, or merge spans saved by
+ * another process (e.g. the update binary) into this one.  trace_load()
+ * returns the number of spans read, or -1 if the file can't be opened.
+ */
+int trace_save(const char *path);
+int trace_load(const char *path);
+
+/* Write all spans as a Chrome trace ("traceEvents" JSON) file. */
+int trace_write_chrome_json(const char *path);
+
+/* Print a per-phase table: count, total, min and max time per span name. */
+void trace_print_summary(FILE *out);
+
+#endif  // TRACING_H_
@@ -18,10 +18,13 @@
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/reboot.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -83,6 +86,9 @@ static const struct { gr_surface* surface; const char *name; } BITMAPS[] = {
     { NULL,                             NULL },
 };
 
+// Set once BITMAPS[i] has been loaded (or failed to load).
+static char gBitmapTried[sizeof(BITMAPS) / sizeof(BITMAPS[0])];
+
 static gr_surface gCurrentIcon = NULL;
 
 static enum ProgressBarType {
@@ -95,6 +101,14 @@ static enum ProgressBarType {
 static float gProgressScopeStart = 0, gProgressScopeSize = 0, gProgress = 0;
 static time_t gProgressScopeTime, gProgressScopeDuration;
 
+// The input thread also redraws the progress bar: when gProgressTimerFd
+// fires (it is only armed while the bar is animating), and when another
+// thread has changed the bar and poked gRedrawFd.
+static int gProgressTimerFd = -1;
+static int gProgressTimerMs = 0;    // current tick interval, 0 if disarmed
+static int gRedrawFd = -1;
+static int gRedrawPending = 0;
+
 // Set to 1 when both graphics pages are the same (except for the progress bar)
 static int gPagesIdentical = 0;
 
@@ -115,6 +129,28 @@ static pthread_cond_t key_queue_cond = PTHREAD_COND_INITIALIZER;
 static int key_queue[256], key_queue_len = 0;
 static volatile char key_pressed[KEY_MAX + 1];
 
+// Returns one of the BITMAPS, loading it the first time it is needed, so
+// images that a session never shows are never decoded.  Returns NULL if
+// the bitmap is missing.
+// Should only be called with gUpdateMutex locked.
+static gr_surface get_bitmap(gr_surface *surface)
+{
+    int i;
+    for (i = 0; *surface == NULL && BITMAPS[i].name != NULL; ++i) {
+        if (BITMAPS[i].surface != surface) continue;
+        if (!gBitmapTried[i]) {
+            gBitmapTried[i] = 1;
+            int result = res_create_surface(BITMAPS[i].name, surface);
+            if (result < 0) {
+                LOGE("Missing bitmap %s\n(Code %d)\n", BITMAPS[i].name, result);
+                *surface = NULL;
+            }
+        }
+        break;
+    }
+    return *surface;
+}
+
 // Clear the screen and draw the currently selected background icon (if any).
 // Should only be called with gUpdateMutex locked.
 static void draw_background_locked(gr_surface icon)
@@ -138,9 +174,10 @@ static void draw_progress_locked()
 {
     if (gProgressBarType == PROGRESSBAR_TYPE_NONE) return;
 
-    int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
-    int width = gr_get_width(gProgressBarIndeterminate[0]);
-    int height = gr_get_height(gProgressBarIndeterminate[0]);
+    int iconHeight = gr_get_height(
+            get_bitmap(&gBackgroundIcon[BACKGROUND_ICON_INSTALLING]));
+    int width = gr_get_width(get_bitmap(&gProgressBarIndeterminate[0]));
+    int height = gr_get_height(get_bitmap(&gProgressBarIndeterminate[0]));
 
     int dx = (gr_fb_width() - width)/2;
     int dy = (3*gr_fb_height() + iconHeight - 2*height)/4;
@@ -153,23 +190,27 @@ static void draw_progress_locked()
         float progress = gProgressScopeStart + gProgress * gProgressScopeSize;
         int pos = (int) (progress * width);
 
-        gr_surface s = (pos ? gProgressBarFill : gProgressBarEmpty)[LEFT_SIDE];
+        gr_surface s = get_bitmap(
+                &(pos ? gProgressBarFill : gProgressBarEmpty)[LEFT_SIDE]);
         gr_blit(s, 0, 0, gr_get_width(s), gr_get_height(s), dx, dy);
 
         int x = gr_get_width(s);
-        while (x + (int) gr_get_width(gProgressBarEmpty[RIGHT_SIDE]) < width) {
-            s = (pos > x ? gProgressBarFill : gProgressBarEmpty)[CENTER_TILE];
+        int right = gr_get_width(get_bitmap(&gProgressBarEmpty[RIGHT_SIDE]));
+        while (x + right < width) {
+            s = get_bitmap(
+                    &(pos > x ? gProgressBarFill : gProgressBarEmpty)[CENTER_TILE]);
             gr_blit(s, 0, 0, gr_get_width(s), gr_get_height(s), dx + x, dy);
             x += gr_get_width(s);
         }
 
-        s = (pos > x ? gProgressBarFill : gProgressBarEmpty)[RIGHT_SIDE];
+        s = get_bitmap(&(pos > x ? gProgressBarFill : gProgressBarEmpty)[RIGHT_SIDE]);
         gr_blit(s, 0, 0, gr_get_width(s), gr_get_height(s), dx + x, dy);
     }
 
     if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE) {
         static int frame = 0;
-        gr_blit(gProgressBarIndeterminate[frame], 0, 0, width, height, dx, dy);
+        gr_blit(get_bitmap(&gProgressBarIndeterminate[frame]),
+                0, 0, width, height, dx, dy);
         frame = (frame + 1) % PROGRESSBAR_INDETERMINATE_STATES;
     }
 }
@@ -183,7 +224,7 @@ static int vk_iconY = 0;
 // Should only be called with gUpdateMutex locked.
 static void draw_virtualkeys_locked()
 {
-    gr_surface surface = gVirtualKeys;
+    gr_surface surface = get_bitmap(&gVirtualKeys);
     int iconWidth = gr_get_width(surface);
     int iconHeight = gr_get_height(surface);
 #ifdef IS_ICONIA
@@ -199,7 +240,7 @@ static void draw_virtualkeys_locked()
 static void export_vk_info()
 {
    if (vk_iconwidth == 0 && vk_iconheight == 0 && vk_iconX == 0 && vk_iconY == 0) {
-   	gr_surface surface = gVirtualKeys;
+   	gr_surface surface = get_bitmap(&gVirtualKeys);
    	vk_iconwidth = gr_get_width(surface);
    	vk_iconheight = gr_get_height(surface);
    	vk_iconX = (gr_fb_width() - vk_iconwidth);
@@ -358,34 +399,94 @@ static void update_progress_locked(void)
     gr_flip();
 }
 
+// Arms the progress timer for whatever the progress bar is doing, or
+// disarms it if the bar is standing still.
+// Should only be called with gUpdateMutex locked.
+static void update_progress_timer_locked(void)
+{
+    int ms = 0;
+
+    // skip the animation if we have a text overlay (too expensive to update)
+    if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
+        ms = 1000 / PROGRESSBAR_INDETERMINATE_FPS;
+    }
+    // timed progress is measured in whole seconds
+    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL &&
+        gProgressScopeDuration > 0 && gProgress < 1.0) {
+        ms = 1000;
+    }
+
+    if (gProgressTimerFd < 0 || ms == gProgressTimerMs) return;
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = ms / 1000;
+    spec.it_interval.tv_nsec = (ms % 1000) * 1000000L;
+    spec.it_value = spec.it_interval;
+    timerfd_settime(gProgressTimerFd, 0, &spec, NULL);
+    gProgressTimerMs = ms;
+}
+
 // Keeps the progress bar updated, even when the process is otherwise busy.
-static void *progress_thread(void *cookie)
+// Called from the event loop when the progress timer fires.
+static int progress_timer_callback(int fd, short revents, void *data)
 {
-    for (;;) {
-        usleep(1000000 / PROGRESSBAR_INDETERMINATE_FPS);
-        pthread_mutex_lock(&gUpdateMutex);
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&gUpdateMutex);
 
-        // update the progress bar animation, if active
-        // skip this if we have a text overlay (too expensive to update)
-        if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
+    // update the progress bar animation, if active
+    if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
+        update_progress_locked();
+    }
+
+    // move the progress bar forward on timed intervals, if configured
+    int duration = gProgressScopeDuration;
+    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && duration > 0) {
+        int elapsed = time(NULL) - gProgressScopeTime;
+        float progress = 1.0 * elapsed / duration;
+        if (progress > 1.0) progress = 1.0;
+        if (progress > gProgress) {
+            gProgress = progress;
             update_progress_locked();
         }
+    }
 
-        // move the progress bar forward on timed intervals, if configured
-        int duration = gProgressScopeDuration;
-        if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && duration > 0) {
-            int elapsed = time(NULL) - gProgressScopeTime;
-            float progress = 1.0 * elapsed / duration;
-            if (progress > 1.0) progress = 1.0;
-            if (progress > gProgress) {
-                gProgress = progress;
-                update_progress_locked();
-            }
-        }
+    update_progress_timer_locked();
+    pthread_mutex_unlock(&gUpdateMutex);
+    return 0;
+}
 
-        pthread_mutex_unlock(&gUpdateMutex);
+// Has the input thread redraw the progress bar, so that the caller (which
+// is usually busy installing something) doesn't wait on the framebuffer.
+// Should only be called with gUpdateMutex locked.
+static void request_progress_update_locked(void)
+{
+    if (gRedrawFd < 0) {
+        update_progress_locked();
+    } else if (!gRedrawPending) {
+        uint64_t one = 1;
+        gRedrawPending = 1;
+        write(gRedrawFd, &one, sizeof(one));
     }
-    return NULL;
+}
+
+// Called from the event loop when someone has requested a redraw.
+static int redraw_callback(int fd, short revents, void *data)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&gUpdateMutex);
+    if (gRedrawPending) {
+        gRedrawPending = 0;
+        update_progress_locked();
+    }
+    pthread_mutex_unlock(&gUpdateMutex);
+    return 0;
 }
 
 static int rel_sum = 0;
@@ -648,6 +749,7 @@ static int input_callback(int fd, short revents, void *data)
             (key_pressed[KEY_HOME] && ev.code == KEY_END && ev.value > 0)) {
         pthread_mutex_lock(&gUpdateMutex);
         show_text = !show_text;
+        update_progress_timer_locked();
         update_screen_locked();
         pthread_mutex_unlock(&gUpdateMutex);
     }
@@ -663,6 +765,8 @@ static int input_callback(int fd, short revents, void *data)
 }
 
 // Reads input events, handles special hot keys, and adds to the key queue.
+// This is the UI event loop: the progress timer and redraw requests are
+// serviced from here too (see ev_add_fd()).
 static void *input_thread(void *cookie)
 {
     for (;;) {
@@ -685,23 +789,30 @@ void ui_init(void)
     text_cols = gr_fb_width() / CHAR_WIDTH;
     if (text_cols > MAX_COLS - 1) text_cols = MAX_COLS - 1;
 
-    int i;
-    for (i = 0; BITMAPS[i].name != NULL; ++i) {
-        int result = res_create_surface(BITMAPS[i].name, BITMAPS[i].surface);
-        if (result < 0) {
-            LOGE("Missing bitmap %s\n(Code %d)\n", BITMAPS[i].name, result);
-            *BITMAPS[i].surface = NULL;
-        }
+    // Bitmaps are loaded as they are first drawn; see get_bitmap().
+
+    gProgressTimerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (gProgressTimerFd >= 0 &&
+        ev_add_fd(gProgressTimerFd, progress_timer_callback, NULL) < 0) {
+        close(gProgressTimerFd);
+        gProgressTimerFd = -1;
+    }
+    if (gProgressTimerFd < 0) {
+        LOGE("Can't create progress timer\n");
+    }
+    gRedrawFd = eventfd(0, 0);
+    if (gRedrawFd >= 0 && ev_add_fd(gRedrawFd, redraw_callback, NULL) < 0) {
+        close(gRedrawFd);
+        gRedrawFd = -1;
     }
 
     pthread_t t;
-    pthread_create(&t, NULL, progress_thread, NULL);
     pthread_create(&t, NULL, input_thread, NULL);
 }
 
 char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
     pthread_mutex_lock(&gUpdateMutex);
-    draw_background_locked(gBackgroundIcon[icon]);
+    draw_background_locked(get_bitmap(&gBackgroundIcon[icon]));
     *width = gr_fb_width();
     *height = gr_fb_height();
     *bpp = sizeof(gr_pixel) * 8;
@@ -719,7 +830,7 @@ char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
 void ui_set_background(int icon)
 {
     pthread_mutex_lock(&gUpdateMutex);
-    gCurrentIcon = gBackgroundIcon[icon];
+    gCurrentIcon = get_bitmap(&gBackgroundIcon[icon]);
     update_screen_locked();
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -730,6 +841,7 @@ void ui_show_indeterminate_progress()
     if (gProgressBarType != PROGRESSBAR_TYPE_INDETERMINATE) {
         gProgressBarType = PROGRESSBAR_TYPE_INDETERMINATE;
         update_progress_locked();
+        update_progress_timer_locked();
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -743,7 +855,8 @@ void ui_show_progress(float portion, int seconds)
     gProgressScopeTime = time(NULL);
     gProgressScopeDuration = seconds;
     gProgress = 0;
-    update_progress_locked();
+    update_progress_timer_locked();
+    request_progress_update_locked();
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -754,11 +867,11 @@ void ui_set_progress(float fraction)
     if (fraction > 1.0) fraction = 1.0;
     if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && fraction > gProgress) {
         // Skip updates that aren't visibly different.
-        int width = gr_get_width(gProgressBarIndeterminate[0]);
+        int width = gr_get_width(get_bitmap(&gProgressBarIndeterminate[0]));
         float scale = width * gProgressScopeSize;
         if ((int) (gProgress * scale) != (int) (fraction * scale)) {
             gProgress = fraction;
-            update_progress_locked();
+            request_progress_update_locked();
         }
     }
     pthread_mutex_unlock(&gUpdateMutex);
@@ -771,6 +884,7 @@ void ui_reset_progress()
     gProgressScopeStart = gProgressScopeSize = 0;
     gProgressScopeTime = gProgressScopeDuration = 0;
     gProgress = 0;
+    update_progress_timer_locked();
     update_screen_locked();
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -333,9 +333,16 @@ char* PackageExtractDirFn(const char* name, State* state,
     // To create a consistent system image, never use the clock for timestamps.
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
+    // Sync the destination once at the end rather than file by file.
     bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                      MZ_EXTRACT_FILES_ONLY |
+                                      MZ_EXTRACT_DEFER_SYNC, &timestamp,
                                       NULL, NULL);
+    if (success && mzSyncFilesystem(dest_path) != 0) {
+        fprintf(stderr, "%s: failed to sync %s: %s\n",
+                name, dest_path, strerror(errno));
+        success = false;
+    }
     free(zip_path);
     free(dest_path);
     return strdup(success ? "t" : "");
@@ -22,11 +22,22 @@
 #include "updater.h"
 #include "install.h"
 #include "minzip/Zip.h"
+#include "tracing/tracing.h"
 
 // Where in the package we expect to find the edify script to execute.
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+static void trace_edify_call(const char* name,
+                             long long start_us, long long end_us) {
+    trace_record("edify", name, start_us, end_us);
+}
+
+// Recovery merges these into its own trace once we exit.
+static void save_trace() {
+    trace_save(TRACE_UPDATER_FILE);
+}
+
 int main(int argc, char** argv) {
     if (argc != 4) {
         fprintf(stderr, "unexpected number of arguments (%d)\n", argc);
@@ -41,6 +52,8 @@ int main(int argc, char** argv) {
         return 2;
     }
 
+    atexit(save_trace);
+
     // Set up the pipe for sending commands back to the parent process.
 
     int fd = atoi(argv[2]);
@@ -52,7 +65,9 @@ int main(int argc, char** argv) {
     char* package_data = argv[3];
     ZipArchive za;
     int err;
+    long long start = trace_now_us();
     err = mzOpenZipArchive(package_data, &za);
+    trace_span("zip", "updater mzOpenZipArchive", start);
     if (err != 0) {
         fprintf(stderr, "failed to open package %s: %s\n",
                 package_data, strerror(err));
@@ -77,6 +92,7 @@ int main(int argc, char** argv) {
     RegisterBuiltins();
     RegisterInstallFunctions();
     FinishRegistration();
+    SetCallObserver(trace_edify_call);
 
     // Parse the script.
 
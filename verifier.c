@@ -23,13 +23,24 @@
 
 #include <netinet/in.h>  /* required for resolv.h */
 #include <resolv.h>      /* for base64 codec */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+/* Packages verified in the background must not write to the screen;
+ * their errors only go to the log until the caller reports them. */
+#define VERIFY_LOGE(quiet, ...) do { \
+        if (quiet) fprintf(stderr, "E:" __VA_ARGS__); \
+        else LOGE(__VA_ARGS__); \
+    } while (0)
+
 /* Return an allocated buffer with the contents of a zip file entry. */
-static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry) {
+static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
+        bool quiet) {
     if (!mzIsZipEntryIntact(pArchive, pEntry)) {
         UnterminatedString fn = mzGetZipEntryFileName(pEntry);
-        LOGE("Invalid %.*s\n", fn.len, fn.str);
+        VERIFY_LOGE(quiet, "Invalid %.*s\n", fn.len, fn.str);
         return NULL;
     }
 
@@ -37,13 +48,14 @@ static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry) {
     char *buf = malloc(len + 1);
     if (buf == NULL) {
         UnterminatedString fn = mzGetZipEntryFileName(pEntry);
-        LOGE("Can't allocate %d bytes for %.*s\n", len, fn.len, fn.str);
+        VERIFY_LOGE(quiet, "Can't allocate %d bytes for %.*s\n",
+                len, fn.len, fn.str);
         return NULL;
     }
 
     if (!mzReadZipEntry(pArchive, pEntry, buf, len)) {
         UnterminatedString fn = mzGetZipEntryFileName(pEntry);
-        LOGE("Can't read %.*s\n", fn.len, fn.str);
+        VERIFY_LOGE(quiet, "Can't read %.*s\n", fn.len, fn.str);
         free(buf);
         return NULL;
     }
@@ -77,14 +89,14 @@ static bool updateHash(const unsigned char *data, int dataLen, void *cookie) {
 /* Get the SHA-1 digest of a zip file entry. */
 static bool digestEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
         unsigned *doneBytes, unsigned totalBytes,
-        uint8_t digest[SHA_DIGEST_SIZE]) {
+        uint8_t digest[SHA_DIGEST_SIZE], bool quiet) {
     struct DigestContext context;
     SHA_init(&context.digest);
     context.doneBytes = doneBytes;
     context.totalBytes = totalBytes;
     if (!mzProcessZipEntryContents(pArchive, pEntry, updateHash, &context)) {
         UnterminatedString fn = mzGetZipEntryFileName(pEntry);
-        LOGE("Can't digest %.*s\n", fn.len, fn.str);
+        VERIFY_LOGE(quiet, "Can't digest %.*s\n", fn.len, fn.str);
         return false;
     }
 
@@ -103,7 +115,7 @@ static bool digestEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
 
 /* Find a /META-INF/xxx.SF signature file signed by a matching xxx.RSA file. */
 static const ZipEntry *verifySignature(const ZipArchive *pArchive,
-        const RSAPublicKey *pKeys, unsigned int numKeys) {
+        const RSAPublicKey *pKeys, unsigned int numKeys, bool quiet) {
     static const char prefix[] = "META-INF/";
     static const char rsa[] = ".RSA", sf[] = ".SF";
 
@@ -118,7 +130,8 @@ static const ZipEntry *verifySignature(const ZipArchive *pArchive,
                          rsa, sizeof(rsa) - 1)) {
             char *sfName = malloc(rsaName.len - sizeof(rsa) + sizeof(sf) + 1);
             if (sfName == NULL) {
-                LOGE("Can't allocate %d bytes for filename\n", rsaName.len);
+                VERIFY_LOGE(quiet, "Can't allocate %d bytes for filename\n",
+                        rsaName.len);
                 continue;
             }
 
@@ -136,9 +149,9 @@ static const ZipEntry *verifySignature(const ZipArchive *pArchive,
             free(sfName);
 
             uint8_t sfDigest[SHA_DIGEST_SIZE];
-            if (!digestEntry(pArchive, sfEntry, NULL, 0, sfDigest)) continue;
+            if (!digestEntry(pArchive, sfEntry, NULL, 0, sfDigest, quiet)) continue;
 
-            char *rsaBuf = slurpEntry(pArchive, rsaEntry);
+            char *rsaBuf = slurpEntry(pArchive, rsaEntry, quiet);
             if (rsaBuf == NULL) continue;
 
             /* Try to verify the signature with all the keys. */
@@ -156,18 +169,18 @@ static const ZipEntry *verifySignature(const ZipArchive *pArchive,
         }
     }
 
-    LOGE("No signature (%d files)\n", mzZipEntryCount(pArchive));
+    VERIFY_LOGE(quiet, "No signature (%d files)\n", mzZipEntryCount(pArchive));
     return NULL;
 }
 
 
 /* Verify /META-INF/MANIFEST.MF against the digest in a signature file. */
 static const ZipEntry *verifyManifest(const ZipArchive *pArchive,
-        const ZipEntry *sfEntry) {
+        const ZipEntry *sfEntry, bool quiet) {
     static const char prefix[] = "SHA1-Digest-Manifest: ", eol[] = "\r\n";
     uint8_t expected[SHA_DIGEST_SIZE + 3], actual[SHA_DIGEST_SIZE];
 
-    char *sfBuf = slurpEntry(pArchive, sfEntry);
+    char *sfBuf = slurpEntry(pArchive, sfEntry, quiet);
     if (sfBuf == NULL) return NULL;
 
     char *line, *save;
@@ -178,7 +191,7 @@ static const ZipEntry *verifyManifest(const ZipArchive *pArchive,
             const char *digest = line + sizeof(prefix) - 1;
             int n = b64_pton(digest, expected, sizeof(expected));
             if (n != SHA_DIGEST_SIZE) {
-                LOGE("Invalid base64 in %.*s: %s (%d)\n",
+                VERIFY_LOGE(quiet, "Invalid base64 in %.*s: %s (%d)\n",
                         fn.len, fn.str, digest, n);
                 line = NULL;
             }
@@ -189,21 +202,22 @@ static const ZipEntry *verifyManifest(const ZipArchive *pArchive,
     free(sfBuf);
 
     if (line == NULL) {
-        LOGE("No digest manifest in signature file\n");
+        VERIFY_LOGE(quiet, "No digest manifest in signature file\n");
         return false;
     }
 
     const char *mfName = "META-INF/MANIFEST.MF";
     const ZipEntry *mfEntry = mzFindZipEntry(pArchive, mfName);
     if (mfEntry == NULL) {
-        LOGE("No manifest file %s\n", mfName);
+        VERIFY_LOGE(quiet, "No manifest file %s\n", mfName);
         return NULL;
     }
 
-    if (!digestEntry(pArchive, mfEntry, NULL, 0, actual)) return NULL;
+    if (!digestEntry(pArchive, mfEntry, NULL, 0, actual, quiet)) return NULL;
     if (memcmp(expected, actual, SHA_DIGEST_SIZE)) {
         UnterminatedString fn = mzGetZipEntryFileName(sfEntry);
-        LOGE("Wrong digest for %s in %.*s\n", mfName, fn.len, fn.str);
+        VERIFY_LOGE(quiet, "Wrong digest for %s in %.*s\n",
+                mfName, fn.len, fn.str);
         return NULL;
     }
 
@@ -213,19 +227,20 @@ static const ZipEntry *verifyManifest(const ZipArchive *pArchive,
 
 
 /* Verify all the files in a Zip archive against the manifest. */
-static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
+static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry,
+        bool quiet) {
     static const char namePrefix[] = "Name: ";
     static const char contPrefix[] = " ";  // Continuation of the filename
     static const char digestPrefix[] = "SHA1-Digest: ";
     static const char eol[] = "\r\n";
 
-    char *mfBuf = slurpEntry(pArchive, mfEntry);
+    char *mfBuf = slurpEntry(pArchive, mfEntry, quiet);
     if (mfBuf == NULL) return false;
 
     /* we're using calloc() here, so the initial state of the array is false */
     bool *unverified = (bool *) calloc(mzZipEntryCount(pArchive), sizeof(bool));
     if (unverified == NULL) {
-        LOGE("Can't allocate valid flags\n");
+        VERIFY_LOGE(quiet, "Can't allocate valid flags\n");
         free(mfBuf);
         return false;
     }
@@ -264,25 +279,25 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
         if (!strncasecmp(line, namePrefix, sizeof(namePrefix) - 1)) {
             // "Name:" introducing a new stanza
             if (name != NULL) {
-                LOGE("No digest:\n  %s\n", name);
+                VERIFY_LOGE(quiet, "No digest:\n  %s\n", name);
                 break;
             }
 
             name = strdup(line + sizeof(namePrefix) - 1);
             if (name == NULL) {
-                LOGE("Can't copy filename in %s\n", line);
+                VERIFY_LOGE(quiet, "Can't copy filename in %s\n", line);
                 break;
             }
         } else if (!strncasecmp(line, contPrefix, sizeof(contPrefix) - 1)) {
             // Continuing a long name (nothing else should be continued)
             const char *tail = line + sizeof(contPrefix) - 1;
             if (name == NULL) {
-                LOGE("Unexpected continuation:\n  %s\n", tail);
+                VERIFY_LOGE(quiet, "Unexpected continuation:\n  %s\n", tail);
             }
 
             char *concat;
             if (asprintf(&concat, "%s%s", name, tail) < 0) {
-                LOGE("Can't append continuation %s\n", tail);
+                VERIFY_LOGE(quiet, "Can't append continuation %s\n", tail);
                 break;
             }
             free(name);
@@ -291,34 +306,35 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
             // "Digest:" supplying a hash code for the current stanza
             const char *base64 = line + sizeof(digestPrefix) - 1;
             if (name == NULL) {
-                LOGE("Unexpected digest:\n  %s\n", base64);
+                VERIFY_LOGE(quiet, "Unexpected digest:\n  %s\n", base64);
                 break;
             }
 
             const ZipEntry *entry = mzFindZipEntry(pArchive, name);
             if (entry == NULL) {
-                LOGE("Missing file:\n  %s\n", name);
+                VERIFY_LOGE(quiet, "Missing file:\n  %s\n", name);
                 break;
             }
             if (!mzIsZipEntryIntact(pArchive, entry)) {
-                LOGE("Corrupt file:\n  %s\n", name);
+                VERIFY_LOGE(quiet, "Corrupt file:\n  %s\n", name);
                 break;
             }
             if (!unverified[mzGetZipEntryIndex(pArchive, entry)]) {
-                LOGE("Unexpected file:\n  %s\n", name);
+                VERIFY_LOGE(quiet, "Unexpected file:\n  %s\n", name);
                 break;
             }
 
             uint8_t expected[SHA_DIGEST_SIZE + 3], actual[SHA_DIGEST_SIZE];
             int n = b64_pton(base64, expected, sizeof(expected));
             if (n != SHA_DIGEST_SIZE) {
-                LOGE("Invalid base64:\n  %s\n  %s\n", name, base64);
+                VERIFY_LOGE(quiet, "Invalid base64:\n  %s\n  %s\n", name, base64);
                 break;
             }
 
-            if (!digestEntry(pArchive, entry, &doneBytes, totalBytes, actual) ||
+            if (!digestEntry(pArchive, entry,
+                        quiet ? NULL : &doneBytes, totalBytes, actual, quiet) ||
                 memcmp(expected, actual, SHA_DIGEST_SIZE) != 0) {
-                LOGE("Wrong digest:\n  %s\n", name);
+                VERIFY_LOGE(quiet, "Wrong digest:\n  %s\n", name);
                 break;
             }
 
@@ -341,7 +357,7 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
     if (i < mzZipEntryCount(pArchive)) {
         const ZipEntry *entry = mzGetZipEntryAt(pArchive, i);
         UnterminatedString fn = mzGetZipEntryFileName(entry);
-        LOGE("No digest for %.*s\n", fn.len, fn.str);
+        VERIFY_LOGE(quiet, "No digest for %.*s\n", fn.len, fn.str);
         return false;
     }
 
@@ -349,13 +365,196 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
 }
 
 
+// Reads a file containing one or more public keys as produced by
+// DumpPublicKey:  this is an RSAPublicKey struct as it would appear
+// as a C source literal, eg:
+//
+//  "{64,0xc926ad21,{1795090719,...,-695002876},{-857949815,...,1175080310}}"
+//
+// (Note that the braces and commas in this example are actual
+// characters the parser expects to find in the file; the ellipses
+// indicate more numbers omitted from this example.)
+//
+// The file may contain multiple keys in this format, separated by
+// commas.  The last key must not be followed by a comma.
+//
+// Returns NULL if the file failed to parse, or if it contain zero keys.
+RSAPublicKey* load_keys(const char* filename, int* numKeys) {
+    RSAPublicKey* out = NULL;
+    *numKeys = 0;
+
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        LOGE("opening %s: %s\n", filename, strerror(errno));
+        goto exit;
+    }
+
+    int i;
+    bool done = false;
+    while (!done) {
+        ++*numKeys;
+        out = realloc(out, *numKeys * sizeof(RSAPublicKey));
+        RSAPublicKey* key = out + (*numKeys - 1);
+        if (fscanf(f, " { %i , 0x%x , { %u",
+                   &(key->len), &(key->n0inv), &(key->n[0])) != 3) {
+            goto exit;
+        }
+        if (key->len != RSANUMWORDS) {
+            LOGE("key length (%d) does not match expected size\n", key->len);
+            goto exit;
+        }
+        for (i = 1; i < key->len; ++i) {
+            if (fscanf(f, " , %u", &(key->n[i])) != 1) goto exit;
+        }
+        if (fscanf(f, " } , { %u", &(key->rr[0])) != 1) goto exit;
+        for (i = 1; i < key->len; ++i) {
+            if (fscanf(f, " , %u", &(key->rr[i])) != 1) goto exit;
+        }
+        fscanf(f, " } } ");
+
+        // if the line ends in a comma, this file has more keys.
+        switch (fgetc(f)) {
+            case ',':
+                // more keys to come.
+                break;
+
+            case EOF:
+                done = true;
+                break;
+
+            default:
+                LOGE("unexpected character between keys\n");
+                goto exit;
+        }
+    }
+
+    fclose(f);
+    return out;
+
+exit:
+    if (f) fclose(f);
+    free(out);
+    *numKeys = 0;
+    return NULL;
+}
+
 bool verify_jar_signature(const ZipArchive *pArchive,
-        const RSAPublicKey *pKeys, int numKeys) {
-    const ZipEntry *sfEntry = verifySignature(pArchive, pKeys, numKeys);
+        const RSAPublicKey *pKeys, int numKeys, bool showProgress) {
+    const ZipEntry *sfEntry =
+        verifySignature(pArchive, pKeys, numKeys, !showProgress);
     if (sfEntry == NULL) return false;
 
-    const ZipEntry *mfEntry = verifyManifest(pArchive, sfEntry);
+    const ZipEntry *mfEntry = verifyManifest(pArchive, sfEntry, !showProgress);
     if (mfEntry == NULL) return false;
 
-    return verifyArchive(pArchive, mfEntry);
+    return verifyArchive(pArchive, mfEntry, !showProgress);
+}
+
+
+/*
+ * Whole-file signatures (as applied by "signapk -w") live in the archive
+ * comment.  The last six bytes of the file are a footer:
+ *
+ *   [signature start, LE16] [0xff 0xff] [comment size, LE16]
+ *
+ * where "signature start" counts back from the end of the file to the
+ * signature block, which runs up to the footer and ends with the
+ * RSANUMBYTES-byte RSA signature.  The signed data is everything up to
+ * (but not including) the EOCD's comment length field.
+ */
+#define FOOTER_SIZE 6
+#define EOCD_HEADER_SIZE 22
+
+typedef struct {
+    SHA_CTX ctx;
+    long long done;
+    long long total;
+    bool showProgress;
+} HashRangeContext;
+
+static bool hash_range(const unsigned char *data, int len, void *cookie) {
+    HashRangeContext *context = (HashRangeContext *) cookie;
+    SHA_update(&context->ctx, data, len);
+    context->done += len;
+    if (context->showProgress && context->total > 0) {
+        ui_set_progress(context->done * 1.0 / context->total);
+    }
+    return true;
+}
+
+int verify_file_signature(const ZipArchive *pArchive,
+        const RSAPublicKey *pKeys, int numKeys, bool showProgress) {
+    /* The archive's mapping always runs to the end of the file, so the
+     * footer and EOCD are in it even when the rest of a big file isn't.
+     */
+    const unsigned char *end =
+        (const unsigned char *) pArchive->map.addr + pArchive->map.length;
+    long long length = pArchive->length;
+
+    if (pArchive->map.length < EOCD_HEADER_SIZE) return VERIFY_FILE_UNSIGNED;
+
+    const unsigned char *footer = end - FOOTER_SIZE;
+    if (footer[2] != 0xff || footer[3] != 0xff) return VERIFY_FILE_UNSIGNED;
+
+    size_t commentSize = footer[4] | (footer[5] << 8);
+    size_t signatureStart = footer[0] | (footer[1] << 8);
+    size_t eocdSize = commentSize + EOCD_HEADER_SIZE;
+    LOGI("whole-file signature: comment %u bytes, signature %u bytes from end\n",
+            (unsigned) commentSize, (unsigned) signatureStart);
+
+    if (signatureStart > commentSize ||
+            signatureStart < FOOTER_SIZE + RSANUMBYTES ||
+            eocdSize > pArchive->map.length) {
+        VERIFY_LOGE(!showProgress, "Malformed whole-file signature footer\n");
+        return VERIFY_FILE_FAILED;
+    }
+
+    /* The footer must belong to the real EOCD record: it has to start
+     * exactly commentSize bytes before the end, and nothing in the comment
+     * may look like another EOCD (which could hide appended data).
+     */
+    const unsigned char *eocd = end - eocdSize;
+    if (eocd[0] != 0x50 || eocd[1] != 0x4b || eocd[2] != 0x05 || eocd[3] != 0x06) {
+        VERIFY_LOGE(!showProgress,
+                "Signature footer doesn't match end of central directory\n");
+        return VERIFY_FILE_FAILED;
+    }
+    size_t i;
+    for (i = 4; i + 3 < eocdSize; ++i) {
+        if (eocd[i] == 0x50 && eocd[i+1] == 0x4b &&
+                eocd[i+2] == 0x05 && eocd[i+3] == 0x06) {
+            VERIFY_LOGE(!showProgress, "EOCD marker occurs after start of EOCD\n");
+            return VERIFY_FILE_FAILED;
+        }
+    }
+
+    /* One sequential pass over the file; minzip maps it a window at a
+     * time and keeps the kernel reading ahead.
+     */
+    HashRangeContext context;
+    SHA_init(&context.ctx);
+    context.done = 0;
+    context.total = length - commentSize - 2;
+    context.showProgress = showProgress;
+    if (!mzProcessArchiveRange(pArchive, 0, context.total, hash_range,
+            &context)) {
+        VERIFY_LOGE(!showProgress,
+                "Can't read package for whole-file signature\n");
+        return VERIFY_FILE_FAILED;
+    }
+    uint8_t digest[SHA_DIGEST_SIZE];
+    memcpy(digest, SHA_final(&context.ctx), SHA_DIGEST_SIZE);
+
+    const uint8_t *sig = end - FOOTER_SIZE - RSANUMBYTES;
+    int j;
+    for (j = 0; j < numKeys; ++j) {
+        if (RSA_verify(&pKeys[j], sig, RSANUMBYTES, digest)) {
+            LOGI("whole-file signature verified using key %d\n", j);
+            return VERIFY_FILE_OK;
+        }
+    }
+
+    VERIFY_LOGE(!showProgress,
+            "whole-file signature didn't verify against any key\n");
+    return VERIFY_FILE_FAILED;
 }
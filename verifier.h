@@ -20,11 +20,34 @@
 #include "minzip/Zip.h"
 #include "mincrypt/rsa.h"
 
+/*
+ * Load the RSA public keys (as produced by DumpPublicKey) from filename.
+ * Returns a malloc()ed array and sets *numKeys, or NULL if the file can't
+ * be parsed or holds no keys.
+ */
+RSAPublicKey* load_keys(const char* filename, int* numKeys);
+
 /*
  * Check the digital signature (as applied by jarsigner) on a Zip archive.
  * Every file in the archive must be signed by one of the supplied RSA keys.
+ *
+ * With showProgress false the screen is left alone: the progress bar
+ * doesn't move and errors only go to the log, for packages verified in
+ * the background while another one installs.
  */
 bool verify_jar_signature(const ZipArchive *pArchive,
-        const RSAPublicKey *pKeys, int numKeys);
+        const RSAPublicKey *pKeys, int numKeys, bool showProgress);
+
+enum { VERIFY_FILE_OK, VERIFY_FILE_FAILED, VERIFY_FILE_UNSIGNED };
+
+/*
+ * Check a whole-file signature footer (as applied by "signapk -w") with a
+ * single sequential SHA-1 pass over the mapped archive.  Returns
+ * VERIFY_FILE_UNSIGNED if the archive has no such footer, in which case
+ * the caller should fall back to verify_jar_signature().  showProgress
+ * is as for verify_jar_signature().
+ */
+int verify_file_signature(const ZipArchive *pArchive,
+        const RSAPublicKey *pKeys, int numKeys, bool showProgress);
 
 #endif  /* _RECOVERY_VERIFIER_H */
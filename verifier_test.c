@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks verify_file_signature() against the packages in testdata/,
+ * which were whole-file signed ("signapk -w") with the private half of
+ * testdata/test_key and then altered.  padded-signature.zip is signed
+ * correctly, but its footer points at a signature block that holds more
+ * than the RSA signature at its end.
+ *
+ *   verifier_test <testdata-dir>
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "minzip/Zip.h"
+#include "verifier.h"
+
+/* The verifier reports through recovery's UI; there's no screen here. */
+void ui_print(const char *fmt, ...) {}
+void ui_set_progress(float fraction) {}
+
+static const struct {
+    const char *package;
+    int expected;
+} kCases[] = {
+    { "otasigned.zip", VERIFY_FILE_OK },
+    { "padded-signature.zip", VERIFY_FILE_OK },
+    { "alter-data.zip", VERIFY_FILE_FAILED },
+    { "alter-signature.zip", VERIFY_FILE_FAILED },
+    { "unsigned.zip", VERIFY_FILE_UNSIGNED },
+};
+
+static const char *result_name(int result) {
+    switch (result) {
+        case VERIFY_FILE_OK:        return "OK";
+        case VERIFY_FILE_FAILED:    return "FAILED";
+        case VERIFY_FILE_UNSIGNED:  return "UNSIGNED";
+    }
+    return "?";
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <testdata-dir>\n", argv[0]);
+        return 2;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/test_key", argv[1]);
+    int numKeys;
+    RSAPublicKey *keys = load_keys(path, &numKeys);
+    if (keys == NULL) {
+        fprintf(stderr, "can't load keys from %s\n", path);
+        return 1;
+    }
+
+    int failures = 0;
+    size_t i;
+    for (i = 0; i < sizeof(kCases) / sizeof(kCases[0]); ++i) {
+        snprintf(path, sizeof(path), "%s/%s", argv[1], kCases[i].package);
+        ZipArchive za;
+        if (mzOpenZipArchive(path, &za) != 0) {
+            fprintf(stderr, "can't open %s\n", path);
+            ++failures;
+            continue;
+        }
+        int result = verify_file_signature(&za, keys, numKeys, false);
+        mzCloseZipArchive(&za);
+
+        if (result == kCases[i].expected) {
+            printf("%s: %s\n", kCases[i].package, result_name(result));
+        } else {
+            printf("%s: %s, expected %s\n", kCases[i].package,
+                   result_name(result), result_name(kCases[i].expected));
+            ++failures;
+        }
+    }
+
+    free(keys);
+    printf("%s\n", failures == 0 ? "PASSED" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}